@@ -3,6 +3,7 @@
 #include <iostream>
 #include <iomanip>
 #include <map>
+#include <fstream>
 #include <string>
 
 // Enhanced shell OS with Interactive Calculator and Memory Viewer
@@ -396,7 +397,30 @@ std::vector<uint8_t> createEnhancedIntegratedShellOS() {
     return code;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    // --dump-image <file>: write the kernel image (loaded at 0x1000) and exit, e.g. for build/aot
+    if (argc == 3 && std::string(argv[1]) == "--dump-image") {
+        std::vector<uint8_t> image = createEnhancedIntegratedShellOS();
+        std::ofstream file(argv[2], std::ios::binary);
+        file.write(reinterpret_cast<const char*>(image.data()), image.size());
+        return file ? 0 : 1;
+    }
+
+    // --record <file> logs the session's keystrokes; --replay <file> plays
+    // such a log back at full speed, without a terminal
+    std::unique_ptr<InputRecorder> recorder;
+    std::unique_ptr<InputReplay> replay;
+    try {
+        if (argc == 3 && std::string(argv[1]) == "--record") {
+            recorder.reset(new InputRecorder(argv[2]));
+        } else if (argc == 3 && std::string(argv[1]) == "--replay") {
+            replay.reset(new InputReplay(argv[2]));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
     std::cout << "========================================" << std::endl;
     std::cout << "    Enhanced Integrated Shell v6.0     " << std::endl;
     std::cout << "  Interactive Calculator & Memory!      " << std::endl;
@@ -428,6 +452,12 @@ int main() {
     
     // Run the enhanced system
     MinimalCPU cpu;
+    if (recorder) {
+        cpu.setInputRecorder(recorder.get());
+    }
+    if (replay) {
+        cpu.setInputReplay(replay.get());
+    }
     cpu.loadProgram(enhancedCode, 0x1000);
     cpu.run();
     
@@ -0,0 +1,148 @@
+#pragma once
+#include "cpu.h"
+#include <vector>
+#include <string>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+
+// Runs one program against many inputs on a pool of MinimalCPUs, one per
+// worker thread.
+//
+// The program is loaded once, into the first worker's CPU, and snapshotted.
+// The other workers' CPUs are clones of it, so they share its pages until
+// they write them. Before every job a worker restores the snapshot, so a job
+// only pays for the pages the previous one dirtied. Jobs are dealt out in
+// contiguous ranges, one per worker. A worker takes jobs from the back of its
+// own deque and, once that is empty, steals from the front of another
+// worker's, so uneven jobs still keep every core busy. A job's output goes to
+// its own Result, never to std::cout.
+class BatchRunner {
+public:
+    struct Result {
+        std::string output;
+        MinimalCPU::StopReason reason = MinimalCPU::StopReason::Halted;
+        uint64_t instructions = 0;
+    };
+
+    struct Stats {
+        size_t jobs = 0;
+        unsigned threads = 0;
+        uint64_t instructions = 0;
+        double seconds = 0;
+        double instructionsPerSecond() const { return seconds > 0 ? instructions / seconds : 0; }
+    };
+
+    // 0 means one worker per hardware thread
+    unsigned threads = 0;
+    MinimalCPU::Engine engine = MinimalCPU::Engine::Interpreter;
+    // per job; keeps a runaway job from holding a worker forever
+    uint64_t maxInstructions = 1ull << 32;
+    bool echoInput = true;
+    bool skipInputWhitespace = true;
+
+    BatchRunner(const std::vector<uint8_t>& program, uint16_t start = 0) : program(program), start(start) {}
+
+    // runs the program once per input; results come back in input order
+    std::vector<Result> run(const std::vector<std::string>& inputs) {
+        unsigned workers = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        workers = static_cast<unsigned>(std::min<size_t>(workers, std::max<size_t>(inputs.size(), 1)));
+        if (cpus.empty()) {
+            cpus.emplace_back(new MinimalCPU);
+            cpus[0]->loadProgram(program, start);
+            cpus[0]->snapshot();
+        }
+        cpus[0]->restore();  // clone() snapshots, and this is the state to share
+        while (cpus.size() < workers) {
+            cpus.push_back(cpus[0]->clone());
+        }
+        queues.reset(new Queue[workers]);
+        for (unsigned w = 0; w < workers; ++w) {
+            for (size_t job = inputs.size() * w / workers; job < inputs.size() * (w + 1) / workers; ++job) {
+                queues[w].jobs.push_back(job);
+            }
+        }
+
+        std::vector<Result> results(inputs.size());
+        std::vector<uint64_t> counted(workers, 0);
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> pool;
+        for (unsigned w = 1; w < workers; ++w) {
+            pool.emplace_back([&, w] { counted[w] = work(w, workers, inputs, results); });
+        }
+        counted[0] = work(0, workers, inputs, results);
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+
+        last = Stats{};
+        last.jobs = inputs.size();
+        last.threads = workers;
+        last.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        for (uint64_t count : counted) {
+            last.instructions += count;
+        }
+        return results;
+    }
+
+    // totals of the last run()
+    const Stats& stats() const { return last; }
+
+private:
+    struct Queue {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+
+    std::vector<uint8_t> program;
+    uint16_t start;
+    std::vector<std::unique_ptr<MinimalCPU>> cpus;
+    std::unique_ptr<Queue[]> queues;
+    Stats last;
+
+    // own jobs from the back, then steal from the front of the others
+    bool next(unsigned self, unsigned workers, size_t& job) {
+        for (unsigned i = 0; i < workers; ++i) {
+            Queue& queue = queues[(self + i) % workers];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            if (queue.jobs.empty()) {
+                continue;
+            }
+            if (i == 0) {
+                job = queue.jobs.back();
+                queue.jobs.pop_back();
+            } else {
+                job = queue.jobs.front();
+                queue.jobs.pop_front();
+            }
+            return true;
+        }
+        return false;  // nothing is ever added while running, so every queue is done
+    }
+
+    uint64_t work(unsigned self, unsigned workers, const std::vector<std::string>& inputs, std::vector<Result>& results) {
+        MinimalCPU& cpu = *cpus[self];
+        cpu.engine = engine;
+        cpu.echoInput = echoInput;
+        cpu.skipInputWhitespace = skipInputWhitespace;
+        uint64_t instructions = 0;
+        size_t job;
+        while (next(self, workers, job)) {
+            Result& result = results[job];
+            StringOutput output(result.output);
+            SpanInput input(inputs[job]);
+            cpu.restore();
+            cpu.setOutput(&output);
+            cpu.setInput(&input);
+            result.reason = cpu.run(maxInstructions);
+            result.instructions = cpu.executed;
+            instructions += cpu.executed;
+            cpu.setOutput(nullptr);
+            cpu.setInput(nullptr);
+        }
+        return instructions;
+    }
+};
@@ -0,0 +1,409 @@
+#pragma once
+#include "parser.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Basic blocks and the control-flow graph of the IR, for the passes that
+// need more than the flat list (ssa.h, optimize.h). A block starts at a
+// LABEL, or at several in a row, or after a jump, and ends at GOTO, IFLEQ or
+// HALT, or where the next one starts; its code keeps that terminator last.
+// The blocks are laid out in the order of the IR, and a block that does not
+// end in GOTO or HALT falls through to the next one in the layout, so
+// lower() gives back a flat IR that Codegen and the IR interpreter run as
+// they always have.
+//
+// The entry block has no predecessors: when a jump goes to the start of the
+// program, the graph begins with an empty block in front of it.
+
+// a phi of SSA form: result is args[i] when control came from preds[i]
+struct Phi {
+    std::string var;                // the variable it is a version of
+    std::string result;
+    std::vector<std::string> args;  // one per predecessor of its block, a value or a literal
+};
+
+struct BasicBlock {
+    std::vector<std::string> labels;
+    std::vector<Phi> phis;          // SSA form only
+    std::vector<IR> code;           // terminator, if any, last
+    std::vector<int> succs;         // the jump target first, then the next block
+    std::vector<int> preds;
+
+    // the GOTO, IFLEQ or HALT that ends the block, or nullptr
+    IR* terminator() {
+        if (code.empty()) {
+            return nullptr;
+        }
+        OpCode op = code.back().op;
+        return op == OpCode::GOTO || op == OpCode::IFLEQ || op == OpCode::HALT ? &code.back() : nullptr;
+    }
+    const IR* terminator() const { return const_cast<BasicBlock*>(this)->terminator(); }
+
+    bool fallsThrough() const {
+        const IR* last = terminator();
+        return !last || last->op == OpCode::IFLEQ;
+    }
+
+    // where code goes that has to run last in the block, before its jump
+    size_t end() const { return code.size() - (terminator() ? 1 : 0); }
+};
+
+class ControlFlowGraph {
+public:
+    std::vector<BasicBlock> blocks;
+    std::vector<int> layout;        // blocks in IR order, block 0 first
+
+    explicit ControlFlowGraph(const std::vector<IR>& ir) {
+        blocks.emplace_back();
+        for (const IR& in : ir) {
+            if (in.op == OpCode::LABEL) {
+                if (!blocks.back().code.empty()) {
+                    blocks.emplace_back();
+                }
+                blocks.back().labels.push_back(in.result);
+                continue;
+            }
+            if (blocks.back().terminator()) {
+                blocks.emplace_back();
+            }
+            blocks.back().code.push_back(in);
+        }
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            layout.push_back(static_cast<int>(b));
+        }
+        connect();
+        if (!blocks[0].preds.empty()) {
+            blocks.insert(blocks.begin(), BasicBlock());
+            layout.push_back(static_cast<int>(layout.size()));
+            connect();
+        }
+        computeDominators();
+    }
+
+    // true if every GOTO and IFLEQ of ir goes to a label it has
+    static bool resolves(const std::vector<IR>& ir) {
+        std::unordered_map<std::string, bool> labels;
+        for (const IR& in : ir) {
+            if (in.op == OpCode::LABEL) {
+                labels[in.result] = true;
+            }
+        }
+        for (const IR& in : ir) {
+            if ((in.op == OpCode::GOTO || in.op == OpCode::IFLEQ) && labels.find(in.result) == labels.end()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the blocks back in one list, in layout order; SSA form must be gone
+    std::vector<IR> lower() const {
+        std::vector<IR> ir;
+        for (int b : layout) {
+            for (const std::string& label : blocks[b].labels) {
+                ir.push_back(IR{OpCode::LABEL, "", "", label});
+            }
+            ir.insert(ir.end(), blocks[b].code.begin(), blocks[b].code.end());
+        }
+        return ir;
+    }
+
+    // works out succs and preds again from the code; phis are not kept in step
+    void connect() {
+        std::unordered_map<std::string, int> labelBlock;
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            blocks[b].succs.clear();
+            blocks[b].preds.clear();
+            for (const std::string& label : blocks[b].labels) {
+                labelBlock[label] = static_cast<int>(b);
+            }
+        }
+        for (size_t i = 0; i < layout.size(); ++i) {
+            BasicBlock& block = blocks[layout[i]];
+            const IR* last = block.terminator();
+            if (last && last->op != OpCode::HALT) {
+                auto target = labelBlock.find(last->result);
+                if (target != labelBlock.end()) {
+                    block.succs.push_back(target->second);
+                }
+            }
+            if (block.fallsThrough() && i + 1 < layout.size()
+                && std::find(block.succs.begin(), block.succs.end(), layout[i + 1]) == block.succs.end()) {
+                block.succs.push_back(layout[i + 1]);
+            }
+        }
+        for (int b : layout) {
+            for (int s : blocks[b].succs) {
+                blocks[s].preds.push_back(b);
+            }
+        }
+    }
+
+    // a label no block has yet
+    std::string newLabel() {
+        while (true) {
+            std::string label = "__block." + std::to_string(labelCount++);
+            bool taken = false;
+            for (const BasicBlock& block : blocks) {
+                taken = taken || std::find(block.labels.begin(), block.labels.end(), label) != block.labels.end();
+            }
+            if (!taken) {
+                return label;
+            }
+        }
+    }
+
+    // Dominator tree by the Cooper-Harvey-Kennedy iteration over reverse
+    // postorder; run again after changing edges.
+    void computeDominators() {
+        order.clear();
+        std::vector<int> number(blocks.size(), -1);
+        std::vector<bool> seen(blocks.size(), false);
+        std::vector<std::pair<int, size_t>> stack{{0, 0}};
+        seen[0] = true;
+        while (!stack.empty()) {
+            int b = stack.back().first;
+            size_t& next = stack.back().second;
+            if (next < blocks[b].succs.size()) {
+                int s = blocks[b].succs[next++];
+                if (!seen[s]) {
+                    seen[s] = true;
+                    stack.push_back({s, 0});
+                }
+            } else {
+                order.push_back(b);
+                stack.pop_back();
+            }
+        }
+        std::reverse(order.begin(), order.end());
+        for (size_t i = 0; i < order.size(); ++i) {
+            number[order[i]] = static_cast<int>(i);
+        }
+
+        idoms.assign(blocks.size(), -1);
+        idoms[0] = 0;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = 1; i < order.size(); ++i) {
+                int b = order[i], dom = -1;
+                for (int p : blocks[b].preds) {
+                    if (idoms[p] < 0) {
+                        continue;
+                    }
+                    if (dom < 0) {
+                        dom = p;
+                        continue;
+                    }
+                    int x = p, y = dom;
+                    while (x != y) {
+                        while (number[x] > number[y]) x = idoms[x];
+                        while (number[y] > number[x]) y = idoms[y];
+                    }
+                    dom = x;
+                }
+                if (dom != idoms[b]) {
+                    idoms[b] = dom;
+                    changed = true;
+                }
+            }
+        }
+        children.assign(blocks.size(), {});
+        for (int b : order) {
+            if (b != 0) {
+                children[idoms[b]].push_back(b);
+            }
+        }
+    }
+
+    // blocks reachable from the entry, each before its successors but for back edges
+    const std::vector<int>& reversePostorder() const { return order; }
+    bool reachable(int b) const { return idoms[b] >= 0; }
+    int idom(int b) const { return b == 0 ? -1 : idoms[b]; }
+    const std::vector<int>& dominated(int b) const { return children[b]; }
+
+    bool dominates(int a, int b) const {
+        if (!reachable(b)) {
+            return false;
+        }
+        while (b != a && b != 0) {
+            b = idoms[b];
+        }
+        return a == b;
+    }
+
+    // true for the name of a variable or temp, false for a constant or nothing
+    static bool isValue(const std::string& name) {
+        return !name.empty() && !std::isdigit(static_cast<unsigned char>(name[0])) && name[0] != '-';
+    }
+
+    // calls f on every variable or temp the instruction reads
+    template <typename Inst, typename F>
+    static void forEachUse(Inst& in, F f) {
+        auto use = [&](auto& name) {
+            if (isValue(name)) {
+                f(name);
+            }
+        };
+        switch (in.op) {
+            case OpCode::LOAD_VAR:
+            case OpCode::STORE:
+            case OpCode::OUT:
+                use(in.arg1);
+                break;
+            case OpCode::ADD:
+            case OpCode::SUB:
+            case OpCode::IFLEQ:
+                use(in.arg1);
+                use(in.arg2);
+                break;
+            case OpCode::LOAD_INDEXED:
+                use(in.arg2);  // arg1 is the array
+                break;
+            case OpCode::STORE_INDEXED:
+                use(in.arg2);
+                use(in.result);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // the variable or temp the instruction sets, or nullptr
+    template <typename Inst>
+    static auto defOf(Inst& in) -> decltype(&in.result) {
+        switch (in.op) {
+            case OpCode::LOAD_CONST:
+            case OpCode::STORE_CONST:
+            case OpCode::LOAD_VAR:
+            case OpCode::STORE:
+            case OpCode::ADD:
+            case OpCode::SUB:
+            case OpCode::LOAD_INDEXED:
+                return isValue(in.result) ? &in.result : nullptr;
+            case OpCode::IN:
+                return isValue(in.arg1) ? &in.arg1 : nullptr;
+            default:
+                return nullptr;
+        }
+    }
+
+    // sets its result and does nothing else, so it can move or go
+    static bool isPure(const IR& in) {
+        switch (in.op) {
+            case OpCode::LOAD_CONST:
+            case OpCode::STORE_CONST:
+            case OpCode::LOAD_VAR:
+            case OpCode::STORE:
+            case OpCode::ADD:
+            case OpCode::SUB:
+                return defOf(in) != nullptr;
+            default:
+                return false;
+        }
+    }
+
+    static bool isCopy(const IR& in) {
+        return (in.op == OpCode::LOAD_VAR || in.op == OpCode::STORE) && isValue(in.arg1) && defOf(in);
+    }
+
+private:
+    std::vector<int> order;
+    std::vector<int> idoms;
+    std::vector<std::vector<int>> children;
+    size_t labelCount = 0;
+};
+
+// Which values are live into and out of every block, iterated to a fixed
+// point; for a graph without phis.
+class Liveness {
+public:
+    typedef std::vector<uint64_t> Set;
+
+    explicit Liveness(const ControlFlowGraph& cfg) {
+        for (const BasicBlock& block : cfg.blocks) {
+            for (const IR& in : block.code) {
+                ControlFlowGraph::forEachUse(in, [&](const std::string& name) { id(name); });
+                if (const std::string* def = ControlFlowGraph::defOf(in)) {
+                    id(*def);
+                }
+            }
+        }
+        size_t words = (names.size() + 63) / 64;
+        liveIn.assign(cfg.blocks.size(), Set(words, 0));
+        liveOut.assign(cfg.blocks.size(), Set(words, 0));
+        const std::vector<int>& order = cfg.reversePostorder();
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = order.size(); i-- > 0;) {
+                int b = order[i];
+                Set live(words, 0);
+                for (int s : cfg.blocks[b].succs) {
+                    for (size_t w = 0; w < words; ++w) {
+                        live[w] |= liveIn[s][w];
+                    }
+                }
+                liveOut[b] = live;
+                const std::vector<IR>& code = cfg.blocks[b].code;
+                for (size_t j = code.size(); j-- > 0;) {
+                    step(live, code[j]);
+                }
+                if (live != liveIn[b]) {
+                    liveIn[b].swap(live);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // live before in, from what is live after it
+    void step(Set& live, const IR& in) const {
+        if (const std::string* def = ControlFlowGraph::defOf(in)) {
+            clear(live, index(*def));
+        }
+        ControlFlowGraph::forEachUse(in, [&](const std::string& name) { insert(live, index(name)); });
+    }
+
+    bool isLiveIn(int b, const std::string& name) const { return has(liveIn[b], name); }
+    bool isLiveOut(int b, const std::string& name) const { return has(liveOut[b], name); }
+    const Set& in(int b) const { return liveIn[b]; }
+    const Set& out(int b) const { return liveOut[b]; }
+
+    int index(const std::string& name) const {
+        auto it = ids.find(name);
+        return it == ids.end() ? -1 : it->second;
+    }
+    const std::vector<std::string>& values() const { return names; }
+
+    template <typename F>
+    static void forEach(const Set& set, F f) {
+        for (size_t w = 0; w < set.size(); ++w) {
+            for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+                f(static_cast<int>(w * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+
+    static bool contains(const Set& set, int v) { return v >= 0 && (set[v / 64] >> (v % 64)) & 1; }
+    static void insert(Set& set, int v) { set[v / 64] |= uint64_t(1) << (v % 64); }
+    static void clear(Set& set, int v) { set[v / 64] &= ~(uint64_t(1) << (v % 64)); }
+
+private:
+    std::unordered_map<std::string, int> ids;
+    std::vector<std::string> names;
+    std::vector<Set> liveIn, liveOut;
+
+    void id(const std::string& name) {
+        if (ids.find(name) == ids.end()) {
+            ids[name] = static_cast<int>(names.size());
+            names.push_back(name);
+        }
+    }
+
+    bool has(const Set& set, const std::string& name) const { return contains(set, index(name)); }
+};
@@ -1,5 +1,8 @@
 #pragma once
 #include "parser.h"
+#include "image.h"
+#include "regalloc.h"
+#include "peephole.h"
 #include <vector>
 #include <string>
 #include <iostream>
@@ -23,27 +26,55 @@ class Codegen {
         void writeToHex(std::string outputFileBin, std::string outputFileHex);
         void writeToHex(std::string outputFile);
         std::vector<uint8_t> getCode();
+        // the code with its variables as BSS, loadable by loadImage() with no address to know
+        ProgramImage getImage();
+        void writeToImage(std::string outputFile);
+        // what the peephole pass saved on the last generateCode()
+        PeepholeStats getPeepholeStats() const { return peepholeStats; }
     private:
         std::string filename;
         std::vector<IR> ir; // IR vector
         std::vector<uint8_t> code; // code vector
         std::vector<uint8_t> data; // data vector
-        static uint16_t DATA_CURSOR; // current data cursor
+        uint16_t dataCursor = 0; // bytes of data this compilation has laid out
         static const uint16_t CODE_START = 0x2000; // start of code, put into the 0x2000 to avoid conflict with the kernel in the future.
         static const uint16_t CODE_END = 0x7FFF; // end of code
         static const uint16_t DATA_START = 0x8000; // start of data
         static const uint16_t DATA_END = 0xFF00; // end of data, output register is at 0xFF00
+        static const uint16_t OUTPUT_ADDR = 0xFF00; // output register
+        static const uint8_t R_CARRY = 2; // SUB borrow, indexed offset, scratch
+        static const uint8_t R_ONE = 3; // always 1 for JNZ as GOTO
+        static const uint8_t R_DATA = 4; // indexed load/store data, scratch
 
         // map the label and variable to the address
         std::unordered_map<std::string, uint16_t> labelMap; // map the label to the address
         std::unordered_map<std::string, uint16_t> varMap; // map the variable to the address
         std::unordered_map<std::string, std::pair<uint16_t, uint16_t>> arrMap; // map the array to the address and size
+        std::unordered_map<std::string, uint8_t> regMap; // values the allocator kept in a register, they get no address
+        std::unordered_map<std::string, uint8_t> constMap; // values without a register that are one constant, made again where read
 
         // for the output file
         std::vector<std::string> asmCode;
+        uint16_t allocateData(const std::string& name, uint16_t size);
         uint16_t allocateVar(const std::string& name);
         uint16_t allocateArrayViaVar(const std::string& name, uint16_t size);
 
+        // emitting instructions onto the allocated registers
+        int registerOf(const std::string& name);
+        uint8_t useValue(const std::string& name, uint8_t scratch);
+        uint8_t targetOf(const std::string& name, uint8_t scratch);
+        void defineValue(const std::string& name, uint8_t reg);
+        void loadOperand(uint8_t rd, const std::string& name);
+        void emitLoadValue(uint8_t rd, const std::string& name);
+        void emitLoad(uint8_t rd, uint16_t addr);
+        void emitLoadConst(uint8_t rd, uint8_t value);
+        void emitStore(uint16_t addr, uint8_t rs);
+        void emitStoreConst(uint16_t addr, uint8_t value);
+        void emitAlu(uint8_t opcode, uint8_t rd, uint8_t rs);
+        void emitJump(uint8_t opcode, uint8_t r, const std::string& label);
+        void emitCopy(uint8_t rd, uint8_t rs);
+
         // for the backpatching
         std::vector<Patch> pendingPatches;
+        PeepholeStats peepholeStats;
 };
\ No newline at end of file
@@ -0,0 +1,329 @@
+#pragma once
+#include "parser.h"
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Constant folding and propagation on the IR, between Parser::getIR() and
+// Codegen or the IR interpreter. The parser gives every literal a temp of
+// its own, so `let x = 3 + 4;` is two STORE_CONSTs and an ADD; folded it is
+// one STORE_CONST 7 to x.
+//
+// The pass follows constants along the paths the program can take: every
+// instruction gets the value each variable and temp has on entry to it, the
+// meet of what its predecessors leave. An IFLEQ whose operands are both
+// known only lets the branch it takes through. Then
+//   ADD/SUB of two constants        STORE_CONST of the result
+//   LOAD_VAR/STORE of a constant    STORE_CONST
+//   IFLEQ of two constants          GOTO, or nothing
+//   IFLEQ, OUT, indexed operands    a constant operand becomes the literal
+//   code no path reaches            removed, except labels and array decls
+// and temps nothing reads any more lose the instructions that set them.
+//
+// Arithmetic wraps at 8 bits and IFLEQ compares unsigned, as on the CPU,
+// and a literal is its low byte, as Codegen emits it. A variable read before
+// anything sets it is not assumed to be 0, the interpreter has no such value.
+
+struct FoldStats {
+    size_t folded = 0;     // instructions turned into a STORE_CONST
+    size_t branches = 0;   // IFLEQs decided at compile time
+    size_t operands = 0;   // operands replaced by a literal
+    size_t removed = 0;    // unreachable or dead instructions dropped
+};
+
+class ConstantFolder {
+public:
+    explicit ConstantFolder(const std::vector<IR>& ir) : ir(ir) {}
+
+    std::vector<IR> run() {
+        collect();
+        propagate();
+        std::vector<IR> out = rewrite();
+        removeDeadTemps(out);
+        return out;
+    }
+
+    const FoldStats& stats() const { return counts; }
+
+    static bool isLiteral(const std::string& name) {
+        return !name.empty() && std::isdigit(static_cast<unsigned char>(name[0]));
+    }
+
+    static bool isTemp(const std::string& name) {
+        return name.compare(0, 8, "__temp__") == 0;
+    }
+
+private:
+    static constexpr int TOP = -2;      // no path reaches here yet
+    static constexpr int VARYING = -1;  // not the same constant on every path
+    typedef std::vector<int> State; // per value: TOP, VARYING or 0..255
+
+    std::vector<IR> ir;
+    FoldStats counts;
+    std::unordered_map<std::string, int> ids;
+    std::unordered_map<std::string, size_t> labels;
+    std::vector<State> states;      // on entry to each instruction
+    std::vector<bool> reached;
+
+    static int literal(const std::string& name) {
+        return std::stoi(name) & 0xFF;
+    }
+
+    void note(const std::string& name) {
+        if (!name.empty() && !isLiteral(name) && ids.find(name) == ids.end()) {
+            int id = static_cast<int>(ids.size());
+            ids[name] = id;
+        }
+    }
+
+    void collect() {
+        for (size_t i = 0; i < ir.size(); ++i) {
+            const IR& in = ir[i];
+            switch (in.op) {
+                case OpCode::LABEL:
+                    labels[in.result] = i;
+                    break;
+                case OpCode::ARRAY_DECL:
+                case OpCode::GOTO:
+                case OpCode::HALT:
+                    break;
+                case OpCode::IFLEQ:
+                    note(in.arg1);
+                    note(in.arg2);
+                    break;
+                case OpCode::LOAD_INDEXED:
+                case OpCode::STORE_INDEXED:
+                    note(in.arg2);  // arg1 is the array
+                    note(in.result);
+                    break;
+                default:
+                    note(in.arg1);
+                    note(in.arg2);
+                    note(in.result);
+                    break;
+            }
+        }
+    }
+
+    // the value of an operand in state, literals included
+    int valueOf(const State& state, const std::string& name) const {
+        if (isLiteral(name)) {
+            return literal(name);
+        }
+        auto it = ids.find(name);
+        return it == ids.end() ? VARYING : state[it->second];
+    }
+
+    static bool known(int value) { return value >= 0; }
+
+    // what IFLEQ at i does in state: 1 jumps, 0 falls through, -1 either
+    int decide(const State& state, size_t i) const {
+        int a = valueOf(state, ir[i].arg1), b = valueOf(state, ir[i].arg2);
+        return known(a) && known(b) ? a <= b : -1;
+    }
+
+    // the state after instruction i
+    State transfer(const State& in, size_t i) const {
+        State out = in;
+        const IR& inst = ir[i];
+        auto set = [&](const std::string& name, int value) {
+            auto it = ids.find(name);
+            if (it != ids.end()) {
+                out[it->second] = value;
+            }
+        };
+        switch (inst.op) {
+            case OpCode::LOAD_CONST:
+            case OpCode::STORE_CONST:
+                if (!inst.result.empty()) {
+                    set(inst.result, literal(inst.arg1));
+                }
+                break;
+            case OpCode::LOAD_VAR:
+            case OpCode::STORE:
+                set(inst.result, valueOf(in, inst.arg1));
+                break;
+            case OpCode::ADD:
+            case OpCode::SUB: {
+                int a = valueOf(in, inst.arg1), b = valueOf(in, inst.arg2);
+                if (known(a) && known(b)) {
+                    set(inst.result, (inst.op == OpCode::ADD ? a + b : a - b) & 0xFF);
+                } else {
+                    set(inst.result, a == TOP || b == TOP ? TOP : VARYING);
+                }
+                break;
+            }
+            case OpCode::IN:
+                set(inst.arg1, VARYING);
+                break;
+            case OpCode::LOAD_INDEXED:
+                set(inst.result, VARYING);
+                break;
+            default:
+                break;
+        }
+        return out;
+    }
+
+    std::vector<size_t> successors(const State& in, size_t i) const {
+        std::vector<size_t> next;
+        const IR& inst = ir[i];
+        bool fallsThrough = inst.op != OpCode::GOTO && inst.op != OpCode::HALT;
+        if (inst.op == OpCode::GOTO || inst.op == OpCode::IFLEQ) {
+            int taken = inst.op == OpCode::GOTO ? 1 : decide(in, i);
+            auto target = labels.find(inst.result);
+            if (taken != 0 && target != labels.end()) {
+                next.push_back(target->second);
+            }
+            fallsThrough = fallsThrough && taken != 1;
+        }
+        if (fallsThrough && i + 1 < ir.size()) {
+            next.push_back(i + 1);
+        }
+        return next;
+    }
+
+    void propagate() {
+        states.assign(ir.size(), State(ids.size(), TOP));
+        reached.assign(ir.size(), false);
+        if (ir.empty()) {
+            return;
+        }
+        states[0].assign(ids.size(), VARYING);
+        reached[0] = true;
+        std::vector<size_t> work{0};
+        while (!work.empty()) {
+            size_t i = work.back();
+            work.pop_back();
+            State out = transfer(states[i], i);
+            for (size_t s : successors(states[i], i)) {
+                bool changed = !reached[s];
+                reached[s] = true;
+                for (size_t v = 0; v < out.size(); ++v) {
+                    int& cell = states[s][v];
+                    int meet = cell == TOP ? out[v] : out[v] == TOP || out[v] == cell ? cell : VARYING;
+                    if (meet != cell) {
+                        cell = meet;
+                        changed = true;
+                    }
+                }
+                if (changed) {
+                    work.push_back(s);
+                }
+            }
+        }
+    }
+
+    // replaces name with its literal where it is a known constant
+    void substitute(const State& state, std::string& name) {
+        if (!isLiteral(name) && known(valueOf(state, name))) {
+            name = std::to_string(valueOf(state, name));
+            ++counts.operands;
+        }
+    }
+
+    std::vector<IR> rewrite() {
+        std::vector<IR> out;
+        out.reserve(ir.size());
+        for (size_t i = 0; i < ir.size(); ++i) {
+            IR inst = ir[i];
+            const State& in = states[i];
+            if (!reached[i] && inst.op != OpCode::LABEL && inst.op != OpCode::ARRAY_DECL) {
+                ++counts.removed;
+                continue;
+            }
+            switch (inst.op) {
+                case OpCode::LOAD_VAR:
+                case OpCode::STORE:
+                case OpCode::ADD:
+                case OpCode::SUB: {
+                    int value = transfer(in, i)[ids.at(inst.result)];
+                    if (known(value)) {
+                        inst = IR{OpCode::STORE_CONST, std::to_string(value), "", inst.result};
+                        ++counts.folded;
+                    }
+                    break;
+                }
+                case OpCode::IFLEQ: {
+                    int taken = decide(in, i);
+                    if (taken == 1) {
+                        inst = IR{OpCode::GOTO, "", "", inst.result};
+                        ++counts.branches;
+                    } else if (taken == 0) {
+                        ++counts.branches;
+                        continue;
+                    } else {
+                        substitute(in, inst.arg2);
+                    }
+                    break;
+                }
+                case OpCode::OUT:
+                    substitute(in, inst.arg1);
+                    break;
+                case OpCode::LOAD_INDEXED:
+                    substitute(in, inst.arg2);
+                    break;
+                case OpCode::STORE_INDEXED:
+                    substitute(in, inst.arg2);
+                    substitute(in, inst.result);
+                    break;
+                default:
+                    break;
+            }
+            out.push_back(inst);
+        }
+        return out;
+    }
+
+    // drops the pure instructions that set a temp nothing reads
+    void removeDeadTemps(std::vector<IR>& out) {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            std::unordered_map<std::string, int> reads;
+            for (const IR& inst : out) {
+                switch (inst.op) {
+                    case OpCode::LOAD_VAR:
+                    case OpCode::STORE:
+                    case OpCode::OUT:
+                        ++reads[inst.arg1];
+                        break;
+                    case OpCode::ADD:
+                    case OpCode::SUB:
+                    case OpCode::IFLEQ:
+                        ++reads[inst.arg1];
+                        ++reads[inst.arg2];
+                        break;
+                    case OpCode::LOAD_INDEXED:
+                        ++reads[inst.arg2];
+                        break;
+                    case OpCode::STORE_INDEXED:
+                        ++reads[inst.arg2];
+                        ++reads[inst.result];
+                        break;
+                    default:
+                        break;
+                }
+            }
+            std::vector<IR> kept;
+            kept.reserve(out.size());
+            for (const IR& inst : out) {
+                bool pure = inst.op == OpCode::STORE_CONST || inst.op == OpCode::LOAD_CONST || inst.op == OpCode::LOAD_VAR
+                         || inst.op == OpCode::STORE || inst.op == OpCode::ADD || inst.op == OpCode::SUB;
+                if (pure && isTemp(inst.result) && reads.find(inst.result) == reads.end()) {
+                    ++counts.removed;
+                    changed = true;
+                    continue;
+                }
+                kept.push_back(inst);
+            }
+            out.swap(kept);
+        }
+    }
+};
+
+inline std::vector<IR> foldConstants(const std::vector<IR>& ir) {
+    return ConstantFolder(ir).run();
+}
@@ -4,155 +4,868 @@
 #include <cstdint>
 #include <iomanip>
 #include <algorithm>
+#include <memory>
+#include <cstring>
+#include "decoder.h"
+#include "jit.h"
+#include "devices.h"
+#include "guest_memory.h"
+#include "profiler.h"
+#include "trace.h"
+#include "replay.h"
 #ifdef DEBUG
 #define DEBUG_PRINT(x) std::cout << x << std::endl;
 #else
 #define DEBUG_PRINT(x)
 #endif
 
+// Dispatch engine, chosen at build time. GCC and Clang jump straight from one
+// handler to the next through a table of label addresses (computed goto), so
+// every handler gets its own indirect branch. Build with -DCPU_SWITCH_DISPATCH
+// (make SWITCH_DISPATCH=1) to force the portable switch engine.
+#if defined(__GNUC__) && !defined(CPU_SWITCH_DISPATCH)
+#define CPU_THREADED_DISPATCH
+#endif
+
+// keeps rarely taken slow paths out of the dispatch loop
+#if defined(__GNUC__)
+#define CPU_NOINLINE __attribute__((noinline))
+#else
+#define CPU_NOINLINE
+#endif
+
 class MinimalCPU {
+    GuestMemory memory;  // first, RAM points into it
+
 public:
-    uint8_t RAM[65536]{};
+    // 64 KB, copy-on-write: see guest_memory.h
+    uint8_t* const RAM = memory.data();
     uint8_t R[8] = {0};  // R0 ~ R7 // R3 = 1 for JNZ // R2 = carry register
     uint16_t PC = 0;
     bool halted = false;
 
+    static const uint16_t PAGE_SIZE = 256;
+    static const size_t PAGES = 65536 / PAGE_SIZE;
+    static const uint8_t PAGE_CODE = 0x01;  // page holds bytes of a cached instruction
+    static const uint8_t PAGE_JIT = 0x02;   // page holds bytes of a JIT-compiled block
+    static const uint8_t PAGE_CLEAN = 0x04; // page still matches the snapshot
+    static const uint8_t PAGE_IO = 0x08;    // stores go to a mapped IoDevice
+
+    // bytes stored here go to the output device
+    static const uint16_t CONSOLE_PORT = 0xFF00;
+
+    MinimalCPU() {
+        mapIo(CONSOLE_PORT, &console);
+    }
+
+    // Execution engine, chosen at runtime. Jit falls back to the interpreter
+    // on hosts without X86Jit support.
+    enum class Engine { Interpreter, Jit };
+    Engine engine = Engine::Interpreter;
+
+    // let the interpreter fuse Codegen's IFLEQ compare-and-branch sequences
+    // into superinstructions; takes effect for code decoded afterwards
+    bool superinstructions = true;
+
+    // Count every instruction executed into profile, or stop with nullptr.
+    // Not owned. A profiled or traced run() always interprets, without
+    // superinstructions, so each guest instruction is seen at its own PC;
+    // other runs use interpreter code that has no instrumentation in it at all.
+    void setProfile(Profile* counts) {
+        bool was = instrumented();
+        profile = counts;
+        instrumentationChanged(was);
+    }
+
+    // Append a TraceRecord for every instruction executed to writer, or stop
+    // with nullptr. Not owned.
+    void setTrace(TraceWriter* writer) {
+        bool was = instrumented();
+        trace = writer;
+        instrumentationChanged(was);
+    }
+
+    static const size_t OUTPUT_BUFFER_SIZE = 64 * 1024;
+
+    // Memory-mapped I/O. Guest stores into addr's 256-byte page are passed to
+    // device after they are written to RAM; nullptr unmaps the page. Pages
+    // carry a PAGE_IO flag, so stores anywhere else still take the one
+    // pageFlags test. Page 0xFF starts out mapped to the console port.
+    // Not owned.
+    void mapIo(uint16_t addr, IoDevice* device) {
+        uint8_t page = addr / PAGE_SIZE;
+        auto mapped = std::find_if(ioDevices.begin(), ioDevices.end(),
+                                   [page](const std::pair<uint8_t, IoDevice*>& entry) { return entry.first == page; });
+        if (mapped != ioDevices.end()) {
+            ioDevices.erase(mapped);
+        }
+        if (device) {
+            ioDevices.emplace_back(page, device);
+            pageFlags[page] |= PAGE_IO;
+        } else {
+            pageFlags[page] &= ~PAGE_IO;
+        }
+    }
+
+    // where bytes written to CONSOLE_PORT go; nullptr means std::cout. Not owned.
+    void setOutput(OutputDevice* device) {
+        flushOutput();
+        output = device;
+    }
+
+    // queue one byte for the output device
+    void putOutput(char ch) {
+        outputBuffer.push_back(ch);
+#ifdef DEBUG
+        flushOutput();  // keep guest output in order with the debug trace
+#else
+        if (outputBuffer.size() >= OUTPUT_BUFFER_SIZE) {
+            flushOutput();
+        }
+#endif
+    }
+
+    void flushOutput() {
+        if (!outputBuffer.empty()) {
+            static StreamOutput standardOutput;
+            (output ? output : &standardOutput)->write(outputBuffer.data(), outputBuffer.size());
+            outputBuffer.clear();
+        }
+    }
+
+    // a guest store made outside run(), as by code the AOT recompiler
+    // translated: the same write, cache invalidation, dirty-page tracking and
+    // I/O device dispatch as STORE
+    void storeByte(uint16_t addr, uint8_t value) {
+        store(RAM, addr, value);
+    }
+
+    // IN policy: echo the byte to the output device, skip ' ', '\t', '\n' and '\r'
+    bool echoInput = true;
+    bool skipInputWhitespace = true;
+
+    // where IN reads from; nullptr means std::cin. Not owned.
+    void setInput(InputDevice* device) {
+        input = device;
+    }
+
+    // Record or replay what IN reads, see replay.h. A recorder logs each byte
+    // IN returns; a replay takes the place of the input device and its
+    // whitespace policy, never waits on a terminal, and counts bytes read at
+    // another clock than recorded. Either one makes run() count instructions
+    // even without a budget, which keeps the clock. Attach before
+    // loadProgram(). Not owned.
+    void setInputRecorder(InputRecorder* log) {
+        recorder = log;
+    }
+
+    void setInputReplay(InputReplay* log) {
+        replay = log;
+    }
+
+    // next byte for IN after the whitespace policy; false once input is exhausted
+    bool readInput(char& ch) {
+        if (replay) {
+            return replay->next(inputClock, ch);
+        }
+        static StreamInput standardInput;
+        InputDevice* device = input ? input : &standardInput;
+        if (device->interactive()) {
+            flushOutput();  // the prompt has to be visible before blocking on input
+            if (recorder) {
+                recorder->flush();
+            }
+        }
+        do {
+            if (!device->read(ch)) {
+                return false;
+            }
+        } while (skipInputWhitespace && (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'));
+        if (recorder) {
+            recorder->record(inputClock, ch);
+        }
+        return true;
+    }
+
     void loadProgram(const std::vector<uint8_t>& program, uint16_t start = 0) {
+        loadProgram(program.data(), program.size(), start);
+    }
+
+    // program may already be in place at RAM + start, as loadHexImage() parses it there
+    void loadProgram(const uint8_t* program, size_t size, uint16_t start = 0) {
         reset();
-        for (size_t i = 0; i < program.size(); ++i) {
-            RAM[start + i] = program[i];
+        if (size > GuestMemory::SIZE - start) {
+            size = GuestMemory::SIZE - start;
         }
+        if (program != RAM + start) {
+            std::memmove(RAM + start, program, size);
+        }
+        markDirty(start, size);
         PC = start;
+    }
 
+    // drop every cached decode and compiled block, for host code that wrote RAM
+    // directly without markDirty(). only pages that ever held decoded code have entries to clear.
+    void invalidateDecodeCache() {
+        for (size_t page = 0; page < sizeof(pageFlags); ++page) {
+            if (pageFlags[page] & PAGE_CODE) {
+                DecodedInsn* first = decodeCache + page * PAGE_SIZE;
+                std::fill(first, first + PAGE_SIZE, DecodedInsn{});
+                pageFlags[page] &= ~PAGE_CODE;
+            }
+        }
+        if (jit) {
+            jit->flush();
+        }
     }
-    // add a debug function to print the state of the CPU
-    void run() {
-        while (!halted) {   
-            uint8_t op = fetch();
-            DEBUG_PRINT("PC: " << std::hex << PC << " Op: " << std::hex << static_cast<int>(op));
-            switch (op) {
-                case 0x00: // HALT
-                    halted = true;
+
+    // Checkpoint of RAM, registers, PC and halted, for rewinding to a known
+    // state (say a booted kernel) between jobs. From the first snapshot on,
+    // the first guest store to each page marks it dirty, and both snapshot()
+    // and restore() copy only the pages dirtied since the last of them.
+    // Host writes straight into RAM are not seen; report them with markDirty().
+    // The first snapshot is a MemoryImage that clones share; pages taken by
+    // later snapshots are kept privately until the next clone().
+    void snapshot() {
+        if (!image) {
+            adoptImage(std::make_shared<const MemoryImage>(RAM));
+        } else {
+            for (size_t page = 0; page < PAGES; ++page) {
+                if (!(pageFlags[page] & PAGE_CLEAN)) {
+                    if (!ownPages[page]) {
+                        ownPages[page].reset(new uint8_t[PAGE_SIZE]);
+                    }
+                    std::copy(RAM + page * PAGE_SIZE, RAM + (page + 1) * PAGE_SIZE, ownPages[page].get());
+                    snapshotPages[page] = ownPages[page].get();
+                    pageFlags[page] |= PAGE_CLEAN;
+                }
+            }
+        }
+        takeRegisterSnapshot();
+    }
+
+    // back to the last snapshot; false if there is none
+    bool restore() {
+        if (!image) {
+            return false;
+        }
+        for (size_t page = 0; page < PAGES; ++page) {
+            if (pageFlags[page] & PAGE_CLEAN) {
+                continue;
+            }
+            uint8_t* bytes = RAM + page * PAGE_SIZE;
+            const uint8_t* saved = snapshotPages[page];
+            if (pageFlags[page] & (PAGE_CODE | PAGE_JIT)) {
+                for (uint16_t offset = 0; offset < PAGE_SIZE; ++offset) {
+                    if (bytes[offset] != saved[offset]) {
+                        invalidateWrite(static_cast<uint16_t>(page * PAGE_SIZE + offset), pageFlags[page]);
+                    }
+                }
+            }
+            std::copy(saved, saved + PAGE_SIZE, bytes);
+            pageFlags[page] |= PAGE_CLEAN;
+        }
+        std::copy(snapshotR, snapshotR + 8, R);
+        PC = snapshotPC;
+        halted = snapshotHalted;
+        stopReason = snapshotStop;
+        retired = snapshotRetired;
+        return true;
+    }
+
+    bool hasSnapshot() const {
+        return image != nullptr;
+    }
+
+    // pages written since the last snapshot() or restore()
+    size_t dirtyPages() const {
+        if (!image) {
+            return 0;
+        }
+        return std::count_if(pageFlags, pageFlags + sizeof(pageFlags),
+                             [](uint8_t flags) { return !(flags & PAGE_CLEAN); });
+    }
+
+    // guest pages holding code the interpreter has decoded
+    size_t decodedPages() const {
+        return std::count_if(pageFlags, pageFlags + sizeof(pageFlags),
+                             [](uint8_t flags) { return flags & PAGE_CODE; });
+    }
+
+    // the host wrote RAM[addr] directly: drop the cached code built from it
+    // and count its page as dirty, as for a guest store
+    void markDirty(uint16_t addr) {
+        invalidateWrite(addr, pageFlags[addr / PAGE_SIZE]);
+    }
+
+    // markDirty() for each of size bytes from addr, stopping at the end of RAM.
+    // A decode that reaches into the range from before it covers addr, so
+    // past addr only the decodes that start in the range are dropped.
+    void markDirty(uint16_t addr, size_t size) {
+        size_t end = static_cast<size_t>(addr) + size;
+        if (end > GuestMemory::SIZE) {
+            end = GuestMemory::SIZE;
+        }
+        if (end > addr) {
+            markDirty(addr);
+        }
+        for (size_t first = addr + 1; first < end;) {
+            size_t last = std::min(end, (first / PAGE_SIZE + 1) * PAGE_SIZE);
+            uint8_t& flags = pageFlags[first / PAGE_SIZE];
+            if (flags & PAGE_CODE) {
+                std::fill(decodeCache + first, decodeCache + last, DecodedInsn{});
+            }
+            if (flags & PAGE_JIT) {
+                for (size_t at = first; at < last; ++at) {
+                    jit->invalidate(static_cast<uint16_t>(at));
+                }
+            }
+            flags &= ~PAGE_CLEAN;
+            first = last;
+        }
+    }
+
+    // compiled blocks currently cached, and how often the JIT had to throw
+    // all of them away
+    size_t jitBlocks() const {
+        return jit ? jit->blocks() : 0;
+    }
+    uint32_t jitFlushes() const {
+        return jit ? jit->flushCount() : 0;
+    }
+
+    // A new CPU in this one's current state, which is snapshot() first. The
+    // clone maps that snapshot, so the two share every page until one of them
+    // writes it, and a clone costs the pages it touches rather than 64 KB.
+    // Both restore() to the same point. Engine and I/O policy are copied, the
+    // devices are not.
+    std::unique_ptr<MinimalCPU> clone() {
+        snapshot();
+        std::unique_ptr<MinimalCPU> copy(new MinimalCPU);
+        copy->engine = engine;
+        copy->superinstructions = superinstructions;
+        copy->echoInput = echoInput;
+        copy->skipInputWhitespace = skipInputWhitespace;
+        copy->memory.map(*sharedImage());
+        copy->adoptImage(image);
+        std::copy(R, R + 8, copy->R);
+        copy->PC = PC;
+        copy->halted = halted;
+        copy->stopReason = stopReason;
+        copy->retired = retired;
+        copy->takeRegisterSnapshot();
+        return copy;
+    }
+
+    static const char* dispatchMode() {
+#ifdef CPU_THREADED_DISPATCH
+        return "threaded";
+#else
+        return "switch";
+#endif
+    }
+
+    static bool jitAvailable() {
+        return X86Jit::available();
+    }
+
+    // why run() returned
+    enum class StopReason {
+        Halted,           // HALT executed
+        BudgetExhausted,  // maxInstructions executed, run() again to continue
+        WaitingForInput,  // IN found the input device empty, PC is on the IN
+        Fault,            // invalid opcode, the CPU is halted
+    };
+    static const uint64_t UNLIMITED = UINT64_MAX;
+    // instructions the last run() executed; only counted when it had a budget
+    uint64_t executed = 0;
+
+    // runs until the guest stops, executing at most maxInstructions instructions.
+    // Without a budget the interpreter does no counting at all.
+    StopReason run(uint64_t maxInstructions = UNLIMITED) {
+        executed = 0;
+        if (halted) {
+            if (stopReason != StopReason::Fault) {
+                stopReason = StopReason::Halted;
+            }
+            return stopReason;
+        }
+        uint64_t budget = maxInstructions;
+        clockBias = retired + maxInstructions;  // the clock is clockBias - budget
+        if (engine == Engine::Jit && jitAvailable() && !instrumented()) {
+            runJit(budget);
+        } else {
+            interpretAll(budget);
+        }
+        retired += maxInstructions - budget;  // stays put when nothing counted
+        executed = maxInstructions == UNLIMITED ? 0 : maxInstructions - budget;
+        flushOutput();
+        if (recorder) {
+            recorder->flush();
+        }
+        return stopReason;
+    }
+
+private:
+    // Decode cache keyed by PC, mapped on the first run(). It is zeroed
+    // memory, all OP_DECODE, so the host commits only the parts code is
+    // decoded into: about 3 KB per guest page of code, not 768 KB.
+    std::unique_ptr<ZeroedMemory> decodeMemory;
+    DecodedInsn* decodeCache = nullptr;
+    uint8_t pageFlags[PAGES]{};
+    std::unique_ptr<X86Jit> jit;
+    Profile* profile = nullptr;
+    TraceWriter* trace = nullptr;
+    InputRecorder* recorder = nullptr;
+    InputReplay* replay = nullptr;
+    OutputDevice* output = nullptr;
+    InputDevice* input = nullptr;
+    std::vector<char> outputBuffer;
+
+    // sends bytes stored at CONSOLE_PORT to putOutput()
+    class ConsolePort : public IoDevice {
+    public:
+        explicit ConsolePort(MinimalCPU& cpu) : cpu(cpu) {}
+        void store(uint16_t addr, uint8_t value) override {
+            if (addr == CONSOLE_PORT) {
+                cpu.putOutput(static_cast<char>(value));
+            }
+        }
+    private:
+        MinimalCPU& cpu;
+    };
+    ConsolePort console{*this};
+    std::vector<std::pair<uint8_t, IoDevice*>> ioDevices;  // page, device; only I/O stores search it
+    StopReason stopReason = StopReason::Halted;
+
+    // instructions retired since loadProgram(), counted while an input log is
+    // attached; IN reads at clock inputClock
+    uint64_t retired = 0;
+    uint64_t clockBias = 0;
+    uint64_t inputClock = 0;
+
+    std::shared_ptr<const MemoryImage> image;  // null until the first snapshot()
+    const uint8_t* snapshotPages[PAGES]{};     // each into image or ownPages
+    std::unique_ptr<uint8_t[]> ownPages[PAGES];
+    uint8_t snapshotR[8]{};
+    uint16_t snapshotPC = 0;
+    bool snapshotHalted = false;
+    StopReason snapshotStop = StopReason::Halted;
+    uint64_t snapshotRetired = 0;
+
+    void takeRegisterSnapshot() {
+        std::copy(R, R + 8, snapshotR);
+        snapshotPC = PC;
+        snapshotHalted = halted;
+        snapshotStop = stopReason;
+        snapshotRetired = retired;
+    }
+
+    // the snapshot is exactly this image, with every page clean
+    void adoptImage(std::shared_ptr<const MemoryImage> base) {
+        image = std::move(base);
+        for (size_t page = 0; page < PAGES; ++page) {
+            snapshotPages[page] = image->data() + page * PAGE_SIZE;
+            ownPages[page].reset();
+            pageFlags[page] |= PAGE_CLEAN;
+        }
+    }
+
+    // the snapshot as a single image, folding in privately kept pages
+    const std::shared_ptr<const MemoryImage>& sharedImage() {
+        bool folded = std::none_of(ownPages, ownPages + PAGES,
+                                   [](const std::unique_ptr<uint8_t[]>& page) { return page != nullptr; });
+        if (!folded) {
+            std::vector<uint8_t> bytes(MemoryImage::SIZE);
+            for (size_t page = 0; page < PAGES; ++page) {
+                std::copy(snapshotPages[page], snapshotPages[page] + PAGE_SIZE, bytes.begin() + page * PAGE_SIZE);
+            }
+            adoptImage(std::make_shared<const MemoryImage>(bytes.data()));
+        }
+        return image;
+    }
+
+    void interpretAll(uint64_t& budget) {
+        bool counted = budget != UNLIMITED || recorder || replay;
+        if (instrumented()) {
+            if (counted) {
+                interpret<false, true, true>(budget);
+            } else {
+                interpret<false, false, true>(budget);
+            }
+        } else if (counted) {
+            interpret<false, true>(budget);
+        } else {
+            interpret<false, false>(budget);
+        }
+    }
+
+    // run compiled blocks, stepping the interpreter over whatever the JIT
+    // leaves to it (I/O, code-page stores, invalid opcodes, the last few
+    // instructions of a budget). Compiled blocks always count against the budget.
+    void runJit(uint64_t& budget) {
+        if (!jit) {
+            jit.reset(new X86Jit(RAM, R, pageFlags, PAGE_CODE | PAGE_JIT | PAGE_CLEAN | PAGE_IO, PAGE_JIT));
+        }
+        if (!jit->ok()) {
+            interpretAll(budget);
+            return;
+        }
+        X86Jit::Exit exit{};
+        bool chainable = false;
+        while (true) {
+            if (budget == 0) {
+                stopReason = StopReason::BudgetExhausted;
+                return;
+            }
+            const uint8_t* block = jit->blockFor(PC);
+            if (!block) {
+                chainable = false;
+                if (interpret<true, true>(budget)) {
+                    return;
+                }
+                continue;
+            }
+            if (chainable) {
+                jit->link(exit, block);
+            }
+            exit = jit->enter(block, &budget);
+            PC = exit.pc;
+            chainable = exit.reason == X86Jit::EXIT_CONTINUE;
+            if (exit.reason == X86Jit::EXIT_HALT) {
+                DEBUG_PRINT("Halted");
+                halted = true;
+                stopReason = StopReason::Halted;
+                return;
+            }
+            if (exit.reason != X86Jit::EXIT_CONTINUE && interpret<true, true>(budget)) {
+                return;
+            }
+        }
+    }
+
+    // Runs from PC until the guest stops, then sets stopReason and returns true.
+    // SingleStep returns false after one instruction instead. Budgeted counts
+    // every instruction against budget and stops when it reaches zero.
+    // Instrumented hands every instruction to observe().
+    template <bool SingleStep, bool Budgeted, bool Instrumented = false>
+    bool interpret(uint64_t& budgetLeft) {
+        if (!decodeCache) {
+            decodeMemory.reset(new ZeroedMemory(GuestMemory::SIZE * sizeof(DecodedInsn)));
+            decodeCache = static_cast<DecodedInsn*>(decodeMemory->data());
+        }
+        // keep PC, the cache and RAM in locals: byte stores to RAM/R may alias members
+        DecodedInsn* cache = decodeCache;
+        uint8_t* const ram = RAM;
+        uint16_t pc = PC;
+        const DecodedInsn* ip;
+        bool stepped = false;
+        uint64_t budget = budgetLeft;  // a local, or every RAM store would force a reload
+        uint16_t at = pc;  // PC of the instruction in flight, kept only when Instrumented
+
+        // handler bodies are shared by both engines; HANDLER opens one and
+        // DISPATCH leaves it for the next decoded instruction. Each handler
+        // advances pc by its own fixed length, so the next fetch does not
+        // wait on a load of the record's len field. RETIRE counts the
+        // instructions a handler executed and returns after one when
+        // single-stepping; REDISPATCH only stops for an empty budget.
+#define RETIRE(count) { if (Budgeted) budget -= count; if (Instrumented) observe(at, *ip); if (SingleStep) { stepped = true; goto done; } REDISPATCH(); }
+#define DISPATCH() RETIRE(1)
+#define OUT_OF_BUDGET() (Budgeted && budget == 0)
+        // a superinstruction that does not fit the budget stops after its
+        // first instruction, which is three bytes long
+#define STOP_AFTER_FIRST_IF_OVER_BUDGET() \
+        if (Budgeted && budget < 3) { \
+            pc -= MAX_FUSED_LEN - 3; \
+            DISPATCH(); \
+        }
+#define FETCH() \
+        ip = &cache[pc]; \
+        if (Instrumented) at = pc; \
+        DEBUG_PRINT("PC: " << std::hex << pc << " Op: " << std::hex << static_cast<int>(ip->op));
+#ifdef CPU_THREADED_DISPATCH
+        static void* const dispatchTable[] = {
+            &&op_decode, &&op_load, &&op_load_const, &&op_store, &&op_store_const,
+            &&op_add, &&op_sub, &&op_jnz, &&op_jz, &&op_in,
+            &&op_load_indexed, &&op_store_indexed, &&op_unknown, &&op_halt,
+            &&op_fused_const_cmp_jz, &&op_fused_cmp_jz,
+        };
+#define HANDLER(opcode, label, len) label: pc += len;
+#define REDISPATCH() do { \
+            if (OUT_OF_BUDGET()) { stopReason = StopReason::BudgetExhausted; goto done; } \
+            FETCH(); goto *dispatchTable[ip->op]; } while (0)
+        REDISPATCH();
+#else
+#define HANDLER(opcode, label, len) case opcode: pc += len;
+#define REDISPATCH() continue
+        while (true) {
+            if (OUT_OF_BUDGET()) {
+                stopReason = StopReason::BudgetExhausted;
+                goto done;
+            }
+            FETCH();
+            switch (ip->op) {
+#endif
+                HANDLER(OP_HALT, op_halt, 1) { // HALT
                     DEBUG_PRINT("Halted");
-                    break;
-                case 0x01: { // LOAD Rd, addr
-                    uint8_t rd = fetch(); // use temp variable to replace the rd. If tempID is <=3, then use R[tempID]
-                    uint16_t addr = (fetch() << 8) | fetch();
-                    R[rd] = RAM[addr];
-                    DEBUG_PRINT("LOAD Rd: " << std::hex << static_cast<int>(rd) << " addr: " << std::hex << addr << " value: " << std::hex << static_cast<int>(R[rd]));
-                    break;
+                    if (Budgeted) budget -= 1;
+                    if (Instrumented) observe(at, *ip);
+                    halted = true;
+                    stopReason = StopReason::Halted;
+                    goto done;
                 }
-                case 0x02: { // LOAD Rd, CONST
-                    uint8_t rd = fetch();
-                    uint8_t constVar = fetch();
-                    R[rd] = constVar;
-                    DEBUG_PRINT("LOAD Rd: " << std::hex << static_cast<int>(rd) << " const: " << std::hex << static_cast<int>(constVar));
-                    break;
+                HANDLER(0x01, op_load, 4) { // LOAD Rd, addr
+                    R[ip->rd] = ram[ip->addr];
+                    DEBUG_PRINT("LOAD Rd: " << std::hex << static_cast<int>(ip->rd) << " addr: " << std::hex << ip->addr << " value: " << std::hex << static_cast<int>(R[ip->rd]));
+                    DISPATCH();
                 }
-                case 0x03: { // STORE addr, Rs
-                    uint16_t addr = (fetch() << 8) | fetch();
-                    uint8_t rs = fetch();
-                    RAM[addr] = R[rs];
-                    DEBUG_PRINT("STORE addr: " << std::hex << addr << " Rs: " << std::hex << static_cast<int>(rs) << " value: " << std::hex << static_cast<int>(R[rs]));
-                    if (addr == static_cast<uint16_t>(0xFF00)) {
-                        std::cout << static_cast<char>(R[rs]);
-                    }
-                    break;
+                HANDLER(0x02, op_load_const, 3) { // LOAD Rd, CONST
+                    R[ip->rd] = ip->imm;
+                    DEBUG_PRINT("LOAD Rd: " << std::hex << static_cast<int>(ip->rd) << " const: " << std::hex << static_cast<int>(ip->imm));
+                    DISPATCH();
+                }
+                HANDLER(0x03, op_store, 4) { // STORE addr, Rs
+                    uint16_t addr = ip->addr;
+                    uint8_t value = R[ip->rs];
+                    DEBUG_PRINT("STORE addr: " << std::hex << addr << " Rs: " << std::hex << static_cast<int>(ip->rs) << " value: " << std::hex << static_cast<int>(value));
+                    store(ram, addr, value);
+                    DISPATCH();
                 }
-                case 0x04: { // STORE_CONST addr, CONST
-                    uint16_t addr = (fetch() << 8) | fetch();
-                    uint8_t conVar = fetch();
-                    RAM[addr] = conVar;
+                HANDLER(0x04, op_store_const, 4) { // STORE_CONST addr, CONST
+                    uint16_t addr = ip->addr;
+                    uint8_t conVar = ip->imm;
                     DEBUG_PRINT("STORE_CONST addr: " << std::hex << addr << " const: " << std::hex << static_cast<int>(conVar));
-                    if (addr == static_cast<uint16_t>(0xFF00)) {
-                        std::cout << static_cast<char>(conVar);
-                    }
-                    break;
+                    store(ram, addr, conVar);
+                    DISPATCH();
                 }
-                case 0x05: { // ADD Rd, Rs
-                    uint8_t rd = fetch();
-                    uint8_t rs = fetch();
-                    R[rd] += R[rs];
-                    DEBUG_PRINT("ADD Rd: " << std::hex << static_cast<int>(rd) << " Rs: " << std::hex << static_cast<int>(rs) << " result: " << std::hex << static_cast<int>(R[rd]));
-                    break;
+                HANDLER(0x05, op_add, 3) { // ADD Rd, Rs
+                    R[ip->rd] += R[ip->rs];
+                    DEBUG_PRINT("ADD Rd: " << std::hex << static_cast<int>(ip->rd) << " Rs: " << std::hex << static_cast<int>(ip->rs) << " result: " << std::hex << static_cast<int>(R[ip->rd]));
+                    DISPATCH();
                 }
-                case 0x06: { // SUB Rd, Rs
-                    uint8_t rd = fetch();
-                    uint8_t rs = fetch();
-                    uint8_t original_rd = R[rd];
-                    R[rd] -= R[rs];
+                HANDLER(0x06, op_sub, 3) { // SUB Rd, Rs
+                    uint8_t original_rd = R[ip->rd];
+                    R[ip->rd] -= R[ip->rs];
                     // Set R2 as carry register: 1 if underflow occurred (Rd < Rs), 0 otherwise
-                    R[2] = (original_rd < R[rs]) ? 1 : 0;
-                    DEBUG_PRINT("SUB Rd: " << std::hex << static_cast<int>(rd) << " Rs: " << std::hex << static_cast<int>(rs) << " result: " << std::hex << static_cast<int>(R[rd]) << " carry: " << std::hex << static_cast<int>(R[2]));
-                    break;
+                    R[2] = (original_rd < R[ip->rs]) ? 1 : 0;
+                    DEBUG_PRINT("SUB Rd: " << std::hex << static_cast<int>(ip->rd) << " Rs: " << std::hex << static_cast<int>(ip->rs) << " result: " << std::hex << static_cast<int>(R[ip->rd]) << " carry: " << std::hex << static_cast<int>(R[2]));
+                    DISPATCH();
                 }
-                case 0x07: { // JNZ Rd, addr
-                    uint8_t rd = fetch();
-                    uint16_t addr = (fetch() << 8) | fetch();
-                    if (R[rd] != 0) {
-                        PC = addr;
-                        DEBUG_PRINT("JNZ Rd: " << std::hex << static_cast<int>(rd) << " addr: " << std::hex << addr);
+                HANDLER(0x07, op_jnz, 4) { // JNZ Rd, addr
+                    if (R[ip->rd] != 0) {
+                        pc = ip->addr;
+                        DEBUG_PRINT("JNZ Rd: " << std::hex << static_cast<int>(ip->rd) << " addr: " << std::hex << ip->addr);
                     }
-                    break;
+                    DISPATCH();
                 }
-                case 0x08: { // JZ Rd, addr
-                    uint8_t rd = fetch();
-                    uint16_t addr = (fetch() << 8) | fetch();
-                    if (R[rd] == 0) {
-                        PC = addr;
-                        DEBUG_PRINT("JZ Rd: " << std::hex << static_cast<int>(rd) << " addr: " << std::hex << addr);
+                HANDLER(0x08, op_jz, 4) { // JZ Rd, addr
+                    if (R[ip->rd] == 0) {
+                        pc = ip->addr;
+                        DEBUG_PRINT("JZ Rd: " << std::hex << static_cast<int>(ip->rd) << " addr: " << std::hex << ip->addr);
                     }
-                    break;
+                    DISPATCH();
                 }
-                case 0x09: { // IN Rd
-                    uint8_t rd = fetch();
+                HANDLER(0x09, op_in, 2) { // IN Rd
+                    uint8_t rd = ip->rd;
                     char ch;
-                    // Skip whitespace and newlines to get meaningful input
-                    do {
-                        std::cin.get(ch);
-                    } while (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
-                    // Echo the character back for immediate feedback
-                    std::cout << ch;
+                    if (Budgeted) inputClock = clockBias - budget;
+                    if (!readInput(ch)) {
+                        // out of input: stop on this IN, so a rerun with more input retries it
+                        DEBUG_PRINT("IN Rd: " << std::hex << static_cast<int>(rd) << " end of input");
+                        pc -= 2;
+                        stopReason = StopReason::WaitingForInput;
+                        goto done;
+                    }
+                    if (echoInput) {
+                        putOutput(ch);
+                    }
                     R[rd] = static_cast<uint8_t>(ch);
                     DEBUG_PRINT("IN Rd: " << std::hex << static_cast<int>(rd) << " value: " << std::hex << static_cast<int>(R[rd]) << " char: '" << ch << "'");
-                    break;
+                    DISPATCH();
                 }
-                case 0x0A: { // 
+                HANDLER(0x0A, op_load_indexed, 1) { //
                     // LOAD_INDIRECT R0, R1, R2 -> R4
                     // R0 = RAM[R0<<8 | R1 + R2]
                     uint8_t hi = R[0], lo = R[1], idx = R[2];
                     uint16_t addr = (hi << 8 | lo) + idx;
-                    R[4] = RAM[addr];
+                    R[4] = ram[addr];
                     DEBUG_PRINT("LOAD_INDIRECT R0: " << std::hex << static_cast<int>(R[0]) << " R1: " << std::hex << static_cast<int>(R[1]) << " R2: " << std::hex << static_cast<int>(R[2]) << " addr: " << std::hex << addr << " value: " << std::hex << static_cast<int>(R[4]));
-                    break;
+                    DISPATCH();
                 }
-                case 0x0B: { // STORE_INDEXED
+                HANDLER(0x0B, op_store_indexed, 1) { // STORE_INDEXED
                     // STORE_INDIRECT R0, R1, R2 -> R4
                     // RAM[R0<<8 | R1 + R2] = R[4]
                     uint8_t hi = R[0], lo = R[1], src = R[2];
                     uint16_t addr = (hi << 8 | lo) + src;
-                    RAM[addr] = R[4];
+                    store(ram, addr, R[4]);
                     DEBUG_PRINT("STORE_INDIRECT R0: " << std::hex << static_cast<int>(R[0]) << " R1: " << std::hex << static_cast<int>(R[1]) << " R2: " << std::hex << static_cast<int>(R[2]) << " addr: " << std::hex << addr << " value: " << std::hex << static_cast<int>(R[0]));
-                    break;
+                    DISPATCH();
                 }
-                default:
-                    std::cerr << "Unknown opcode: " << std::hex << static_cast<int>(op) << "\n";
+                HANDLER(OP_UNKNOWN, op_unknown, 1) {
+                    flushOutput();
+                    std::cerr << "Unknown opcode: " << std::hex << static_cast<int>(ip->imm) << "\n";
+                    DEBUG_PRINT("Unknown opcode: " << std::hex << static_cast<int>(ip->imm));
                     halted = true;
-                    DEBUG_PRINT("Unknown opcode: " << std::hex << static_cast<int>(op));
+                    stopReason = StopReason::Fault;
+                    goto done;
+                }
+                HANDLER(OP_FUSED_CONST_CMP_JZ, op_fused_const_cmp_jz, MAX_FUSED_LEN) {
+                    R[ip->rd] = ip->imm;
+                    STOP_AFTER_FIRST_IF_OVER_BUDGET();
+                    uint8_t original_rd = R[ip->rd];
+                    R[ip->rd] -= R[ip->rs];
+                    R[2] = (original_rd < R[ip->rs]) ? 1 : 0;
+                    if (R[ip->rt] == 0) {
+                        pc = ip->addr;
+                    }
+                    DEBUG_PRINT("FUSED CONST_CMP_JZ Rd: " << std::hex << static_cast<int>(ip->rd) << " const: " << std::hex << static_cast<int>(ip->imm) << " Rs: " << std::hex << static_cast<int>(ip->rs) << " carry: " << std::hex << static_cast<int>(R[2]) << " addr: " << std::hex << ip->addr);
+                    RETIRE(3);
+                }
+                HANDLER(OP_FUSED_CMP_JZ, op_fused_cmp_jz, MAX_FUSED_LEN) {
+                    uint8_t original_rd = R[ip->rd];
+                    R[ip->rd] -= R[ip->rs];
+                    R[2] = (original_rd < R[ip->rs]) ? 1 : 0;
+                    STOP_AFTER_FIRST_IF_OVER_BUDGET();
+                    R[ip->rd] += R[ip->rs];
+                    if (R[ip->rt] == 0) {
+                        pc = ip->addr;
+                    }
+                    DEBUG_PRINT("FUSED CMP_JZ Rd: " << std::hex << static_cast<int>(ip->rd) << " Rs: " << std::hex << static_cast<int>(ip->rs) << " carry: " << std::hex << static_cast<int>(R[2]) << " addr: " << std::hex << ip->addr);
+                    RETIRE(3);
+                }
+                HANDLER(OP_DECODE, op_decode, 0) { // first visit of this PC: decode it, then dispatch it
+                    decodeAt(pc, cache[pc]);
+                    REDISPATCH();
+                }
+#ifndef CPU_THREADED_DISPATCH
+            }
+        }
+#endif
+#undef FETCH
+#undef HANDLER
+#undef DISPATCH
+#undef REDISPATCH
+#undef RETIRE
+#undef OUT_OF_BUDGET
+#undef STOP_AFTER_FIRST_IF_OVER_BUDGET
+    done:
+        PC = pc;
+        budgetLeft = budget;
+        return !stepped;
+    }
+
+    bool instrumented() const {
+        return profile || trace;
+    }
+
+    void instrumentationChanged(bool was) {
+        if (was != instrumented()) {
+            invalidateDecodeCache();  // decode again with or without fusion
+        }
+    }
+
+    // The instrumented interpreter's hook, after the instruction at pc ran.
+    // Trace records are rebuilt from the registers afterwards: no instruction
+    // writes the registers its address came from.
+    CPU_NOINLINE void observe(uint16_t pc, const DecodedInsn& d) {
+        uint8_t op = d.op == OP_HALT ? 0x00 : d.op;
+        if (profile) {
+            profile->hit(pc, op);
+        }
+        if (!trace) {
+            return;
+        }
+        TraceRecord r;
+        r.pc = pc;
+        r.op = op;
+        auto wrote = [&r, this](uint8_t reg) {
+            r.effects |= TRACE_REG | reg;
+            r.value = R[reg];
+        };
+        auto touched = [&r](uint8_t kind, uint16_t addr, uint8_t data) {
+            r.effects |= kind;
+            r.addr = addr;
+            r.data = data;
+        };
+        uint16_t indexed = static_cast<uint16_t>((R[0] << 8 | R[1]) + R[2]);
+        switch (d.op) {
+            case 0x01: wrote(d.rd); touched(TRACE_LOAD, d.addr, R[d.rd]); break;
+            case 0x02: case 0x05: case 0x09: wrote(d.rd); break;
+            case 0x03: touched(TRACE_STORE, d.addr, R[d.rs]); break;
+            case 0x04: touched(TRACE_STORE, d.addr, d.imm); break;
+            case 0x06: wrote(d.rd); r.effects |= TRACE_CARRY; r.data = R[2]; break;
+            case 0x0A: wrote(4); touched(TRACE_LOAD, indexed, R[4]); break;
+            case 0x0B: touched(TRACE_STORE, indexed, R[4]); break;
+        }
+        trace->record(r);
+    }
+
+    void decodeAt(uint16_t pc, DecodedInsn& d) {
+        if (!superinstructions || instrumented() || !fuseInstructions(RAM, pc, d)) {
+            decodeInstruction(RAM, pc, d);
+            if (d.op == 0x00) {
+                d.op = OP_HALT;
+            }
+        }
+        pageFlags[pc / PAGE_SIZE] |= PAGE_CODE;
+        pageFlags[static_cast<uint16_t>(pc + d.len - 1) / PAGE_SIZE] |= PAGE_CODE;
+    }
+
+    // every guest write goes through here so cached decodes of the written
+    // byte are dropped and the page counts as dirty for restore(). ram is the
+    // interpreter's local copy of RAM, which saves reloading the member.
+    void store(uint8_t* ram, uint16_t addr, uint8_t value) {
+        ram[addr] = value;
+        uint8_t flags = pageFlags[addr / PAGE_SIZE];
+        if (flags != 0) {
+            pageWritten(addr, value, flags);
+        }
+    }
+
+    // the written page holds cached code, is tracked for restore() or is I/O
+    CPU_NOINLINE void pageWritten(uint16_t addr, uint8_t value, uint8_t flags) {
+        invalidateWrite(addr, flags);
+        if (flags & PAGE_IO) {
+            uint8_t page = addr / PAGE_SIZE;
+            for (const std::pair<uint8_t, IoDevice*>& entry : ioDevices) {
+                if (entry.first == page) {
+                    entry.second->store(addr, value);
                     break;
+                }
             }
         }
     }
 
-private:
-    uint8_t fetch() {
-        return RAM[PC++];
+    // addr changed: drop just the decodes and compiled blocks built from it,
+    // and count its page as dirty. flags are the page's.
+    void invalidateWrite(uint16_t addr, uint8_t flags) {
+        if (flags & PAGE_CODE) {
+            invalidateCodeAt(addr);
+        }
+        if (flags & PAGE_JIT) {
+            jit->invalidate(addr);
+        }
+        if (flags & PAGE_CLEAN) {
+            pageFlags[addr / PAGE_SIZE] &= ~PAGE_CLEAN;
+        }
+    }
+
+    // a record starting up to MAX_FUSED_LEN - 1 bytes before addr may cover it
+    void invalidateCodeAt(uint16_t addr) {
+        for (uint8_t back = 0; back < MAX_FUSED_LEN; ++back) {
+            DecodedInsn& d = decodeCache[static_cast<uint16_t>(addr - back)];
+            if (d.len > back) {
+                d = DecodedInsn{};
+            }
+        }
     }
+
     void reset() {
         halted = false;
         PC = 0;
+        retired = 0;
         for(int i = 0; i < 4; i++) {
             R[i] = 0;
         }
     }
-};
\ No newline at end of file
+};
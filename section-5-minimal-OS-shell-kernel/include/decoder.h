@@ -0,0 +1,119 @@
+#pragma once
+#include <cstdint>
+
+// Instruction decoding shared by the interpreter in cpu.h and the JIT in jit.h.
+
+// opcodes that only exist in decoded form, never in RAM
+const uint8_t OP_UNKNOWN = 0x0C;  // invalid opcode byte, kept in imm for the error message
+const uint8_t OP_HALT = 0x0D;     // HALT as the interpreter caches it, 0x00 being OP_DECODE
+
+// interpreter cache slot not decoded yet; it is the HALT opcode so that
+// zeroed memory is an empty cache
+const uint8_t OP_DECODE = 0x00;
+
+// superinstructions for the two ways Codegen lowers IFLEQ, produced only by
+// fuseInstructions()
+const uint8_t OP_FUSED_CONST_CMP_JZ = 0x0E;  // LOAD Rd,imm; SUB Rd,Rs; JZ Rt,addr
+const uint8_t OP_FUSED_CMP_JZ = 0x0F;        // SUB Rd,Rs; ADD Rd,Rs; JZ Rt,addr
+
+const uint8_t MAX_INSN_LEN = 4;
+const uint8_t MAX_FUSED_LEN = 10;  // LOAD_CONST/SUB + SUB/ADD + JZ
+
+// A fully decoded instruction. run() decodes each PC once and then only
+// dispatches on these records, instead of re-fetching the operand bytes.
+struct DecodedInsn {
+    uint8_t op = OP_DECODE;  // opcode
+    uint8_t rd = 0;          // destination (or tested) register
+    uint8_t rs = 0;          // source register
+    uint8_t imm = 0;         // 8-bit constant
+    uint16_t addr = 0;       // 16-bit memory or jump address
+    uint8_t len = 0;         // encoded length in bytes
+    uint8_t rt = 0;          // superinstructions: register the JZ tests
+};
+
+// decodes the instruction whose i-th byte is byteAt(i), for callers whose
+// memory is not one flat array
+template <typename ByteAt>
+inline void decodeBytes(ByteAt byteAt, DecodedInsn& d) {
+    d = DecodedInsn{};
+    d.op = byteAt(0);
+    switch (d.op) {
+        case 0x01: // LOAD Rd, addr
+        case 0x07: // JNZ Rd, addr
+        case 0x08: // JZ Rd, addr
+            d.rd = byteAt(1);
+            d.addr = static_cast<uint16_t>((byteAt(2) << 8) | byteAt(3));
+            d.len = 4;
+            break;
+        case 0x02: // LOAD Rd, CONST
+            d.rd = byteAt(1);
+            d.imm = byteAt(2);
+            d.len = 3;
+            break;
+        case 0x03: // STORE addr, Rs
+            d.addr = static_cast<uint16_t>((byteAt(1) << 8) | byteAt(2));
+            d.rs = byteAt(3);
+            d.len = 4;
+            break;
+        case 0x04: // STORE_CONST addr, CONST
+            d.addr = static_cast<uint16_t>((byteAt(1) << 8) | byteAt(2));
+            d.imm = byteAt(3);
+            d.len = 4;
+            break;
+        case 0x05: // ADD Rd, Rs
+        case 0x06: // SUB Rd, Rs
+            d.rd = byteAt(1);
+            d.rs = byteAt(2);
+            d.len = 3;
+            break;
+        case 0x09: // IN Rd
+            d.rd = byteAt(1);
+            d.len = 2;
+            break;
+        case 0x00: // HALT
+        case 0x0A: // LOAD_INDEXED
+        case 0x0B: // STORE_INDEXED
+            d.len = 1;
+            break;
+        default:
+            d.op = OP_UNKNOWN;
+            d.imm = byteAt(0);
+            d.len = 1;
+            break;
+    }
+}
+
+// operand bytes are read high byte first, wrapping around at 0xFFFF like fetch() did
+inline void decodeInstruction(const uint8_t* RAM, uint16_t pc, DecodedInsn& d) {
+    decodeBytes([RAM, pc](int offset) { return RAM[static_cast<uint16_t>(pc + offset)]; }, d);
+}
+
+// Decodes the superinstruction starting at pc if the next three instructions
+// form one of the fused sequences, otherwise returns false and leaves d alone.
+// The handlers run the three instructions in order, so any registers may
+// overlap, including R2 as operand, carry and tested register.
+inline bool fuseInstructions(const uint8_t* RAM, uint16_t pc, DecodedInsn& d) {
+    DecodedInsn first, second, jump;
+    decodeInstruction(RAM, pc, first);
+    if (first.op != 0x02 && first.op != 0x06) {
+        return false;
+    }
+    decodeInstruction(RAM, static_cast<uint16_t>(pc + 3), second);
+    if (second.op != (first.op == 0x02 ? 0x06 : 0x05) || second.rd != first.rd
+        || (first.op == 0x06 && second.rs != first.rs)) {
+        return false;
+    }
+    decodeInstruction(RAM, static_cast<uint16_t>(pc + 6), jump);
+    if (jump.op != 0x08 || second.rd > 7 || second.rs > 7 || jump.rd > 7) {
+        return false;
+    }
+    d = DecodedInsn{};
+    d.op = first.op == 0x02 ? OP_FUSED_CONST_CMP_JZ : OP_FUSED_CMP_JZ;
+    d.rd = second.rd;
+    d.rs = second.rs;
+    d.imm = first.imm;
+    d.addr = jump.addr;
+    d.len = MAX_FUSED_LEN;
+    d.rt = jump.rd;
+    return true;
+}
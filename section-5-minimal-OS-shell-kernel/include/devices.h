@@ -0,0 +1,199 @@
+#pragma once
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <cstddef>
+#include <cstdint>
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// A device behind a 256-byte page of guest memory, mapped with
+// MinimalCPU::mapIo(). A guest store into the page is written to RAM as
+// usual, then passed to store(), so device registers read back from RAM.
+// Loads are plain RAM reads.
+class IoDevice {
+public:
+    virtual ~IoDevice() = default;
+    virtual void store(uint16_t addr, uint8_t value) = 0;
+};
+
+// Host side of the memory-mapped output port at 0xFF00. MinimalCPU collects
+// the guest's bytes in its own buffer and hands them over in large chunks,
+// on HALT, before IN waits on interactive input, and whenever the buffer fills up.
+class OutputDevice {
+public:
+    virtual ~OutputDevice() = default;
+    virtual void write(const char* data, size_t size) = 0;
+};
+
+// writes to a std::ostream, std::cout by default
+class StreamOutput : public OutputDevice {
+public:
+    explicit StreamOutput(std::ostream& stream = std::cout) : stream(stream) {}
+    void write(const char* data, size_t size) override {
+        stream.write(data, static_cast<std::streamsize>(size));
+        stream.flush();
+    }
+private:
+    std::ostream& stream;
+};
+
+// appends to a std::string the caller owns
+class StringOutput : public OutputDevice {
+public:
+    explicit StringOutput(std::string& text) : text(text) {}
+    void write(const char* data, size_t size) override {
+        text.append(data, size);
+    }
+private:
+    std::string& text;
+};
+
+#if defined(__unix__) || defined(__APPLE__)
+// writes straight to a file descriptor, bypassing iostream
+class FdOutput : public OutputDevice {
+public:
+    explicit FdOutput(int fd = STDOUT_FILENO) : fd(fd) {}
+    void write(const char* data, size_t size) override {
+        while (size > 0) {
+            ssize_t written = ::write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;  // the guest has no way to see host write errors
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+private:
+    int fd;
+};
+#endif
+
+// Host side of the IN opcode. MinimalCPU asks for one byte at a time and
+// applies its own echo and whitespace policy on top.
+class InputDevice {
+public:
+    virtual ~InputDevice() = default;
+    // next byte; false once the input is exhausted
+    virtual bool read(char& ch) = 0;
+    // a person is waiting on the other side, so pending output is flushed before each read
+    virtual bool interactive() const { return false; }
+};
+
+// reads from a std::istream, std::cin by default. std::cin counts as
+// interactive only when it is a terminal, so piped scripts keep the output buffered.
+class StreamInput : public InputDevice {
+public:
+    explicit StreamInput(std::istream& stream = std::cin) : stream(stream), tty(isTerminal(stream)) {}
+    bool read(char& ch) override {
+        return static_cast<bool>(stream.get(ch));
+    }
+    bool interactive() const override { return tty; }
+private:
+    std::istream& stream;
+    bool tty;
+
+    static bool isTerminal(std::istream& stream) {
+#if defined(__unix__) || defined(__APPLE__)
+        return &stream == &std::cin && isatty(STDIN_FILENO);
+#else
+        return &stream == &std::cin;
+#endif
+    }
+};
+
+// reads from bytes in memory; the caller keeps them alive
+class SpanInput : public InputDevice {
+public:
+    SpanInput(const char* data, size_t size) : cursor(data), end(data + size) {}
+    explicit SpanInput(const std::string& text) : SpanInput(text.data(), text.size()) {}
+    explicit SpanInput(std::string&& text) = delete;  // would point into a temporary
+    bool read(char& ch) override {
+        if (cursor == end) {
+            return false;
+        }
+        ch = *cursor++;
+        return true;
+    }
+    size_t remaining() const { return static_cast<size_t>(end - cursor); }
+protected:
+    SpanInput() = default;
+    void reset(const char* data, size_t size) {
+        cursor = data;
+        end = data + size;
+    }
+private:
+    const char* cursor = nullptr;
+    const char* end = nullptr;
+};
+
+// A whole file, read-only: mapped where the host has mmap, read into memory
+// elsewhere. Empty files have no data.
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::runtime_error("Could not open file: " + filename);
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            length = static_cast<size_t>(info.st_size);
+            void* mem = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mem == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("Could not map file: " + filename);
+            }
+            bytes = static_cast<char*>(mem);
+        }
+        ::close(fd);
+#else
+        std::ifstream file(filename, std::ios::binary);
+        if (!file) {
+            throw std::runtime_error("Could not open file: " + filename);
+        }
+        copy.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        bytes = copy.empty() ? nullptr : &copy[0];
+        length = copy.size();
+#endif
+    }
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (bytes) {
+            munmap(bytes, length);
+        }
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+private:
+    char* bytes = nullptr;
+    size_t length = 0;
+#if !defined(__unix__) && !defined(__APPLE__)
+    std::string copy;
+#endif
+};
+
+// maps a whole file and reads it as a span
+class FileInput : public SpanInput {
+public:
+    explicit FileInput(const std::string& filename) : file(filename) {
+        reset(file.data(), file.size());
+    }
+private:
+    MappedFile file;
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include "decoder.h"
+#include <ostream>
+#include <iomanip>
+#include <cstddef>
+
+// Disassembler shared by Codegen::writeToFile() and the profiler report.
+// Lengths and operands come from decodeBytes(), so a listing always splits
+// the bytes the same way the CPU executes them.
+
+inline const char* mnemonic(uint8_t opcode) {
+    switch (opcode) {
+        case 0x00: return "HALT";
+        case 0x01: return "LOAD_VAR";
+        case 0x02: return "LOAD_CONST";
+        case 0x03: return "STORE";
+        case 0x04: return "STORE_CONST";
+        case 0x05: return "ADD";
+        case 0x06: return "SUB";
+        case 0x07: return "JNZ";
+        case 0x08: return "JZ";
+        case 0x09: return "IN";
+        case 0x0A: return "LOAD_INDEXED";
+        case 0x0B: return "STORE_INDEXED";
+        default: return "UNKNOWN";
+    }
+}
+
+inline const char* operandForm(uint8_t opcode) {
+    switch (opcode) {
+        case 0x00: return "HALT";
+        case 0x01: return "LOAD Rd, addr";
+        case 0x02: return "LOAD Rd, const";
+        case 0x03: return "STORE addr, Rs";
+        case 0x04: return "STORE addr, const";
+        case 0x05: return "ADD Rd, Rs";
+        case 0x06: return "SUB Rd, Rs";
+        case 0x07: return "JNZ Rd, addr";
+        case 0x08: return "JZ Rd, addr";
+        case 0x09: return "IN Rd";
+        case 0x0A: return "LOAD_INDEXED R4 = [R0:R1 + R2]";
+        case 0x0B: return "STORE_INDEXED [R0:R1 + R2] = R4";
+        default: return "Unknown opcode";
+    }
+}
+
+// Writes the instruction at code[at] as
+//   0x01 0x00 0x80 0x00 ; LOAD_VAR (LOAD Rd, addr) R0, 0x8000
+// and returns its length. A truncated last instruction prints the bytes
+// there are.
+inline uint8_t disassemble(std::ostream& out, const uint8_t* code, size_t size, size_t at) {
+    DecodedInsn d;
+    decodeBytes([code, size, at](int offset) { return at + offset < size ? code[at + offset] : uint8_t(0); }, d);
+    uint8_t opcode = code[at];
+    std::ios::fmtflags saved = out.flags();
+    char fill = out.fill();
+    out << std::hex << std::setfill('0');
+    for (uint8_t i = 0; i < d.len && at + i < size; ++i) {
+        out << (i ? " 0x" : "0x") << std::setw(2) << static_cast<int>(code[at + i]);
+    }
+    out << " ; " << mnemonic(opcode) << " (" << operandForm(opcode) << ")";
+    auto address = [&out](uint16_t addr) -> std::ostream& {
+        return out << "0x" << std::hex << std::setw(4) << addr << std::dec;
+    };
+    out << std::dec;
+    switch (d.op) {
+        case 0x01: case 0x07: case 0x08:
+            out << " R" << static_cast<int>(d.rd) << ", ";
+            address(d.addr);
+            break;
+        case 0x02:
+            out << " R" << static_cast<int>(d.rd) << ", " << static_cast<int>(d.imm);
+            break;
+        case 0x03:
+            out << " ";
+            address(d.addr) << ", R" << static_cast<int>(d.rs);
+            break;
+        case 0x04:
+            out << " ";
+            address(d.addr) << ", " << static_cast<int>(d.imm);
+            break;
+        case 0x05: case 0x06:
+            out << " R" << static_cast<int>(d.rd) << ", R" << static_cast<int>(d.rs);
+            break;
+        case 0x09:
+            out << " R" << static_cast<int>(d.rd);
+            break;
+    }
+    out.flags(saved);
+    out.fill(fill);
+    return d.len;
+}
@@ -0,0 +1,209 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <new>
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define CPU_MAPPED_MEMORY
+#endif
+
+// Guest RAM is 64 KB per CPU, but most of it is never touched, and with many
+// CPUs running one program most of what is touched is the same program image.
+// So RAM is not an array. On Linux and macOS it is a private mapping, and the
+// host kernel does the copy-on-write:
+// - GuestMemory starts as anonymous memory. Pages the guest never writes are
+//   the kernel's shared zero page and cost nothing.
+// - MemoryImage is a frozen copy of a RAM, held in an unlinked shared file.
+// - GuestMemory::map() maps an image privately. Every page is shared with the
+//   image until this RAM writes it, then the kernel copies that one page.
+// RAM keeps one fixed address for its lifetime, so the interpreter and the
+// JIT index it directly as before. Sharing is at host page granularity
+// (4 KB, 16 guest pages). Elsewhere both are plain heap copies.
+
+// A read-only 64 KB RAM image that any number of GuestMemory can map.
+class MemoryImage {
+public:
+    static const size_t SIZE = 65536;
+
+    explicit MemoryImage(const uint8_t* bytes) {
+#ifdef CPU_MAPPED_MEMORY
+        fd = openFile();
+        if (fd >= 0 && fill(bytes)) {
+            void* mem = mmap(nullptr, SIZE, PROT_READ, MAP_SHARED, fd, 0);
+            if (mem != MAP_FAILED) {
+                view = static_cast<const uint8_t*>(mem);
+                return;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+#endif
+        copy.reset(new uint8_t[SIZE]);
+        std::memcpy(copy.get(), bytes, SIZE);
+        view = copy.get();
+    }
+
+    ~MemoryImage() {
+#ifdef CPU_MAPPED_MEMORY
+        if (fd >= 0) {
+            munmap(const_cast<uint8_t*>(view), SIZE);
+            close(fd);
+        }
+#endif
+    }
+
+    MemoryImage(const MemoryImage&) = delete;
+    MemoryImage& operator=(const MemoryImage&) = delete;
+
+    const uint8_t* data() const { return view; }
+
+    // the file to map privately, or -1 when the image is a heap copy
+    int descriptor() const { return fd; }
+
+private:
+    int fd = -1;
+    const uint8_t* view = nullptr;
+    std::unique_ptr<uint8_t[]> copy;
+
+#ifdef CPU_MAPPED_MEMORY
+    static const size_t HOST_PAGE = 4096;
+
+    static int openFile() {
+#if defined(__linux__)
+        return memfd_create("guest-ram", MFD_CLOEXEC);
+#else
+        char path[] = "/tmp/guest-ram-XXXXXX";
+        int file = mkstemp(path);
+        if (file >= 0) {
+            unlink(path);
+        }
+        return file;
+#endif
+    }
+
+    // all-zero host pages stay holes in the file
+    bool fill(const uint8_t* bytes) {
+        if (ftruncate(fd, SIZE) != 0) {
+            return false;
+        }
+        static const uint8_t zeros[HOST_PAGE] = {};
+        for (size_t offset = 0; offset < SIZE; offset += HOST_PAGE) {
+            if (std::memcmp(bytes + offset, zeros, HOST_PAGE) == 0) {
+                continue;
+            }
+            if (pwrite(fd, bytes + offset, HOST_PAGE, static_cast<off_t>(offset)) != static_cast<ssize_t>(HOST_PAGE)) {
+                return false;
+            }
+        }
+        return true;
+    }
+#endif
+};
+
+// 64 KB of zeroed guest RAM at an address that never changes.
+class GuestMemory {
+public:
+    static const size_t SIZE = MemoryImage::SIZE;
+
+    GuestMemory() {
+#ifdef CPU_MAPPED_MEMORY
+        bytes = anonymous(nullptr, 0);
+        if (bytes) {
+            return;
+        }
+#endif
+        heap.reset(new uint8_t[SIZE]());
+        bytes = heap.get();
+    }
+
+    ~GuestMemory() {
+#ifdef CPU_MAPPED_MEMORY
+        if (!heap) {
+            munmap(bytes, SIZE);
+        }
+#endif
+    }
+
+    GuestMemory(const GuestMemory&) = delete;
+    GuestMemory& operator=(const GuestMemory&) = delete;
+
+    uint8_t* data() const { return bytes; }
+
+    // make RAM equal to the image, sharing its pages until they are written
+    void map(const MemoryImage& image) {
+#ifdef CPU_MAPPED_MEMORY
+        if (!heap && image.descriptor() >= 0) {
+            if (mmap(bytes, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image.descriptor(), 0) != MAP_FAILED) {
+                return;
+            }
+            anonymous(bytes, MAP_FIXED);  // a failed MAP_FIXED may have unmapped the range
+        }
+#endif
+        std::memcpy(bytes, image.data(), SIZE);
+    }
+
+private:
+    uint8_t* bytes = nullptr;
+    std::unique_ptr<uint8_t[]> heap;  // only without mmap
+
+#ifdef CPU_MAPPED_MEMORY
+    static uint8_t* anonymous(uint8_t* at, int flags) {
+        void* mem = mmap(at, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        if (mem == MAP_FAILED) {
+            if (at) {
+                abort();  // RAM has to stay at its address, and nothing is mapped there now
+            }
+            return nullptr;
+        }
+        return static_cast<uint8_t*>(mem);
+    }
+#endif
+};
+
+// size bytes of zeros that take host memory only where they are written, for
+// tables indexed by guest address of which a program uses a few pages: the
+// kernel's zero page under mmap, calloc elsewhere.
+class ZeroedMemory {
+public:
+    explicit ZeroedMemory(size_t size) : size(size) {
+#ifdef CPU_MAPPED_MEMORY
+        void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            bytes = mem;
+            return;
+        }
+#endif
+        bytes = std::calloc(size, 1);
+        heap = true;
+        if (!bytes) {
+            throw std::bad_alloc();
+        }
+    }
+
+    ~ZeroedMemory() {
+        if (heap) {
+            std::free(bytes);
+        }
+#ifdef CPU_MAPPED_MEMORY
+        else {
+            munmap(bytes, size);
+        }
+#endif
+    }
+
+    ZeroedMemory(const ZeroedMemory&) = delete;
+    ZeroedMemory& operator=(const ZeroedMemory&) = delete;
+
+    void* data() const { return bytes; }
+
+private:
+    size_t size;
+    void* bytes = nullptr;
+    bool heap = false;
+};
@@ -0,0 +1,166 @@
+#pragma once
+#include "devices.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Executable images. Where a .hex or flat .bin file is only code, and the
+// loader has to be told where it goes, an image says where everything goes:
+// code at its load address, initialised data at its own address, a zeroed
+// BSS right after the data, and the entry point. Codegen::writeToImage()
+// writes one; loadImage() in loader.h maps it and copies the sections into
+// RAM with no parsing beyond the header.
+//
+// File, all numbers little-endian:
+//    0  magic "MCIMAGE\0"
+//    8  u16 version (1)       10  u16 flags (0)
+//   12  u16 load address      14  u16 entry point
+//   16  u32 code size
+//   20  u16 data address      22  u16 reserved (0)
+//   24  u32 data size         28  u32 BSS size
+//   32  code, then data
+
+struct ProgramImage {
+    uint16_t load = 0;
+    uint16_t entry = 0;
+    std::vector<uint8_t> code;
+    uint16_t dataAddress = 0;
+    std::vector<uint8_t> data;
+    uint32_t bssSize = 0;  // zero bytes after the data
+};
+
+// the sections of an image, pointing into a file or a ProgramImage
+struct ImageView {
+    uint16_t load = 0;
+    uint16_t entry = 0;
+    const uint8_t* code = nullptr;
+    uint32_t codeSize = 0;
+    uint16_t dataAddress = 0;
+    const uint8_t* data = nullptr;
+    uint32_t dataSize = 0;
+    uint32_t bssSize = 0;
+
+    ImageView() = default;
+    explicit ImageView(const ProgramImage& image)
+        : load(image.load), entry(image.entry), code(image.code.data()),
+          codeSize(static_cast<uint32_t>(image.code.size())), dataAddress(image.dataAddress),
+          data(image.data.data()), dataSize(static_cast<uint32_t>(image.data.size())), bssSize(image.bssSize) {}
+};
+
+class ImageFormat {
+public:
+    static constexpr const char* MAGIC = "MCIMAGE";  // and its terminating zero
+    static const size_t MAGIC_SIZE = 8;
+    static const uint16_t VERSION = 1;
+    static const size_t HEADER_SIZE = 32;
+
+    // true if bytes start like an image, to tell one from a .hex file
+    static bool matches(const void* bytes, size_t size) {
+        return size >= MAGIC_SIZE && std::memcmp(bytes, MAGIC, MAGIC_SIZE) == 0;
+    }
+
+    // Checks the header and that every section fits in the file and in
+    // 64 KB of RAM, and points a view at the sections in bytes. Throws
+    // std::runtime_error naming what is wrong.
+    static ImageView view(const uint8_t* bytes, size_t size) {
+        if (!matches(bytes, size)) {
+            throw std::runtime_error("Not an image");
+        }
+        if (size < HEADER_SIZE) {
+            throw std::runtime_error("Truncated image header");
+        }
+        if (get16(bytes + 8) != VERSION) {
+            throw std::runtime_error("Unsupported image version " + std::to_string(get16(bytes + 8)));
+        }
+        ImageView v;
+        v.load = get16(bytes + 12);
+        v.entry = get16(bytes + 14);
+        v.codeSize = get32(bytes + 16);
+        v.dataAddress = get16(bytes + 20);
+        v.dataSize = get32(bytes + 24);
+        v.bssSize = get32(bytes + 28);
+        if (uint64_t(HEADER_SIZE) + v.codeSize + v.dataSize != size) {
+            throw std::runtime_error("Image size does not match its header");
+        }
+        check(v);
+        v.code = bytes + HEADER_SIZE;
+        v.data = v.code + v.codeSize;
+        return v;
+    }
+
+    // sections that would run past the end of RAM
+    static void check(const ImageView& v) {
+        if (uint64_t(v.load) + v.codeSize > 65536) {
+            throw std::runtime_error("Image code does not fit in memory");
+        }
+        if (uint64_t(v.dataAddress) + v.dataSize + v.bssSize > 65536) {
+            throw std::runtime_error("Image data does not fit in memory");
+        }
+    }
+
+    static std::vector<uint8_t> encode(const ProgramImage& image) {
+        ImageView v(image);
+        check(v);
+        std::vector<uint8_t> bytes(HEADER_SIZE);
+        std::memcpy(bytes.data(), MAGIC, MAGIC_SIZE);
+        put16(&bytes[8], VERSION);
+        put16(&bytes[12], v.load);
+        put16(&bytes[14], v.entry);
+        put32(&bytes[16], v.codeSize);
+        put16(&bytes[20], v.dataAddress);
+        put32(&bytes[24], v.dataSize);
+        put32(&bytes[28], v.bssSize);
+        bytes.insert(bytes.end(), image.code.begin(), image.code.end());
+        bytes.insert(bytes.end(), image.data.begin(), image.data.end());
+        return bytes;
+    }
+
+private:
+    static uint16_t get16(const uint8_t* p) {
+        return static_cast<uint16_t>(p[0] | p[1] << 8);
+    }
+    static uint32_t get32(const uint8_t* p) {
+        return uint32_t(get16(p)) | uint32_t(get16(p + 2)) << 16;
+    }
+    static void put16(uint8_t* p, uint16_t value) {
+        p[0] = static_cast<uint8_t>(value);
+        p[1] = static_cast<uint8_t>(value >> 8);
+    }
+    static void put32(uint8_t* p, uint32_t value) {
+        put16(p, static_cast<uint16_t>(value));
+        put16(p + 2, static_cast<uint16_t>(value >> 16));
+    }
+};
+
+inline void writeProgramImage(const std::string& filename, const ProgramImage& image) {
+    std::vector<uint8_t> bytes = ImageFormat::encode(image);
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file || !file.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()))) {
+        throw std::runtime_error("Could not write image: " + filename);
+    }
+}
+
+// the sections of a mapped image file; valid as long as the mapping
+inline ImageView viewImage(const MappedFile& file, const std::string& filename) {
+    try {
+        return ImageFormat::view(reinterpret_cast<const uint8_t*>(file.data()), file.size());
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+}
+
+inline ProgramImage readProgramImage(const std::string& filename) {
+    MappedFile file(filename);
+    ImageView v = viewImage(file, filename);
+    ProgramImage image;
+    image.load = v.load;
+    image.entry = v.entry;
+    image.code.assign(v.code, v.code + v.codeSize);
+    image.dataAddress = v.dataAddress;
+    image.data.assign(v.data, v.data + v.dataSize);
+    image.bssSize = v.bssSize;
+    return image;
+}
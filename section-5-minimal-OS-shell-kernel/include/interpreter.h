@@ -1,10 +1,29 @@
 #pragma once
 #include <vector>
+#include <array>
+#include <memory>
 #include <unordered_map>
 #include "parser.h"
 #include <iostream>
 #include <sstream>
 
+// The IR's 64K words of memory, allocated a page at a time. Pages that were
+// never written read as 0 and cost nothing. Copies share pages until one
+// side writes them.
+class PagedMemory {
+    public:
+        int read(uint16_t addr) const;
+        void write(uint16_t addr, int value);
+        size_t allocatedPages() const;
+    private:
+        static const size_t PAGE_SIZE = 256;
+        using Page = std::array<int, PAGE_SIZE>;
+        std::vector<std::shared_ptr<Page>> pages = std::vector<std::shared_ptr<Page>>(0x10000 / PAGE_SIZE);
+};
+
+// Runs IR directly. Values are bytes as on the CPU: ADD and SUB wrap at 8
+// bits, a literal is its low byte and IFLEQ compares unsigned, so a program
+// prints the same here, compiled, and with its constants folded.
 class IRInterpreter {
     public:
         IRInterpreter();
@@ -15,7 +34,7 @@ class IRInterpreter {
         std::unordered_map<std::string, int> variables;
         std::unordered_map<std::string, std::pair<uint16_t, size_t>> arrayMap;
         std::unordered_map<std::string, uint16_t> addressMap;
-        std::vector<int> memory;
+        PagedMemory memory;
         uint16_t nextAddress;
         
         uint16_t allocate(const std::string& name);
@@ -0,0 +1,478 @@
+#pragma once
+#include "decoder.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#include <sys/mman.h>
+#define CPU_JIT_X86_64
+#endif
+
+// Basic-block JIT from guest bytecode to x86-64.
+//
+// A block is a run of guest instructions ending at JNZ/JZ/HALT. It is
+// compiled into an mmap'd executable buffer and works directly on the
+// guest RAM and register file:
+//   rbx = RAM, rbp = R[], r12 = page flags of the owning CPU,
+//   r13 = instruction budget.
+// A block only runs when the budget covers all of its instructions and
+// subtracts the ones it executed on the way out, so budgeted runs stay exact.
+// Every block exit returns (next pc | reason << 16 | exit site << 32) to
+// the dispatcher in MinimalCPU. Exits to another guest address are plain
+// `jmp rel32` that first land on their own return stub; once the target
+// is compiled the dispatcher patches the jump to go straight to it, so hot
+// loops chain block to block without leaving native code.
+//
+// A block is built from one straight run of guest bytes. A guest write to
+// one of them drops just the blocks covering that byte and unpatches the
+// jumps chained into them, so a loader copying code into RAM keeps the rest
+// of the cache. The whole cache is only flushed when the buffer fills up.
+//
+// IN, unknown opcodes and register indexes above R7 are left to the
+// interpreter. Stores into a page whose flags match storeCheckMask (compiled
+// or decoded code, pages still clean since a snapshot, I/O pages) exit
+// before writing, so the interpreter performs the write, keeps its
+// bookkeeping and calls the device.
+class X86Jit {
+public:
+    enum ExitReason : uint8_t {
+        EXIT_CONTINUE = 0,   // jump to pc, which may get chained
+        EXIT_HALT = 1,       // HALT executed, pc is past it
+        EXIT_INTERPRET = 2,  // interpreter must execute the instruction at pc
+        EXIT_BUDGET = 3,     // budget too small for the block at pc
+    };
+
+    struct Exit {
+        uint16_t pc;
+        uint8_t reason;
+        uint32_t site;       // chainable exit site + 1, 0 if not chainable
+        uint32_t flushes;    // cache generation the site belongs to
+    };
+
+    static const size_t BUFFER_SIZE = 4 << 20;
+    static const size_t MAX_BLOCK_BYTES = 4096;
+    static const int MAX_BLOCK_INSNS = 64;
+
+    static bool available() {
+#ifdef CPU_JIT_X86_64
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // storeCheckMask: page flags that make a guest store leave native code.
+    // jitPageFlag: flag this JIT sets on pages it compiled code from.
+    X86Jit(uint8_t* ram, uint8_t* regs, uint8_t* pageFlags, uint8_t storeCheckMask, uint8_t jitPageFlag)
+        : ram(ram), regs(regs), pageFlags(pageFlags), storeCheckMask(storeCheckMask), jitPageFlag(jitPageFlag) {
+#ifdef CPU_JIT_X86_64
+        void* mem = mmap(nullptr, BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem != MAP_FAILED) {
+            buffer = static_cast<uint8_t*>(mem);
+            cursor = buffer;
+            emitTrampoline();
+            blockOffset.assign(65536, -1);
+            blockBytes.assign(65536, 0);
+            covered.assign(65536, 0);
+        }
+#endif
+    }
+
+    ~X86Jit() {
+#ifdef CPU_JIT_X86_64
+        if (buffer) {
+            munmap(buffer, BUFFER_SIZE);
+        }
+#endif
+    }
+
+    X86Jit(const X86Jit&) = delete;
+    X86Jit& operator=(const X86Jit&) = delete;
+
+    // false when the executable buffer could not be mapped
+    bool ok() const { return buffer != nullptr; }
+
+    // compiled entry for pc, compiling it on first use. nullptr means the
+    // instruction at pc has to go through the interpreter.
+    const uint8_t* blockFor(uint16_t pc) {
+        if (blockOffset[pc] >= 0) {
+            return buffer + blockOffset[pc];
+        }
+        return compile(pc);
+    }
+
+    // runs from block until an exit; budget is decremented by the number of
+    // guest instructions executed
+    Exit enter(const uint8_t* block, uint64_t* budget) {
+        using EntryFn = uint64_t (*)(const uint8_t*, uint8_t*, uint8_t*, uint8_t*, uint64_t*);
+        EntryFn fn = reinterpret_cast<EntryFn>(buffer);
+        uint64_t result = fn(block, ram, regs, pageFlags, budget);
+        Exit exit;
+        exit.pc = static_cast<uint16_t>(result);
+        exit.reason = static_cast<uint8_t>(result >> 16);
+        exit.site = static_cast<uint32_t>(result >> 32);
+        exit.flushes = flushes;
+        return exit;
+    }
+
+    // point a chainable exit straight at the block compiled for its target,
+    // which starts at exit.pc
+    void link(const Exit& exit, const uint8_t* target) {
+        if (exit.site == 0 || exit.flushes != flushes) {
+            return;
+        }
+        uint32_t site = sites[exit.site - 1];
+        patch(site, target);
+        linksTo[exit.pc].push_back(site);
+    }
+
+    // a guest write hit a page flagged jitPageFlag: drop the blocks built
+    // from the written byte
+    void invalidate(uint16_t addr) {
+        if (!covered[addr]) {
+            return;
+        }
+        std::vector<uint16_t> stale;
+        for (uint16_t start : pageBlocks[addr >> 8]) {
+            if (static_cast<uint16_t>(addr - start) < blockBytes[start]) {
+                stale.push_back(start);
+            }
+        }
+        for (uint16_t start : stale) {
+            drop(start);
+        }
+    }
+
+    // blocks currently compiled
+    size_t blocks() const { return liveBlocks; }
+
+    // how often the whole cache was thrown away
+    uint32_t flushCount() const { return flushes; }
+
+    // forget every compiled block
+    void flush() {
+        if (!buffer) {
+            return;
+        }
+        for (uint16_t pc : blockStarts) {
+            blockOffset[pc] = -1;
+            blockBytes[pc] = 0;
+        }
+        for (size_t page = 0; page < 256; ++page) {
+            if (pageFlags[page] & jitPageFlag) {
+                std::memset(&covered[page * 256], 0, 256);
+                pageFlags[page] &= ~jitPageFlag;
+            }
+            pageBlocks[page].clear();
+        }
+        blockStarts.clear();
+        sites.clear();
+        linksTo.clear();
+        liveBlocks = 0;
+        cursor = buffer + trampolineSize;
+        ++flushes;
+    }
+
+private:
+    uint8_t* ram;
+    uint8_t* regs;
+    uint8_t* pageFlags;
+    uint8_t storeCheckMask;
+    uint8_t jitPageFlag;
+
+    uint8_t* buffer = nullptr;
+    uint8_t* cursor = nullptr;
+    uint8_t* epilogue = nullptr;
+    size_t trampolineSize = 0;
+    uint32_t flushes = 0;
+
+    std::vector<int32_t> blockOffset;  // per guest pc, -1 = not compiled
+    std::vector<uint16_t> blockBytes;  // per compiled pc, guest bytes the block was built from
+    std::vector<uint8_t> covered;      // guest bytes that compiled code was built from
+    std::vector<uint16_t> blockStarts; // every pc compiled since the last flush, live or not
+    std::vector<uint16_t> pageBlocks[256];  // live blocks built from bytes of each page
+    size_t liveBlocks = 0;
+    std::vector<uint32_t> sites;       // buffer offsets of chainable rel32 fields
+    std::unordered_map<uint16_t, std::vector<uint32_t>> linksTo;  // chained sites per target pc
+
+    void patch(uint32_t site, const uint8_t* target) {
+        uint8_t* field = buffer + site;
+        int32_t rel = static_cast<int32_t>(target - (field + 4));
+        std::memcpy(field, &rel, sizeof(rel));
+    }
+
+    // pages holding bytes [start, start + bytes)
+    template <typename Fn>
+    static void forEachPage(uint16_t start, uint16_t bytes, Fn fn) {
+        size_t first = start >> 8;
+        size_t last = static_cast<uint16_t>(start + bytes - 1) >> 8;
+        fn(first);
+        if (last != first) {
+            fn(last);  // blocks are at most 256 bytes, so two pages at most
+        }
+    }
+
+    // forget the block at start; its code stays in the buffer until the next flush
+    void drop(uint16_t start) {
+        auto links = linksTo.find(start);
+        if (links != linksTo.end()) {
+            for (uint32_t site : links->second) {
+                patch(site, buffer + site + 4);  // back to its own return stub
+            }
+            linksTo.erase(links);
+        }
+        blockOffset[start] = -1;
+        uint16_t bytes = blockBytes[start];
+        blockBytes[start] = 0;
+        --liveBlocks;
+        forEachPage(start, bytes, [&](size_t page) {
+            std::vector<uint16_t>& list = pageBlocks[page];
+            list.erase(std::remove(list.begin(), list.end(), start), list.end());
+            // rebuild the page's covered bytes from the blocks left on it
+            std::memset(&covered[page * 256], 0, 256);
+            for (uint16_t other : list) {
+                for (uint16_t i = 0; i < blockBytes[other]; ++i) {
+                    uint16_t addr = static_cast<uint16_t>(other + i);
+                    if ((addr >> 8) == page) {
+                        covered[addr] = 1;
+                    }
+                }
+            }
+            if (list.empty()) {
+                pageFlags[page] &= ~jitPageFlag;
+            }
+        });
+    }
+
+    void emit8(uint8_t b) { *cursor++ = b; }
+    void emit(std::initializer_list<uint8_t> bytes) {
+        for (uint8_t b : bytes) {
+            emit8(b);
+        }
+    }
+    void emit32(uint32_t v) {
+        std::memcpy(cursor, &v, sizeof(v));
+        cursor += sizeof(v);
+    }
+    void emit64(uint64_t v) {
+        std::memcpy(cursor, &v, sizeof(v));
+        cursor += sizeof(v);
+    }
+    void emitJmpTo(const uint8_t* target) {
+        emit8(0xE9);                                      // jmp rel32
+        emit32(static_cast<uint32_t>(target - (cursor + 4)));
+    }
+
+    // uint64_t enter(block, ram, regs, pageFlags, budget), followed by the shared epilogue
+    void emitTrampoline() {
+        emit({0x53});                   // push rbx
+        emit({0x55});                   // push rbp
+        emit({0x41, 0x54});             // push r12
+        emit({0x41, 0x55});             // push r13
+        emit({0x48, 0x89, 0xF3});       // mov rbx, rsi
+        emit({0x48, 0x89, 0xD5});       // mov rbp, rdx
+        emit({0x49, 0x89, 0xCC});       // mov r12, rcx
+        emit({0x4D, 0x89, 0xC5});       // mov r13, r8
+        emit({0xFF, 0xE7});             // jmp rdi
+        epilogue = cursor;
+        emit({0x41, 0x5D});             // pop r13
+        emit({0x41, 0x5C});             // pop r12
+        emit({0x5D});                   // pop rbp
+        emit({0x5B});                   // pop rbx
+        emit({0xC3});                   // ret
+        trampolineSize = cursor - buffer;
+    }
+
+    // mov rax, pc | reason << 16 | site << 32 ; jmp epilogue
+    void emitExit(uint16_t pc, uint8_t reason, uint32_t site = 0) {
+        emit({0x48, 0xB8});
+        emit64(pc | (static_cast<uint64_t>(reason) << 16) | (static_cast<uint64_t>(site) << 32));
+        emitJmpTo(epilogue);
+    }
+
+    // sub qword [r13], count
+    void emitRetire(int count) {
+        if (count > 0) {
+            emit({0x49, 0x83, 0x6D, 0x00, static_cast<uint8_t>(count)});
+        }
+    }
+
+    // hand the instruction at pc to the interpreter after retiring the ones before it
+    void emitInterpretExit(uint16_t pc, int retired) {
+        emitRetire(retired);
+        emitExit(pc, EXIT_INTERPRET);
+    }
+    static uint8_t interpretExitSize(int retired) {
+        return retired > 0 ? 20 : 15;
+    }
+
+    // jmp rel32 that initially falls into its own return stub
+    void emitChainExit(uint16_t target) {
+        emit8(0xE9);
+        sites.push_back(static_cast<uint32_t>(cursor - buffer));
+        emit32(0);
+        emitExit(target, EXIT_CONTINUE, static_cast<uint32_t>(sites.size()));
+    }
+
+    // leave before a store into a checked page, so the interpreter does it
+    void emitStoreCheck(uint16_t addr, uint16_t pc, int retired) {
+        emit({0x41, 0xF6, 0x84, 0x24});  // test byte [r12 + page], mask
+        emit32(addr >> 8);
+        emit8(storeCheckMask);
+        emit({0x74, interpretExitSize(retired)}); // jz over the exit
+        emitInterpretExit(pc, retired);
+    }
+
+    // eax = (R0 << 8 | R1) + R2, wrapped to 16 bits
+    void emitIndexedAddress() {
+        emit({0x0F, 0xB6, 0x45, 0x00});  // movzx eax, byte [rbp + 0]
+        emit({0xC1, 0xE0, 0x08});        // shl eax, 8
+        emit({0x0F, 0xB6, 0x4D, 0x01});  // movzx ecx, byte [rbp + 1]
+        emit({0x09, 0xC8});              // or eax, ecx
+        emit({0x0F, 0xB6, 0x4D, 0x02});  // movzx ecx, byte [rbp + 2]
+        emit({0x01, 0xC8});              // add eax, ecx
+        emit({0x0F, 0xB7, 0xC0});        // movzx eax, ax
+    }
+
+    static bool needsInterpreter(const DecodedInsn& d) {
+        switch (d.op) {
+            case 0x01: case 0x02: case 0x07: case 0x08:
+                return d.rd > 7;
+            case 0x03:
+                return d.rs > 7;
+            case 0x05: case 0x06:
+                return d.rd > 7 || d.rs > 7;
+            case 0x00: case 0x04: case 0x0A: case 0x0B:
+                return false;
+            default:  // IN, unknown opcodes
+                return true;
+        }
+    }
+
+    void markCovered(uint16_t pc, uint8_t len) {
+        for (uint8_t i = 0; i < len; ++i) {
+            uint16_t addr = static_cast<uint16_t>(pc + i);
+            covered[addr] = 1;
+            pageFlags[addr >> 8] |= jitPageFlag;
+        }
+    }
+
+    const uint8_t* compile(uint16_t startPc) {
+        if (static_cast<size_t>(cursor - buffer) + MAX_BLOCK_BYTES > BUFFER_SIZE) {
+            flush();
+        }
+        uint8_t* start = cursor;
+        uint16_t pc = startPc;
+        DecodedInsn first;
+        decodeInstruction(ram, pc, first);
+        if (needsInterpreter(first)) {
+            return nullptr;
+        }
+        // cmp qword [r13], length ; jae body ; otherwise the interpreter takes over
+        emit({0x49, 0x83, 0x7D, 0x00});
+        uint8_t* length = cursor;
+        emit8(0);
+        emit({0x73, 15});
+        emitExit(startPc, EXIT_BUDGET);
+        int count = 0;
+        uint16_t end = startPc;  // past the last byte compiled
+        for (; ; ++count) {
+            DecodedInsn d;
+            decodeInstruction(ram, pc, d);
+            if (needsInterpreter(d)) {
+                emitInterpretExit(pc, count);
+                break;
+            }
+            if (count == MAX_BLOCK_INSNS) {
+                emitRetire(count);
+                emitChainExit(pc);
+                break;
+            }
+            markCovered(pc, d.len);
+            uint16_t next = static_cast<uint16_t>(pc + d.len);
+            end = next;
+            bool endsBlock = false;
+            switch (d.op) {
+                case 0x00: // HALT
+                    emitRetire(++count);
+                    emitExit(next, EXIT_HALT);
+                    endsBlock = true;
+                    break;
+                case 0x01: // LOAD Rd, addr
+                    emit({0x8A, 0x83}); emit32(d.addr);     // mov al, [rbx + addr]
+                    emit({0x88, 0x45, d.rd});               // mov [rbp + rd], al
+                    break;
+                case 0x02: // LOAD Rd, CONST
+                    emit({0xC6, 0x45, d.rd, d.imm});        // mov byte [rbp + rd], imm
+                    break;
+                case 0x03: // STORE addr, Rs
+                    emitStoreCheck(d.addr, pc, count);
+                    emit({0x8A, 0x45, d.rs});               // mov al, [rbp + rs]
+                    emit({0x88, 0x83}); emit32(d.addr);     // mov [rbx + addr], al
+                    break;
+                case 0x04: // STORE_CONST addr, CONST
+                    emitStoreCheck(d.addr, pc, count);
+                    emit({0xC6, 0x83}); emit32(d.addr);     // mov byte [rbx + addr], imm
+                    emit8(d.imm);
+                    break;
+                case 0x05: // ADD Rd, Rs
+                    emit({0x8A, 0x45, d.rs});               // mov al, [rbp + rs]
+                    emit({0x00, 0x45, d.rd});               // add [rbp + rd], al
+                    break;
+                case 0x06: // SUB Rd, Rs, carry into R2
+                    emit({0x8A, 0x45, d.rd});               // mov al, [rbp + rd]
+                    emit({0x8A, 0x4D, d.rs});               // mov cl, [rbp + rs]
+                    emit({0x28, 0xC8});                     // sub al, cl
+                    emit({0x0F, 0x92, 0xC2});               // setb dl
+                    emit({0x88, 0x45, d.rd});               // mov [rbp + rd], al
+                    emit({0x88, 0x55, 0x02});               // mov [rbp + 2], dl
+                    break;
+                case 0x07: // JNZ Rd, addr
+                case 0x08: { // JZ Rd, addr
+                    emitRetire(++count);                    // before cmp, it clobbers flags
+                    emit({0x80, 0x7D, d.rd, 0x00});         // cmp byte [rbp + rd], 0
+                    emit({0x0F, static_cast<uint8_t>(d.op == 0x07 ? 0x84 : 0x85)}); // je/jne fallthrough
+                    uint8_t* skip = cursor;
+                    emit32(0);
+                    emitChainExit(d.addr);
+                    int32_t rel = static_cast<int32_t>(cursor - (skip + 4));
+                    std::memcpy(skip, &rel, sizeof(rel));
+                    emitChainExit(next);
+                    endsBlock = true;
+                    break;
+                }
+                case 0x0A: // LOAD_INDEXED
+                    emitIndexedAddress();
+                    emit({0x8A, 0x04, 0x03});               // mov al, [rbx + rax]
+                    emit({0x88, 0x45, 0x04});               // mov [rbp + 4], al
+                    break;
+                case 0x0B: // STORE_INDEXED
+                    emitIndexedAddress();
+                    emit({0x89, 0xC1});                     // mov ecx, eax
+                    emit({0xC1, 0xE9, 0x08});               // shr ecx, 8
+                    emit({0x41, 0xF6, 0x04, 0x0C, storeCheckMask}); // test byte [r12 + rcx], mask
+                    emit({0x74, interpretExitSize(count)}); // jz over the exit
+                    emitInterpretExit(pc, count);
+                    emit({0x8A, 0x55, 0x04});               // mov dl, [rbp + 4]
+                    emit({0x88, 0x14, 0x03});               // mov [rbx + rax], dl
+                    break;
+            }
+            if (endsBlock) {
+                break;
+            }
+            pc = next;
+        }
+        *length = static_cast<uint8_t>(count);
+        blockOffset[startPc] = static_cast<int32_t>(start - buffer);
+        blockStarts.push_back(startPc);
+        blockBytes[startPc] = static_cast<uint16_t>(end - startPc);
+        if (blockBytes[startPc] > 0) {
+            forEachPage(startPc, blockBytes[startPc], [&](size_t page) { pageBlocks[page].push_back(startPc); });
+        }
+        ++liveBlocks;
+        return start;
+    }
+};
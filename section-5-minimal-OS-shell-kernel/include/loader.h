@@ -0,0 +1,153 @@
+#pragma once
+#include "cpu.h"
+#include "image.h"
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Guest images on disk: .hex images below, and the binary images of image.h
+// with loadImage(). A .hex image is whitespace separated hex bytes, one
+// or two digits each with an optional 0x, as Codegen::writeToHex writes it:
+//   02 00 31
+//   0x04 0xFF 0x00 0x43
+// The file is mapped, not read, and parsed with a table lookup per character
+// straight to where the bytes go, guest RAM for loadHexImage().
+
+namespace hex_detail {
+// digit value, or one of these for everything that is not a hex digit
+static const uint8_t SPACE = 0x10;
+static const uint8_t OTHER = 0x20;
+
+struct Table {
+    uint8_t classes[256];
+    Table() {
+        for (int ch = 0; ch < 256; ++ch) {
+            classes[ch] = OTHER;
+        }
+        for (int digit = 0; digit < 10; ++digit) {
+            classes['0' + digit] = static_cast<uint8_t>(digit);
+        }
+        for (int digit = 0; digit < 6; ++digit) {
+            classes['a' + digit] = classes['A' + digit] = static_cast<uint8_t>(10 + digit);
+        }
+        for (char space : {' ', '\t', '\n', '\r', '\v', '\f'}) {
+            classes[static_cast<uint8_t>(space)] = SPACE;
+        }
+    }
+};
+
+inline const uint8_t* classes() {
+    static const Table table;
+    return table.classes;
+}
+}
+
+// Parses the hex image in text into out, which has room for capacity bytes,
+// and returns the number of bytes. Throws std::runtime_error at the offset
+// of a bad token or when the image does not fit.
+inline size_t parseHex(const char* text, size_t size, uint8_t* out, size_t capacity) {
+    using namespace hex_detail;
+    const uint8_t* table = classes();
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(text);
+    const uint8_t* end = p + size;
+    size_t count = 0;
+    auto fail = [&](const char* what) {
+        throw std::runtime_error(std::string(what) + " at offset " + std::to_string(p - reinterpret_cast<const uint8_t*>(text)));
+    };
+    while (true) {
+        while (p != end && table[*p] == SPACE) {
+            ++p;
+        }
+        if (p == end) {
+            return count;
+        }
+        if (*p == '0' && end - p > 2 && (p[1] | 0x20) == 'x') {
+            p += 2;
+        }
+        uint8_t high = p != end ? table[*p] : OTHER;
+        if (high >= SPACE) {
+            fail("Bad hex byte");
+        }
+        ++p;
+        uint8_t value = high;
+        if (p != end && table[*p] < SPACE) {  // the usual two digits
+            value = static_cast<uint8_t>(high << 4 | table[*p]);
+            ++p;
+        }
+        if (p != end && table[*p] != SPACE) {
+            fail("Bad hex byte");
+        }
+        if (count == capacity) {
+            fail("Image too large");
+        }
+        out[count++] = value;
+    }
+}
+
+// the bytes of a hex image file
+inline std::vector<uint8_t> readHexImage(const std::string& filename) {
+    MappedFile file(filename);
+    std::vector<uint8_t> image(file.size() / 2 + 1);  // a byte and a separator are two characters
+    try {
+        image.resize(parseHex(file.data(), file.size(), image.data(), image.size()));
+    } catch (const std::runtime_error& e) {
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+    return image;
+}
+
+namespace hex_detail {
+inline size_t loadHex(MinimalCPU& cpu, const MappedFile& file, const std::string& filename, uint16_t start) {
+    size_t size;
+    try {
+        size = parseHex(file.data(), file.size(), cpu.RAM + start, GuestMemory::SIZE - start);
+    } catch (const std::runtime_error& e) {
+        cpu.loadProgram(cpu.RAM + start, GuestMemory::SIZE - start, start);  // no stale cached code
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+    cpu.loadProgram(cpu.RAM + start, size, start);
+    return size;
+}
+}
+
+// parses a hex image file into cpu's RAM at start and loadProgram()s it there;
+// returns the image size. A bad image throws after it may have written part
+// of RAM from start on, and leaves the CPU reset as if that were the program.
+inline size_t loadHexImage(MinimalCPU& cpu, const std::string& filename, uint16_t start = 0) {
+    MappedFile file(filename);
+    return hex_detail::loadHex(cpu, file, filename, start);
+}
+
+// Copies the code and data of image into cpu's RAM and zeroes its BSS, then
+// leaves the CPU reset at the entry point, as loadProgram() would.
+inline void loadImage(MinimalCPU& cpu, const ImageView& image) {
+    ImageFormat::check(image);
+    cpu.loadProgram(image.code, image.codeSize, image.load);
+    if (image.dataSize) {
+        std::memcpy(cpu.RAM + image.dataAddress, image.data, image.dataSize);
+    }
+    std::memset(cpu.RAM + image.dataAddress + image.dataSize, 0, image.bssSize);
+    cpu.markDirty(image.dataAddress, size_t(image.dataSize) + image.bssSize);
+    cpu.PC = image.entry;
+}
+
+inline void loadImage(MinimalCPU& cpu, const ProgramImage& image) {
+    loadImage(cpu, ImageView(image));
+}
+
+// maps an image file and loads it straight from the mapping
+inline void loadImage(MinimalCPU& cpu, const std::string& filename) {
+    MappedFile file(filename);
+    loadImage(cpu, viewImage(file, filename));
+}
+
+// an image file by its magic, anything else as a .hex image at hexStart
+inline void loadProgramFile(MinimalCPU& cpu, const std::string& filename, uint16_t hexStart = 0) {
+    MappedFile file(filename);
+    if (ImageFormat::matches(file.data(), file.size())) {
+        loadImage(cpu, viewImage(file, filename));
+    } else {
+        hex_detail::loadHex(cpu, file, filename, hexStart);
+    }
+}
@@ -0,0 +1,462 @@
+#pragma once
+#include "decoder.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__GNUC__)
+// The vector-typed helpers would pass differently with -mavx. They are all
+// inline, so that never matters. GCC reports it at the end of the including
+// file, which is why this is not scoped with push/pop.
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+// Runs one program on many guest CPUs ("lanes") at once, for fuzzing and
+// parameter sweeps where only the initial RAM differs between runs.
+//
+// State is kept in struct-of-arrays form. Register r of every lane is one
+// contiguous byte array, and so is every RAM address: byte addr of lane l
+// lives at ram[addr * stride + l]. Each step picks the lowest PC among the
+// running lanes and executes that instruction for every lane sitting on it.
+// Loads, stores, ALU ops and branches work on blocks of LANE_BLOCK lanes at
+// once and blend the results in under a lane mask. With GCC or Clang these
+// blocks are vector types, compiled to SSE2 or AVX2 depending on -march.
+// Lanes on other PCs are masked out and catch up in later steps. Running
+// the lowest PC first lets lanes that branched apart meet again at the first
+// instruction they all reach. A lane looping forever below the others would
+// hold them back for good, so every FAIRNESS_INTERVAL-th step goes instead to
+// the next lane, in round-robin order, that is not at the lowest PC.
+//
+// Semantics follow MinimalCPU instruction for instruction: the R2 carry on
+// SUB, output on stores to 0xFF00, and IN with the echo and whitespace policy.
+// There are two differences:
+// - A lane whose code bytes at the PC differ from the other lanes' bytes
+//   simply runs in a later step.
+// - A register index above R7 faults the lane, instead of writing past the
+//   register file.
+// Only the console port is modelled; devices mapped with MinimalCPU::mapIo()
+// have no lockstep counterpart.
+class LockstepCPU {
+public:
+    enum class LaneState : uint8_t { Running, Halted, WaitingForInput, Fault };
+    static const uint64_t UNLIMITED = UINT64_MAX;
+    static const uint64_t FAIRNESS_INTERVAL = 64;
+
+#if defined(__GNUC__)
+    static const size_t LANE_BLOCK = 32;
+#else
+    static const size_t LANE_BLOCK = 1;
+#endif
+
+    // IN policy, as in MinimalCPU
+    bool echoInput = true;
+    bool skipInputWhitespace = true;
+
+    uint64_t steps = 0;       // instructions issued, one per group of lanes
+    uint64_t laneSteps = 0;   // instructions executed, summed over lanes
+
+    explicit LockstepCPU(size_t lanes)
+        : lanes(lanes), stride((lanes + LANE_BLOCK - 1) / LANE_BLOCK * LANE_BLOCK),
+          ram(65536 * stride, 0), regs(8 * stride, 0), pcs(stride, 0), running(stride, 0),
+          mask8(stride, 0), mask16(stride, 0), states(lanes), inputs(lanes), cursors(lanes, 0), outputs(lanes) {
+        loadProgram({});
+    }
+
+    size_t laneCount() const { return lanes; }
+
+    // the same image in every lane; registers, PCs, input and output start over
+    void loadProgram(const std::vector<uint8_t>& program, uint16_t start = 0) {
+        for (size_t i = 0; i < program.size(); ++i) {
+            uint8_t* bytes = cell(static_cast<uint16_t>(start + i));
+            std::fill(bytes, bytes + stride, program[i]);
+        }
+        std::fill(regs.begin(), regs.end(), 0);
+        std::fill(pcs.begin(), pcs.end(), start);
+        std::fill(running.begin(), running.begin() + lanes, 0xFFFF);
+        std::fill(states.begin(), states.end(), LaneState::Running);
+        std::fill(std::begin(pageState), std::end(pageState), PAGE_UNCHECKED);
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            inputs[lane].clear();
+            cursors[lane] = 0;
+            outputs[lane].clear();
+        }
+        runningLanes = lanes;
+        fairnessCursor = 0;
+        steps = laneSteps = 0;
+    }
+
+    uint8_t peek(size_t lane, uint16_t addr) const { return ram[addr * stride + lane]; }
+    void poke(size_t lane, uint16_t addr, uint8_t value) {
+        ram[addr * stride + lane] = value;
+        written(addr);
+    }
+    uint8_t reg(size_t lane, uint8_t r) const { return regs[r * stride + lane]; }
+    void setReg(size_t lane, uint8_t r, uint8_t value) { regs[r * stride + lane] = value; }
+    uint16_t pc(size_t lane) const { return pcs[lane]; }
+    LaneState state(size_t lane) const { return states[lane]; }
+    const std::string& output(size_t lane) const { return outputs[lane]; }
+
+    // bytes for IN on this lane; a lane waiting for input resumes
+    void setInput(size_t lane, std::string text) {
+        inputs[lane] = std::move(text);
+        cursors[lane] = 0;
+        if (states[lane] == LaneState::WaitingForInput) {
+            setState(lane, LaneState::Running);
+        }
+    }
+
+    // steps until no lane is running or maxSteps instructions were issued;
+    // true if every lane stopped
+    bool run(uint64_t maxSteps = UNLIMITED) {
+        for (uint64_t n = 0; n < maxSteps; ++n) {
+            if (!step()) {
+                return true;
+            }
+        }
+        return runningLanes == 0;
+    }
+
+    // one instruction for the lanes at the lowest running PC; false if no lane runs
+    bool step() {
+        if (runningLanes == 0) {
+            return false;
+        }
+        uint16_t pc = lowestPc();
+        if (steps % FAIRNESS_INTERVAL == FAIRNESS_INTERVAL - 1) {
+            pc = laggingPc(pc);
+        }
+        size_t first = selectLanes(pc);
+        DecodedInsn d;
+        decodeBytes([&](int offset) { return cell(static_cast<uint16_t>(pc + offset))[first]; }, d);
+        matchCode(pc, d.len, first);
+        execute(pc, d);
+        ++steps;
+        return true;
+    }
+
+private:
+    // what is known about a page's bytes being the same in every lane
+    enum : uint8_t { PAGE_UNCHECKED, PAGE_UNIFORM, PAGE_MIXED };
+
+#if defined(__GNUC__)
+    typedef uint8_t Bytes __attribute__((vector_size(LANE_BLOCK)));
+    typedef uint16_t Words __attribute__((vector_size(LANE_BLOCK * 2)));
+    typedef int8_t SignedBytes __attribute__((vector_size(LANE_BLOCK)));
+    typedef int16_t SignedWords __attribute__((vector_size(LANE_BLOCK * 2)));
+    // comparisons give all-ones or zero per lane
+    static Bytes splat(uint8_t v) { return Bytes{} + v; }
+    static Words splat16(uint16_t v) { return Words{} + v; }
+    static Bytes eq(Bytes a, Bytes b) { return (Bytes)(a == b); }
+    static Bytes lt(Bytes a, Bytes b) { return (Bytes)(a < b); }
+    static Words eq(Words a, Words b) { return (Words)(a == b); }
+    static Words lt(Words a, Words b) { return (Words)(a < b); }
+    static Words widen(Bytes m) { return (Words)__builtin_convertvector((SignedBytes)m, SignedWords); }
+    static Bytes narrow(Words m) { return __builtin_convertvector(m, Bytes); }
+#else
+    typedef uint8_t Bytes;
+    typedef uint16_t Words;
+    static Bytes splat(uint8_t v) { return v; }
+    static Words splat16(uint16_t v) { return v; }
+    static Bytes eq(Bytes a, Bytes b) { return a == b ? 0xFF : 0; }
+    static Bytes lt(Bytes a, Bytes b) { return a < b ? 0xFF : 0; }
+    static Words eq(Words a, Words b) { return a == b ? 0xFFFF : 0; }
+    static Words lt(Words a, Words b) { return a < b ? 0xFFFF : 0; }
+    static Words widen(Bytes m) { return m ? 0xFFFF : 0; }
+    static Bytes narrow(Words m) { return static_cast<Bytes>(m); }
+#endif
+    static size_t sum(Words counts) {
+        uint16_t parts[LANE_BLOCK];
+        store(parts, counts);
+        size_t total = 0;
+        for (uint16_t part : parts) {
+            total += part;
+        }
+        return total;
+    }
+    template <typename V, typename T>
+    static V load(const T* p) {
+        V v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    template <typename V, typename T>
+    static void store(T* p, V v) {
+        std::memcpy(p, &v, sizeof(v));
+    }
+    // lanes where mask is set take a, the others keep b
+    template <typename V>
+    static V blend(V mask, V a, V b) { return static_cast<V>((a & mask) | (b & ~mask)); }
+
+    size_t lanes;
+    size_t stride;                   // lanes rounded up to whole blocks; the padding never runs
+    std::vector<uint8_t> ram;
+    std::vector<uint8_t> regs;
+    std::vector<uint16_t> pcs;
+    std::vector<uint16_t> running;   // 0xFFFF for running lanes
+    std::vector<uint8_t> mask8;      // lanes taking part in this step, as bytes
+    std::vector<uint16_t> mask16;    // and as words, for the PCs
+    std::vector<LaneState> states;
+    std::vector<std::string> inputs;
+    std::vector<size_t> cursors;
+    std::vector<std::string> outputs;
+    size_t runningLanes = 0;
+    size_t selected = 0;             // lanes in the mask
+    size_t fairnessCursor = 0;       // where laggingPc() looks first
+    uint8_t pageState[256]{};
+
+    uint8_t* cell(uint16_t addr) { return ram.data() + static_cast<size_t>(addr) * stride; }
+    uint8_t* R(uint8_t r) { return regs.data() + static_cast<size_t>(r) * stride; }
+
+    void setState(size_t lane, LaneState state) {
+        bool wasRunning = states[lane] == LaneState::Running;
+        bool isRunning = state == LaneState::Running;
+        runningLanes += isRunning - wasRunning;
+        states[lane] = state;
+        running[lane] = isRunning ? 0xFFFF : 0;
+    }
+
+    void written(uint16_t addr) {
+        if (pageState[addr >> 8] == PAGE_UNIFORM) {
+            pageState[addr >> 8] = PAGE_MIXED;
+        }
+    }
+
+    uint16_t lowestPc() {
+        Words lowest = load<Words>(pcs.data()) | ~load<Words>(running.data());
+        for (size_t l = LANE_BLOCK; l < stride; l += LANE_BLOCK) {
+            Words key = load<Words>(pcs.data() + l) | ~load<Words>(running.data() + l);
+            lowest = blend(lt(key, lowest), key, lowest);
+        }
+        uint16_t keys[LANE_BLOCK];
+        store(keys, lowest);
+        uint16_t pc = *std::min_element(keys, keys + LANE_BLOCK);
+        if (pc == 0xFFFF) {  // every running lane sits at 0xFFFF, or a stopped lane won the tie
+            for (size_t l = 0; l < lanes; ++l) {
+                if (running[l]) {
+                    return pcs[l];
+                }
+            }
+        }
+        return pc;
+    }
+
+    // the PC of the next running lane, round-robin, that is not at lowest;
+    // lowest if every running lane is there
+    uint16_t laggingPc(uint16_t lowest) {
+        for (size_t n = 0; n < lanes; ++n) {
+            size_t l = (fairnessCursor + n) % lanes;
+            if (running[l] && pcs[l] != lowest) {
+                fairnessCursor = l + 1;
+                return pcs[l];
+            }
+        }
+        return lowest;
+    }
+
+    // mask in the running lanes at pc; returns the first of them
+    size_t selectLanes(uint16_t pc) {
+        Words at = splat16(pc);
+        Words count{};
+        for (size_t l = 0; l < stride; l += LANE_BLOCK) {
+            Words m = eq(load<Words>(pcs.data() + l), at) & load<Words>(running.data() + l);
+            store(mask16.data() + l, m);
+            store(mask8.data() + l, narrow(m));
+            count += m & splat16(1);  // at most 65535 blocks before it could wrap
+        }
+        selected = sum(count);
+        return std::find(mask8.begin(), mask8.end(), 0xFF) - mask8.begin();
+    }
+
+    // drop lanes whose bytes at pc..pc+len-1 differ from lane `first`.
+    // Pages no lane has written since they were found uniform need no check.
+    void matchCode(uint16_t pc, uint8_t len, size_t first) {
+        bool uniform = true;
+        for (uint8_t i = 0; i < len; ++i) {
+            uint8_t page = static_cast<uint16_t>(pc + i) >> 8;
+            if (pageState[page] == PAGE_UNCHECKED) {
+                pageState[page] = checkPage(page) ? PAGE_UNIFORM : PAGE_MIXED;
+            }
+            uniform = uniform && pageState[page] == PAGE_UNIFORM;
+        }
+        if (uniform) {
+            return;
+        }
+        Words count{};
+        for (size_t l = 0; l < stride; l += LANE_BLOCK) {
+            Bytes m = load<Bytes>(mask8.data() + l);
+            for (uint8_t i = 0; i < len; ++i) {
+                const uint8_t* bytes = cell(static_cast<uint16_t>(pc + i));
+                m &= eq(load<Bytes>(bytes + l), splat(bytes[first]));
+            }
+            store(mask8.data() + l, m);
+            store(mask16.data() + l, widen(m));
+            count += widen(m) & splat16(1);
+        }
+        selected = sum(count);
+    }
+
+    bool checkPage(uint8_t page) {
+        for (int offset = 0; offset < 256; ++offset) {
+            const uint8_t* bytes = cell(static_cast<uint16_t>(page << 8 | offset));
+            if (!std::equal(bytes + 1, bytes + lanes, bytes)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // calls f(lane) for every lane taking part in this step
+    template <typename F>
+    void forEachSelected(F f) {
+        for (size_t l = 0; l < lanes; ++l) {
+            if (mask8[l]) {
+                f(l);
+            }
+        }
+    }
+
+    void fault(uint16_t pc) {
+        forEachSelected([&](size_t l) {
+            setState(l, LaneState::Fault);
+            pcs[l] = pc;
+        });
+    }
+
+    bool readInput(size_t lane, char& ch) {
+        const std::string& text = inputs[lane];
+        do {
+            if (cursors[lane] == text.size()) {
+                return false;
+            }
+            ch = text[cursors[lane]++];
+        } while (skipInputWhitespace && (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r'));
+        return true;
+    }
+
+    void execute(uint16_t pc, const DecodedInsn& d) {
+        uint16_t next = static_cast<uint16_t>(pc + d.len);
+        bool regsOk = d.rd < 8 && d.rs < 8;
+        laneSteps += selected;
+        switch (d.op) {
+            case 0x00: // HALT
+                forEachSelected([&](size_t l) {
+                    setState(l, LaneState::Halted);
+                    pcs[l] = next;
+                });
+                return;
+            case 0x01: // LOAD Rd, addr
+            case 0x02: { // LOAD Rd, CONST
+                if (!regsOk) {
+                    return fault(pc);
+                }
+                uint8_t* rd = R(d.rd);
+                const uint8_t* src = cell(d.addr);
+                for (size_t l = 0; l < stride; l += LANE_BLOCK) {
+                    Bytes value = d.op == 0x01 ? load<Bytes>(src + l) : splat(d.imm);
+                    store(rd + l, blend(load<Bytes>(mask8.data() + l), value, load<Bytes>(rd + l)));
+                }
+                break;
+            }
+            case 0x03: // STORE addr, Rs
+            case 0x04: { // STORE_CONST addr, CONST
+                if (!regsOk) {
+                    return fault(pc);
+                }
+                uint8_t* dst = cell(d.addr);
+                const uint8_t* rs = R(d.rs);
+                for (size_t l = 0; l < stride; l += LANE_BLOCK) {
+                    Bytes value = d.op == 0x03 ? load<Bytes>(rs + l) : splat(d.imm);
+                    store(dst + l, blend(load<Bytes>(mask8.data() + l), value, load<Bytes>(dst + l)));
+                }
+                written(d.addr);
+                if (d.addr == 0xFF00) {
+                    forEachSelected([&](size_t l) { outputs[l] += static_cast<char>(dst[l]); });
+                }
+                break;
+            }
+            case 0x05: // ADD Rd, Rs
+            case 0x06: { // SUB Rd, Rs, carry into R2 (Rs is read again after the write, like MinimalCPU)
+                if (!regsOk) {
+                    return fault(pc);
+                }
+                uint8_t* rd = R(d.rd);
+                const uint8_t* rs = R(d.rs);
+                uint8_t* carry = R(2);
+                for (size_t l = 0; l < stride; l += LANE_BLOCK) {
+                    Bytes m = load<Bytes>(mask8.data() + l);
+                    Bytes original = load<Bytes>(rd + l);
+                    Bytes result = d.op == 0x05 ? original + load<Bytes>(rs + l) : original - load<Bytes>(rs + l);
+                    store(rd + l, blend(m, result, original));
+                    if (d.op == 0x06) {
+                        Bytes borrow = lt(original, load<Bytes>(rs + l)) & splat(1);
+                        store(carry + l, blend(m, borrow, load<Bytes>(carry + l)));
+                    }
+                }
+                break;
+            }
+            case 0x07: // JNZ Rd, addr
+            case 0x08: { // JZ Rd, addr
+                if (!regsOk) {
+                    return fault(pc);
+                }
+                const uint8_t* rd = R(d.rd);
+                Words taken = splat16(d.addr);
+                Words notTaken = splat16(next);
+                for (size_t l = 0; l < stride; l += LANE_BLOCK) {
+                    Words zero = widen(eq(load<Bytes>(rd + l), Bytes{}));
+                    Words target = d.op == 0x08 ? blend(zero, taken, notTaken) : blend(zero, notTaken, taken);
+                    store(pcs.data() + l, blend(load<Words>(mask16.data() + l), target, load<Words>(pcs.data() + l)));
+                }
+                return;
+            }
+            case 0x09: { // IN Rd
+                if (!regsOk) {
+                    return fault(pc);
+                }
+                uint8_t* rd = R(d.rd);
+                forEachSelected([&](size_t l) {
+                    char ch;
+                    if (!readInput(l, ch)) {
+                        setState(l, LaneState::WaitingForInput);  // stays on the IN
+                        return;
+                    }
+                    if (echoInput) {
+                        outputs[l] += ch;
+                    }
+                    rd[l] = static_cast<uint8_t>(ch);
+                    pcs[l] = next;
+                });
+                return;
+            }
+            case 0x0A: // LOAD_INDEXED, a gather over per-lane addresses
+            case 0x0B: { // STORE_INDEXED, a scatter
+                const uint8_t* hi = R(0);
+                const uint8_t* lo = R(1);
+                const uint8_t* idx = R(2);
+                uint8_t* value = R(4);
+                forEachSelected([&](size_t l) {
+                    uint16_t addr = static_cast<uint16_t>((hi[l] << 8 | lo[l]) + idx[l]);
+                    if (d.op == 0x0A) {
+                        value[l] = cell(addr)[l];
+                    } else {
+                        cell(addr)[l] = value[l];
+                        written(addr);
+                        if (addr == 0xFF00) {
+                            outputs[l] += static_cast<char>(value[l]);
+                        }
+                    }
+                });
+                break;
+            }
+            default: // unknown opcode, PC ends up past it like MinimalCPU
+                fault(next);
+                return;
+        }
+        Words after = splat16(next);
+        for (size_t l = 0; l < stride; l += LANE_BLOCK) {
+            store(pcs.data() + l, blend(load<Words>(mask16.data() + l), after, load<Words>(pcs.data() + l)));
+        }
+    }
+};
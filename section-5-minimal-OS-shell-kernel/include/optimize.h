@@ -0,0 +1,411 @@
+#pragma once
+#include "constfold.h"
+#include "ssa.h"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// The middle end between the parser and both backends, Codegen and the IR
+// interpreter: optimizeIR() folds constants on the flat IR (constfold.h),
+// then on SSA form (ssa.h)
+//   value numbering   an ADD or SUB the dominating code already computed,
+//                     a copy, or a phi of one value, is replaced by the
+//                     name that has it; a copy of a constant is the constant
+//   loop-invariant    ADD, SUB and constants in a loop whose operands are
+//   code motion       all set outside it move to just before the loop
+//   dead code         whatever no OUT, jump, array access or IN depends on
+//                     goes, variables as well as temps
+// and gives back flat IR with the same labels, plus one in front of a loop
+// that had code moved out when nothing before it could take the code.
+//
+// Only ADD, SUB, copies and constants move or go: they set their result
+// and nothing else, and ADD and SUB cannot fail, so running one a time
+// more or fewer changes nothing. Array accesses stay where they are.
+
+struct OptimizeStats {
+    size_t phis = 0;       // phis placed going into SSA form
+    size_t numbered = 0;   // instructions replaced by an earlier value
+    size_t hoisted = 0;    // instructions moved out of a loop
+    size_t removed = 0;    // dead instructions and phis dropped
+};
+
+class Optimizer {
+public:
+    explicit Optimizer(const std::vector<IR>& ir) : ssa(ir) {
+        counts.phis = ssa.phiCount();
+    }
+
+    std::vector<IR> run() {
+        numberValues();
+        hoistInvariants();
+        numberValues();  // what moved out of loops side by side
+        removeDeadCode();
+        return ssa.lower();
+    }
+
+    const OptimizeStats& stats() const { return counts; }
+
+private:
+    SSAForm ssa;
+    OptimizeStats counts;
+
+    ControlFlowGraph& cfg() { return ssa.cfg; }
+
+    // Dominator-based value numbering: walks the dominator tree with a
+    // table of the expressions computed on the way down, so an entry always
+    // dominates the code that finds it. Constants are the exception, as
+    // setting a register again costs less than keeping it set: one is only
+    // reused within its block, and a copy of one, or a phi of one, sets it
+    // again. Phi arguments can be the literal itself.
+    void numberValues() {
+        std::unordered_map<std::string, std::string> same;       // name -> an earlier name with its value
+        std::unordered_map<std::string, std::string> constants;  // name -> the literal it is set to
+        auto leader = [&](std::string& name) {
+            auto it = same.find(name);
+            while (it != same.end()) {
+                name = it->second;
+                it = same.find(name);
+            }
+        };
+        auto argument = [&](std::string& arg) {
+            leader(arg);
+            auto k = constants.find(arg);
+            if (k != constants.end()) {
+                arg = k->second;
+            }
+        };
+        std::unordered_map<std::string, std::string> table;  // expression -> name
+        std::vector<std::string> added;
+        std::vector<std::pair<int, size_t>> stack{{0, 0}};  // block, size of added on entry
+        std::vector<std::vector<bool>> gone(cfg().blocks.size());
+        while (!stack.empty()) {
+            int b = stack.back().first;
+            if (b < 0) {
+                for (size_t i = stack.back().second; i < added.size(); ++i) {
+                    table.erase(added[i]);
+                }
+                added.resize(stack.back().second);
+                stack.pop_back();
+                continue;
+            }
+            stack.back().first = -1;
+            stack.back().second = added.size();
+            BasicBlock& block = cfg().blocks[b];
+
+            // a phi whose arguments are all one value, or itself, is that value
+            std::vector<IR> head;
+            for (size_t p = 0; p < block.phis.size();) {
+                Phi& phi = block.phis[p];
+                std::string only;
+                bool one = true;
+                for (std::string& arg : phi.args) {
+                    argument(arg);
+                    if (arg != phi.result) {
+                        one = one && (only.empty() || only == arg);
+                        only = arg;
+                    }
+                }
+                if (!one || only.empty()) {
+                    ++p;
+                    continue;
+                }
+                if (ControlFlowGraph::isValue(only)) {
+                    same[phi.result] = only;
+                } else {
+                    head.push_back(IR{OpCode::STORE_CONST, only, "", phi.result});
+                }
+                block.phis.erase(block.phis.begin() + p);
+                ++counts.numbered;
+            }
+            block.code.insert(block.code.begin(), head.begin(), head.end());
+
+            gone[b].assign(block.code.size(), false);
+            for (size_t i = 0; i < block.code.size(); ++i) {
+                IR& in = block.code[i];
+                ControlFlowGraph::forEachUse(in, leader);
+                if (!ControlFlowGraph::isPure(in)) {
+                    continue;
+                }
+                if (ControlFlowGraph::isCopy(in)) {
+                    auto k = constants.find(in.arg1);
+                    if (k == constants.end()) {
+                        same[in.result] = in.arg1;
+                        gone[b][i] = true;
+                        ++counts.numbered;
+                        continue;
+                    }
+                    in = IR{OpCode::STORE_CONST, k->second, "", in.result};
+                }
+                std::string key;
+                if (in.op == OpCode::ADD || in.op == OpCode::SUB) {
+                    key = expression(in);
+                } else {
+                    constants[in.result] = in.arg1;
+                    key = "# " + in.arg1 + " " + std::to_string(b);
+                }
+                auto found = table.find(key);
+                if (found != table.end()) {
+                    same[in.result] = found->second;
+                    gone[b][i] = true;
+                    ++counts.numbered;
+                } else {
+                    table[key] = in.result;
+                    added.push_back(key);
+                }
+            }
+            const std::vector<int>& children = cfg().dominated(b);
+            for (size_t c = children.size(); c-- > 0;) {
+                stack.push_back({children[c], 0});
+            }
+        }
+
+        // drop what was replaced and point every use at its leader, phis
+        // on back edges included
+        for (size_t b = 0; b < cfg().blocks.size(); ++b) {
+            BasicBlock& block = cfg().blocks[b];
+            for (Phi& phi : block.phis) {
+                for (std::string& arg : phi.args) {
+                    argument(arg);
+                }
+            }
+            std::vector<IR> kept;
+            kept.reserve(block.code.size());
+            for (size_t i = 0; i < block.code.size(); ++i) {
+                if (i < gone[b].size() && gone[b][i]) {
+                    continue;
+                }
+                ControlFlowGraph::forEachUse(block.code[i], leader);
+                kept.push_back(block.code[i]);
+            }
+            block.code.swap(kept);
+        }
+    }
+
+    // what an ADD or SUB computes, the same for the same value
+    static std::string expression(const IR& in) {
+        switch (in.op) {
+            case OpCode::ADD:
+                // a + b is b + a
+                return in.arg1 < in.arg2 ? "+ " + in.arg1 + " " + in.arg2 : "+ " + in.arg2 + " " + in.arg1;
+            default:
+                return "- " + in.arg1 + " " + in.arg2;
+        }
+    }
+
+    // Moves the invariant code of every natural loop, inner loops first, to
+    // the end of the block before the loop's header.
+    void hoistInvariants() {
+        ControlFlowGraph& graph = cfg();
+        std::vector<std::pair<int, std::vector<bool>>> loops;  // header, body
+        for (int b : graph.reversePostorder()) {
+            for (int h : graph.blocks[b].succs) {
+                if (!graph.dominates(h, b)) {
+                    continue;
+                }
+                auto loop = std::find_if(loops.begin(), loops.end(), [&](const auto& l) { return l.first == h; });
+                if (loop == loops.end()) {
+                    loops.push_back({h, std::vector<bool>(graph.blocks.size(), false)});
+                    loop = loops.end() - 1;
+                    loop->second[h] = true;
+                }
+                // the blocks that reach the back edge without passing the header
+                std::vector<int> work{b};
+                while (!work.empty()) {
+                    int x = work.back();
+                    work.pop_back();
+                    if (loop->second[x]) {
+                        continue;
+                    }
+                    loop->second[x] = true;
+                    for (int p : graph.blocks[x].preds) {
+                        if (graph.reachable(p)) {
+                            work.push_back(p);
+                        }
+                    }
+                }
+            }
+        }
+        std::stable_sort(loops.begin(), loops.end(), [](const auto& a, const auto& b) {
+            return std::count(a.second.begin(), a.second.end(), true) < std::count(b.second.begin(), b.second.end(), true);
+        });
+
+        for (auto& loop : loops) {
+            std::vector<bool>& body = loop.second;
+            body.resize(graph.blocks.size(), false);
+            size_t blocks = graph.blocks.size();
+            int pre = preheader(loop.first, body);
+            if (pre < 0) {
+                continue;
+            }
+            if (static_cast<size_t>(pre) == blocks) {
+                // a new block is in every loop its edge was in
+                int from = graph.blocks[pre].preds[0];
+                for (auto& other : loops) {
+                    other.second.resize(graph.blocks.size(), false);
+                    other.second[pre] = other.second[from] && other.second[loop.first];
+                }
+            }
+            std::unordered_map<std::string, bool> inside;
+            for (size_t b = 0; b < body.size(); ++b) {
+                if (!body[b]) {
+                    continue;
+                }
+                for (const Phi& phi : graph.blocks[b].phis) {
+                    inside[phi.result] = true;
+                }
+                for (const IR& in : graph.blocks[b].code) {
+                    if (const std::string* def = ControlFlowGraph::defOf(in)) {
+                        inside[*def] = true;
+                    }
+                }
+            }
+            // in reverse postorder an operand moved out is seen before its uses
+            for (int b : graph.reversePostorder()) {
+                if (b >= static_cast<int>(body.size()) || !body[b]) {
+                    continue;
+                }
+                std::vector<IR>& code = graph.blocks[b].code;
+                for (size_t i = 0; i < code.size();) {
+                    bool invariant = ControlFlowGraph::isPure(code[i]);
+                    ControlFlowGraph::forEachUse(code[i], [&](const std::string& name) {
+                        invariant = invariant && !inside.count(name);
+                    });
+                    if (!invariant) {
+                        ++i;
+                        continue;
+                    }
+                    inside.erase(code[i].result);
+                    BasicBlock& into = graph.blocks[pre];
+                    into.code.insert(into.code.begin() + into.end(), code[i]);
+                    code.erase(code.begin() + i);
+                    ++counts.hoisted;
+                }
+            }
+        }
+    }
+
+    // The block that runs just before the loop at header, and only then:
+    // its one predecessor from outside when that goes nowhere else, or else
+    // a new block between the two. -1 when there is no such place.
+    int preheader(int header, std::vector<bool>& body) {
+        ControlFlowGraph& graph = cfg();
+        std::vector<int> outside;
+        for (int p : graph.blocks[header].preds) {
+            if (!body[p] && graph.reachable(p)) {
+                outside.push_back(p);
+            }
+        }
+        if (outside.size() != 1) {
+            return -1;
+        }
+        int from = outside[0];
+        if (graph.blocks[from].succs.size() == 1) {
+            return from;
+        }
+        // the new block goes right before the header, where from falls
+        // through to it or jumps to it, if nothing in the loop falls through there
+        size_t at = std::find(graph.layout.begin(), graph.layout.end(), header) - graph.layout.begin();
+        int before = at > 0 ? graph.layout[at - 1] : -1;
+        if (before >= 0 && before != from && graph.reachable(before) && graph.blocks[before].fallsThrough()) {
+            return -1;
+        }
+        int pre = static_cast<int>(graph.blocks.size());
+        graph.blocks.emplace_back();
+        BasicBlock& block = graph.blocks[pre];
+        BasicBlock& h = graph.blocks[header];
+        BasicBlock& f = graph.blocks[from];
+        block.labels.push_back(graph.newLabel());
+        block.preds.push_back(from);
+        block.succs.push_back(header);
+        std::replace(h.preds.begin(), h.preds.end(), from, pre);  // the phis keep their order
+        std::replace(f.succs.begin(), f.succs.end(), header, pre);
+        IR* jump = f.terminator();
+        if (jump && jump->op != OpCode::HALT
+            && std::find(h.labels.begin(), h.labels.end(), jump->result) != h.labels.end()) {
+            jump->result = block.labels[0];
+        }
+        graph.layout.insert(graph.layout.begin() + at, pre);
+        graph.computeDominators();
+        return pre;
+    }
+
+    // Marks what the program's effects need, starting from its OUTs, jumps,
+    // array accesses and INs, and removes the pure code and phis left.
+    void removeDeadCode() {
+        ControlFlowGraph& graph = cfg();
+        std::unordered_map<std::string, std::pair<int, int>> defs;  // name -> block, phi (-1 - index) or code index
+        for (int b : graph.reversePostorder()) {
+            const BasicBlock& block = graph.blocks[b];
+            for (size_t p = 0; p < block.phis.size(); ++p) {
+                defs[block.phis[p].result] = {b, -1 - static_cast<int>(p)};
+            }
+            for (size_t i = 0; i < block.code.size(); ++i) {
+                if (const std::string* def = ControlFlowGraph::defOf(block.code[i])) {
+                    defs[*def] = {b, static_cast<int>(i)};
+                }
+            }
+        }
+        std::unordered_map<std::string, bool> live;
+        std::vector<std::string> work;
+        auto need = [&](const std::string& name) {
+            if (ControlFlowGraph::isValue(name) && !live[name]) {
+                live[name] = true;
+                work.push_back(name);
+            }
+        };
+        for (int b : graph.reversePostorder()) {
+            for (const IR& in : graph.blocks[b].code) {
+                if (!ControlFlowGraph::isPure(in)) {
+                    ControlFlowGraph::forEachUse(in, need);
+                    if (const std::string* def = ControlFlowGraph::defOf(in)) {
+                        need(*def);
+                    }
+                }
+            }
+        }
+        while (!work.empty()) {
+            std::string name = work.back();
+            work.pop_back();
+            auto def = defs.find(name);
+            if (def == defs.end()) {
+                continue;  // an entry value
+            }
+            const BasicBlock& block = graph.blocks[def->second.first];
+            if (def->second.second < 0) {
+                for (const std::string& arg : block.phis[-1 - def->second.second].args) {
+                    need(arg);
+                }
+            } else {
+                ControlFlowGraph::forEachUse(block.code[def->second.second], need);
+            }
+        }
+        for (int b : graph.reversePostorder()) {
+            BasicBlock& block = graph.blocks[b];
+            size_t before = block.phis.size() + block.code.size();
+            block.phis.erase(std::remove_if(block.phis.begin(), block.phis.end(),
+                                            [&](const Phi& phi) { return !live[phi.result]; }),
+                             block.phis.end());
+            block.code.erase(std::remove_if(block.code.begin(), block.code.end(),
+                                            [&](const IR& in) { return ControlFlowGraph::isPure(in) && !live[in.result]; }),
+                             block.code.end());
+            counts.removed += before - block.phis.size() - block.code.size();
+        }
+    }
+};
+
+// the IR with constants folded and the SSA passes above run over it; IR that
+// jumps to a label it does not have is only folded, for Codegen or the
+// interpreter to report
+inline std::vector<IR> optimizeIR(const std::vector<IR>& ir, OptimizeStats* stats = nullptr) {
+    std::vector<IR> folded = foldConstants(ir);
+    if (!ControlFlowGraph::resolves(folded)) {
+        return folded;
+    }
+    Optimizer optimizer(folded);
+    std::vector<IR> out = optimizer.run();
+    if (stats) {
+        *stats = optimizer.stats();
+    }
+    return out;
+}
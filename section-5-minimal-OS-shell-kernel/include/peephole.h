@@ -0,0 +1,411 @@
+#pragma once
+#include "decoder.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Peephole pass over finished guest code, after Codegen has backpatched the
+// jumps. The code runs from offset 0 and every jump address is an offset into
+// it, so the pass decodes it, points each jump at the instruction it lands
+// on, rewrites and removes instructions until nothing changes, and encodes
+// the rest with the jumps moved to where their targets went.
+//
+//   JNZ/JZ to the next instruction             removed
+//   a jump to an unconditional jump            sent on to that one's target
+//   code after an unconditional jump or HALT   removed up to the next target
+//   STORE a, Rs; LOAD Rs, a                    LOAD removed
+//   STORE_CONST a, k; LOAD Rd, a               LOAD becomes LOAD_CONST Rd, k
+//   LOAD Rd, a; STORE a, Rd                    STORE removed
+//   LOAD_CONST Rd, k with k already in Rd      removed
+//   ADD Rd, Rs with 0 in Rs                    removed
+//   LOAD_CONST Rd, k written over unread       removed
+//
+// Register values are only known within a straight-line run, from its
+// LOAD_CONSTs and arithmetic, and for a register set once by a LOAD_CONST
+// ahead of every jump and never written again, as Codegen sets R3 to 1 for
+// GOTO. Loads and stores of the I/O page are never touched.
+
+struct PeepholeStats {
+    size_t instructionsBefore = 0;
+    size_t instructionsAfter = 0;
+    size_t bytesBefore = 0;
+    size_t bytesAfter = 0;
+};
+
+class Peephole {
+public:
+    static const uint16_t IO_START = 0xFF00;
+
+    // decodes code; code that does not decode cleanly into instructions with
+    // jumps landing on them is left as it is
+    explicit Peephole(const std::vector<uint8_t>& code) : original(code) {
+        decode();
+    }
+
+    // rewrites until nothing changes; returns the stats of the whole pass
+    PeepholeStats run() {
+        // a ring of jumps threads into a jump to itself, give that time to settle
+        for (int round = 0; valid && round < MAX_ROUNDS; ++round) {
+            bool changed = threadJumps();
+            changed |= simplify();
+            if (!changed) {
+                break;
+            }
+        }
+        return stats();
+    }
+
+    std::vector<uint8_t> code() const {
+        if (!valid) {
+            return original;
+        }
+        std::vector<size_t> offsets = newOffsets();
+        std::vector<uint8_t> out;
+        out.reserve(offsets.back());
+        for (const Insn& insn : insns) {
+            if (!insn.removed) {
+                DecodedInsn d = insn.d;
+                if (insn.target != NONE) {
+                    d.addr = static_cast<uint16_t>(offsets[insn.target]);
+                }
+                encode(d, out);
+            }
+        }
+        return out;
+    }
+
+    // where the instruction that started at offset of the old code went;
+    // the end of the old code maps to the end of the new
+    uint16_t relocate(size_t offset) const {
+        if (!valid) {
+            return static_cast<uint16_t>(offset);
+        }
+        size_t index = indexAt(offset);
+        return static_cast<uint16_t>(newOffsets()[index == NONE ? insns.size() : index]);
+    }
+
+    PeepholeStats stats() const {
+        PeepholeStats s;
+        s.instructionsBefore = insns.size();
+        s.bytesBefore = original.size();
+        s.instructionsAfter = s.instructionsBefore;
+        s.bytesAfter = s.bytesBefore;
+        if (valid) {
+            s.instructionsAfter = 0;
+            for (const Insn& insn : insns) {
+                s.instructionsAfter += !insn.removed;
+            }
+            s.bytesAfter = newOffsets().back();
+        }
+        return s;
+    }
+
+private:
+    static const size_t NONE = SIZE_MAX;
+    static const int UNKNOWN = -1;
+    static const int MAX_ROUNDS = 64;
+
+    struct Insn {
+        DecodedInsn d;
+        size_t at = 0;          // offset in the old code
+        size_t target = NONE;   // jumps: index of the instruction landed on
+        bool removed = false;
+    };
+
+    std::vector<uint8_t> original;
+    std::vector<Insn> insns;
+    bool valid = true;
+    int pinned[8];              // value a register holds from pinnedFrom on, or UNKNOWN
+    size_t pinnedFrom = 0;
+
+    static bool isJump(const DecodedInsn& d) { return d.op == 0x07 || d.op == 0x08; }
+
+    void decode() {
+        for (size_t at = 0; at < original.size();) {
+            Insn insn;
+            insn.at = at;
+            decodeBytes([this, at](int offset) {
+                return at + offset < original.size() ? original[at + offset] : uint8_t(0);
+            }, insn.d);
+            if (insn.d.op == OP_UNKNOWN || at + insn.d.len > original.size() || (insn.d.rd | insn.d.rs) > 7) {
+                valid = false;
+                return;
+            }
+            insns.push_back(insn);
+            at += insn.d.len;
+        }
+        for (Insn& insn : insns) {
+            if (isJump(insn.d)) {
+                insn.target = indexAt(insn.d.addr);
+                if (insn.target == NONE) {
+                    valid = false;  // into the middle of an instruction or past the end
+                    return;
+                }
+            }
+        }
+        findPinned();
+    }
+
+    // index of the instruction starting at offset, insns.size() for the
+    // end of the code, NONE for anything else
+    size_t indexAt(size_t offset) const {
+        if (offset == original.size()) {
+            return insns.size();
+        }
+        size_t low = 0, high = insns.size();
+        while (low < high) {
+            size_t mid = (low + high) / 2;
+            if (insns[mid].at < offset) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low < insns.size() && insns[low].at == offset ? low : NONE;
+    }
+
+    std::vector<size_t> newOffsets() const {
+        std::vector<size_t> offsets(insns.size() + 1);
+        size_t at = 0;
+        for (size_t i = 0; i < insns.size(); ++i) {
+            offsets[i] = at;  // a removed instruction's is its successor's
+            if (!insns[i].removed) {
+                at += insns[i].d.len;
+            }
+        }
+        offsets[insns.size()] = at;
+        return offsets;
+    }
+
+    static void encode(const DecodedInsn& d, std::vector<uint8_t>& out) {
+        out.push_back(d.op);
+        switch (d.op) {
+            case 0x01: case 0x07: case 0x08:
+                out.insert(out.end(), {d.rd, uint8_t(d.addr >> 8), uint8_t(d.addr & 0xFF)});
+                break;
+            case 0x02:
+                out.insert(out.end(), {d.rd, d.imm});
+                break;
+            case 0x03:
+                out.insert(out.end(), {uint8_t(d.addr >> 8), uint8_t(d.addr & 0xFF), d.rs});
+                break;
+            case 0x04:
+                out.insert(out.end(), {uint8_t(d.addr >> 8), uint8_t(d.addr & 0xFF), d.imm});
+                break;
+            case 0x05: case 0x06:
+                out.insert(out.end(), {d.rd, d.rs});
+                break;
+            case 0x09:
+                out.push_back(d.rd);
+                break;
+        }
+    }
+
+    // registers an instruction reads and writes, as bit masks
+    static unsigned reads(const DecodedInsn& d) {
+        switch (d.op) {
+            case 0x03: return 1u << d.rs;
+            case 0x05: case 0x06: return 1u << d.rd | 1u << d.rs;
+            case 0x07: case 0x08: return 1u << d.rd;
+            case 0x0A: return 0x07;   // R0, R1, R2
+            case 0x0B: return 0x17;   // and R4
+            default: return 0;
+        }
+    }
+    static unsigned writes(const DecodedInsn& d) {
+        switch (d.op) {
+            case 0x01: case 0x02: case 0x05: case 0x09: return 1u << d.rd;
+            case 0x06: return 1u << d.rd | 1u << 2;
+            case 0x0A: return 1u << 4;
+            default: return 0;
+        }
+    }
+
+    // a register written only by one LOAD_CONST that every run passes first
+    void findPinned() {
+        for (int& value : pinned) {
+            value = UNKNOWN;
+        }
+        size_t firstJump = insns.size();
+        for (size_t i = 0; i < insns.size(); ++i) {
+            if (isJump(insns[i].d) || insns[i].d.op == 0x00) {
+                firstJump = i;
+                break;
+            }
+        }
+        for (const Insn& insn : insns) {
+            if (insn.target != NONE && insn.target < firstJump) {
+                firstJump = insn.target;  // reached again later
+            }
+        }
+        int writers[8] = {0};
+        for (const Insn& insn : insns) {
+            for (int r = 0; r < 8; ++r) {
+                writers[r] += writes(insn.d) >> r & 1;
+            }
+        }
+        for (size_t i = 0; i < firstJump; ++i) {
+            const DecodedInsn& d = insns[i].d;
+            if (d.op == 0x02 && writers[d.rd] == 1) {
+                pinned[d.rd] = d.imm;
+                pinnedFrom = std::max(pinnedFrom, i + 1);
+            }
+        }
+    }
+
+    size_t nextLive(size_t i) const {
+        while (i < insns.size() && insns[i].removed) {
+            ++i;
+        }
+        return i;
+    }
+
+    // the register value a jump tests decides it wherever it is
+    bool alwaysTaken(size_t i) const {
+        const DecodedInsn& d = insns[i].d;
+        if (i < pinnedFrom || pinned[d.rd] == UNKNOWN) {
+            return false;
+        }
+        return d.op == 0x07 ? pinned[d.rd] != 0 : pinned[d.rd] == 0;
+    }
+
+    // jumps to an unconditional jump go straight to where it goes
+    bool threadJumps() {
+        bool changed = false;
+        for (Insn& insn : insns) {
+            if (insn.removed || insn.target == NONE) {
+                continue;
+            }
+            for (int hops = 0; hops < 16; ++hops) {
+                size_t t = nextLive(insn.target);
+                if (t == insns.size() || insns[t].target == NONE || !alwaysTaken(t) || insns[t].target == t) {
+                    if (t != insn.target) {
+                        insn.target = t;
+                        changed = true;
+                    }
+                    break;
+                }
+                insn.target = insns[t].target;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    std::vector<bool> targets() const {
+        std::vector<bool> isTarget(insns.size() + 1, false);
+        for (const Insn& insn : insns) {
+            if (!insn.removed && insn.target != NONE) {
+                isTarget[nextLive(insn.target)] = true;
+            }
+        }
+        return isTarget;
+    }
+
+    void remove(size_t i, bool& changed) {
+        insns[i].removed = true;
+        changed = true;
+    }
+
+    // one pass over the straight-line runs
+    bool simplify() {
+        bool changed = false;
+        std::vector<bool> isTarget = targets();
+        int known[8];
+        bool reachable = true;
+        size_t prev = NONE;  // previous live instruction in this run
+        for (size_t i = 0; i < insns.size(); ++i) {
+            if (insns[i].removed) {
+                continue;
+            }
+            if (i == 0 || isTarget[i] || !reachable) {
+                if (!isTarget[i] && !reachable) {
+                    remove(i, changed);  // nothing jumps or falls here
+                    continue;
+                }
+                for (int r = 0; r < 8; ++r) {
+                    known[r] = i >= pinnedFrom ? pinned[r] : UNKNOWN;
+                }
+                reachable = true;
+                prev = NONE;
+            }
+            Insn& insn = insns[i];
+            DecodedInsn& d = insn.d;
+            // the previous instruction's value is in a register already, or unread
+            if (prev != NONE) {
+                const DecodedInsn& p = insns[prev].d;
+                bool memory = d.addr < IO_START && p.addr == d.addr;
+                if (memory && p.op == 0x03 && d.op == 0x01 && d.rd == p.rs) {
+                    remove(i, changed);
+                    continue;
+                }
+                if (memory && p.op == 0x04 && d.op == 0x01) {
+                    d = DecodedInsn{0x02, d.rd, 0, p.imm, 0, 3};  // LOAD_CONST Rd, k
+                    changed = true;
+                }
+                if (memory && p.op == 0x01 && d.op == 0x03 && d.rs == p.rd) {
+                    remove(i, changed);
+                    continue;
+                }
+                if (p.op == 0x02 && (writes(d) >> p.rd & 1) && !(reads(d) >> p.rd & 1)) {
+                    remove(prev, changed);
+                    known[p.rd] = UNKNOWN;  // not its value any more, whatever it was before
+                }
+            }
+            if (d.op == 0x02 && known[d.rd] == d.imm) {
+                remove(i, changed);
+                continue;
+            }
+            if (d.op == 0x05 && known[d.rs] == 0) {
+                remove(i, changed);
+                continue;
+            }
+            if (isJump(d)) {
+                size_t next = nextLive(i + 1);
+                bool taken = alwaysTaken(i) || (known[d.rd] != UNKNOWN && (d.op == 0x07) == (known[d.rd] != 0));
+                bool notTaken = known[d.rd] != UNKNOWN && !taken;
+                if (nextLive(insn.target) == next || notTaken) {
+                    remove(i, changed);
+                    continue;
+                }
+                if (taken) {
+                    reachable = false;
+                }
+            }
+            if (d.op == 0x00) {
+                reachable = false;
+            }
+            // what the registers hold after it
+            switch (d.op) {
+                case 0x02:
+                    known[d.rd] = d.imm;
+                    break;
+                case 0x05:
+                case 0x06: {
+                    int a = known[d.rd], b = known[d.rs];
+                    known[d.rd] = UNKNOWN;
+                    if (d.op == 0x06) {
+                        known[2] = UNKNOWN;
+                    }
+                    if (a != UNKNOWN && b != UNKNOWN) {
+                        known[d.rd] = d.op == 0x05 ? (a + b) & 0xFF : (a - b) & 0xFF;
+                        if (d.op == 0x06) {
+                            known[2] = a < b;
+                        }
+                    }
+                    break;
+                }
+                default:
+                    for (int r = 0; r < 8; ++r) {
+                        if (writes(d) >> r & 1) {
+                            known[r] = UNKNOWN;
+                        }
+                    }
+                    break;
+            }
+            prev = i;
+        }
+        return changed;
+    }
+};
@@ -0,0 +1,113 @@
+#pragma once
+#include "disasm.h"
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <ostream>
+#include <iomanip>
+
+// Execution counts for MinimalCPU::setProfile(): how often each PC and each
+// opcode ran. Only the profiled interpreter touches it, so runs without a
+// profile pay nothing.
+class Profile {
+public:
+    std::vector<uint64_t> pcCounts = std::vector<uint64_t>(65536);
+    uint64_t opCounts[256] = {};
+
+    // a straight run of instructions that all ran the same number of times
+    struct Block {
+        uint16_t start = 0;
+        uint32_t bytes = 0;
+        uint32_t length = 0;      // instructions
+        uint64_t executions = 0;
+        uint64_t instructions() const { return executions * length; }
+    };
+
+    void hit(uint16_t pc, uint8_t op) {
+        ++pcCounts[pc];
+        ++opCounts[op];
+    }
+
+    void clear() {
+        std::fill(pcCounts.begin(), pcCounts.end(), 0);
+        std::fill(opCounts, opCounts + 256, 0);
+    }
+
+    uint64_t instructions() const {
+        uint64_t total = 0;
+        for (uint64_t count : opCounts) {
+            total += count;
+        }
+        return total;
+    }
+
+    // Splits the executed instructions of ram into basic blocks, hottest
+    // first. A block ends at a jump or HALT, or where the next instruction
+    // ran a different number of times, which is where control entered or
+    // left. ram should hold the code as it ran.
+    std::vector<Block> hotBlocks(const uint8_t* ram) const {
+        std::vector<Block> blocks;
+        uint32_t pc = 0;
+        while (pc < pcCounts.size()) {
+            if (pcCounts[pc] == 0) {
+                ++pc;
+                continue;
+            }
+            Block block;
+            block.start = static_cast<uint16_t>(pc);
+            block.executions = pcCounts[pc];
+            while (true) {
+                DecodedInsn d;
+                decodeInstruction(ram, static_cast<uint16_t>(pc), d);
+                pc += d.len;
+                block.bytes += d.len;
+                ++block.length;
+                bool transfer = d.op == 0x00 || d.op == 0x07 || d.op == 0x08;
+                if (transfer || pc >= pcCounts.size() || pcCounts[pc] != block.executions) {
+                    break;
+                }
+            }
+            blocks.push_back(block);
+        }
+        std::stable_sort(blocks.begin(), blocks.end(), [](const Block& a, const Block& b) {
+            return a.instructions() > b.instructions();
+        });
+        return blocks;
+    }
+
+    // opcode mix and the top hottest blocks, disassembled from ram
+    void report(std::ostream& out, const uint8_t* ram, size_t top = 10) const {
+        std::ios::fmtflags saved = out.flags();
+        uint64_t total = instructions();
+        auto percent = [total](uint64_t count) { return total ? 100.0 * count / total : 0.0; };
+        out << "Profile: " << total << " instructions" << std::endl;
+        out << "Opcodes:" << std::endl;
+        std::vector<uint8_t> ops;
+        for (int op = 0; op < 256; ++op) {
+            if (opCounts[op]) {
+                ops.push_back(static_cast<uint8_t>(op));
+            }
+        }
+        std::stable_sort(ops.begin(), ops.end(), [this](uint8_t a, uint8_t b) { return opCounts[a] > opCounts[b]; });
+        for (uint8_t op : ops) {
+            out << "  " << std::left << std::setw(14) << mnemonic(op) << std::right << std::setw(12) << opCounts[op]
+                << std::fixed << std::setprecision(1) << std::setw(7) << percent(opCounts[op]) << "%" << std::endl;
+        }
+        std::vector<Block> blocks = hotBlocks(ram);
+        out << "Hot blocks:" << std::endl;
+        for (size_t i = 0; i < blocks.size() && i < top; ++i) {
+            const Block& block = blocks[i];
+            out << "  #" << std::dec << i + 1 << " 0x" << std::hex << std::setw(4) << std::setfill('0') << block.start
+                << std::dec << std::setfill(' ') << ": " << block.executions << " x " << block.length
+                << " instructions = " << block.instructions() << " (" << std::fixed << std::setprecision(1)
+                << percent(block.instructions()) << "%)" << std::endl;
+            uint32_t pc = block.start;
+            for (uint32_t n = 0; n < block.length; ++n) {
+                out << "    " << std::hex << std::setw(4) << std::setfill('0') << pc << std::setfill(' ') << std::dec << ": ";
+                pc += disassemble(out, ram, 65536, pc);
+                out << std::endl;
+            }
+        }
+        out.flags(saved);
+    }
+};
@@ -0,0 +1,42 @@
+#pragma once
+#include "decoder.h"
+#include <vector>
+#include <string>
+#include <set>
+#include <map>
+
+// Ahead-of-time recompiler: turns a flat program image into a C++ translation
+// unit that runs it on a MinimalCPU without interpreting.
+//
+// Code is discovered by following every path from the entry point (the image
+// base). Each reachable instruction becomes plain C++ on local copies of the
+// registers, and each block leader becomes a label, so direct jumps are gotos
+// and the host compiler sees the whole guest control flow. Entry goes through a
+// switch on PC. Stores go through MinimalCPU::storeByte(), so mapped I/O
+// devices and snapshot dirty tracking see them as they see run()'s.
+//
+// Anything the translation cannot guarantee to match is handed back to the
+// interpreter: invalid opcodes, register indexes above R7, jumps out of the
+// translated code, and stores that would modify translated code. The registers
+// and PC are written back and the interpreter continues with MinimalCPU::run().
+class Recompiler {
+    public:
+        Recompiler(const std::vector<uint8_t>& image, uint16_t base);
+        // generated C++ source; sourceName only appears in the header comment
+        std::string translate(const std::string& sourceName);
+        size_t instructionCount() const { return insns.size(); }
+        size_t blockCount() const { return leaders.size(); }
+    private:
+        std::vector<uint8_t> image;
+        uint16_t base;
+        std::vector<uint8_t> RAM;                  // image as the CPU will see it
+        std::map<uint16_t, DecodedInsn> insns;     // translated instructions by address
+        std::set<uint16_t> leaders;                // addresses that need a label
+        std::vector<bool> covered;                 // bytes belonging to translated instructions
+
+        bool inImage(uint16_t addr, uint8_t len) const;
+        bool translatable(const DecodedInsn& d) const;
+        void discover();
+        std::string emitInstruction(uint16_t pc, const DecodedInsn& d);
+        std::string jumpTo(uint16_t target) const;
+};
@@ -0,0 +1,483 @@
+#pragma once
+#include "parser.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Register allocation for Codegen. Every variable and temp of the IR is a
+// value. The allocator works out where each value is live, builds the graph
+// of values live at the same time, merges the two ends of a copy (LOAD_VAR,
+// STORE) when they never interfere, and colours the graph with the registers
+// below, most used values in loops first to keep. A value left without a
+// register gets a RAM slot, and Codegen reaches it through the scratch
+// registers. Slots are coloured from the same graph: values never live at
+// the same time share one, so the data segment holds only as many bytes as
+// there are spilled values live at once. A value that is one constant
+// everywhere it is read needs no slot: Codegen loads the constant again
+// where it is used, so it is also the cheapest to leave without a register.
+//
+//   R0 R1 R5 R6 R7  allocated; R0 and R1 never to a value live across an
+//                   indexed load or store, which puts the array base there
+//   R2              carry of SUB, index of the indexed ops, scratch
+//   R3              always 1, GOTO is JNZ R3
+//   R4              data of the indexed ops, scratch
+
+class RegisterAllocator {
+public:
+    static constexpr int SPILLED = -1;
+    static constexpr uint8_t REGISTERS[] = {0, 1, 5, 6, 7};  // in order of preference
+    static constexpr size_t REGISTER_COUNT = sizeof(REGISTERS);
+
+    explicit RegisterAllocator(const std::vector<IR>& ir) {
+        collect(ir);
+        computeLiveness();
+        findConstants();
+        buildGraph();
+        coalesce();
+        colour();
+        assignSlots();
+    }
+
+    // true for the name of a variable or temp, false for a constant or nothing
+    static bool isValue(const std::string& name) {
+        return !name.empty() && !std::isdigit(static_cast<unsigned char>(name[0]));
+    }
+
+    // the register of a value, or SPILLED for one kept in RAM
+    int registerOf(const std::string& name) const {
+        auto it = ids.find(name);
+        return it == ids.end() ? SPILLED : colours[find(it->second)];
+    }
+
+    // the RAM slot of a value left without a register, counted from 0, or
+    // SPILLED for one in a register or not in the program
+    int slotOf(const std::string& name) const {
+        auto it = ids.find(name);
+        return it == ids.end() ? SPILLED : slots[find(it->second)];
+    }
+
+    // the constant a value is set to, once and before anything reads it,
+    // or -1; one without a register is loaded as that constant
+    int constantOf(const std::string& name) const {
+        auto it = ids.find(name);
+        return it == ids.end() ? -1 : constants[it->second];
+    }
+
+    // how many slots the spilled values take
+    size_t slotCount() const { return slotsUsed; }
+
+    // values kept in a register that the program reads before writing; they
+    // have to start as zero, like the RAM they would otherwise have had
+    std::vector<std::string> entryValues() const {
+        std::vector<std::string> values;
+        if (!insns.empty()) {
+            forEach(liveIn[0], [&](int v) {
+                if (colours[find(v)] != SPILLED) {
+                    values.push_back(names[v]);
+                }
+            });
+        }
+        return values;
+    }
+
+    const std::vector<std::string>& values() const { return names; }
+
+private:
+    typedef std::vector<uint64_t> Set;
+
+    // what one IR instruction reads and writes
+    struct Access {
+        int def = -1;
+        int uses[2] = {-1, -1};
+        bool move = false;          // def is a copy of uses[0]
+        bool indexed = false;       // clobbers R0 and R1
+        std::vector<size_t> next;   // successors
+    };
+
+    std::unordered_map<std::string, int> ids;
+    std::vector<std::string> names;
+    std::vector<Access> insns;
+    std::vector<Set> liveIn, liveOut;
+    std::vector<Set> adjacency;
+    std::vector<int> degree;
+    std::vector<uint8_t> forbidden;  // register mask a value may not have
+    std::vector<double> weight;      // how much keeping it in a register saves
+    std::vector<double> defWeight;   // the part of it from setting the value
+    std::vector<int> defs;           // how many instructions set it
+    std::vector<int> constants;      // see constantOf(); -2 while collecting, for not one
+    std::vector<int> parent;         // coalesced values, union-find
+    std::vector<int> colours;
+    std::vector<int> slots;
+    size_t slotsUsed = 0;
+
+    int value(const std::string& name) {
+        if (!isValue(name)) {
+            return -1;
+        }
+        auto it = ids.find(name);
+        if (it != ids.end()) {
+            return it->second;
+        }
+        ids[name] = static_cast<int>(names.size());
+        names.push_back(name);
+        return static_cast<int>(names.size()) - 1;
+    }
+
+    void collect(const std::vector<IR>& ir) {
+        std::unordered_map<std::string, size_t> labels;
+        for (size_t i = 0; i < ir.size(); ++i) {
+            if (ir[i].op == OpCode::LABEL) {
+                labels[ir[i].result] = i;
+            }
+        }
+        insns.resize(ir.size());
+        std::vector<int> depth(ir.size() + 1, 0);
+        for (size_t i = 0; i < ir.size(); ++i) {
+            const IR& in = ir[i];
+            Access& a = insns[i];
+            bool fallsThrough = true;
+            switch (in.op) {
+                case OpCode::LOAD_CONST:
+                case OpCode::STORE_CONST:
+                    a.def = value(in.result);
+                    break;
+                case OpCode::LOAD_VAR:
+                case OpCode::STORE:
+                    a.uses[0] = value(in.arg1);
+                    a.def = value(in.result);
+                    a.move = a.uses[0] >= 0 && a.def >= 0;
+                    break;
+                case OpCode::ADD:
+                case OpCode::SUB:
+                    a.uses[0] = value(in.arg1);
+                    a.uses[1] = value(in.arg2);
+                    a.def = value(in.result);
+                    break;
+                case OpCode::IFLEQ:
+                case OpCode::GOTO: {
+                    if (in.op == OpCode::IFLEQ) {
+                        a.uses[0] = value(in.arg1);
+                        a.uses[1] = value(in.arg2);
+                    } else {
+                        fallsThrough = false;
+                    }
+                    auto target = labels.find(in.result);
+                    if (target != labels.end()) {
+                        a.next.push_back(target->second);
+                        for (size_t j = target->second; j <= i && target->second <= i; ++j) {
+                            ++depth[j];  // a loop back to the label
+                        }
+                    }
+                    break;
+                }
+                case OpCode::OUT:
+                    a.uses[0] = value(in.arg1);
+                    break;
+                case OpCode::IN:
+                    a.def = value(in.arg1);
+                    break;
+                case OpCode::HALT:
+                    fallsThrough = false;
+                    break;
+                case OpCode::LOAD_INDEXED:
+                    a.uses[0] = value(in.arg2);
+                    a.def = value(in.result);
+                    a.indexed = true;
+                    break;
+                case OpCode::STORE_INDEXED:
+                    a.uses[0] = value(in.arg2);
+                    a.uses[1] = value(in.result);
+                    a.indexed = true;
+                    break;
+                case OpCode::LABEL:
+                case OpCode::ARRAY_DECL:
+                    break;
+            }
+            if (fallsThrough && i + 1 < ir.size()) {
+                a.next.push_back(i + 1);
+            }
+        }
+
+        size_t n = names.size();
+        weight.assign(n, 0.0);
+        defWeight.assign(n, 0.0);
+        defs.assign(n, 0);
+        constants.assign(n, -1);
+        for (size_t i = 0; i < insns.size(); ++i) {
+            double w = 1.0;
+            for (int d = 0; d < depth[i] && d < 6; ++d) {
+                w *= 10.0;
+            }
+            for (int v : {insns[i].def, insns[i].uses[0], insns[i].uses[1]}) {
+                if (v >= 0) {
+                    weight[v] += w;
+                }
+            }
+            int def = insns[i].def;
+            if (def >= 0) {
+                defWeight[def] += w;
+                ++defs[def];
+                bool constant = ir[i].op == OpCode::STORE_CONST || ir[i].op == OpCode::LOAD_CONST;
+                constants[def] = constant ? static_cast<uint8_t>(std::stoi(ir[i].arg1)) : -2;
+            }
+        }
+    }
+
+    // set once to a constant and read only after: the set costs nothing
+    // without a register, so it does not count towards keeping one
+    void findConstants() {
+        for (size_t v = 0; v < names.size(); ++v) {
+            bool readFirst = !insns.empty() && has(liveIn[0], static_cast<int>(v));
+            if (defs[v] != 1 || constants[v] < 0 || readFirst) {
+                constants[v] = -1;
+            } else {
+                weight[v] -= defWeight[v];
+            }
+        }
+    }
+
+    // live-in and live-out of every instruction, iterated to a fixed point
+    void computeLiveness() {
+        size_t words = (names.size() + 63) / 64;
+        liveIn.assign(insns.size(), Set(words, 0));
+        liveOut.assign(insns.size(), Set(words, 0));
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = insns.size(); i-- > 0;) {
+                const Access& a = insns[i];
+                Set out(words, 0);
+                for (size_t s : a.next) {
+                    for (size_t w = 0; w < words; ++w) {
+                        out[w] |= liveIn[s][w];
+                    }
+                }
+                Set in = out;
+                if (a.def >= 0) {
+                    in[a.def / 64] &= ~(uint64_t(1) << (a.def % 64));
+                }
+                for (int u : a.uses) {
+                    if (u >= 0) {
+                        in[u / 64] |= uint64_t(1) << (u % 64);
+                    }
+                }
+                if (in != liveIn[i] || out != liveOut[i]) {
+                    liveIn[i].swap(in);
+                    liveOut[i].swap(out);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    template <typename F>
+    static void forEach(const Set& set, F f) {
+        for (size_t w = 0; w < set.size(); ++w) {
+            for (uint64_t bits = set[w]; bits; bits &= bits - 1) {
+                f(static_cast<int>(w * 64 + __builtin_ctzll(bits)));
+            }
+        }
+    }
+
+    static bool has(const Set& set, int v) {
+        return (set[v / 64] >> (v % 64)) & 1;
+    }
+
+    void addEdge(int a, int b) {
+        if (a == b || has(adjacency[a], b)) {
+            return;
+        }
+        adjacency[a][b / 64] |= uint64_t(1) << (b % 64);
+        adjacency[b][a / 64] |= uint64_t(1) << (a % 64);
+        ++degree[a];
+        ++degree[b];
+    }
+
+    void buildGraph() {
+        size_t n = names.size();
+        adjacency.assign(n, Set((n + 63) / 64, 0));
+        degree.assign(n, 0);
+        forbidden.assign(n, 0);
+        parent.resize(n);
+        for (size_t v = 0; v < n; ++v) {
+            parent[v] = static_cast<int>(v);
+        }
+        // whatever is live at the start was all set there at once, to zero
+        if (!insns.empty()) {
+            forEach(liveIn[0], [&](int a) {
+                forEach(liveIn[0], [&](int b) { addEdge(a, b); });
+            });
+        }
+        for (size_t i = 0; i < insns.size(); ++i) {
+            const Access& a = insns[i];
+            if (a.def >= 0) {
+                forEach(liveOut[i], [&](int v) {
+                    if (!(a.move && v == a.uses[0])) {
+                        addEdge(a.def, v);
+                    }
+                });
+            }
+            if (a.indexed) {
+                forEach(liveOut[i], [&](int v) {
+                    if (v != a.def) {
+                        forbidden[v] |= (1 << 0) | (1 << 1);
+                    }
+                });
+            }
+        }
+    }
+
+    int find(int v) const {
+        while (parent[v] != v) {
+            v = parent[v];
+        }
+        return v;
+    }
+
+    int available(int v) const {
+        int count = 0;
+        for (uint8_t r : REGISTERS) {
+            count += !(forbidden[v] >> r & 1);
+        }
+        return count;
+    }
+
+    // Merges the ends of copies that never interfere, so the copy costs
+    // nothing, as long as the merged value stays as easy to colour (Briggs:
+    // fewer than REGISTER_COUNT neighbours that are hard to colour themselves).
+    void coalesce() {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (const Access& a : insns) {
+                if (!a.move) {
+                    continue;
+                }
+                int x = find(a.def), y = find(a.uses[0]);
+                if (x == y || has(adjacency[x], y)) {
+                    continue;
+                }
+                Set both = adjacency[x];
+                for (size_t w = 0; w < both.size(); ++w) {
+                    both[w] |= adjacency[y][w];
+                }
+                int hard = 0;
+                forEach(both, [&](int v) { hard += degree[v] >= static_cast<int>(REGISTER_COUNT); });
+                if (hard >= static_cast<int>(REGISTER_COUNT)) {
+                    continue;
+                }
+                if (weight[y] > weight[x]) {
+                    std::swap(x, y);
+                }
+                forEach(adjacency[y], [&](int v) {
+                    adjacency[v][y / 64] &= ~(uint64_t(1) << (y % 64));
+                    --degree[v];
+                    addEdge(x, v);
+                });
+                std::fill(adjacency[y].begin(), adjacency[y].end(), 0);
+                degree[y] = 0;
+                parent[y] = x;
+                forbidden[x] |= forbidden[y];
+                weight[x] += weight[y];
+                changed = true;
+            }
+        }
+    }
+
+    // Takes out a value that is sure to find a register, or failing that the
+    // one cheapest to leave in RAM, until none is left; then gives each a
+    // register in the reverse order, where its neighbours leave one.
+    void colour() {
+        size_t n = names.size();
+        colours.assign(n, SPILLED);
+        std::vector<bool> removed(n, false);
+        std::vector<int> remaining = degree;
+        std::vector<int> stack;
+        for (size_t v = 0; v < n; ++v) {
+            if (find(static_cast<int>(v)) != static_cast<int>(v)) {
+                removed[v] = true;
+            }
+        }
+        while (true) {
+            int pick = -1;
+            double cheapest = 0;
+            for (size_t v = 0; v < n; ++v) {
+                if (removed[v]) {
+                    continue;
+                }
+                int vi = static_cast<int>(v);
+                if (remaining[v] < available(vi)) {
+                    pick = vi;
+                    break;
+                }
+                double cost = weight[v] / (remaining[v] + 1);
+                if (pick < 0 || cost < cheapest) {
+                    pick = vi;
+                    cheapest = cost;
+                }
+            }
+            if (pick < 0) {
+                break;
+            }
+            removed[pick] = true;
+            stack.push_back(pick);
+            forEach(adjacency[pick], [&](int v) { --remaining[v]; });
+        }
+        while (!stack.empty()) {
+            int v = stack.back();
+            stack.pop_back();
+            unsigned taken = forbidden[v];
+            forEach(adjacency[v], [&](int u) {
+                if (colours[u] != SPILLED) {
+                    taken |= 1u << colours[u];
+                }
+            });
+            for (uint8_t r : REGISTERS) {
+                if (!(taken >> r & 1)) {
+                    colours[v] = r;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Gives every value left in RAM the lowest slot none of its neighbours
+    // has, the most used first so they sit together at the start of the data.
+    // Merged copies share their slot too, which leaves the copy a LOAD and a
+    // STORE back to the same byte for the peephole pass to drop.
+    void assignSlots() {
+        size_t n = names.size();
+        slots.assign(n, SPILLED);
+        slotsUsed = 0;
+        std::vector<bool> stored(n, false);  // a merged value with a part that is no constant
+        for (size_t v = 0; v < n; ++v) {
+            stored[find(static_cast<int>(v))] = stored[find(static_cast<int>(v))] || constants[v] < 0;
+        }
+        std::vector<int> order;
+        for (size_t v = 0; v < n; ++v) {
+            int vi = static_cast<int>(v);
+            if (find(vi) == vi && colours[v] == SPILLED && stored[v]) {
+                order.push_back(vi);
+            }
+        }
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return weight[a] > weight[b]; });
+        for (int v : order) {
+            std::vector<bool> taken(slotsUsed, false);
+            forEach(adjacency[v], [&](int u) {
+                if (slots[u] != SPILLED) {
+                    taken[slots[u]] = true;
+                }
+            });
+            size_t slot = 0;
+            while (slot < slotsUsed && taken[slot]) {
+                ++slot;
+            }
+            slotsUsed = std::max(slotsUsed, slot + 1);
+            slots[v] = static_cast<int>(slot);
+        }
+    }
+};
+
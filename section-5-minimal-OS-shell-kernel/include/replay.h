@@ -0,0 +1,136 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Deterministic record and replay of guest input. The guest only sees the
+// outside world through IN, so a log of every byte IN returned, and when,
+// reproduces a run exactly. MinimalCPU::setInputRecorder() writes the log,
+// MinimalCPU::setInputReplay() feeds it back with no input device and no
+// terminal in the way.
+//
+// "When" is the clock: instructions retired since loadProgram() before the
+// IN. Replay does not need it to deliver bytes, it checks it, so a program
+// or engine that takes a different path shows up as a divergence.
+//
+// File: the magic string, then per byte a LEB128 varint of the clock's
+// advance since the previous byte and the byte itself.
+
+struct InputEvent {
+    uint64_t clock = 0;
+    char byte = 0;
+
+    bool operator==(const InputEvent& other) const {
+        return clock == other.clock && byte == other.byte;
+    }
+};
+
+static const char INPUT_LOG_MAGIC[] = "MCINPUT1";
+static const size_t INPUT_LOG_MAGIC_SIZE = 8;
+
+class InputRecorder {
+public:
+    explicit InputRecorder(const std::string& path) : file(path, std::ios::binary | std::ios::trunc) {
+        if (!file || !file.write(INPUT_LOG_MAGIC, INPUT_LOG_MAGIC_SIZE)) {
+            throw std::runtime_error("Could not open input log: " + path);
+        }
+    }
+
+    void record(uint64_t clock, char ch) {
+        uint64_t advance = clock - lastClock;
+        lastClock = clock;
+        char bytes[11];
+        size_t size = 0;
+        do {
+            uint8_t low = advance & 0x7F;
+            advance >>= 7;
+            bytes[size++] = static_cast<char>(advance ? low | 0x80 : low);
+        } while (advance);
+        bytes[size++] = ch;
+        file.write(bytes, static_cast<std::streamsize>(size));
+        ++count;
+    }
+
+    // MinimalCPU flushes after each run() and before waiting on a person,
+    // so a run that crashes still leaves the log of what it was given
+    void flush() {
+        file.flush();
+    }
+
+    size_t events() const { return count; }
+    bool ok() const { return static_cast<bool>(file); }
+
+private:
+    std::ofstream file;
+    uint64_t lastClock = 0;
+    size_t count = 0;
+};
+
+class InputReplay {
+public:
+    explicit InputReplay(std::vector<InputEvent> events) : log(std::move(events)) {}
+
+    explicit InputReplay(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        std::string bytes;
+        if (file) {
+            bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        }
+        if (bytes.compare(0, INPUT_LOG_MAGIC_SIZE, INPUT_LOG_MAGIC, INPUT_LOG_MAGIC_SIZE) != 0) {
+            throw std::runtime_error("Not an input log: " + path);
+        }
+        uint64_t clock = 0;
+        size_t at = INPUT_LOG_MAGIC_SIZE;
+        while (at < bytes.size()) {
+            uint64_t advance = 0;
+            int shift = 0;
+            uint8_t byte;
+            do {
+                if (at == bytes.size() || shift > 63) {
+                    throw std::runtime_error("Truncated input log: " + path);
+                }
+                byte = static_cast<uint8_t>(bytes[at++]);
+                advance |= uint64_t(byte & 0x7F) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+            if (at == bytes.size()) {
+                throw std::runtime_error("Truncated input log: " + path);
+            }
+            clock += advance;
+            InputEvent event;
+            event.clock = clock;
+            event.byte = bytes[at++];
+            log.push_back(event);
+        }
+    }
+
+    // the next logged byte; false once the log is used up. A byte asked for
+    // at another clock than it was recorded at is still returned, and counted.
+    bool next(uint64_t clock, char& ch) {
+        if (position == log.size()) {
+            return false;
+        }
+        const InputEvent& event = log[position];
+        if (event.clock != clock && misses++ == 0) {
+            firstMiss = position;
+        }
+        ch = event.byte;
+        ++position;
+        return true;
+    }
+
+    const std::vector<InputEvent>& events() const { return log; }
+    size_t remaining() const { return log.size() - position; }
+    // bytes read at a different clock than recorded, and the index of the first
+    size_t divergences() const { return misses; }
+    size_t firstDivergence() const { return firstMiss; }
+
+private:
+    std::vector<InputEvent> log;
+    size_t position = 0;
+    size_t misses = 0;
+    size_t firstMiss = 0;
+};
@@ -0,0 +1,330 @@
+#pragma once
+#include "cfg.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// SSA form of the IR on its control-flow graph (cfg.h). Every definition of
+// a variable or temp gets a name of its own, x.1, x.2 and so on (the dot
+// keeps them apart from the names of the source), and where definitions
+// meet a phi picks one. A variable read before anything sets it keeps its
+// own name, which stands for whatever it held at entry: zero on the CPU, and
+// undefined to the IR interpreter.
+//
+// Phis go where the dominance frontiers of the definitions put them, but
+// only where the variable is live (pruned SSA). lower() leaves SSA by
+// copying each phi argument into a new name at the end of its predecessor
+// and that into the phi's result at the top of the block, which is right
+// even on a critical edge or when phis swap their values. Then the copies
+// whose two ends are never live at once are merged away, and the versions
+// of a variable go back to its name where they can.
+
+class SSAForm {
+public:
+    ControlFlowGraph cfg;
+
+    explicit SSAForm(const std::vector<IR>& ir) : cfg(ir) {
+        dropUnreachable();
+        placePhis();
+        rename();
+    }
+
+    // a name no definition has yet for a new version of var
+    std::string newVersion(const std::string& var) {
+        std::string name = var + "." + std::to_string(++versions[var]);
+        origins[name] = var;
+        return name;
+    }
+
+    // the variable a version belongs to
+    const std::string& variableOf(const std::string& name) const {
+        auto it = origins.find(name);
+        return it == origins.end() ? name : it->second;
+    }
+
+    size_t phiCount() const { return placed; }
+
+    // the flat IR out of SSA form, which leaves the graph without phis
+    std::vector<IR> lower() {
+        cfg.computeDominators();
+        removePhis();
+        std::vector<IR> ir = cfg.lower();
+        coalesce(ir);
+        return ir;
+    }
+
+private:
+    std::unordered_map<std::string, int> versions;
+    std::unordered_map<std::string, std::string> origins;
+    size_t placed = 0;
+
+    // Nothing runs there, so only the array declarations stay, where
+    // Codegen lays out the data in IR order.
+    void dropUnreachable() {
+        bool dropped = false;
+        for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+            if (cfg.reachable(static_cast<int>(b))) {
+                continue;
+            }
+            std::vector<IR>& code = cfg.blocks[b].code;
+            size_t before = code.size();
+            code.erase(std::remove_if(code.begin(), code.end(), [](const IR& in) { return in.op != OpCode::ARRAY_DECL; }),
+                       code.end());
+            dropped = dropped || code.size() != before;
+        }
+        if (dropped) {
+            cfg.connect();  // only edges out of blocks no one reaches change
+            cfg.computeDominators();
+        }
+    }
+
+    void placePhis() {
+        const std::vector<int>& order = cfg.reversePostorder();
+        std::vector<std::vector<int>> frontier(cfg.blocks.size());
+        for (int b : order) {
+            const std::vector<int>& preds = cfg.blocks[b].preds;
+            if (preds.size() < 2) {
+                continue;
+            }
+            for (int p : preds) {
+                for (int runner = p; cfg.reachable(runner) && runner != cfg.idom(b); runner = cfg.idom(runner)) {
+                    std::vector<int>& f = frontier[runner];
+                    if (std::find(f.begin(), f.end(), b) == f.end()) {
+                        f.push_back(b);
+                    }
+                }
+            }
+        }
+
+        std::unordered_map<std::string, std::vector<int>> defBlocks;
+        std::vector<std::string> vars;
+        for (int b : order) {
+            for (const IR& in : cfg.blocks[b].code) {
+                if (const std::string* def = ControlFlowGraph::defOf(in)) {
+                    std::vector<int>& blocks = defBlocks[*def];
+                    if (blocks.empty()) {
+                        vars.push_back(*def);
+                    }
+                    if (blocks.empty() || blocks.back() != b) {
+                        blocks.push_back(b);
+                    }
+                }
+            }
+        }
+
+        Liveness live(cfg);
+        std::vector<int> hasPhi(cfg.blocks.size(), -1), queued(cfg.blocks.size(), -1);
+        for (size_t v = 0; v < vars.size(); ++v) {
+            int mark = static_cast<int>(v);
+            std::vector<int> work = defBlocks[vars[v]];
+            for (int b : work) {
+                queued[b] = mark;
+            }
+            while (!work.empty()) {
+                int b = work.back();
+                work.pop_back();
+                for (int f : frontier[b]) {
+                    if (hasPhi[f] == mark || !live.isLiveIn(f, vars[v])) {
+                        continue;
+                    }
+                    hasPhi[f] = mark;
+                    BasicBlock& block = cfg.blocks[f];
+                    block.phis.push_back(Phi{vars[v], vars[v], std::vector<std::string>(block.preds.size(), vars[v])});
+                    ++placed;
+                    if (queued[f] != mark) {
+                        queued[f] = mark;
+                        work.push_back(f);
+                    }
+                }
+            }
+        }
+    }
+
+    // gives every definition its own version, walking the dominator tree
+    void rename() {
+        std::unordered_map<std::string, std::vector<std::string>> current;
+        auto top = [&](const std::string& var) -> const std::string& {
+            auto it = current.find(var);
+            return it == current.end() || it->second.empty() ? var : it->second.back();
+        };
+        // a block is entered with its number and left with its number + 1 negated
+        std::vector<int> stack{0};
+        std::vector<std::vector<std::string>> defined(cfg.blocks.size());
+        while (!stack.empty()) {
+            int entry = stack.back();
+            stack.pop_back();
+            if (entry < 0) {
+                for (const std::string& var : defined[-entry - 1]) {
+                    current[var].pop_back();
+                }
+                continue;
+            }
+            int b = entry;
+            BasicBlock& block = cfg.blocks[b];
+            for (Phi& phi : block.phis) {
+                phi.result = newVersion(phi.var);
+                current[phi.var].push_back(phi.result);
+                defined[b].push_back(phi.var);
+            }
+            for (IR& in : block.code) {
+                ControlFlowGraph::forEachUse(in, [&](std::string& name) { name = top(name); });
+                if (std::string* def = ControlFlowGraph::defOf(in)) {
+                    std::string var = *def;
+                    *def = newVersion(var);
+                    current[var].push_back(*def);
+                    defined[b].push_back(var);
+                }
+            }
+            for (int s : block.succs) {
+                const std::vector<int>& preds = cfg.blocks[s].preds;
+                size_t j = std::find(preds.begin(), preds.end(), b) - preds.begin();
+                for (Phi& phi : cfg.blocks[s].phis) {
+                    phi.args[j] = top(phi.var);
+                }
+            }
+            stack.push_back(-b - 1);
+            const std::vector<int>& children = cfg.dominated(b);
+            for (size_t c = children.size(); c-- > 0;) {
+                stack.push_back(children[c]);
+            }
+        }
+    }
+
+    // Sreedhar's method I: each phi gets a name of its own that every
+    // predecessor sets last thing and the block reads first thing.
+    void removePhis() {
+        for (BasicBlock& block : cfg.blocks) {
+            std::vector<IR> head;
+            for (const Phi& phi : block.phis) {
+                std::string through = newVersion(phi.var);
+                for (size_t i = 0; i < block.preds.size(); ++i) {
+                    if (!cfg.reachable(block.preds[i])) {
+                        continue;
+                    }
+                    BasicBlock& pred = cfg.blocks[block.preds[i]];
+                    const std::string& arg = phi.args[i];
+                    IR copy = ControlFlowGraph::isValue(arg) ? IR{OpCode::STORE, arg, "", through}
+                                                             : IR{OpCode::STORE_CONST, arg, "", through};
+                    pred.code.insert(pred.code.begin() + pred.end(), copy);
+                }
+                head.push_back(IR{OpCode::STORE, through, "", phi.result});
+            }
+            block.code.insert(block.code.begin(), head.begin(), head.end());
+            block.phis.clear();
+        }
+    }
+
+    // Merges the two ends of every copy that are never live at the same
+    // time into one name, the way RegisterAllocator merges them into one
+    // register but with no limit on names; the copies left are the ones a
+    // name could not do without.
+    void coalesce(std::vector<IR>& ir) {
+        ControlFlowGraph flat(ir);
+        Liveness live(flat);
+        const std::vector<std::string>& names = live.values();
+        size_t n = names.size();
+        std::vector<Liveness::Set> adjacency(n, Liveness::Set((n + 63) / 64, 0));
+        auto addEdge = [&](int a, int b) {
+            if (a != b) {
+                Liveness::insert(adjacency[a], b);
+                Liveness::insert(adjacency[b], a);
+            }
+        };
+        // whatever is live at the start was all set there at once
+        Liveness::forEach(live.in(0), [&](int a) {
+            Liveness::forEach(live.in(0), [&](int b) { addEdge(a, b); });
+        });
+        for (int b : flat.reversePostorder()) {
+            Liveness::Set after = live.out(b);
+            const std::vector<IR>& code = flat.blocks[b].code;
+            for (size_t j = code.size(); j-- > 0;) {
+                const IR& in = code[j];
+                if (const std::string* def = ControlFlowGraph::defOf(in)) {
+                    int d = live.index(*def), from = ControlFlowGraph::isCopy(in) ? live.index(in.arg1) : -1;
+                    Liveness::forEach(after, [&](int v) {
+                        if (v != from) {
+                            addEdge(d, v);
+                        }
+                    });
+                }
+                live.step(after, in);
+            }
+        }
+
+        std::vector<int> parent(n);
+        for (size_t v = 0; v < n; ++v) {
+            parent[v] = static_cast<int>(v);
+        }
+        auto find = [&](int v) {
+            while (parent[v] != v) {
+                v = parent[v] = parent[parent[v]];
+            }
+            return v;
+        };
+        auto original = [&](int v) { return variableOf(names[v]) == names[v]; };
+        for (const IR& in : ir) {
+            if (!ControlFlowGraph::isCopy(in)) {
+                continue;
+            }
+            int x = find(live.index(in.result)), y = find(live.index(in.arg1));
+            if (x == y || Liveness::contains(adjacency[x], y)) {
+                continue;
+            }
+            if (original(y) && !original(x)) {
+                std::swap(x, y);  // a name of the source wins
+            }
+            for (size_t w = 0; w < adjacency[x].size(); ++w) {
+                adjacency[x][w] |= adjacency[y][w];
+            }
+            Liveness::forEach(adjacency[y], [&](int v) { Liveness::insert(adjacency[v], x); });
+            parent[y] = x;
+        }
+
+        // a merged group with no name of the source gets its variable's
+        // name when no other group has it
+        std::unordered_map<std::string, std::string> renamed;
+        std::unordered_map<std::string, bool> taken;
+        for (size_t v = 0; v < n; ++v) {
+            if (find(static_cast<int>(v)) == static_cast<int>(v)) {
+                taken[names[v]] = true;
+            }
+        }
+        for (size_t v = 0; v < n; ++v) {
+            int root = find(static_cast<int>(v));
+            const std::string& rootName = names[root];
+            auto it = renamed.find(rootName);
+            if (it == renamed.end()) {
+                std::string name = rootName;
+                const std::string& var = variableOf(rootName);
+                if (!original(root) && !taken[var]) {
+                    taken[var] = true;
+                    name = var;
+                }
+                it = renamed.emplace(rootName, name).first;
+            }
+            if (names[v] != it->second) {
+                renamed[names[v]] = it->second;
+            }
+        }
+
+        std::vector<IR> out;
+        out.reserve(ir.size());
+        for (IR in : ir) {
+            auto rename = [&](std::string& name) {
+                auto it = renamed.find(name);
+                if (it != renamed.end()) {
+                    name = it->second;
+                }
+            };
+            ControlFlowGraph::forEachUse(in, rename);
+            if (std::string* def = ControlFlowGraph::defOf(in)) {
+                rename(*def);
+            }
+            if (ControlFlowGraph::isCopy(in) && in.arg1 == in.result) {
+                continue;
+            }
+            out.push_back(in);
+        }
+        ir.swap(out);
+    }
+};
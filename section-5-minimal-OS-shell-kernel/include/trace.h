@@ -0,0 +1,328 @@
+#pragma once
+#include "disasm.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Binary execution trace. MinimalCPU::setTrace() hands every executed
+// instruction to a TraceWriter as one 8-byte TraceRecord. The writer puts
+// records in a lock-free ring and returns; its own thread compresses them and
+// writes the file. TraceReader reads a trace back, and build/tracedump
+// prints one.
+
+// what an instruction did, as seen after it ran
+struct TraceRecord {
+    uint16_t pc = 0;
+    uint16_t addr = 0;   // memory read or written, with TRACE_LOAD/TRACE_STORE
+    uint8_t op = 0;
+    uint8_t effects = 0; // TRACE_* bits, the register number in the low three
+    uint8_t value = 0;   // new value of the register, with TRACE_REG
+    uint8_t data = 0;    // byte loaded or stored, or the new carry with TRACE_CARRY
+
+    bool operator==(const TraceRecord& other) const {
+        return pc == other.pc && addr == other.addr && op == other.op && effects == other.effects
+            && value == other.value && data == other.data;
+    }
+};
+
+static const uint8_t TRACE_REGISTER = 0x07; // mask for the register written
+static const uint8_t TRACE_REG = 0x08;      // a register was written
+static const uint8_t TRACE_LOAD = 0x10;     // data was read from addr
+static const uint8_t TRACE_STORE = 0x20;    // data was written to addr
+static const uint8_t TRACE_CARRY = 0x40;    // SUB set R2 to data
+
+// The file is a magic string and then one entry per record: a mask byte and
+// the record's bytes that differ from a prediction, one per set mask bit.
+// The PC is predicted to be whatever followed the previous PC last time, and
+// the rest of the record to be what it was last time at this PC, so a loop
+// costs about two bytes per instruction. TraceEncoder and TraceDecoder keep
+// the same tables and must see the records in order.
+class TraceCodec {
+public:
+    static constexpr const char* MAGIC = "MCTRACE1";
+    static const size_t MAGIC_SIZE = 8;
+    static const size_t MAX_ENTRY = 9;  // mask and all eight bytes
+
+protected:
+    // a record as a little-endian word: pc, addr, op, effects, value, data
+    std::vector<uint16_t> nextPc = std::vector<uint16_t>(65536);
+    std::vector<uint64_t> lastAt = std::vector<uint64_t>(65536);
+    uint16_t previousPc = 0;
+
+    static uint64_t pack(const TraceRecord& r) {
+        return uint64_t(r.pc) | uint64_t(r.addr) << 16 | uint64_t(r.op) << 32 | uint64_t(r.effects) << 40
+            | uint64_t(r.value) << 48 | uint64_t(r.data) << 56;
+    }
+
+    static TraceRecord unpack(uint64_t word) {
+        TraceRecord r;
+        r.pc = static_cast<uint16_t>(word);
+        r.addr = static_cast<uint16_t>(word >> 16);
+        r.op = static_cast<uint8_t>(word >> 32);
+        r.effects = static_cast<uint8_t>(word >> 40);
+        r.value = static_cast<uint8_t>(word >> 48);
+        r.data = static_cast<uint8_t>(word >> 56);
+        return r;
+    }
+
+    uint64_t prediction(uint16_t pc) const {
+        return (lastAt[pc] & ~uint64_t(0xFFFF)) | nextPc[previousPc];
+    }
+
+    void learn(uint64_t word, uint16_t pc) {
+        lastAt[pc] = word;
+        nextPc[previousPc] = pc;
+        previousPc = pc;
+    }
+};
+
+class TraceEncoder : public TraceCodec {
+    static int lowestBit(uint64_t bits) {
+#if defined(__GNUC__)
+        return __builtin_ctzll(bits);
+#else
+        int bit = 0;
+        while (!(bits & 1)) {
+            bits >>= 1;
+            ++bit;
+        }
+        return bit;
+#endif
+    }
+
+public:
+    // writes the entry for r at out, which has room for MAX_ENTRY bytes;
+    // returns the end of the entry
+    uint8_t* encode(const TraceRecord& r, uint8_t* out) {
+        uint64_t word = pack(r);
+        uint64_t delta = word ^ prediction(r.pc);
+        learn(word, r.pc);
+        // the top bit of each nonzero byte, then those eight bits gathered into the mask
+        const uint64_t low7 = 0x7F7F7F7F7F7F7F7FULL;
+        uint64_t nonzero = (((delta & low7) + low7) | delta) & ~low7;
+        *out++ = static_cast<uint8_t>(((nonzero >> 7) * 0x0102040810204080ULL) >> 56);
+        while (nonzero) {  // usually one or two bytes
+            int bit = lowestBit(nonzero);
+            *out++ = static_cast<uint8_t>(delta >> (bit - 7));
+            nonzero &= nonzero - 1;
+        }
+        return out;
+    }
+
+    void encode(const TraceRecord& r, std::vector<uint8_t>& out) {
+        size_t size = out.size();
+        out.resize(size + MAX_ENTRY);
+        out.resize(encode(r, out.data() + size) - out.data());
+    }
+};
+
+class TraceDecoder : public TraceCodec {
+public:
+    // reads one record from the entry at in; returns the bytes used, or 0
+    // when the entry runs past end
+    size_t decode(const uint8_t* in, const uint8_t* end, TraceRecord& r) {
+        if (in == end) {
+            return 0;
+        }
+        uint8_t mask = in[0];
+        size_t size = 1;
+        for (int i = 0; i < 8; ++i) {
+            size += (mask >> i) & 1;
+        }
+        if (static_cast<size_t>(end - in) < size) {
+            return 0;
+        }
+        uint64_t delta = 0;
+        const uint8_t* p = in + 1;
+        for (int i = 0; i < 8; ++i) {
+            if (mask & (1 << i)) {
+                delta |= uint64_t(*p++) << (8 * i);
+            }
+        }
+        uint16_t pc = static_cast<uint16_t>(nextPc[previousPc] ^ delta);
+        uint64_t word = prediction(pc) ^ delta;
+        learn(word, pc);
+        r = unpack(word);
+        return size;
+    }
+};
+
+// Producer side of the trace, used by one CPU thread. record() copies into
+// a ring of capacity records and publishes it with one release store; the
+// writer thread drains the ring, encodes and writes. When the ring is full
+// record() waits for the writer rather than lose records, and counts a stall.
+class TraceWriter {
+public:
+    explicit TraceWriter(const std::string& path, size_t capacity = 1 << 16)
+        : file(path, std::ios::binary | std::ios::trunc) {
+        if (!file) {
+            throw std::runtime_error("Could not open trace file: " + path);
+        }
+        size_t rounded = 1;
+        while (rounded < capacity) {
+            rounded <<= 1;
+        }
+        ring.reset(new TraceRecord[rounded]);
+        mask = rounded - 1;
+        file.write(TraceCodec::MAGIC, TraceCodec::MAGIC_SIZE);
+        written = TraceCodec::MAGIC_SIZE;
+        writer = std::thread([this] { drain(); });
+    }
+
+    ~TraceWriter() {
+        close();
+    }
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    void record(const TraceRecord& r) {
+        if (head - tailSeen > mask) {
+            waitForRoom();
+        }
+        ring[head & mask] = r;
+        published.store(++head, std::memory_order_release);
+    }
+
+    // writes out every record so far and stops the writer thread
+    void close() {
+        if (writer.joinable()) {
+            stopping.store(true, std::memory_order_release);
+            writer.join();
+            file.flush();
+        }
+    }
+
+    uint64_t records() const { return head; }
+    // times record() found the ring full
+    uint64_t stalls() const { return waits; }
+    // file size so far, valid after close()
+    uint64_t bytesWritten() const { return written; }
+    bool ok() const { return !failed.load(std::memory_order_acquire); }
+
+private:
+    std::ofstream file;
+    std::unique_ptr<TraceRecord[]> ring;
+    size_t mask = 0;
+    std::thread writer;
+
+    // producer state
+    uint64_t head = 0;
+    uint64_t tailSeen = 0;
+    uint64_t waits = 0;
+
+    alignas(64) std::atomic<uint64_t> published{0};
+    alignas(64) std::atomic<uint64_t> consumed{0};
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> failed{false};
+    uint64_t written = 0;  // writer thread only until close()
+
+    void waitForRoom() {
+        ++waits;
+        while ((tailSeen = consumed.load(std::memory_order_acquire)) + mask < head) {
+            std::this_thread::yield();
+        }
+    }
+
+    void drain() {
+        TraceEncoder encoder;
+        uint64_t tail = 0;
+        size_t batch = (mask + 1) / 4 ? (mask + 1) / 4 : 1;  // hand slots back before the ring is drained
+        std::vector<uint8_t> out(batch * TraceCodec::MAX_ENTRY);
+        while (true) {
+            uint64_t end = published.load(std::memory_order_acquire);
+            if (end == tail) {
+                if (stopping.load(std::memory_order_acquire)) {
+                    if (published.load(std::memory_order_acquire) == tail) {
+                        break;
+                    }
+                    continue;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            if (end - tail > batch) {
+                end = tail + batch;
+            }
+            uint8_t* at = out.data();
+            for (; tail != end; ++tail) {
+                at = encoder.encode(ring[tail & mask], at);
+            }
+            consumed.store(tail, std::memory_order_release);
+            size_t size = at - out.data();
+            file.write(reinterpret_cast<const char*>(out.data()), static_cast<std::streamsize>(size));
+            written += size;
+            if (!file) {
+                failed.store(true, std::memory_order_release);
+            }
+        }
+    }
+};
+
+// reads a trace file written by TraceWriter, one record at a time
+class TraceReader {
+public:
+    explicit TraceReader(const std::string& path) : file(path, std::ios::binary) {
+        char magic[TraceCodec::MAGIC_SIZE];
+        if (!file || !file.read(magic, sizeof(magic))
+            || std::string(magic, sizeof(magic)) != TraceCodec::MAGIC) {
+            throw std::runtime_error("Not a trace file: " + path);
+        }
+    }
+
+    // false at the end of the trace; a truncated last entry is dropped
+    bool next(TraceRecord& r) {
+        if (end - pos < MAX_ENTRY && !refill() && pos == end) {
+            return false;
+        }
+        size_t used = decoder.decode(buffer.data() + pos, buffer.data() + end, r);
+        pos += used;
+        return used != 0;
+    }
+
+private:
+    static const size_t MAX_ENTRY = TraceCodec::MAX_ENTRY;
+    std::ifstream file;
+    TraceDecoder decoder;
+    std::vector<uint8_t> buffer = std::vector<uint8_t>(64 * 1024);
+    size_t pos = 0;
+    size_t end = 0;
+
+    bool refill() {
+        std::copy(buffer.begin() + pos, buffer.begin() + end, buffer.begin());
+        end -= pos;
+        pos = 0;
+        file.read(reinterpret_cast<char*>(buffer.data() + end), static_cast<std::streamsize>(buffer.size() - end));
+        end += static_cast<size_t>(file.gcount());
+        return file.gcount() > 0;
+    }
+};
+
+// one line per record: 0009  ADD           R0=0x05
+inline void renderTrace(std::ostream& out, const TraceRecord& r) {
+    std::ios::fmtflags saved = out.flags();
+    char fill = out.fill();
+    out << std::hex << std::setfill('0') << std::setw(4) << r.pc << "  " << std::setfill(' ') << std::left
+        << std::setw(14) << mnemonic(r.op) << std::right << std::setfill('0');
+    if (r.effects & TRACE_REG) {
+        out << " R" << (r.effects & TRACE_REGISTER) << "=0x" << std::setw(2) << static_cast<int>(r.value);
+    }
+    if (r.effects & TRACE_CARRY) {
+        out << " R2=" << static_cast<int>(r.data);
+    }
+    if (r.effects & TRACE_LOAD) {
+        out << " [0x" << std::setw(4) << r.addr << "]->0x" << std::setw(2) << static_cast<int>(r.data);
+    }
+    if (r.effects & TRACE_STORE) {
+        out << " [0x" << std::setw(4) << r.addr << "]<-0x" << std::setw(2) << static_cast<int>(r.data);
+    }
+    out.flags(saved);
+    out.fill(fill);
+}
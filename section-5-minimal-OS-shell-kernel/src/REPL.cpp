@@ -1,7 +1,8 @@
 #include "lexer.h"
 #include "parser.h"
-#include "cpu.h"
+#include "loader.h"
 #include "codegen.h"
+#include "optimize.h"
 #include <iostream>
 #include <sstream>
 #include <fstream>
@@ -54,7 +55,7 @@ void handleCommand(const std::string& command) {
         Lexer lexer(allCode);
         Parser parser(lexer);
         parser.parseProgram();
-        loadedProgram = parser.getIR();
+        loadedProgram = optimizeIR(parser.getIR());
         for(size_t i = 0; i < loadedProgram.size(); i++){
             if(loadedProgram[i].op == OpCode::LABEL){
                 labelMap[loadedProgram[i].result] = i;
@@ -100,7 +101,6 @@ void handleCommand(const std::string& command) {
         interpreterScript = nullptr;
     }else if(cmd == ".runfromCPU"){
         std::string filename; 
-        uint16_t addr = 0x2000;
         iss >> filename; // Extract filename from the stream
         if(filename.empty()) {
             std::cout << "Error: Please provide a filename after .runfromCPU" << std::endl;
@@ -116,13 +116,13 @@ void handleCommand(const std::string& command) {
         Codegen gen(filename);
         gen.writeToHex("output.bin", "output.hex");
         gen.writeToFile("output.asm");
-        std::vector<uint8_t> code = gen.getCode();
-        DEBUG_PRINT("Code size: " << code.size());
-        // load the code to the CPU
+        gen.writeToImage("output.img");
+        ProgramImage image = gen.getImage();
+        DEBUG_PRINT("Code size: " << image.code.size());
+        // load the code to the CPU, wherever the image says
         MinimalCPU cpu;
         DEBUG_PRINT("Loading code to CPU...");
-        DEBUG_PRINT("Code size: " << code.size());
-        cpu.loadProgram(code, addr);
+        loadImage(cpu, image);
         cpu.run();
     }
     else {
@@ -0,0 +1,52 @@
+#include "../include/recompiler.h"
+#include "../include/loader.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// .hex files hold whitespace separated hex bytes (as written by Codegen::writeToHex),
+// anything else is read as a flat binary image
+static std::vector<uint8_t> readImage(const std::string& filename) {
+    bool isHex = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".hex") == 0;
+    try {
+        if (isHex) {
+            return readHexImage(filename);
+        }
+        MappedFile file(filename);
+        return std::vector<uint8_t>(file.data(), file.data() + file.size());
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    std::string input;
+    std::string output = "output_aot.cpp";
+    unsigned long base = 0;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--base" && i + 1 < argc) {
+            base = std::stoul(argv[++i], nullptr, 0);
+        } else if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (input.empty()) {
+            input = arg;
+        } else {
+            input.clear();
+            break;
+        }
+    }
+    if (input.empty() || base > 0xFFFF) {
+        std::cerr << "Usage: " << argv[0] << " <image.bin|image.hex> [--base ADDR] [-o output.cpp]" << std::endl;
+        return 1;
+    }
+
+    Recompiler recompiler(readImage(input), static_cast<uint16_t>(base));
+    std::ofstream file(output);
+    file << recompiler.translate(input);
+    file.close();
+    std::cout << "Translated " << recompiler.instructionCount() << " instructions in "
+              << recompiler.blockCount() << " blocks to " << output << std::endl;
+    return 0;
+}
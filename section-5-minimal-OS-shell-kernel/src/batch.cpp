@@ -0,0 +1,109 @@
+#include "batch.h"
+#include "loader.h"
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+
+static std::string readFile(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open file: " << filename << std::endl;
+        exit(1);
+    }
+    std::ostringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+static const char* reasonName(MinimalCPU::StopReason reason) {
+    switch (reason) {
+        case MinimalCPU::StopReason::Halted: return "halted";
+        case MinimalCPU::StopReason::BudgetExhausted: return "budget exhausted";
+        case MinimalCPU::StopReason::WaitingForInput: return "waiting for input";
+        case MinimalCPU::StopReason::Fault: return "fault";
+    }
+    return "?";
+}
+
+int main(int argc, char* argv[]) {
+    unsigned threads = 0;
+    bool useJit = false;
+    bool echo = true;
+    bool skipWhitespace = true;
+    bool quiet = false;
+    unsigned long repeat = 1;
+    uint64_t maxInstructions = 0;
+    std::string filename;
+    std::vector<std::string> inputFiles;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = static_cast<unsigned>(std::stoul(argv[++i]));
+        } else if (arg == "--jit") {
+            useJit = true;
+        } else if (arg == "--max-instructions" && i + 1 < argc) {
+            maxInstructions = std::stoull(argv[++i], nullptr, 0);
+        } else if (arg == "--repeat" && i + 1 < argc) {
+            repeat = std::stoul(argv[++i]);
+        } else if (arg == "--no-echo") {
+            echo = false;
+        } else if (arg == "--keep-whitespace") {
+            skipWhitespace = false;
+        } else if (arg == "--quiet") {
+            quiet = true;
+        } else if (filename.empty()) {
+            filename = arg;
+        } else {
+            inputFiles.push_back(arg);
+        }
+    }
+    if (filename.empty() || inputFiles.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--threads N] [--jit] [--max-instructions N] [--repeat N]"
+                  << " [--no-echo] [--keep-whitespace] [--quiet] <hexfile> <input file>..." << std::endl;
+        return 1;
+    }
+
+    std::vector<uint8_t> program;
+    try {
+        program = readHexImage(filename);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    // one job per input file, the whole list repeated --repeat times
+    std::vector<std::string> texts;
+    for (const std::string& inputFile : inputFiles) {
+        texts.push_back(readFile(inputFile));
+    }
+    std::vector<std::string> inputs;
+    for (unsigned long r = 0; r < repeat; ++r) {
+        inputs.insert(inputs.end(), texts.begin(), texts.end());
+    }
+
+    BatchRunner runner(program);
+    runner.threads = threads;
+    runner.echoInput = echo;
+    runner.skipInputWhitespace = skipWhitespace;
+    if (useJit) {
+        runner.engine = MinimalCPU::Engine::Jit;
+    }
+    if (maxInstructions) {
+        runner.maxInstructions = maxInstructions;
+    }
+    std::vector<BatchRunner::Result> results = runner.run(inputs);
+
+    if (!quiet) {
+        for (size_t job = 0; job < results.size(); ++job) {
+            std::cout << "=== job " << job << ": " << inputFiles[job % inputFiles.size()]
+                      << " (" << reasonName(results[job].reason) << ") ===" << std::endl;
+            std::cout << results[job].output << std::endl;
+        }
+    }
+    const BatchRunner::Stats& stats = runner.stats();
+    std::cerr << stats.jobs << " jobs on " << stats.threads << " threads: " << stats.instructions
+              << " instructions in " << std::fixed << std::setprecision(3) << stats.seconds << " s, "
+              << std::setprecision(1) << stats.instructionsPerSecond() / 1e6 << " MIPS" << std::endl;
+    return 0;
+}
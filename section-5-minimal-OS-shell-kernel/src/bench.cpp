@@ -0,0 +1,324 @@
+#include "cpu.h"
+#include "codegen.h"
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define BENCH_FORK 1
+#endif
+
+// Engine benchmarks: build/bench [--filter name] [--engine interpreter|jit]
+//                                [--reps N] [--quick] [--programs dir] [--json file]
+//
+// Micro benchmarks run one instruction mix 10M times inside a counter nest,
+// macro benchmarks run the DSL programs in bench/programs. Each runs on the
+// interpreter and, where the host has one, the JIT, in a child process of its
+// own so peak RSS is that benchmark's. Results go to stdout and as JSON to
+// --json, build/bench.json by default, to compare runs over time.
+
+struct Workload {
+    std::string name;
+    std::string kind;  // "micro" or "macro"
+    std::vector<uint8_t> code;
+    uint16_t start = 0;
+    bool readsInput = false;
+};
+
+// fixed size, so a child can hand it back through a pipe
+struct Measurement {
+    bool ok = false;
+    uint64_t instructions = 0;
+    double seconds = 0;  // best of the reps
+    long peakRssKb = 0;
+};
+
+class NullOutput : public OutputDevice {
+public:
+    void write(const char*, size_t) override {}
+};
+
+// body run outer x 250 x 250 times; R5-R7 count down and R3 holds the 1 to subtract
+static Workload microLoop(const std::string& name, const std::vector<uint8_t>& body, uint8_t outer) {
+    Workload w;
+    w.name = name;
+    w.kind = "micro";
+    std::vector<uint8_t>& c = w.code;
+    c = {0x02, 0x03, 0x01, 0x02, 0x05, outer};
+    uint16_t middle = static_cast<uint16_t>(c.size());
+    c.insert(c.end(), {0x02, 0x06, 250});
+    uint16_t inner = static_cast<uint16_t>(c.size());
+    c.insert(c.end(), {0x02, 0x07, 250});
+    uint16_t top = static_cast<uint16_t>(c.size());
+    c.insert(c.end(), body.begin(), body.end());
+    // SUB Rn, R3; JNZ Rn, label for each counter, innermost first
+    const uint8_t counters[] = {7, 6, 5};
+    const uint16_t targets[] = {top, inner, middle};
+    for (int i = 0; i < 3; ++i) {
+        c.insert(c.end(), {0x06, counters[i], 0x03, 0x07, counters[i],
+                           static_cast<uint8_t>(targets[i] >> 8), static_cast<uint8_t>(targets[i])});
+    }
+    c.push_back(0x00);
+    return w;
+}
+
+static std::vector<Workload> microBenchmarks(uint8_t outer) {
+    std::vector<Workload> list;
+    // LOAD R0,[0x8000]; LOAD R1,[0x8001]; ADD R0,R1; STORE [0x8002],R0
+    list.push_back(microLoop("load_add_store", {0x01, 0x00, 0x80, 0x00, 0x01, 0x01, 0x80, 0x01, 0x05, 0x00, 0x01,
+                                                0x03, 0x80, 0x02, 0x00}, outer));
+    // LOAD_CONST R0,7; ADD R0,R1; SUB R0,R4
+    list.push_back(microLoop("alu", {0x02, 0x00, 0x07, 0x05, 0x00, 0x01, 0x06, 0x00, 0x04}, outer));
+    // R0:R1 = 0x9000, R2 = 5; LOAD_INDEXED; R2 = 6; STORE_INDEXED
+    list.push_back(microLoop("indexed", {0x02, 0x00, 0x90, 0x02, 0x01, 0x00, 0x02, 0x02, 0x05, 0x0A,
+                                         0x02, 0x02, 0x06, 0x0B}, outer));
+    // STORE_CONST [0x8000],1
+    list.push_back(microLoop("store_const", {0x04, 0x80, 0x00, 0x01}, outer));
+    // JZ R3 never taken, R3 is 1
+    list.push_back(microLoop("branch", {0x08, 0x03, 0x00, 0x00}, outer));
+    // STORE_CONST to the console port, written to nowhere
+    list.push_back(microLoop("output", {0x04, 0xFF, 0x00, 0x2E}, outer));
+    // IN R0 from a buffer with a byte for every pass
+    Workload input = microLoop("input", {0x09, 0x00}, outer);
+    input.readsInput = true;
+    list.push_back(input);
+    return list;
+}
+
+static bool compileProgram(const std::string& path, Workload& w) {
+    std::streambuf* saved = std::cout.rdbuf();
+    std::ios::fmtflags flags = std::cout.flags();
+    std::ostringstream noise;  // the code generator narrates to stdout
+    std::cout.rdbuf(noise.rdbuf());
+    bool compiled = true;
+    try {
+        Codegen codegen(path);
+        w.code = codegen.getCode();
+    } catch (const std::exception& e) {
+        std::cerr << path << ": " << e.what() << std::endl;
+        compiled = false;
+    }
+    std::cout.rdbuf(saved);
+    std::cout.flags(flags);
+    for (const char* output : {"output.asm", "output.bin", "output.hex"}) {
+        std::remove(output);  // written by every Codegen
+    }
+    if (!compiled) {
+        return false;
+    }
+    w.kind = "macro";  // jump targets are code offsets, so it loads at 0 like build/runner
+    return true;
+}
+
+static Measurement measure(const Workload& w, MinimalCPU::Engine engine, int reps, uint64_t limit) {
+    Measurement m;
+    NullOutput nowhere;
+    std::string bytes(w.readsInput ? 16u << 20 : 0, 'x');
+    MinimalCPU cpu;
+    cpu.engine = engine;
+    cpu.setOutput(&nowhere);
+    cpu.echoInput = false;
+    // a budgeted run counts the instructions, unbudgeted ones are timed
+    {
+        SpanInput input(bytes);
+        cpu.setInput(&input);
+        cpu.loadProgram(w.code, w.start);
+        if (cpu.run(limit) != MinimalCPU::StopReason::Halted) {
+            std::cerr << w.name << ": did not halt within " << limit << " instructions" << std::endl;
+            return m;
+        }
+        m.instructions = cpu.executed;
+    }
+    for (int rep = 0; rep < reps; ++rep) {
+        SpanInput input(bytes);
+        cpu.setInput(&input);
+        cpu.loadProgram(w.code, w.start);
+        auto begin = std::chrono::steady_clock::now();
+        cpu.run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+        if (rep == 0 || elapsed.count() < m.seconds) {
+            m.seconds = elapsed.count();
+        }
+    }
+    m.ok = m.seconds > 0;
+    return m;
+}
+
+#ifdef BENCH_FORK
+// measures in a fresh child, so ru_maxrss is this benchmark's alone
+static Measurement measureIsolated(const Workload& w, MinimalCPU::Engine engine, int reps, uint64_t limit) {
+    Measurement m;
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return measure(w, engine, reps, limit);
+    }
+    std::cout.flush();
+    pid_t child = fork();
+    if (child < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return measure(w, engine, reps, limit);
+    }
+    if (child == 0) {
+        close(fds[0]);
+        Measurement result = measure(w, engine, reps, limit);
+        ssize_t written = write(fds[1], &result, sizeof(result));
+        _exit(written == sizeof(result) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], &m, sizeof(m));
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) != child || got != sizeof(m) || !WIFEXITED(status)) {
+        return Measurement();
+    }
+#ifdef __APPLE__
+    m.peakRssKb = usage.ru_maxrss / 1024;  // bytes there, kilobytes on Linux
+#else
+    m.peakRssKb = usage.ru_maxrss;
+#endif
+    return m;
+}
+#else
+static Measurement measureIsolated(const Workload& w, MinimalCPU::Engine engine, int reps, uint64_t limit) {
+    return measure(w, engine, reps, limit);  // no per-benchmark RSS here
+}
+#endif
+
+struct Result {
+    const Workload* workload;
+    const char* engine;
+    Measurement m;
+    double mips() const { return m.instructions / m.seconds / 1e6; }
+    double nsPerInstruction() const { return m.seconds * 1e9 / m.instructions; }
+};
+
+static std::string jsonString(const std::string& text) {
+    std::string quoted = "\"";
+    for (char ch : text) {
+        if (ch == '"' || ch == '\\') {
+            quoted += '\\';
+        }
+        quoted += ch;
+    }
+    return quoted + "\"";
+}
+
+static bool writeJson(const std::string& path, const std::vector<Result>& results, int reps) {
+    std::ofstream out(path);
+    char stamp[32] = "";
+    std::time_t now = std::time(nullptr);
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+    out << "{\n"
+        << "  \"timestamp\": " << jsonString(stamp) << ",\n"
+        << "  \"dispatch\": " << jsonString(MinimalCPU::dispatchMode()) << ",\n"
+        << "  \"jit_available\": " << (MinimalCPU::jitAvailable() ? "true" : "false") << ",\n"
+        << "  \"reps\": " << reps << ",\n"
+        << "  \"results\": [";
+    out << std::setprecision(6);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": " << jsonString(r.workload->name)
+            << ", \"kind\": " << jsonString(r.workload->kind) << ", \"engine\": " << jsonString(r.engine)
+            << ", \"instructions\": " << r.m.instructions << ", \"seconds\": " << r.m.seconds
+            << ", \"mips\": " << r.mips() << ", \"ns_per_instruction\": " << r.nsPerInstruction()
+            << ", \"peak_rss_kb\": " << r.m.peakRssKb << "}";
+    }
+    out << "\n  ]\n}\n";
+    return static_cast<bool>(out);
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter;
+    std::string engineName;
+    std::string programs = "bench/programs";
+    std::string jsonFile = "build/bench.json";
+    int reps = 5;
+    bool quick = false;
+    bool usage = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--engine" && i + 1 < argc) {
+            engineName = argv[++i];
+        } else if (arg == "--reps" && i + 1 < argc) {
+            reps = std::stoi(argv[++i]);
+        } else if (arg == "--programs" && i + 1 < argc) {
+            programs = argv[++i];
+        } else if (arg == "--json" && i + 1 < argc) {
+            jsonFile = argv[++i];
+        } else if (arg == "--quick") {
+            quick = true;
+        } else {
+            usage = true;
+        }
+    }
+    if (usage || reps < 1 || (!engineName.empty() && engineName != "interpreter" && engineName != "jit")) {
+        std::cerr << "Usage: " << argv[0] << " [--filter name] [--engine interpreter|jit] [--reps N] [--quick]"
+                  << " [--programs dir] [--json file]" << std::endl;
+        return 1;
+    }
+
+    // --quick: a tenth of the iterations, for a smoke run
+    std::vector<Workload> workloads = microBenchmarks(quick ? 16 : 160);
+    for (const char* name : {"counter", "array_fill", "nested_loops"}) {
+        Workload w;
+        w.name = name;
+        if (!compileProgram(programs + "/" + name + ".dsl", w)) {
+            return 1;
+        }
+        workloads.push_back(w);
+    }
+
+    std::vector<std::pair<const char*, MinimalCPU::Engine>> engines;
+    if (engineName != "jit") {
+        engines.emplace_back("interpreter", MinimalCPU::Engine::Interpreter);
+    }
+    if (engineName != "interpreter" && MinimalCPU::jitAvailable()) {
+        engines.emplace_back("jit", MinimalCPU::Engine::Jit);
+    }
+
+    std::cout << "dispatch: " << MinimalCPU::dispatchMode() << ", jit: "
+              << (MinimalCPU::jitAvailable() ? "yes" : "no") << ", best of " << reps << std::endl;
+    std::cout << std::left << std::setw(16) << "benchmark" << std::setw(13) << "engine" << std::right
+              << std::setw(14) << "instructions" << std::setw(11) << "ms" << std::setw(10) << "MIPS"
+              << std::setw(10) << "ns/insn" << std::setw(12) << "peak RSS" << std::endl;
+    const uint64_t limit = 4000000000ULL;  // a workload that runs past this is broken
+    std::vector<Result> results;
+    bool failed = false;
+    for (const Workload& w : workloads) {
+        if (!filter.empty() && w.name.find(filter) == std::string::npos) {
+            continue;
+        }
+        for (const auto& engine : engines) {
+            Result r{&w, engine.first, measureIsolated(w, engine.second, reps, limit)};
+            if (!r.m.ok) {
+                std::cerr << w.name << " (" << engine.first << ") failed" << std::endl;
+                failed = true;
+                continue;
+            }
+            results.push_back(r);
+            std::cout << std::left << std::setw(16) << w.name << std::setw(13) << engine.first << std::right
+                      << std::setw(14) << r.m.instructions << std::fixed << std::setprecision(2)
+                      << std::setw(11) << r.m.seconds * 1e3 << std::setw(10) << std::setprecision(1) << r.mips()
+                      << std::setw(10) << std::setprecision(2) << r.nsPerInstruction() << std::setw(9)
+                      << r.m.peakRssKb << " kB" << std::endl;
+        }
+    }
+    if (!writeJson(jsonFile, results, reps)) {
+        std::cerr << "Could not write " << jsonFile << std::endl;
+        return 1;
+    }
+    std::cout << "results: " << jsonFile << std::endl;
+    return failed ? 1 : 0;
+}
@@ -2,20 +2,29 @@
 #include "../include/parser.h"
 #include "../include/lexer.h"
 #include "../include/token.h"
+#include "../include/disasm.h"
+#include "../include/peephole.h"
+#include "../include/optimize.h"
 #include <vector>
 #include <string>
 #include <iostream>
 #include <cctype>
 #include <iomanip>
 #include <stdexcept>
+#include <algorithm>
+
+#ifdef DEBUG
+#define DEBUG_PRINT(x) do { x; } while (0)
+#else
+#define DEBUG_PRINT(x) do {} while (0)
+#endif
 
 // Memory layout:
 // [0x2000 - 0x7FFF] : Code (<32KB for program)
-// [0x8000 - 0xFF00) : Data (~32KB for variables and temps)
+// [0x8000 - 0xFF00) : Data (~32KB for arrays, and variables and temps left without a register)
 // 0xFF00 : Output register
-
-// Initialize static member
-uint16_t Codegen::DATA_CURSOR = 0x0000;
+// Each compilation lays out its own data from 0x8000: first the slots the
+// register allocator gave the spilled values, then the arrays.
 
 Codegen::Codegen(std::string filename) : filename(filename) { 
     // parse the program and generate the code
@@ -31,7 +40,7 @@ Codegen::Codegen(std::string filename) : filename(filename) {
     Lexer lexer(program);
     Parser parser(lexer);
     parser.parseProgram();
-    ir = parser.getIR();
+    ir = optimizeIR(parser.getIR());
     
     // generate the code
     generateCode();
@@ -46,22 +55,160 @@ Codegen::Codegen(std::string filename) : filename(filename) {
 //     ARRAY_DECL, LOAD_INDEXED, STORE_INDEXED
 // };
 
+// the next size bytes of the data segment
+uint16_t Codegen::allocateData(const std::string& name, uint16_t size) {
+    if (size > DATA_END - DATA_START - dataCursor) {
+        throw std::runtime_error("Out of data memory for " + name);
+    }
+    uint16_t addr = DATA_START + dataCursor;
+    dataCursor += size;
+    return addr;
+}
+
 uint16_t Codegen::allocateVar(const std::string& name) {
     if (varMap.find(name) == varMap.end()) {
-        varMap[name] = DATA_START + DATA_CURSOR; 
-        DATA_CURSOR += 1;
+        varMap[name] = allocateData(name, 1);
     }
     return varMap[name];
 }
 
 uint16_t Codegen::allocateArrayViaVar(const std::string& name, uint16_t size) {
-    uint16_t base = allocateVar(name);  // get current base
-    DATA_CURSOR += (size - 1);          // manually skip full size
-    return base;
+    return allocateData(name, size);
+}
+
+// the register a value was given, or -1 if it lives in RAM
+int Codegen::registerOf(const std::string& name) {
+    auto it = regMap.find(name);
+    return it == regMap.end() ? RegisterAllocator::SPILLED : it->second;
+}
+
+void Codegen::emitLoad(uint8_t rd, uint16_t addr) {
+    code.push_back(0x01); // LOAD Rd, addr
+    code.push_back(rd);
+    code.push_back(addr >> 8);
+    code.push_back(addr & 0xFF);
+}
+
+void Codegen::emitLoadConst(uint8_t rd, uint8_t value) {
+    code.push_back(0x02); // LOAD_CONST Rd, const
+    code.push_back(rd);
+    code.push_back(value);
+}
+
+void Codegen::emitStore(uint16_t addr, uint8_t rs) {
+    code.push_back(0x03); // STORE addr, Rs
+    code.push_back(addr >> 8);
+    code.push_back(addr & 0xFF);
+    code.push_back(rs);
+}
+
+void Codegen::emitStoreConst(uint16_t addr, uint8_t value) {
+    code.push_back(0x04); // STORE addr, const
+    code.push_back(addr >> 8);
+    code.push_back(addr & 0xFF);
+    code.push_back(value);
+}
+
+void Codegen::emitAlu(uint8_t opcode, uint8_t rd, uint8_t rs) {
+    code.push_back(opcode); // ADD or SUB Rd, Rs
+    code.push_back(rd);
+    code.push_back(rs);
+}
+
+void Codegen::emitJump(uint8_t opcode, uint8_t r, const std::string& label) {
+    code.push_back(opcode); // JNZ or JZ R, label
+    code.push_back(r);
+    size_t patchPos = code.size();
+    code.push_back(0x00); // placeholder high byte
+    code.push_back(0x00); // placeholder low byte
+    pendingPatches.push_back(Patch{patchPos, label});
+}
+
+// there is no register move: clear Rd, then add Rs to it
+void Codegen::emitCopy(uint8_t rd, uint8_t rs) {
+    if (rd != rs) {
+        emitLoadConst(rd, 0);
+        emitAlu(0x05, rd, rs);
+    }
+}
+
+// the register holding a value, loading it into scratch if it lives in RAM
+uint8_t Codegen::useValue(const std::string& name, uint8_t scratch) {
+    int reg = registerOf(name);
+    if (reg != RegisterAllocator::SPILLED) {
+        return static_cast<uint8_t>(reg);
+    }
+    emitLoadValue(scratch, name);
+    return scratch;
+}
+
+// the register to compute a value into: its own, or scratch for defineValue() to store
+uint8_t Codegen::targetOf(const std::string& name, uint8_t scratch) {
+    int reg = registerOf(name);
+    return reg != RegisterAllocator::SPILLED ? static_cast<uint8_t>(reg) : scratch;
+}
+
+// puts an operand in a given register: a literal, a register value or one from RAM
+void Codegen::loadOperand(uint8_t rd, const std::string& name) {
+    int reg = registerOf(name);
+    if (isdigit(name[0])) {
+        emitLoadConst(rd, uint8_t(std::stoi(name)));
+    } else if (reg != RegisterAllocator::SPILLED) {
+        emitCopy(rd, static_cast<uint8_t>(reg));
+    } else {
+        emitLoadValue(rd, name);
+    }
+}
+
+// a value without a register into rd: from its RAM slot, or the constant it always is
+void Codegen::emitLoadValue(uint8_t rd, const std::string& name) {
+    auto constant = constMap.find(name);
+    if (constant != constMap.end()) {
+        emitLoadConst(rd, constant->second);
+    } else {
+        emitLoad(rd, allocateVar(name));
+    }
+}
+
+// a value computed into targetOf() is done; one living in RAM is stored there
+void Codegen::defineValue(const std::string& name, uint8_t reg) {
+    if (registerOf(name) == RegisterAllocator::SPILLED && constMap.find(name) == constMap.end()) {
+        emitStore(allocateVar(name), reg);
+    }
 }
 
 void Codegen::generateCode() {
-    code.push_back(0x02); code.push_back(0x03); code.push_back(1); // LOAD R3, 1 to use JNZ as GOTO.
+    // keep variables and temps in registers where they fit, see regalloc.h;
+    // R2 and R4 are scratch for the rest, R3 stays 1
+    RegisterAllocator allocator(ir);
+    // start over, so calling this again builds the same program again
+    code.clear();
+    data.clear();
+    asmCode.clear();
+    pendingPatches.clear();
+    labelMap.clear();
+    regMap.clear();
+    constMap.clear();
+    varMap.clear();
+    arrMap.clear();
+    dataCursor = 0;
+    for (const std::string& name : allocator.values()) {
+        int reg = allocator.registerOf(name);
+        if (reg != RegisterAllocator::SPILLED) {
+            regMap[name] = static_cast<uint8_t>(reg);
+        } else if (allocator.constantOf(name) >= 0) {
+            constMap[name] = static_cast<uint8_t>(allocator.constantOf(name));
+        } else {
+            varMap[name] = DATA_START + allocator.slotOf(name);  // shared with values never live at once
+        }
+    }
+    allocateData("spilled values", static_cast<uint16_t>(allocator.slotCount()));
+
+    emitLoadConst(R_ONE, 1); // LOAD R3, 1 to use JNZ as GOTO.
+    // values read before written start as zero, as their RAM would have
+    for (const std::string& name : allocator.entryValues()) {
+        emitLoadConst(static_cast<uint8_t>(registerOf(name)), 0);
+    }
     
     // use backpatching to patch the address of the label
     // we just need to scan the code once rather than twice because use the:
@@ -79,143 +226,95 @@ void Codegen::generateCode() {
                 // get the first character of the arg1, check if its a number
                 if (isdigit(instruction.arg1[0])) {
                     // if it's a number, then put it to the location 0xFF00
-                    code.push_back(0x04); // STORE addr, CONST
-                    code.push_back(0xFF); // addr high
-                    code.push_back(0x00); // addr low
-                    code.push_back(uint8_t(std::stoi(instruction.arg1))); // constant
+                    emitStoreConst(OUTPUT_ADDR, uint8_t(std::stoi(instruction.arg1)));
                 } else {
-                    // it's a variable, then load the variable to the output register
-                    // first load to the R0
-                    // LOAD_VAR R0, varAddress
-                    code.push_back(0x01); // LOAD Rd, addr
-                    code.push_back(0x00); // R0
-                    uint16_t varAddress = allocateVar(instruction.arg1);
-                    code.push_back(varAddress >> 8);
-                    code.push_back(varAddress & 0xFF);
-                    // then store to the 0xFF00
-                    code.push_back(0x03); // STORE addr, Rs
-                    code.push_back(0xFF); // addr high
-                    code.push_back(0x00); // addr low
-                    code.push_back(0x00); // R0
+                    // it's a variable, store its register to the output register
+                    emitStore(OUTPUT_ADDR, useValue(instruction.arg1, R_DATA));
                 }
                 break;
-            case OpCode::LOAD_VAR: {
-                // LOAD_VAR Rn, varAddress
-                code.push_back(0x01);
-                code.push_back(0x00); // R0
-                uint16_t varAddress = allocateVar(instruction.arg1);
-                code.push_back(varAddress >> 8);
-                code.push_back(varAddress & 0xFF);
-                break;
-            }
-            case OpCode::LOAD_CONST:{
-                // LOAD_CONST R0, const
-                code.push_back(0x02);
-                code.push_back(0x00); // R0
-                code.push_back(uint8_t(std::stoi(instruction.arg1))); // const
-                break;
-            }
+            case OpCode::LOAD_VAR:
             case OpCode::STORE: {
-                // STORE addr1, addr2 store the value of addr2 to addr1
-                uint16_t addr1 = allocateVar(instruction.result);
-                uint16_t addr2 = allocateVar(instruction.arg1);
-                // LOAD addr2, R0
-                code.push_back(0x01); // LOAD Rd, addr
-                code.push_back(0x00); // R0
-                code.push_back(addr2 >> 8); // addr high
-                code.push_back(addr2 & 0xFF); // addr low
-                // STORE addr1, R0
-                code.push_back(0x03); // STORE addr, Rs
-                code.push_back(addr1 >> 8); // addr high
-                code.push_back(addr1 & 0xFF); // addr low
-                code.push_back(0x00); // R0
+                // result = arg1, nothing to do when the allocator gave both the same register
+                int from = registerOf(instruction.arg1);
+                int to = registerOf(instruction.result);
+                if (to != RegisterAllocator::SPILLED) {
+                    if (from != RegisterAllocator::SPILLED) {
+                        emitCopy(static_cast<uint8_t>(to), static_cast<uint8_t>(from));
+                    } else {
+                        emitLoadValue(static_cast<uint8_t>(to), instruction.arg1);
+                    }
+                } else {
+                    emitStore(allocateVar(instruction.result), useValue(instruction.arg1, R_DATA));
+                }
                 break;
-                
             }
-            case OpCode::ADD: {
-                // LOAD R0, var1
-                code.push_back(0x01); 
-                code.push_back(0x00); // R0
-                uint16_t varAddress = allocateVar(instruction.arg1);
-                code.push_back(varAddress >> 8);
-                code.push_back(varAddress & 0xFF);
-                // LOAD R1, var2
-                code.push_back(0x01);
-                code.push_back(0x01); // R1
-                varAddress = allocateVar(instruction.arg2);
-                code.push_back(varAddress >> 8);
-                code.push_back(varAddress & 0xFF);
-                // ADD R0, R1
-                code.push_back(0x05); // ADD Rd, Rs
-                code.push_back(0x00); // Rd
-                code.push_back(0x01); // Rs
-                // STORE resultAddress, R0
-                code.push_back(0x03); // STORE addr, Rs
-                uint16_t resultAddress = allocateVar(instruction.result); // resultAddress
-                code.push_back(resultAddress >> 8);
-                code.push_back(resultAddress & 0xFF);
-                code.push_back(0x00); // R0
+            case OpCode::LOAD_CONST:
+            case OpCode::STORE_CONST: {
+                // LOAD_CONST Rd, const, or STORE addr, const for a value in RAM
+                if (instruction.result.empty()) {
+                    break;
+                }
+                uint8_t value = uint8_t(std::stoi(instruction.arg1));
+                int reg = registerOf(instruction.result);
+                if (reg != RegisterAllocator::SPILLED) {
+                    emitLoadConst(static_cast<uint8_t>(reg), value);
+                } else if (constMap.find(instruction.result) == constMap.end()) {
+                    emitStoreConst(allocateVar(instruction.result), value);
+                }
                 break;
             }
+            case OpCode::ADD:
             case OpCode::SUB: {
-                // LOAD R0, var1
-                code.push_back(0x01);
-                code.push_back(0x00); // R0
-                uint16_t varAddress = allocateVar(instruction.arg1);
-                code.push_back(varAddress >> 8);
-                code.push_back(varAddress & 0xFF);
-                // LOAD R1, var2
-                code.push_back(0x01);
-                code.push_back(0x01); // R1
-                varAddress = allocateVar(instruction.arg2);
-                code.push_back(varAddress >> 8);
-                code.push_back(varAddress & 0xFF);
-                // SUB R0, R1
-                code.push_back(0x06); // SUB Rd, Rs
-                code.push_back(0x00); // Rd
-                code.push_back(0x01); // Rs
-                // STORE resultAddress, R0
-                code.push_back(0x03); // STORE addr, Rs
-                uint16_t resultAddress = allocateVar(instruction.result); // resultAddress
-                code.push_back(resultAddress >> 8);
-                code.push_back(resultAddress & 0xFF);
-                code.push_back(0x00); // R0
-                break;
-            }
-            case OpCode::STORE_CONST: {
-                // STORE addr, const
-                uint16_t varAddress = allocateVar(instruction.result);
-                code.push_back(0x04); // STORE addr, const
-                code.push_back(varAddress >> 8); // addr high
-                code.push_back(varAddress & 0xFF); // addr low
-                code.push_back(uint8_t(std::stoi(instruction.arg1))); // const
+                // result = arg1 op arg2 with the two-address ADD/SUB Rd, Rs
+                uint8_t opcode = instruction.op == OpCode::ADD ? 0x05 : 0x06;
+                uint8_t rd = targetOf(instruction.result, R_DATA);
+                uint8_t rs = useValue(instruction.arg2, R_CARRY);
+                int left = registerOf(instruction.arg1);
+                if (left == rd) {
+                    // arg1 is already where the result goes
+                } else if (rd == rs) {
+                    // the result reuses arg2's register: add the other way
+                    // round, or subtract in scratch
+                    uint8_t ra = useValue(instruction.arg1, R_DATA);
+                    if (opcode == 0x05) {
+                        emitAlu(opcode, rd, ra);
+                    } else {
+                        emitCopy(R_DATA, ra);
+                        emitAlu(opcode, R_DATA, rs);
+                        emitCopy(rd, R_DATA);
+                    }
+                    defineValue(instruction.result, rd);
+                    break;
+                } else if (left != RegisterAllocator::SPILLED) {
+                    emitCopy(rd, static_cast<uint8_t>(left));
+                } else {
+                    emitLoadValue(rd, instruction.arg1);
+                }
+                emitAlu(opcode, rd, rs);
+                defineValue(instruction.result, rd);
                 break;
             }
             case OpCode::IFLEQ: {
-                // LOAD R0, var1
-                code.push_back(0x01);
-                code.push_back(0x00); // R0
-                uint16_t varAddress = allocateVar(instruction.arg1);
-                code.push_back(varAddress >> 8);
-                code.push_back(varAddress & 0xFF);
-                // LOAD R1, var2
-                code.push_back(0x01);
-                code.push_back(0x01); // R1
-                varAddress = allocateVar(instruction.arg2);
-                code.push_back(varAddress >> 8);
-                code.push_back(varAddress & 0xFF);
-                // SUB R1, R0
-                code.push_back(0x06); // SUB Rd, Rs
-                code.push_back(0x01); // Rd Var2
-                code.push_back(0x00); // Rs Var1
-                
-                // JZ R2, skip (jump to label if a <= b)
-                code.push_back(0x08);
-                code.push_back(0x02); // R2
-                size_t patchPos = code.size();
-                code.push_back(0x00);
-                code.push_back(0x00);
-                pendingPatches.push_back(Patch{patchPos, instruction.result});
+                // jump if arg1 <= arg2, that is if arg2 - arg1 does not borrow:
+                // SUB sets R2 to the borrow and JZ R2 jumps on none
+                uint8_t ra = useValue(instruction.arg1, R_DATA);
+                int right = registerOf(instruction.arg2);
+                if (isdigit(instruction.arg2[0])) {
+                    emitLoadConst(R_CARRY, uint8_t(std::stoi(instruction.arg2)));
+                    emitAlu(0x06, R_CARRY, ra);
+                } else if (right == RegisterAllocator::SPILLED) {
+                    emitLoadValue(R_CARRY, instruction.arg2);
+                    emitAlu(0x06, R_CARRY, ra);
+                } else if (right == ra) {
+                    // a value is always <= itself
+                    emitJump(0x07, R_ONE, instruction.result);
+                    break;
+                } else {
+                    // subtract in place and add back; ADD leaves R2 alone
+                    emitAlu(0x06, static_cast<uint8_t>(right), ra);
+                    emitAlu(0x05, static_cast<uint8_t>(right), ra);
+                }
+                emitJump(0x08, R_CARRY, instruction.result);
                 break;
             }
             case OpCode::LABEL: {
@@ -225,15 +324,9 @@ void Codegen::generateCode() {
                 labelMap[instruction.result] = currentCodeAddress;
                 break;
             }
-            case OpCode::GOTO: {
-                code.push_back(0x07);       // JNZ
-                code.push_back(0x03);       // R3 (always 1)
-                size_t patchPos = code.size();
-                code.push_back(0x00);       // placeholder high byte
-                code.push_back(0x00);       // placeholder low byte
-                pendingPatches.push_back(Patch{patchPos, instruction.result});
+            case OpCode::GOTO:
+                emitJump(0x07, R_ONE, instruction.result); // JNZ R3 (always 1)
                 break;
-            }
             case OpCode::ARRAY_DECL: {
                 // ARRAY_DECL arrayName, arraySize
                 // allocate the array
@@ -243,99 +336,75 @@ void Codegen::generateCode() {
                 break;
             }
             case OpCode::LOAD_INDEXED: {
-                uint16_t indexAddr = allocateVar(instruction.arg2);
-                uint16_t resAddr = allocateVar(instruction.result);
                 uint16_t baseAddr = arrMap[instruction.arg1].first;
-
-                // load index to R2
-                code.push_back(0x01);
-                code.push_back(0x02); // R2
-                code.push_back(indexAddr >> 8); // addr high
-                code.push_back(indexAddr & 0xFF); // addr low
-                // Load base address high byte to R0
-                code.push_back(0x02);
-                code.push_back(0x00); // R0
-                code.push_back(baseAddr >> 8); // addr high byte only
-                // Load base address low byte to R1  
-                code.push_back(0x02);
-                code.push_back(0x01); // R1
-                code.push_back(baseAddr & 0xFF); // addr low byte
-
+                // index to R2, before R0 and R1 take the base
+                loadOperand(R_CARRY, instruction.arg2);
+                emitLoadConst(0, baseAddr >> 8);   // R0, base high byte
+                emitLoadConst(1, baseAddr & 0xFF); // R1, base low byte
                 // LOAD_INDEXED uses: R0 (base), R2 (offset), R4 (dst)
                 code.push_back(0x0A);
-                // store result to resAddr
-                code.push_back(0x03);
-                code.push_back(resAddr >> 8); // addr high
-                code.push_back(resAddr & 0xFF); // addr low
-                code.push_back(0x04); // R4
+                int reg = registerOf(instruction.result);
+                if (reg != RegisterAllocator::SPILLED) {
+                    emitCopy(static_cast<uint8_t>(reg), R_DATA);
+                } else {
+                    emitStore(allocateVar(instruction.result), R_DATA);
+                }
                 break;
             }
             case OpCode::STORE_INDEXED: {
                 // STORE_INDEXED arrayName, index, value
-                // get the array address and size
-                uint16_t indexAddr = allocateVar(instruction.arg2);
-                uint16_t valAddr = allocateVar(instruction.result);
                 uint16_t baseAddr = arrMap[instruction.arg1].first;
-
-                // load value to R4
-                code.push_back(0x01);
-                code.push_back(0x04); // R4
-                code.push_back(valAddr >> 8); // addr high
-                code.push_back(valAddr & 0xFF); // addr low
-                // load index to R2
-                code.push_back(0x01);
-                code.push_back(0x02); // R2
-                code.push_back(indexAddr >> 8); // addr high
-                code.push_back(indexAddr & 0xFF); // addr low
-                // Load base address high byte to R0
-                code.push_back(0x02);
-                code.push_back(0x00); // R0
-                code.push_back(baseAddr >> 8); // addr high byte only
-                // Load base address low byte to R1  
-                code.push_back(0x02);
-                code.push_back(0x01); // R1
-                code.push_back(baseAddr & 0xFF); // addr low byte
+                // value to R4 and index to R2, before R0 and R1 take the base
+                loadOperand(R_DATA, instruction.result);
+                loadOperand(R_CARRY, instruction.arg2);
+                emitLoadConst(0, baseAddr >> 8);   // R0, base high byte
+                emitLoadConst(1, baseAddr & 0xFF); // R1, base low byte
                 // STORE_INDEXED uses: R0 (hi), R1 (lo), R2 (offset), R4 (src)
                 code.push_back(0x0B);
                 break;
             }
             case OpCode::IN: {
-                // IN addr
-                // can be parsed into instructions:
-                // in R0 // this will put the value from the input buffer to R0 and store it to 0xFF01
-                // STORE 0xFF01, addr // this will store the value of 0xFF01 to the addr
-
-                // get the Rd from the std input and store it to the Rd
+                // IN Rd puts the next input byte in the variable's register,
+                // or in R4 to store to its RAM
+                uint8_t rd = targetOf(instruction.arg1, R_DATA);
                 code.push_back(0x09); // IN Rd
-                code.push_back(0x00); // Rd
-                // STORE 0xFF01, addr
-                code.push_back(0x04); // STORE addr, R0
-                uint16_t addr = allocateVar(instruction.arg1);
-                code.push_back(addr >> 8);
-                code.push_back(addr & 0xFF);
-                code.push_back(0x00); // R0
+                code.push_back(rd);
+                defineValue(instruction.arg1, rd);
                 break;
             }
         }
     }
-    // backpatching
-    // std::cout << "Backpatching..." << std::endl;
-    // std::cout << "Label map:" << std::endl;
+    // backpatching; the debug trace prints addresses in hex and leaves
+    // std::cout as it found it
+#ifdef DEBUG
+    std::ios::fmtflags flags = std::cout.flags();
+    std::cout << "Label map:" << std::endl;
     for (const auto& label : labelMap) {
         std::cout << "  " << label.first << " -> 0x" << std::hex << label.second << std::endl;
     }
-    // std::cout << "Pending patches:" << std::endl;
+    std::cout << "Pending patches:" << std::endl;
+#endif
     for (const auto& patch : pendingPatches) {
-        std::cout << "  " << patch.labelName << " at position " << patch.addrPos << std::endl;
+        DEBUG_PRINT(std::cout << "  " << patch.labelName << " at position " << std::dec << patch.addrPos << std::endl);
         if (labelMap.find(patch.labelName) != labelMap.end()) {
             uint16_t labelAddress = labelMap[patch.labelName];
-            std::cout << "    Patching with address 0x" << std::hex << labelAddress << std::endl;
+            DEBUG_PRINT(std::cout << "    Patching with address 0x" << std::hex << labelAddress << std::endl);
             code[patch.addrPos] = labelAddress >> 8;
             code[patch.addrPos + 1] = labelAddress & 0xFF;
         } else {
-            std::cout << "    Label not found!" << std::endl;
+            std::cerr << "Label not found: " << patch.labelName << std::endl;
         }
     }
+#ifdef DEBUG
+    std::cout.flags(flags);
+#endif
+    // peephole pass over the patched code; the labels move with it
+    Peephole peephole(code);
+    peepholeStats = peephole.run();
+    code = peephole.code();
+    for (auto& label : labelMap) {
+        label.second = peephole.relocate(label.second);
+    }
     // write the code to the file
     writeToFile("output.asm");
     writeToHex("output.bin", "output.hex");
@@ -345,6 +414,20 @@ std::vector<uint8_t> Codegen::getCode() {
     return code;
 }
 
+ProgramImage Codegen::getImage() {
+    ProgramImage image;
+    image.load = 0;  // jump targets are offsets into code
+    image.entry = 0;
+    image.code = code;
+    image.dataAddress = DATA_START;
+    image.bssSize = dataCursor;  // spill slots and arrays, zero until the code sets them
+    return image;
+}
+
+void Codegen::writeToImage(std::string outputFile) {
+    writeProgramImage(outputFile, getImage());
+}
+
 void Codegen::writeToHex(std::string filenameBin, std::string filenameHex) {
     std::ofstream fileBin(filenameBin, std::ios::binary);
     std::ofstream fileHex(filenameHex);
@@ -364,6 +447,8 @@ void Codegen::writeToFile(std::string filename) {
     // Write the generated code in a readable format
     file << "; Generated assembly code" << std::endl;
     file << "; Code size: " << code.size() << " bytes" << std::endl;
+    file << "; Peephole: " << peepholeStats.instructionsBefore - peepholeStats.instructionsAfter << " instructions, "
+         << peepholeStats.bytesBefore - peepholeStats.bytesAfter << " bytes saved" << std::endl;
     file << std::endl;
     
     // Write IR instructions for debugging
@@ -397,259 +482,43 @@ void Codegen::writeToFile(std::string filename) {
         file << std::endl;
     }
     file << std::endl;
+
+    // Write where the allocator put each value, the rest are in RAM
+    std::vector<std::pair<std::string, uint8_t>> registers(regMap.begin(), regMap.end());
+    std::sort(registers.begin(), registers.end());
+    file << "; Registers:" << std::endl;
+    for (const auto& value : registers) {
+        file << ";   " << value.first << " R" << std::dec << int(value.second) << std::endl;
+    }
+    file << std::endl;
+
+    // and where the rest went; values that share a slot are never live at once
+    std::vector<std::pair<uint16_t, std::string>> slots;
+    for (const auto& value : varMap) {
+        slots.push_back({value.second, value.first});
+    }
+    std::vector<std::pair<std::string, uint8_t>> constants(constMap.begin(), constMap.end());
+    std::sort(constants.begin(), constants.end());
+    for (const auto& array : arrMap) {
+        slots.push_back({array.second.first, array.first + "[" + std::to_string(array.second.second) + "]"});
+    }
+    std::sort(slots.begin(), slots.end());
+    file << "; Data: " << std::dec << dataCursor << " bytes" << std::endl;
+    for (const auto& slot : slots) {
+        file << ";   " << slot.second << " " << std::hex << std::setw(4) << std::setfill('0') << slot.first << std::endl;
+    }
+    for (const auto& constant : constants) {
+        file << ";   " << constant.first << " = " << std::dec << int(constant.second) << ", no slot" << std::endl;
+    }
+    file << std::endl;
     
     // Write machine code
     file << "; Machine Code:" << std::endl;
     size_t i = 0;
     while (i < code.size()) {
         file << std::hex << std::setw(4) << std::setfill('0') << i << ": ";
-        
-        uint8_t opcode = code[i];
-        
-        // Add instruction name and opcode as comment
-        std::string instruction_name;
-        std::string opcode_desc;
-        
-        switch (opcode) {
-            case 0x00:
-                instruction_name = "HALT";
-                opcode_desc = "HALT";
-                break;
-            case 0x01:
-                instruction_name = "LOAD_VAR";
-                opcode_desc = "LOAD Rd, addr";
-                break;
-            case 0x02:
-                instruction_name = "LOAD_CONST";
-                opcode_desc = "LOAD Rd, const";
-                break;
-            case 0x03:
-                instruction_name = "STORE";
-                opcode_desc = "STORE addr, Rs";
-                break;
-            case 0x04:
-                instruction_name = "STORE_CONST";
-                opcode_desc = "STORE addr, const";
-                break;
-            case 0x05:
-                instruction_name = "ADD";
-                opcode_desc = "ADD Rd, Rs";
-                break;
-            case 0x06:
-                instruction_name = "SUB";
-                opcode_desc = "SUB Rd, Rs";
-                break;
-            case 0x07:
-                instruction_name = "JNZ";
-                opcode_desc = "JNZ Rd, addr";
-                break;
-            case 0x08:
-                instruction_name = "JZ";
-                opcode_desc = "JZ Rd, addr";
-                break;
-            case 0x09:
-                instruction_name = "IN";
-                opcode_desc = "IN Rd"; //not only load the value to the Rd, but also store it to 0xFF01
-                break;
-            case 0x0A:
-                instruction_name = "LOAD_INDEXED";
-                opcode_desc = "LOAD_INDEXED arrayName, index, result";
-                break;
-            case 0x0B:
-                instruction_name = "STORE_INDEXED";
-                opcode_desc = "STORE_INDEXED arrayName, index, value";
-                break;
-            default:
-                instruction_name = "UNKNOWN";
-                opcode_desc = "Unknown opcode";
-                break;
-        }
-        
-        // Print all bytes of the instruction
-        file << "0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(opcode);
-        
-        // Add operand information for multi-byte instructions
-        if (opcode == 0x01 || opcode == 0x02) { // LOAD_VAR, LOAD_CONST
-            if (i + 1 < code.size()) {
-                uint8_t rd = code[i + 1];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(rd);
-                if (opcode == 0x01 && i + 3 < code.size()) { // LOAD_VAR with address
-                    uint8_t addr_high = code[i + 2];
-                    uint8_t addr_low = code[i + 3];
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-                } else if (opcode == 0x02 && i + 2 < code.size()) { // LOAD_CONST with constant
-                    uint8_t const_val = code[i + 2];
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(const_val);
-                }
-            }
-        } else if (opcode == 0x03) { // STORE
-            if (i + 3 < code.size()) {
-                uint8_t addr_high = code[i + 1];
-                uint8_t addr_low = code[i + 2];
-                uint8_t rs = code[i + 3];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(rs);
-            }
-        } else if (opcode == 0x04) { // STORE_CONST
-            if (i + 3 < code.size()) {
-                uint8_t addr_high = code[i + 1];
-                uint8_t addr_low = code[i + 2];
-                uint8_t const_val = code[i + 3];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(const_val);
-            }
-        } else if (opcode == 0x05 || opcode == 0x06) { // ADD, SUB
-            if (i + 2 < code.size()) {
-                uint8_t rd = code[i + 1];
-                uint8_t rs = code[i + 2];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(rd);
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(rs);
-            }
-        } else if (opcode == 0x07) { // JNZ
-            if (i + 1 < code.size()) {
-                uint8_t rd = code[i + 1];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(rd);
-                if (i + 3 < code.size()) {
-                    uint8_t addr_high = code[i + 2];
-                    uint8_t addr_low = code[i + 3];
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-                }
-            }
-        } else if (opcode == 0x08) { // JZ
-            if (i + 1 < code.size()) {
-                uint8_t rd = code[i + 1];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(rd);
-                if (i + 3 < code.size()) {
-                    uint8_t addr_high = code[i + 2];
-                    uint8_t addr_low = code[i + 3];
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-                }
-            }
-        } else if (opcode == 0x09) { // IN
-            if (i + 1 < code.size()) {
-                uint8_t addr_high = code[i + 1];
-                uint8_t addr_low = code[i + 2];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-            }
-        } else if (opcode == 0x0A) { // LOAD_INDEXED
-            if (i + 1 < code.size()) {
-                uint8_t addr_high = code[i + 1];
-                uint8_t addr_low = code[i + 2];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-            }
-        } else if (opcode == 0x0B) { // STORE_INDEXED
-            if (i + 1 < code.size()) {
-                uint8_t addr_high = code[i + 1];
-                uint8_t addr_low = code[i + 2];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-            }
-        }
-        
-        file << " ; " << instruction_name << " (" << opcode_desc << ")";
-        
-        // Add operand details to the comment
-        if (opcode == 0x01 || opcode == 0x02) { // LOAD_VAR, LOAD_CONST
-            if (i + 1 < code.size()) {
-                uint8_t rd = code[i + 1];
-                file << " R" << static_cast<int>(rd);
-                if (opcode == 0x01 && i + 3 < code.size()) { // LOAD_VAR with address
-                    uint16_t addr = (code[i + 2] << 8) | code[i + 3];
-                    file << ", 0x" << std::hex << std::setw(4) << std::setfill('0') << addr;
-                } else if (opcode == 0x02 && i + 2 < code.size()) { // LOAD_CONST with constant
-                    uint8_t const_val = code[i + 2];
-                    file << ", " << static_cast<int>(const_val);
-                }
-            }
-        } else if (opcode == 0x03) { // STORE
-            if (i + 3 < code.size()) {
-                uint16_t addr = (code[i + 1] << 8) | code[i + 2];
-                uint8_t rs = code[i + 3];
-                file << " 0x" << std::hex << std::setw(4) << std::setfill('0') << addr << ", R" << static_cast<int>(rs);
-            }
-        } else if (opcode == 0x04) { // STORE_CONST
-            if (i + 3 < code.size()) {
-                uint16_t addr = (code[i + 1] << 8) | code[i + 2];
-                uint8_t const_val = code[i + 3];
-                file << " 0x" << std::hex << std::setw(4) << std::setfill('0') << addr << ", " << static_cast<int>(const_val);
-            }
-        } else if (opcode == 0x05 || opcode == 0x06) { // ADD, SUB
-            if (i + 2 < code.size()) {
-                uint8_t rd = code[i + 1];
-                uint8_t rs = code[i + 2];
-                file << " R" << static_cast<int>(rd) << ", R" << static_cast<int>(rs);
-            }
-        } else if (opcode == 0x07) { // JNZ
-            if (i + 1 < code.size()) {
-                uint8_t rd = code[i + 1];
-                file << " R" << static_cast<int>(rd);
-                if (i + 3 < code.size()) {
-                    uint16_t addr = (code[i + 2] << 8) | code[i + 3];
-                    file << ", 0x" << std::hex << std::setw(4) << std::setfill('0') << addr;
-                }
-            }
-        } else if (opcode == 0x08) { // JZ
-            if (i + 1 < code.size()) {
-                uint8_t rd = code[i + 1];
-                file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(rd);
-                if (i + 3 < code.size()) {
-                    uint8_t addr_high = code[i + 2];
-                    uint8_t addr_low = code[i + 3];
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_high);
-                    file << " 0x" << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(addr_low);
-                }
-            }
-        }   
-        
+        i += disassemble(file, code.data(), code.size(), i);
         file << std::endl;
-        
-        // Advance to next instruction based on opcode
-        switch (opcode) {
-            case 0x00: // HALT
-                i += 1;
-                break;
-            case 0x01: // LOAD_VAR
-                i += 4; // opcode + rd + addr_high + addr_low
-                break;
-            case 0x02: // LOAD_CONST
-                i += 3; // opcode + rd + const
-                break;
-            case 0x03: // STORE
-                i += 4; // opcode + addr_high + addr_low + rs
-                break;
-            case 0x04: // STORE_CONST
-                i += 4; // opcode + addr_high + addr_low + const
-                break;
-            case 0x05: // ADD
-            case 0x06: // SUB
-                i += 3; // opcode + rd + rs
-                break;
-            case 0x07: // JNZ
-                i += 4; // opcode + rd + addr_high + addr_low
-                break;
-            case 0x08: // JZ
-                i += 4; // opcode + rd + addr_high + addr_low
-                break;
-            case 0x09: // IN
-                i += 3; // opcode + addr_high + addr_low
-                break;
-            case 0x0A: // LOAD_INDEXED
-                i += 1; // opcode + R4
-                break;
-            case 0x0B: // STORE_INDEXED
-                i += 1; // opcode + R4
-                break;
-            default:
-                i += 1; // Unknown opcode, advance by 1
-                break;
-        }
     }
     
     file.close();
@@ -21,6 +21,10 @@ int main(int argc, char* argv[]) {
     Codegen codegen(inputFile);
     codegen.writeToHex("output.bin", "output.hex");
     codegen.writeToFile("output.asm");
+    codegen.writeToImage("output.img");
+    PeepholeStats peephole = codegen.getPeepholeStats();
+    std::cout << "peephole: saved " << peephole.instructionsBefore - peephole.instructionsAfter << " instructions, "
+              << peephole.bytesBefore - peephole.bytesAfter << " bytes" << std::endl;
     std::cout << "Compiler completed!" << std::endl;
     return 0;
 }
\ No newline at end of file
@@ -3,8 +3,34 @@
 #include <stdexcept>
 #include <limits>
 
-IRInterpreter::IRInterpreter() : nextAddress(0x1000) {
-    memory.resize(0x10000, 0); // 64KB memory
+int PagedMemory::read(uint16_t addr) const {
+    const std::shared_ptr<Page>& page = pages[addr / PAGE_SIZE];
+    return page ? (*page)[addr % PAGE_SIZE] : 0;
+}
+
+void PagedMemory::write(uint16_t addr, int value) {
+    std::shared_ptr<Page>& page = pages[addr / PAGE_SIZE];
+    if (!page) {
+        page = std::make_shared<Page>();
+    } else if (page.use_count() > 1) {
+        page = std::make_shared<Page>(*page);  // shared with a copy: take our own
+    }
+    (*page)[addr % PAGE_SIZE] = value;
+}
+
+size_t PagedMemory::allocatedPages() const {
+    size_t count = 0;
+    for (const std::shared_ptr<Page>& page : pages) {
+        count += page != nullptr;
+    }
+    return count;
+}
+
+IRInterpreter::IRInterpreter() : nextAddress(0x1000) {}
+
+// the low byte of value, what the CPU's 8-bit registers would hold
+static int toByte(int value) {
+    return value & 0xFF;
 }
 
 uint16_t IRInterpreter::allocate(const std::string& name) {
@@ -19,7 +45,7 @@ uint16_t IRInterpreter::allocate(const std::string& name) {
 int IRInterpreter::resolve(const std::string& operand) {
     // Check if it's a numeric constant
     if (operand[0] == '-' || std::isdigit(operand[0])) {
-        return std::stoi(operand);
+        return toByte(std::stoi(operand));
     }
     // Check if it's a variable
     if (variables.find(operand) != variables.end()) {
@@ -30,7 +56,7 @@ int IRInterpreter::resolve(const std::string& operand) {
 
 void IRInterpreter::executeSingleInstruction(const IR& inst){
     if (inst.op == OpCode::LOAD_CONST) {
-        variables[inst.result] = std::stoi(inst.arg1);
+        variables[inst.result] = toByte(std::stoi(inst.arg1));
     } else if (inst.op == OpCode::LOAD_VAR) {
         if (variables.find(inst.arg1) == variables.end()) {
             throw std::runtime_error("Undefined variable: " + inst.arg1);
@@ -43,7 +69,7 @@ void IRInterpreter::executeSingleInstruction(const IR& inst){
         if (variables.find(inst.arg2) == variables.end()) {
             throw std::runtime_error("Undefined variable: " + inst.arg2);
         }
-        variables[inst.result] = variables[inst.arg1] + variables[inst.arg2];
+        variables[inst.result] = toByte(variables[inst.arg1] + variables[inst.arg2]);
     } else if (inst.op == OpCode::SUB) {
         if (variables.find(inst.arg1) == variables.end()) {
             throw std::runtime_error("Undefined variable: " + inst.arg1);
@@ -52,7 +78,7 @@ void IRInterpreter::executeSingleInstruction(const IR& inst){
             throw std::runtime_error("Undefined variable: " + inst.arg2);
         }
         int original_val = variables[inst.arg1];
-        variables[inst.result] = variables[inst.arg1] - variables[inst.arg2];
+        variables[inst.result] = toByte(variables[inst.arg1] - variables[inst.arg2]);
         // Set carry flag: 1 if underflow occurred (arg1 < arg2), 0 otherwise
         variables["__carry__"] = (original_val < variables[inst.arg2]) ? 1 : 0;
     } else if (inst.op == OpCode::STORE) {
@@ -61,12 +87,13 @@ void IRInterpreter::executeSingleInstruction(const IR& inst){
         }
         variables[inst.result] = variables[inst.arg1];
     } else if (inst.op == OpCode::STORE_CONST) {
-        variables[inst.result] = std::stoi(inst.arg1);
+        variables[inst.result] = toByte(std::stoi(inst.arg1));
     } else if (inst.op == OpCode::OUT) {
-        if (variables.find(inst.arg1) == variables.end()) {
+        // a variable, or a literal where constant folding knew its value
+        if (!std::isdigit(inst.arg1[0]) && variables.find(inst.arg1) == variables.end()) {
             throw std::runtime_error("Undefined variable: " + inst.arg1);
         }
-        std::cout << variables[inst.arg1] << std::endl;
+        std::cout << resolve(inst.arg1) << std::endl;
     } else if (inst.op == OpCode::HALT) {
         return;
     } else if (inst.op == OpCode::LABEL) {
@@ -94,7 +121,7 @@ void IRInterpreter::executeSingleInstruction(const IR& inst){
         const auto& [baseAddr, size] = arrayMap[inst.arg1];
         int index = resolve(inst.arg2);
         if (index >= 0 && index < static_cast<int>(size)) {
-            variables[inst.result] = memory[baseAddr + index];
+            variables[inst.result] = memory.read(static_cast<uint16_t>(baseAddr + index));
         } else {
             throw std::runtime_error("Array index out of bounds: " + std::to_string(index));
         }
@@ -106,7 +133,7 @@ void IRInterpreter::executeSingleInstruction(const IR& inst){
         int index = resolve(inst.arg2);
         int value = resolve(inst.result);
         if (index >= 0 && index < static_cast<int>(size)) {
-            memory[baseAddr + index] = value;
+            memory.write(static_cast<uint16_t>(baseAddr + index), value);
         } else {
             throw std::runtime_error("Array index out of bounds: " + std::to_string(index));
         }
@@ -117,7 +144,7 @@ void IRInterpreter::executeSingleInstruction(const IR& inst){
 void IRInterpreter::execute(const std::vector<IR>& ir) {
     for (const auto& inst : ir) {
         if (inst.op == OpCode::LOAD_CONST) {
-            variables[inst.result] = std::stoi(inst.arg1);
+            variables[inst.result] = toByte(std::stoi(inst.arg1));
         } else if (inst.op == OpCode::LOAD_VAR) {
             if (variables.find(inst.arg1) == variables.end()) {
                 throw std::runtime_error("Undefined variable: " + inst.arg1);
@@ -130,7 +157,7 @@ void IRInterpreter::execute(const std::vector<IR>& ir) {
             if (variables.find(inst.arg2) == variables.end()) {
                 throw std::runtime_error("Undefined variable: " + inst.arg2);
             }
-            variables[inst.result] = variables[inst.arg1] + variables[inst.arg2];
+            variables[inst.result] = toByte(variables[inst.arg1] + variables[inst.arg2]);
         } else if (inst.op == OpCode::SUB) {
             if (variables.find(inst.arg1) == variables.end()) {
                 throw std::runtime_error("Undefined variable: " + inst.arg1);
@@ -139,7 +166,7 @@ void IRInterpreter::execute(const std::vector<IR>& ir) {
                 throw std::runtime_error("Undefined variable: " + inst.arg2);
             }
             int original_val = variables[inst.arg1];
-            variables[inst.result] = variables[inst.arg1] - variables[inst.arg2];
+            variables[inst.result] = toByte(variables[inst.arg1] - variables[inst.arg2]);
             // Set carry flag: 1 if underflow occurred (arg1 < arg2), 0 otherwise
             variables["__carry__"] = (original_val < variables[inst.arg2]) ? 1 : 0;
         } else if (inst.op == OpCode::STORE) {
@@ -148,12 +175,12 @@ void IRInterpreter::execute(const std::vector<IR>& ir) {
             }
             variables[inst.result] = variables[inst.arg1];
         } else if (inst.op == OpCode::STORE_CONST) {
-            variables[inst.result] = std::stoi(inst.arg1);
+            variables[inst.result] = toByte(std::stoi(inst.arg1));
         } else if (inst.op == OpCode::OUT) {
-            if (variables.find(inst.arg1) == variables.end()) {
+            if (!std::isdigit(inst.arg1[0]) && variables.find(inst.arg1) == variables.end()) {
                 throw std::runtime_error("Undefined variable: " + inst.arg1);
             }
-            std::cout << variables[inst.arg1] << std::endl;
+            std::cout << resolve(inst.arg1) << std::endl;
         } else if (inst.op == OpCode::HALT) {
             throw std::runtime_error("HALT instruction executed");
         } else if (inst.op == OpCode::IN) {
@@ -161,7 +188,7 @@ void IRInterpreter::execute(const std::vector<IR>& ir) {
             std::cout << "Enter a number: ";
             int value;
             std::cin >> value;
-            variables[inst.arg1] = value;
+            variables[inst.arg1] = toByte(value);
         } else if(inst.op == OpCode::ARRAY_DECL){
             std::string arrayName = inst.arg1;
             int size = std::stoi(inst.arg2);
@@ -178,7 +205,7 @@ void IRInterpreter::execute(const std::vector<IR>& ir) {
             const auto& [baseAddr, size] = arrayMap[inst.arg1];
             int index = resolve(inst.arg2);
             if (index >= 0 && index < static_cast<int>(size)) {
-                variables[inst.result] = memory[baseAddr + index];
+                variables[inst.result] = memory.read(static_cast<uint16_t>(baseAddr + index));
             } else {
                 throw std::runtime_error("Array index out of bounds: " + std::to_string(index));
             }
@@ -190,7 +217,7 @@ void IRInterpreter::execute(const std::vector<IR>& ir) {
             int index = resolve(inst.arg2);
             int value = resolve(inst.result);
             if (index >= 0 && index < static_cast<int>(size)) {
-                memory[baseAddr + index] = value;
+                memory.write(static_cast<uint16_t>(baseAddr + index), value);
             } else {
                 throw std::runtime_error("Array index out of bounds: " + std::to_string(index));
             }
@@ -206,7 +233,7 @@ void IRInterpreter::execute(const std::vector<IR>& ir, const std::unordered_map<
     while(pc < ir.size()){
         const auto& inst = ir[pc];
         if(inst.op == OpCode::GOTO){
-            pc = labelMap.at(inst.arg1);
+            pc = labelMap.at(inst.result);
         }else if(inst.op == OpCode::IFLEQ){
             int leftVal = variables[inst.arg1];
             int rightVal;
@@ -217,7 +244,7 @@ void IRInterpreter::execute(const std::vector<IR>& ir, const std::unordered_map<
                         throw std::runtime_error("Invalid constant: " + inst.arg2);
                     }
                 }
-                rightVal = std::stoi(inst.arg2);
+                rightVal = toByte(std::stoi(inst.arg2));
             }else if(variables.find(inst.arg2) != variables.end()){
                 rightVal = variables[inst.arg2];
             }else{
@@ -1,40 +1,126 @@
-#include "cpu.h"
+#include "loader.h"
 #include <fstream>
 #include <vector>
 #include <iostream>
 #include <iomanip>
 
-// Helper to read a hex file into a vector<uint8_t>
-std::vector<uint8_t> readHexFile(const std::string& filename) {
-    std::vector<uint8_t> program;
-    std::ifstream infile(filename);
-    if (!infile) {
-        std::cerr << "Failed to open file: " << filename << std::endl;
-        exit(1);
-    }
-    std::string byteStr;
-    while (infile >> byteStr) {
-        // Accepts 0xXX or XX format
-        uint8_t byte = 0;
-        if (byteStr.rfind("0x", 0) == 0 || byteStr.rfind("0X", 0) == 0) {
-            byte = static_cast<uint8_t>(std::stoul(byteStr, nullptr, 16));
+int main(int argc, char* argv[]) {
+    bool useJit = false;
+    bool echo = true;
+    bool skipWhitespace = true;
+    bool profiling = false;
+    uint64_t maxInstructions = MinimalCPU::UNLIMITED;
+    std::string inputFile;
+    std::string traceFile;
+    std::string recordFile;
+    std::string replayFile;
+    std::string filename;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--jit") {
+            useJit = true;
+        } else if (arg == "--input" && i + 1 < argc) {
+            inputFile = argv[++i];
+        } else if (arg == "--no-echo") {
+            echo = false;
+        } else if (arg == "--keep-whitespace") {
+            skipWhitespace = false;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            traceFile = argv[++i];
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+        } else if (arg == "--profile") {
+            profiling = true;
+        } else if (arg == "--max-instructions" && i + 1 < argc) {
+            maxInstructions = std::stoull(argv[++i], nullptr, 0);
+        } else if (filename.empty()) {
+            filename = arg;
         } else {
-            byte = static_cast<uint8_t>(std::stoul(byteStr, nullptr, 16));
+            filename.clear();
+            break;
         }
-        program.push_back(byte);
     }
-    return program;
-}
-
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Usage: " << argv[0] << " <hexfile>" << std::endl;
+    if (filename.empty() || (!recordFile.empty() && !replayFile.empty())) {
+        std::cerr << "Usage: " << argv[0] << " [--jit] [--input file] [--no-echo] [--keep-whitespace] [--max-instructions N] [--profile] [--trace file] [--record file | --replay file] <hexfile|image>" << std::endl;
         return 1;
     }
-    std::string filename = argv[1];
-    std::vector<uint8_t> program = readHexFile(filename);
     MinimalCPU cpu;
-    cpu.loadProgram(program);
-    cpu.run();
+    FdOutput stdoutDevice(STDOUT_FILENO);  // nothing else writes to stdout here
+    cpu.setOutput(&stdoutDevice);
+    std::unique_ptr<FileInput> scriptedInput;
+    if (!inputFile.empty()) {
+        try {
+            scriptedInput.reset(new FileInput(inputFile));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        cpu.setInput(scriptedInput.get());
+    }
+    cpu.echoInput = echo;
+    cpu.skipInputWhitespace = skipWhitespace;
+    if (useJit) {
+        cpu.engine = MinimalCPU::Engine::Jit;
+    }
+    // --profile: hot blocks and opcode mix on stderr once the program stops
+    Profile profile;
+    if (profiling) {
+        cpu.setProfile(&profile);
+    }
+    // --record: log what IN reads; --replay: read a log instead of the input
+    std::unique_ptr<InputRecorder> recorder;
+    std::unique_ptr<InputReplay> replay;
+    try {
+        if (!recordFile.empty()) {
+            recorder.reset(new InputRecorder(recordFile));
+            cpu.setInputRecorder(recorder.get());
+        }
+        if (!replayFile.empty()) {
+            replay.reset(new InputReplay(replayFile));
+            cpu.setInputReplay(replay.get());
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    // --trace: binary trace of every instruction, read it with build/tracedump
+    std::unique_ptr<TraceWriter> trace;
+    if (!traceFile.empty()) {
+        try {
+            trace.reset(new TraceWriter(traceFile));
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        cpu.setTrace(trace.get());
+    }
+    try {
+        loadProgramFile(cpu, filename);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    MinimalCPU::StopReason stop = cpu.run(maxInstructions);
+    if (profiling) {
+        profile.report(std::cerr, cpu.RAM);
+    }
+    if (replay && replay->divergences()) {
+        std::cerr << "Replay diverged: " << replay->divergences() << " of " << replay->events().size()
+                  << " inputs read at another instruction count, first at input " << replay->firstDivergence() << std::endl;
+    }
+    if (trace) {
+        trace->close();
+        if (!trace->ok()) {
+            std::cerr << "Failed writing trace file: " << traceFile << std::endl;
+            return 1;
+        }
+    }
+    if (stop == MinimalCPU::StopReason::BudgetExhausted) {
+        std::cerr << "Stopped after " << maxInstructions << " instructions at PC 0x"
+                  << std::hex << std::setw(4) << std::setfill('0') << cpu.PC << std::endl;
+        return 2;
+    }
     return 0;
 } 
\ No newline at end of file
@@ -0,0 +1,251 @@
+#include "../include/recompiler.h"
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+Recompiler::Recompiler(const std::vector<uint8_t>& image, uint16_t base)
+    : image(image), base(base), RAM(65536, 0), covered(65536, false) {
+    for (size_t i = 0; i < image.size() && base + i < RAM.size(); ++i) {
+        RAM[base + i] = image[i];
+    }
+    discover();
+}
+
+// only bytes of the image are known; anything else is RAM the program may still write
+bool Recompiler::inImage(uint16_t addr, uint8_t len) const {
+    return addr >= base && static_cast<size_t>(addr) + len <= base + image.size();
+}
+
+bool Recompiler::translatable(const DecodedInsn& d) const {
+    switch (d.op) {
+        case 0x01: case 0x02: case 0x07: case 0x08: case 0x09:
+            return d.rd < 8;
+        case 0x03:
+            return d.rs < 8;
+        case 0x05: case 0x06:
+            return d.rd < 8 && d.rs < 8;
+        case 0x00: case 0x04: case 0x0A: case 0x0B:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// follow every path from the entry point, collecting instructions and block leaders
+void Recompiler::discover() {
+    std::vector<uint16_t> worklist = {base};
+    std::set<uint16_t> targets = {base};
+    while (!worklist.empty()) {
+        uint16_t pc = worklist.back();
+        worklist.pop_back();
+        if (insns.count(pc) || !inImage(pc, 1)) {
+            continue;
+        }
+        DecodedInsn d;
+        decodeInstruction(RAM.data(), pc, d);
+        insns[pc] = d;
+        if (!inImage(pc, d.len) || !translatable(d)) {
+            continue;  // emitted as a hand-off to the interpreter
+        }
+        for (uint8_t i = 0; i < d.len; ++i) {
+            covered[static_cast<uint16_t>(pc + i)] = true;
+        }
+        if (d.op == 0x00) {
+            continue;
+        }
+        uint16_t next = static_cast<uint16_t>(pc + d.len);
+        worklist.push_back(next);
+        if (d.op == 0x07 || d.op == 0x08) {
+            targets.insert(d.addr);
+            targets.insert(next);
+            worklist.push_back(d.addr);
+        }
+    }
+    // fall-through into an instruction that is not emitted right after needs a goto
+    for (auto it = insns.begin(); it != insns.end(); ++it) {
+        uint16_t next = static_cast<uint16_t>(it->first + it->second.len);
+        auto following = std::next(it);
+        if (following == insns.end() || following->first != next) {
+            targets.insert(next);
+        }
+    }
+    for (uint16_t target : targets) {
+        if (insns.count(target)) {
+            leaders.insert(target);
+        }
+    }
+}
+
+static std::string hex4(uint16_t value) {
+    std::ostringstream out;
+    out << "0x" << std::hex << std::uppercase << std::setw(4) << std::setfill('0') << value;
+    return out.str();
+}
+
+static std::string label(uint16_t pc) {
+    return "L_" + hex4(pc).substr(2);
+}
+
+static std::string reg(uint8_t r) {
+    return "r" + std::to_string(r);
+}
+
+std::string Recompiler::jumpTo(uint16_t target) const {
+    if (leaders.count(target)) {
+        return "goto " + label(target) + ";";
+    }
+    return "AOT_EXIT(" + hex4(target) + ");";
+}
+
+std::string Recompiler::emitInstruction(uint16_t pc, const DecodedInsn& d) {
+    std::ostringstream out;
+    std::string exitHere = "AOT_EXIT(" + hex4(pc) + ");";
+    if (!inImage(pc, d.len) || !translatable(d)) {
+        out << "    " << exitHere << "  // left to the interpreter\n";
+        return out.str();
+    }
+    uint16_t next = static_cast<uint16_t>(pc + d.len);
+    switch (d.op) {
+        case 0x00: // HALT
+            out << "    AOT_HALT(" << hex4(next) << ");  // HALT\n";
+            break;
+        case 0x01: // LOAD Rd, addr
+            out << "    " << reg(d.rd) << " = RAM[" << hex4(d.addr) << "];  // LOAD R" << int(d.rd) << ", [" << hex4(d.addr) << "]\n";
+            break;
+        case 0x02: // LOAD Rd, CONST
+            out << "    " << reg(d.rd) << " = " << int(d.imm) << ";  // LOAD R" << int(d.rd) << ", " << int(d.imm) << "\n";
+            break;
+        case 0x03: // STORE addr, Rs
+        case 0x04: { // STORE_CONST addr, CONST
+            std::string value = d.op == 0x03 ? reg(d.rs) : std::to_string(d.imm);
+            std::string comment = d.op == 0x03 ? "STORE [" + hex4(d.addr) + "], R" + std::to_string(d.rs)
+                                               : "STORE_CONST [" + hex4(d.addr) + "], " + std::to_string(d.imm);
+            if (covered[d.addr]) {
+                out << "    " << exitHere << "  // " << comment << " modifies translated code\n";
+                return out.str();
+            }
+            out << "    cpu.storeByte(" << hex4(d.addr) << ", " << value << ");  // " << comment << "\n";
+            break;
+        }
+        case 0x05: // ADD Rd, Rs
+            out << "    " << reg(d.rd) << " += " << reg(d.rs) << ";  // ADD R" << int(d.rd) << ", R" << int(d.rs) << "\n";
+            break;
+        case 0x06: // SUB Rd, Rs, carry into R2 (Rs is read again after the write, like run())
+            out << "    { uint8_t o = " << reg(d.rd) << "; " << reg(d.rd) << " -= " << reg(d.rs) << "; r2 = o < " << reg(d.rs)
+                << "; }  // SUB R" << int(d.rd) << ", R" << int(d.rs) << "\n";
+            break;
+        case 0x07: // JNZ Rd, addr
+        case 0x08: // JZ Rd, addr
+            out << "    if (" << reg(d.rd) << (d.op == 0x07 ? " != 0" : " == 0") << ") " << jumpTo(d.addr)
+                << "  // " << (d.op == 0x07 ? "JNZ" : "JZ") << " R" << int(d.rd) << ", " << hex4(d.addr) << "\n";
+            break;
+        case 0x09: // IN Rd
+            out << "    {  // IN R" << int(d.rd) << "\n"
+                << "        char ch;\n"
+                << "        if (!cpu.readInput(ch)) AOT_WAIT(" << hex4(pc) << ");  // out of input, stop on this IN\n"
+                << "        if (cpu.echoInput) cpu.putOutput(ch);\n"
+                << "        " << reg(d.rd) << " = static_cast<uint8_t>(ch);\n"
+                << "    }\n";
+            break;
+        case 0x0A: // LOAD_INDEXED
+            out << "    r4 = RAM[static_cast<uint16_t>((r0 << 8 | r1) + r2)];  // LOAD_INDEXED\n";
+            break;
+        case 0x0B: // STORE_INDEXED
+            out << "    {  // STORE_INDEXED\n"
+                << "        uint16_t addr = static_cast<uint16_t>((r0 << 8 | r1) + r2);\n"
+                << "        if (isTranslated(addr)) " << exitHere << "\n"
+                << "        cpu.storeByte(addr, r4);\n"
+                << "    }\n";
+            break;
+    }
+    auto following = insns.upper_bound(pc);
+    if (d.op != 0x00 && (following == insns.end() || following->first != next)) {
+        out << "    " << jumpTo(next) << "\n";
+    }
+    return out.str();
+}
+
+std::string Recompiler::translate(const std::string& sourceName) {
+    std::ostringstream out;
+    out << "// Generated by aot from " << sourceName << ", do not edit.\n"
+        << "// " << insns.size() << " instructions in " << leaders.size() << " blocks, loaded at " << hex4(base) << ".\n"
+        << "// Build with -DAOT_NO_MAIN to link aotRun() into another program.\n"
+        << "#include \"cpu.h\"\n\n";
+
+    out << "static const uint16_t kBase = " << hex4(base) << ";\n";
+    out << "static const uint8_t kImage[] = {";
+    for (size_t i = 0; i < image.size(); ++i) {
+        out << (i % 16 == 0 ? "\n    " : " ") << "0x" << std::hex << std::setw(2) << std::setfill('0') << int(image[i]) << std::dec << ",";
+    }
+    out << "\n};\n\n";
+
+    // bitmap of translated bytes, for stores whose address is only known at run time
+    uint32_t lo = 0xFFFF, hi = 0;
+    for (uint32_t addr = 0; addr < covered.size(); ++addr) {
+        if (covered[addr]) {
+            lo = std::min(lo, addr);
+            hi = std::max(hi, addr);
+        }
+    }
+    uint32_t span = lo <= hi ? hi - lo + 1 : 0;
+    out << "static const uint16_t kCodeLo = " << hex4(span ? lo : 0) << ";\n";
+    out << "static const uint32_t kCodeSpan = " << span << ";\n";
+    out << "static const uint8_t kCodeBits[] = {";
+    for (uint32_t byte = 0; byte < (span + 7) / 8 || byte == 0; ++byte) {
+        uint8_t bits = 0;
+        for (uint32_t bit = 0; bit < 8; ++bit) {
+            uint32_t offset = byte * 8 + bit;
+            if (offset < span && covered[lo + offset]) {
+                bits |= 1 << bit;
+            }
+        }
+        out << (byte % 16 == 0 ? "\n    " : " ") << int(bits) << ",";
+    }
+    out << "\n};\n\n";
+    out << "static inline bool isTranslated(uint16_t addr) {\n"
+        << "    uint32_t offset = static_cast<uint16_t>(addr - kCodeLo);\n"
+        << "    return offset < kCodeSpan && (kCodeBits[offset >> 3] >> (offset & 7)) & 1;\n"
+        << "}\n\n";
+
+    out << "// runs cpu from cpu.PC until HALT or until IN runs out of input; cpu must have been loaded with kImage at kBase\n"
+        << "void aotRun(MinimalCPU& cpu) {\n"
+        << "    if (cpu.halted) {\n"
+        << "        return;\n"
+        << "    }\n"
+        << "    uint8_t* RAM = cpu.RAM;\n"
+        << "    uint8_t r0 = cpu.R[0], r1 = cpu.R[1], r2 = cpu.R[2], r3 = cpu.R[3];\n"
+        << "    uint8_t r4 = cpu.R[4], r5 = cpu.R[5], r6 = cpu.R[6], r7 = cpu.R[7];\n"
+        << "#define AOT_SAVE() \\\n"
+        << "    cpu.R[0] = r0; cpu.R[1] = r1; cpu.R[2] = r2; cpu.R[3] = r3; \\\n"
+        << "    cpu.R[4] = r4; cpu.R[5] = r5; cpu.R[6] = r6; cpu.R[7] = r7\n"
+        << "#define AOT_HALT(next) do { AOT_SAVE(); cpu.PC = next; cpu.halted = true; cpu.flushOutput(); return; } while (0)\n"
+        << "#define AOT_WAIT(at) do { AOT_SAVE(); cpu.PC = at; cpu.flushOutput(); return; } while (0)\n"
+        << "#define AOT_EXIT(at) do { AOT_SAVE(); cpu.PC = at; cpu.invalidateDecodeCache(); cpu.run(); return; } while (0)\n"
+        << "    switch (cpu.PC) {\n";
+    for (uint16_t leader : leaders) {
+        out << "        case " << hex4(leader) << ": goto " << label(leader) << ";\n";
+    }
+    out << "        default: AOT_EXIT(cpu.PC);\n"
+        << "    }\n";
+    for (const auto& entry : insns) {
+        if (leaders.count(entry.first)) {
+            out << label(entry.first) << ":\n";
+        }
+        out << emitInstruction(entry.first, entry.second);
+    }
+    out << "#undef AOT_SAVE\n"
+        << "#undef AOT_HALT\n"
+        << "#undef AOT_WAIT\n"
+        << "#undef AOT_EXIT\n"
+        << "}\n\n";
+
+    out << "#ifndef AOT_NO_MAIN\n"
+        << "int main() {\n"
+        << "    static MinimalCPU cpu;\n"
+        << "    cpu.loadProgram(std::vector<uint8_t>(kImage, kImage + sizeof(kImage)), kBase);\n"
+        << "    aotRun(cpu);\n"
+        << "    return 0;\n"
+        << "}\n"
+        << "#endif\n";
+    return out.str();
+}
@@ -0,0 +1,44 @@
+#include "trace.h"
+#include <iostream>
+#include <string>
+
+// prints a trace written by build/runner --trace, one instruction per line
+int main(int argc, char* argv[]) {
+    uint64_t skip = 0;
+    uint64_t count = UINT64_MAX;
+    std::string filename;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--skip" && i + 1 < argc) {
+            skip = std::stoull(argv[++i], nullptr, 0);
+        } else if (arg == "--count" && i + 1 < argc) {
+            count = std::stoull(argv[++i], nullptr, 0);
+        } else if (filename.empty()) {
+            filename = arg;
+        } else {
+            filename.clear();
+            break;
+        }
+    }
+    if (filename.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [--skip N] [--count N] <tracefile>" << std::endl;
+        return 1;
+    }
+    try {
+        TraceReader reader(filename);
+        TraceRecord record;
+        uint64_t index = 0;
+        while (count && reader.next(record)) {
+            if (index++ < skip) {
+                continue;
+            }
+            renderTrace(std::cout, record);
+            std::cout << '\n';
+            --count;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
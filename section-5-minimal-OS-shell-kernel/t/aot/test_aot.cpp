@@ -0,0 +1,242 @@
+#include "../../include/cpu.h"
+#include "../../include/recompiler.h"
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <stdexcept>
+#include <iterator>
+
+// Test framework utilities
+class TestFramework {
+private:
+    int testsRun = 0;
+    int testsPassed = 0;
+    int testsFailed = 0;
+
+public:
+    void runTest(const std::string& testName, bool (*testFunc)()) {
+        std::cout << "Running test: " << testName << std::endl;
+        testsRun++;
+
+        try {
+            bool result = testFunc();
+            if (result) {
+                std::cout << "✓ PASSED: " << testName << std::endl;
+                testsPassed++;
+            } else {
+                std::cout << "✗ FAILED: " << testName << std::endl;
+                testsFailed++;
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ FAILED: " << testName << " (Exception: " << e.what() << ")" << std::endl;
+            testsFailed++;
+        }
+        std::cout << std::endl;
+    }
+
+    void printSummary() {
+        std::cout << "=== Test Summary ===" << std::endl;
+        std::cout << "Tests run: " << testsRun << std::endl;
+        std::cout << "Passed: " << testsPassed << std::endl;
+        std::cout << "Failed: " << testsFailed << std::endl;
+        if (testsFailed == 0) {
+            std::cout << "🎉 All tests passed!" << std::endl;
+        }
+    }
+
+    int getFailedCount() const { return testsFailed; }
+};
+
+// Test helper functions
+void emit(std::vector<uint8_t>& code, std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+}
+
+std::string readFile(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+std::vector<uint8_t> readHexFile(const std::string& filename) {
+    std::vector<uint8_t> program;
+    std::ifstream file(filename);
+    std::string byteStr;
+    while (file >> byteStr) {
+        program.push_back(static_cast<uint8_t>(std::stoul(byteStr, nullptr, 16)));
+    }
+    return program;
+}
+
+// stdout of MinimalCPU::run() on the image
+std::string interpret(const std::vector<uint8_t>& image, uint16_t base) {
+    static MinimalCPU cpu;
+    std::stringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    std::streambuf* old_cerr = std::cerr.rdbuf(nullptr);
+    cpu.loadProgram(image, base);
+    cpu.run();
+    std::cout.rdbuf(old_cout);
+    std::cerr.rdbuf(old_cerr);
+    return output.str();
+}
+
+// translate, build with the host compiler and run; stdout of the recompiled program
+std::string recompileAndRun(const std::vector<uint8_t>& image, uint16_t base, const std::string& name) {
+    Recompiler recompiler(image, base);
+    std::ofstream(name + ".cpp") << recompiler.translate(name);
+    std::string build = std::string(AOT_CXX) + " -std=c++17 -O1 -I../../../include -o " + name + " " + name + ".cpp";
+    if (std::system(build.c_str()) != 0) {
+        throw std::runtime_error("could not compile " + name + ".cpp");
+    }
+    std::system(("./" + name + " < /dev/null > " + name + ".out 2> /dev/null").c_str());
+    return readFile(name + ".out");
+}
+
+bool matchesInterpreter(const std::vector<uint8_t>& image, uint16_t base, const std::string& name) {
+    std::string expected = interpret(image, base);
+    std::string actual = recompileAndRun(image, base, name);
+    if (expected != actual) {
+        std::cout << "  expected: \"" << expected << "\"" << std::endl;
+        std::cout << "  actual:   \"" << actual << "\"" << std::endl;
+    }
+    return expected == actual;
+}
+
+// Test functions
+bool test_discovers_loop() {
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 0});          // LOAD R0, 0
+    emit(code, {0x02, 0x01, 1});          // LOAD R1, 1
+    emit(code, {0x05, 0x00, 0x01});       // 6: ADD R0, R1
+    emit(code, {0x07, 0x00, 0x00, 6});    // JNZ R0, 6
+    emit(code, {0x00});                   // HALT
+    emit(code, {0xEE, 0xEE});             // data, never reached
+    Recompiler recompiler(code, 0);
+    std::string source = recompiler.translate("loop");
+    return recompiler.instructionCount() == 5
+        && source.find("goto L_0006;") != std::string::npos
+        && source.find("left to the interpreter") == std::string::npos;
+}
+
+bool test_hello_program() {
+    return matchesInterpreter(readHexFile("../../../programs/hello.hex"), 0, "hello");
+}
+
+bool test_counter_program() {
+    return matchesInterpreter(readHexFile("../../../programs/counter.hex"), 0, "counter");
+}
+
+bool test_calc_program() {
+    return matchesInterpreter(readHexFile("../../../programs/calc.hex"), 0, "calc");
+}
+
+bool test_self_modifying_falls_back() {
+    // prints 'A', patches its own immediate to 'B' and runs it again
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 'A'});              // 0x1000: LOAD R0, 'A'
+    emit(code, {0x03, 0xFF, 0x00, 0x00});       // STORE 0xFF00, R0
+    emit(code, {0x01, 0x01, 0x80, 0x00});       // LOAD R1, [0x8000]
+    emit(code, {0x07, 0x01, 0x10, 0x1B});       // JNZ R1, 0x101B
+    emit(code, {0x04, 0x80, 0x00, 1});          // STORE_CONST 0x8000, 1
+    emit(code, {0x04, 0x10, 0x02, 'B'});        // STORE_CONST 0x1002, 'B'
+    emit(code, {0x08, 0x02, 0x10, 0x00});       // JZ R2, 0x1000
+    emit(code, {0x00});                         // 0x101B: HALT
+    return matchesInterpreter(code, 0x1000, "selfmod");
+}
+
+bool test_unknown_opcode_falls_back() {
+    std::vector<uint8_t> code = {0x04, 0xFF, 0x00, 'x', 0xEE, 0x04, 0xFF, 0x00, 'y', 0x00};
+    return matchesInterpreter(code, 0, "unknown");
+}
+
+// logs every store it is passed
+class StoreLog : public IoDevice {
+public:
+    std::string text;
+    void store(uint16_t addr, uint8_t value) override {
+        text += std::to_string(addr) + "=" + std::to_string(value) + " ";
+    }
+};
+
+bool test_stores_reach_devices_and_snapshots() {
+    // stores into a mapped page, a plain page and the console, then HALT
+    std::vector<uint8_t> code;
+    emit(code, {0x04, 0xFE, 0x10, 7});          // STORE_CONST 0xFE10, 7
+    emit(code, {0x02, 0x05, 8});                // LOAD R5, 8
+    emit(code, {0x03, 0xFE, 0x11, 0x05});       // STORE 0xFE11, R5
+    emit(code, {0x02, 0x00, 0xFE});             // LOAD R0, 0xFE
+    emit(code, {0x02, 0x01, 0x12});             // LOAD R1, 0x12
+    emit(code, {0x02, 0x04, 9});                // LOAD R4, 9
+    emit(code, {0x0B});                         // STORE_INDEXED -> 0xFE12
+    emit(code, {0x04, 0x80, 0x00, 1});          // STORE_CONST 0x8000, 1
+    emit(code, {0x04, 0xFF, 0x00, 'k'});        // STORE_CONST 0xFF00, 'k'
+    emit(code, {0x00});
+
+    // the driver links the translation in place of its own main()
+    const char* driver =
+        "#define AOT_NO_MAIN\n"
+        "#include \"devices.cpp\"\n"
+        "struct StoreLog : IoDevice {\n"
+        "    void store(uint16_t addr, uint8_t value) override { std::cout << addr << '=' << int(value) << ' '; }\n"
+        "};\n"
+        "int main() {\n"
+        "    static MinimalCPU cpu;\n"
+        "    StoreLog log;\n"
+        "    cpu.mapIo(0xFE00, &log);\n"
+        "    cpu.loadProgram(std::vector<uint8_t>(kImage, kImage + sizeof(kImage)), kBase);\n"
+        "    cpu.snapshot();\n"
+        "    aotRun(cpu);\n"
+        "    std::cout << cpu.dirtyPages() << std::endl;\n"
+        "}\n";
+    Recompiler recompiler(code, 0);
+    std::ofstream("devices.cpp") << recompiler.translate("devices");
+    std::ofstream("devices_driver.cpp") << driver;
+    std::string build = std::string(AOT_CXX) + " -std=c++17 -O1 -I../../../include -o devices devices_driver.cpp";
+    if (std::system(build.c_str()) != 0) {
+        throw std::runtime_error("could not compile devices_driver.cpp");
+    }
+    std::system("./devices < /dev/null > devices.out 2> /dev/null");
+
+    static MinimalCPU cpu;
+    StoreLog log;
+    cpu.mapIo(0xFE00, &log);
+    std::stringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    cpu.loadProgram(code);
+    cpu.snapshot();
+    cpu.run();
+    std::cout.rdbuf(old_cout);
+    std::string expected = log.text + output.str() + std::to_string(cpu.dirtyPages()) + "\n";
+    std::string actual = readFile("devices.out");
+    if (expected != actual) {
+        std::cout << "  expected: \"" << expected << "\"" << std::endl;
+        std::cout << "  actual:   \"" << actual << "\"" << std::endl;
+    }
+    return expected == actual && expected == "65040=7 65041=8 65042=9 k3\n";
+}
+
+int main() {
+    TestFramework framework;
+
+    std::cout << "🧪 AOT Recompiler Test Suite" << std::endl;
+    std::cout << "============================" << std::endl << std::endl;
+
+    // Translation tests
+    std::cout << "🔍 Translation Tests:" << std::endl;
+    framework.runTest("Discovers Loop", test_discovers_loop);
+
+    // Recompiled programs must print exactly what the interpreter prints
+    std::cout << "⚙️  Equivalence Tests:" << std::endl;
+    framework.runTest("hello.hex", test_hello_program);
+    framework.runTest("counter.hex", test_counter_program);
+    framework.runTest("calc.hex", test_calc_program);
+    framework.runTest("Self-Modifying Code Falls Back", test_self_modifying_falls_back);
+    framework.runTest("Unknown Opcode Falls Back", test_unknown_opcode_falls_back);
+    framework.runTest("Stores Reach Devices And Snapshots", test_stores_reach_devices_and_snapshots);
+
+    framework.printSummary();
+    return framework.getFailedCount();
+}
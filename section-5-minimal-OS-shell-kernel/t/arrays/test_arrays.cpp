@@ -3,6 +3,9 @@
 #include "../../include/token.h"
 #include "../../include/interpreter.h"
 #include "../../include/codegen.h"
+#include "../../include/loader.h"
+#include "../../include/constfold.h"
+#include "../../include/optimize.h"
 #include <iostream>
 #include <string>
 #include <vector>
@@ -10,6 +13,7 @@
 #include <sstream>
 #include <functional>
 #include <fstream>
+#include <cstring>
 
 // Test framework utilities
 class TestFramework {
@@ -207,6 +211,148 @@ bool test_interpreter_array_variable_index() {
     return output.str() == "99\n";
 }
 
+bool test_fold_constants() {
+    // y wraps to 1, so the branch is never taken and out y prints a literal
+    std::string code = "let x = 3 + 4; let y = x + 250; if y <= 0 goto done; out y; done:";
+    Lexer lexer(code);
+    Parser parser(lexer);
+    parser.parseProgram();
+    ConstantFolder folder(parser.getIR());
+    std::vector<IR> ir = folder.run();
+
+    bool arithmetic = false;
+    for (const IR& inst : ir) {
+        arithmetic |= inst.op == OpCode::ADD || inst.op == OpCode::SUB || inst.op == OpCode::IFLEQ;
+    }
+    bool x = false, out = false;
+    for (const IR& inst : ir) {
+        x |= inst.op == OpCode::STORE_CONST && inst.arg1 == "7" && inst.result == "x";
+        out |= inst.op == OpCode::OUT && inst.arg1 == "1";
+    }
+
+    std::ostringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    IRInterpreter interpreter;
+    interpreter.execute(ir);
+    std::cout.rdbuf(old_cout);
+
+    return !arithmetic && x && out && folder.stats().branches == 1 && output.str() == "1\n";
+}
+
+bool test_fold_keeps_loops() {
+    // i changes around the loop, so neither it nor the test on it may fold;
+    // the array index and value are literals
+    std::string code = "let arr[2]; let i = 0; loop: i = i + 1; if i <= 2 goto loop; arr[1] = 5; out arr[1]; out i;";
+    Lexer lexer(code);
+    Parser parser(lexer);
+    parser.parseProgram();
+    std::vector<IR> ir = foldConstants(parser.getIR());
+
+    bool loop = false, literals = false;
+    for (const IR& inst : ir) {
+        loop |= inst.op == OpCode::IFLEQ && inst.arg1 == "i" && inst.arg2 == "2";
+        literals |= inst.op == OpCode::STORE_INDEXED && inst.arg2 == "1" && inst.result == "5";
+    }
+
+    std::unordered_map<std::string, size_t> labels;
+    for (size_t i = 0; i < ir.size(); ++i) {
+        if (ir[i].op == OpCode::LABEL) {
+            labels[ir[i].result] = i;
+        }
+    }
+    std::ostringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    IRInterpreter interpreter;
+    interpreter.execute(ir, labels);
+    std::cout.rdbuf(old_cout);
+
+    return loop && literals && output.str() == "5\n3\n";
+}
+
+bool test_ssa_form() {
+    // s and i meet at the loop header, so each gets a phi there; the header
+    // dominates the body and the exit, and out of SSA the program runs as before
+    std::string code = "let s = 0; let i = 0; loop: s = s + i; i = i + 1; if i <= 3 goto loop; out s;";
+    Lexer lexer(code);
+    Parser parser(lexer);
+    parser.parseProgram();
+    SSAForm ssa(parser.getIR());
+
+    const ControlFlowGraph& cfg = ssa.cfg;
+    int header = -1;
+    for (size_t b = 0; b < cfg.blocks.size(); ++b) {
+        for (const std::string& label : cfg.blocks[b].labels) {
+            header = label == "loop" ? static_cast<int>(b) : header;
+        }
+    }
+    bool versions = header >= 0 && cfg.blocks[header].phis.size() == 2;
+    for (size_t p = 0; versions && p < cfg.blocks[header].phis.size(); ++p) {
+        const Phi& phi = cfg.blocks[header].phis[p];
+        versions = ssa.variableOf(phi.result) == phi.var && phi.result != phi.var && phi.args.size() == 2;
+    }
+    bool dominance = header >= 0 && cfg.dominates(0, header);
+    for (size_t b = 0; dominance && b < cfg.blocks.size(); ++b) {
+        dominance = static_cast<int>(b) <= header || cfg.dominates(header, static_cast<int>(b));
+    }
+
+    std::vector<IR> ir = ssa.lower();
+    std::unordered_map<std::string, size_t> labels;
+    for (size_t i = 0; i < ir.size(); ++i) {
+        if (ir[i].op == OpCode::LABEL) {
+            labels[ir[i].result] = i;
+        }
+    }
+    std::ostringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    IRInterpreter interpreter;
+    interpreter.execute(ir, labels);
+    std::cout.rdbuf(old_cout);
+
+    return ssa.phiCount() == 2 && versions && dominance && output.str() == "6\n";
+}
+
+bool test_optimizer_passes() {
+    // n + n is computed twice, k * 2 never changes in the loop and d is
+    // never read: numbering, hoisting and dead code each have one to take
+    std::string code = "let n = 0; let k = 0; in n; in k; let d = 0; let i = 0; "
+                       "loop: let a = n + n; let b = n + n; let c = k + k; d = a + c; i = i + b; "
+                       "if i <= 20 goto loop; out i; out c;";
+    Lexer lexer(code);
+    Parser parser(lexer);
+    parser.parseProgram();
+    std::vector<IR> folded = foldConstants(parser.getIR());
+    OptimizeStats stats;
+    std::vector<IR> ir = optimizeIR(parser.getIR(), &stats);
+
+    // the loop is down to the add, the test and the jump back
+    size_t start = 0, end = 0;
+    for (size_t i = 0; i < ir.size(); ++i) {
+        start = ir[i].op == OpCode::LABEL && ir[i].result == "loop" ? i : start;
+        end = ir[i].op == OpCode::IFLEQ && ir[i].result == "loop" ? i : end;
+    }
+
+    auto run = [](const std::vector<IR>& program) {
+        std::unordered_map<std::string, size_t> labels;
+        for (size_t i = 0; i < program.size(); ++i) {
+            if (program[i].op == OpCode::LABEL) {
+                labels[program[i].result] = i;
+            }
+        }
+        std::istringstream input("3\n4\n");
+        std::streambuf* old_cin = std::cin.rdbuf(input.rdbuf());
+        std::ostringstream output;
+        std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+        IRInterpreter interpreter;
+        interpreter.execute(program, labels);
+        std::cout.rdbuf(old_cout);
+        std::cin.rdbuf(old_cin);
+        return output.str();
+    };
+
+    return stats.phis > 0 && stats.numbered > 0 && stats.hoisted > 0 && stats.removed > 0
+        && end > start && end - start <= 3 && run(ir) == run(folded) && run(ir) == "Enter a number: Enter a number: 24\n8\n";
+}
+
 bool test_codegen_array_basic() {
     // Create a test DSL file
     std::ofstream testFile("test_codegen_array.dsl");
@@ -239,6 +385,270 @@ bool test_codegen_array_basic() {
     }
 }
 
+bool test_codegen_image_runs() {
+    std::ofstream testFile("test_codegen_image.dsl");
+    testFile << "let a[2];\nlet x = 0;\nloop:\nx = x + 1;\na[1] = x;\nif x <= 4 goto loop;\nout a[0];\nout a[1];\nhalt;\n";
+    testFile.close();
+
+    try {
+        Codegen gen("test_codegen_image.dsl");
+        gen.writeToImage("test_codegen_image.img");
+        ProgramImage image = gen.getImage();
+        std::remove("test_codegen_image.dsl");
+        std::remove("output.asm");
+        std::remove("output.bin");
+        std::remove("output.hex");
+
+        MinimalCPU cpu;
+        std::memset(cpu.RAM + 0x8000, 0xAA, 16);  // the BSS has to be zeroed on load
+        std::string text;
+        StringOutput output(text);
+        cpu.setOutput(&output);
+        loadImage(cpu, "test_codegen_image.img");
+        std::remove("test_codegen_image.img");
+        cpu.run();
+        return image.load == 0 && image.entry == 0 && image.code == gen.getCode() && image.dataAddress == 0x8000
+            && image.bssSize > 0 && text == std::string("\x00\x05", 2);
+    } catch (const std::exception& e) {
+        std::remove("test_codegen_image.dsl");
+        return false;
+    }
+}
+
+// compiles program and runs it on input; the output and how many instructions it took
+static bool runCompiled(const std::string& program, std::string& text, uint64_t& executed,
+                        const std::string& input = "") {
+    std::ofstream testFile("test_codegen_regs.dsl");
+    testFile << program;
+    testFile.close();
+    try {
+        Codegen gen("test_codegen_regs.dsl");
+        std::remove("test_codegen_regs.dsl");
+        std::remove("output.asm");
+        std::remove("output.bin");
+        std::remove("output.hex");
+        MinimalCPU cpu;
+        StringOutput output(text);
+        cpu.setOutput(&output);
+        SpanInput bytes(input);
+        cpu.setInput(&bytes);
+        cpu.echoInput = false;
+        loadImage(cpu, gen.getImage());
+        bool halted = cpu.run(100000) == MinimalCPU::StopReason::Halted;
+        executed = cpu.executed;
+        return halted;
+    } catch (const std::exception& e) {
+        std::remove("test_codegen_regs.dsl");
+        return false;
+    }
+}
+
+bool test_codegen_copies_values() {
+    // rotates seven values twice; as the loop carries them, nothing can
+    // fold the copies away
+    std::string text;
+    uint64_t executed = 0;
+    std::string program = "let a = 65;\nlet b = 66;\nlet c = 67;\nlet d = 68;\nlet e = 69;\nlet f = 70;\n"
+                          "let g = 71;\nlet i = 0;\nloop:\n"
+                          "let t = a;\na = b;\nb = c;\nc = d;\nd = e;\ne = f;\nf = g;\ng = t;\n"
+                          "i = i + 1;\nif i <= 1 goto loop;\n"
+                          "out a;\nout b;\nout c;\nout d;\nout e;\nout f;\nout g;\nhalt;\n";
+    bool ok = runCompiled(program, text, executed);
+    return ok && text == "CDEFGAB";
+}
+
+bool test_codegen_ifleq_literal_bound() {
+    // x steps over the bound, which is a literal and so loaded as a constant,
+    // not from RAM
+    std::string text;
+    uint64_t executed = 0;
+    std::string program = "let lo = 76;\nlet hi = 72;\nlet x = 246;\nloop:\nx = x + 1;\n"
+                          "if x <= 249 goto low;\nout hi;\ngoto next;\nlow:\nout lo;\n"
+                          "next:\nif x <= 250 goto loop;\nhalt;\n";
+    bool ok = runCompiled(program, text, executed);
+    return ok && text == "LLLHH";
+}
+
+bool test_interpreter_wraps_like_cpu() {
+    // negative and overflowing results, folded or computed from input, and an
+    // IFLEQ on one of them: the REPL's path with and without optimizeIR and
+    // the compiled program all see the same bytes
+    std::string program = "in x;\nlet c = 3 - 5;\nout c;\nlet d = 200 + 100;\nout d;\n"
+                          "let y = x + 10;\nout y;\nlet r = 7;\nif c <= 1 goto small;\ngoto done;\n"
+                          "small:\nr = 9;\ndone:\nout r;\nif x <= 5 goto low;\nr = 11;\nlow:\nout r;\nhalt;\n";
+    auto interpret = [](const std::vector<IR>& ir) {
+        std::unordered_map<std::string, size_t> labels;
+        for (size_t i = 0; i < ir.size(); ++i) {
+            if (ir[i].op == OpCode::LABEL) {
+                labels[ir[i].result] = i;
+            }
+        }
+        std::istringstream input("250\n");
+        std::streambuf* old_cin = std::cin.rdbuf(input.rdbuf());
+        std::ostringstream output;
+        std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+        IRInterpreter interpreter;
+        interpreter.execute(ir, labels);
+        std::cout.rdbuf(old_cout);
+        std::cin.rdbuf(old_cin);
+        return output.str();
+    };
+    Lexer lexer(program);
+    Parser parser(lexer);
+    parser.parseProgram();
+    std::string expected = "Enter a number: 254\n44\n4\n7\n11\n";
+    bool interpreted = interpret(parser.getIR()) == expected && interpret(optimizeIR(parser.getIR())) == expected;
+
+    std::string text;
+    uint64_t executed = 0;
+    bool compiled = runCompiled(program, text, executed, "\xFA") && text == "\xFE\x2C\x04\x07\x0B";
+    return interpreted && compiled;
+}
+
+bool test_codegen_generates_again() {
+    // a second generateCode() starts from nothing instead of appending
+    std::ofstream testFile("test_codegen_again.dsl");
+    testFile << "let a = 0;\nloop:\na = a + 1;\nif a <= 9 goto loop;\nout a;\nhalt;\n";
+    testFile.close();
+    try {
+        Codegen gen("test_codegen_again.dsl");
+        std::vector<uint8_t> first = gen.getCode();
+        ProgramImage image = gen.getImage();
+        gen.generateCode();
+        std::remove("test_codegen_again.dsl");
+        std::remove("output.asm");
+        std::remove("output.bin");
+        std::remove("output.hex");
+        return !first.empty() && gen.getCode() == first && gen.getImage().bssSize == image.bssSize;
+    } catch (const std::exception& e) {
+        std::remove("test_codegen_again.dsl");
+        return false;
+    }
+}
+
+bool test_codegen_is_quiet() {
+    // compiling prints nothing and leaves std::cout's flags as they were
+    std::ofstream testFile("test_codegen_quiet.dsl");
+    testFile << "let a = 0;\nloop:\na = a + 1;\nif a <= 9 goto loop;\nout a;\nhalt;\n";
+    testFile.close();
+    std::ostringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    std::ios::fmtflags flags = std::cout.flags();
+    bool compiled = true;
+    try {
+        Codegen gen("test_codegen_quiet.dsl");
+    } catch (const std::exception& e) {
+        compiled = false;
+    }
+    bool same = std::cout.flags() == flags;
+    std::cout.rdbuf(old_cout);
+    std::remove("test_codegen_quiet.dsl");
+    std::remove("output.asm");
+    std::remove("output.bin");
+    std::remove("output.hex");
+    return compiled && same && output.str().empty();
+}
+
+bool test_codegen_loop_in_registers() {
+    // the counter and the temps of x + 1 stay in registers: per pass one
+    // LOAD_CONST and ADD for the increment, then LOAD_CONST, SUB and JZ
+    std::string text;
+    uint64_t executed = 0;
+    bool ok = runCompiled("let x = 0;\nloop:\nx = x + 1;\nif x <= 199 goto loop;\nout x;\nhalt;\n", text, executed);
+    return ok && text == std::string(1, '\xC8') && executed <= 200 * 5 + 10;
+}
+
+bool test_codegen_spills_to_ram() {
+    // eight values live at once are more than the registers, the rest go to RAM
+    std::string text;
+    uint64_t executed = 0;
+    std::string program = "let arr[4];\n";
+    for (int i = 0; i < 8; ++i) {
+        program += "let v" + std::to_string(i) + " = " + std::to_string(i + 1) + ";\n";
+    }
+    program += "i = 0;\nloop:\narr[i] = v0 + v1 + v2 + v3 - v4 + v5 + v6 - v7;\n"
+               "v0 = v0 + v7;\ni = i + 1;\nif i <= 3 goto loop;\n"
+               "out arr[0];\nout arr[3];\nout v0;\nout v7;\nout z;\nhalt;\n";
+    bool ok = runCompiled(program, text, executed);
+    // arr[i] is v0 + 9, with v0 going 1, 9, 17, 25, 33; z was never set
+    return ok && text == std::string("\x0A\x22\x21\x08\x00", 5);
+}
+
+bool test_codegen_shares_data_slots() {
+    // four rounds of eight different values live at once: each round spills
+    // some, and since no two rounds are live together they share the slots
+    std::string program = "let k = 0;\nloop:\nk = k + 1;\n";
+    for (int round = 0; round < 4; ++round) {
+        std::string r = "r" + std::to_string(round) + "v", sum;
+        for (int i = 0; i < 8; ++i) {
+            program += "let " + r + std::to_string(i) + " = k + " + std::to_string(8 * round + i + 1) + ";\n";
+            sum += (i ? " + " : "") + r + std::to_string(i);
+        }
+        program += "let s" + std::to_string(round) + " = " + sum + ";\nout s" + std::to_string(round) + ";\n";
+    }
+    program += "if k <= 1 goto loop;\nhalt;\n";
+    std::ofstream testFile("test_codegen_slots.dsl");
+    testFile << program;
+    testFile.close();
+
+    try {
+        // a second compilation in the same process lays out the same data
+        Codegen first("test_codegen_slots.dsl");
+        Codegen second("test_codegen_slots.dsl");
+        std::remove("test_codegen_slots.dsl");
+        std::remove("output.asm");
+        std::remove("output.bin");
+        std::remove("output.hex");
+        ProgramImage image = second.getImage();
+
+        MinimalCPU cpu;
+        std::string text;
+        StringOutput output(text);
+        cpu.setOutput(&output);
+        loadImage(cpu, image);
+        bool halted = cpu.run(100000) == MinimalCPU::StopReason::Halted;
+        // a round is 8k + 64 round + 36, for k = 1 and 2
+        return halted && text == "\x2C\x6C\xAC\xEC\x34\x74\xB4\xF4" && image.bssSize > 0 && image.bssSize <= 4
+            && image.bssSize == first.getImage().bssSize && image.code == first.getCode();
+    } catch (const std::exception& e) {
+        std::remove("test_codegen_slots.dsl");
+        return false;
+    }
+}
+
+bool test_peephole_patterns() {
+    std::vector<uint8_t> code = {
+        0x02, 0x03, 0x01,        //  0: LOAD_CONST R3, 1
+        0x03, 0x80, 0x00, 0x04,  //  3: STORE 0x8000, R4
+        0x01, 0x04, 0x80, 0x00,  //  7: LOAD R4, 0x8000      already in R4
+        0x07, 0x03, 0x00, 0x0F,  // 11: JNZ R3, 15           the next instruction
+        0x04, 0x80, 0x01, 0x09,  // 15: STORE_CONST 0x8001, 9
+        0x01, 0x05, 0x80, 0x01,  // 19: LOAD R5, 0x8001      becomes LOAD_CONST R5, 9
+        0x07, 0x03, 0x00, 0x03,  // 23: JNZ R3, 3            R3 is 1 for good
+        0x00,                    // 27: HALT                 never reached
+    };
+    Peephole peephole(code);
+    PeepholeStats stats = peephole.run();
+    std::vector<uint8_t> expected = {
+        0x02, 0x03, 0x01,
+        0x03, 0x80, 0x00, 0x04,
+        0x04, 0x80, 0x01, 0x09,
+        0x02, 0x05, 0x09,
+        0x07, 0x03, 0x00, 0x03,
+    };
+    return peephole.code() == expected && stats.instructionsBefore == 8 && stats.instructionsAfter == 5
+        && stats.bytesBefore == 28 && stats.bytesAfter == 18 && peephole.relocate(15) == 7
+        && peephole.relocate(27) == 18 && peephole.relocate(28) == 18;
+}
+
+bool test_codegen_peephole_runs() {
+    // the GOTO's jump becomes the only way to reach next, the dead x = 2 goes
+    std::string text;
+    uint64_t executed = 0;
+    bool ok = runCompiled("let x = 1;\ngoto next;\nx = 2;\nnext:\nout x;\ngoto done;\ndone:\nhalt;\n", text, executed);
+    return ok && text == std::string(1, '\x01') && executed <= 4;
+}
+
 bool test_codegen_no_spurious_halt() {
     // Create a test DSL file
     std::ofstream testFile("test_codegen_halt.dsl");
@@ -314,6 +724,17 @@ bool test_lexer_array_declaration() {
            tok6.type == TokenType::SEMICOLON;
 }
 
+bool test_paged_memory_copy_on_write() {
+    PagedMemory memory;
+    bool zero = memory.read(0x1234) == 0 && memory.allocatedPages() == 0;
+    memory.write(0x1000, 7);
+    memory.write(0x10FF, 8);
+    bool onePage = memory.allocatedPages() == 1 && memory.read(0x1000) == 7 && memory.read(0x10FF) == 8;
+    PagedMemory copy = memory;
+    copy.write(0x1000, 9);
+    return zero && onePage && memory.read(0x1000) == 7 && copy.read(0x1000) == 9 && copy.read(0x10FF) == 8;
+}
+
 // Error handling tests
 bool test_array_bounds_error() {
     std::string code = "let arr[2]; arr[5] = 10; out arr[5];";
@@ -358,11 +779,27 @@ int main() {
     framework.runTest("Multiple Array Elements", test_interpreter_array_multiple_elements);
     framework.runTest("Array Arithmetic", test_interpreter_array_arithmetic);
     framework.runTest("Variable Index Access", test_interpreter_array_variable_index);
+    framework.runTest("Paged Memory Copy-On-Write", test_paged_memory_copy_on_write);
+    framework.runTest("Constant Folding", test_fold_constants);
+    framework.runTest("Folding Keeps Loops", test_fold_keeps_loops);
+    framework.runTest("SSA Form", test_ssa_form);
+    framework.runTest("Optimizer Passes", test_optimizer_passes);
+    framework.runTest("Interpreter Wraps Like The CPU", test_interpreter_wraps_like_cpu);
     
     // Codegen tests
     std::cout << "🔧 Code Generation Tests:" << std::endl;
     framework.runTest("Basic Array Codegen", test_codegen_array_basic);
     framework.runTest("No Spurious HALT Instructions", test_codegen_no_spurious_halt);
+    framework.runTest("Codegen Image Runs", test_codegen_image_runs);
+    framework.runTest("Codegen Copies Values", test_codegen_copies_values);
+    framework.runTest("Codegen IFLEQ Literal Bound", test_codegen_ifleq_literal_bound);
+    framework.runTest("Codegen Generates Again", test_codegen_generates_again);
+    framework.runTest("Codegen Is Quiet", test_codegen_is_quiet);
+    framework.runTest("Codegen Keeps Loops In Registers", test_codegen_loop_in_registers);
+    framework.runTest("Codegen Spills To RAM", test_codegen_spills_to_ram);
+    framework.runTest("Codegen Shares Data Slots", test_codegen_shares_data_slots);
+    framework.runTest("Peephole Patterns", test_peephole_patterns);
+    framework.runTest("Codegen Peephole Runs", test_codegen_peephole_runs);
     
     // Error handling tests
     std::cout << "❌ Error Handling Tests:" << std::endl;
@@ -0,0 +1,201 @@
+#include "../../include/batch.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+
+// Test framework utilities
+class TestFramework {
+private:
+    int testsRun = 0;
+    int testsPassed = 0;
+    int testsFailed = 0;
+
+public:
+    void runTest(const std::string& testName, bool (*testFunc)()) {
+        std::cout << "Running test: " << testName << std::endl;
+        testsRun++;
+
+        try {
+            bool result = testFunc();
+            if (result) {
+                std::cout << "✓ PASSED: " << testName << std::endl;
+                testsPassed++;
+            } else {
+                std::cout << "✗ FAILED: " << testName << std::endl;
+                testsFailed++;
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ FAILED: " << testName << " (Exception: " << e.what() << ")" << std::endl;
+            testsFailed++;
+        }
+        std::cout << std::endl;
+    }
+
+    void printSummary() {
+        std::cout << "=== Test Summary ===" << std::endl;
+        std::cout << "Tests run: " << testsRun << std::endl;
+        std::cout << "Passed: " << testsPassed << std::endl;
+        std::cout << "Failed: " << testsFailed << std::endl;
+        if (testsFailed == 0) {
+            std::cout << "🎉 All tests passed!" << std::endl;
+        }
+    }
+
+    int getFailedCount() const { return testsFailed; }
+};
+
+// Test helper functions
+void emit(std::vector<uint8_t>& code, std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+}
+
+// reads one byte and prints it; prints it again and halts, except for 'L', which loops forever
+std::vector<uint8_t> echoOrLoopProgram() {
+    std::vector<uint8_t> code;
+    emit(code, {0x09, 0x00});             // 0: IN R0
+    emit(code, {0x03, 0xFF, 0x00, 0x00}); // 2: STORE 0xFF00, R0
+    emit(code, {0x02, 0x01, 'L'});        // 6: LOAD R1, 'L'
+    emit(code, {0x06, 0x01, 0x00});       // 9: SUB R1, R0
+    emit(code, {0x08, 0x01, 0x00, 12});   // 12: JZ R1, 12
+    emit(code, {0x03, 0xFF, 0x00, 0x00}); // 16: STORE 0xFF00, R0
+    emit(code, {0x00});                   // 20: HALT
+    return code;
+}
+
+// adds up its input bytes up to a '.' in 0x8000 and prints the low byte of the sum
+std::vector<uint8_t> sumProgram() {
+    std::vector<uint8_t> code;
+    emit(code, {0x09, 0x00});             // 0: IN R0
+    emit(code, {0x02, 0x01, '.'});        // 2: LOAD R1, '.'
+    emit(code, {0x06, 0x01, 0x00});       // 5: SUB R1, R0
+    emit(code, {0x08, 0x01, 0x00, 30});   // 8: JZ R1, done
+    emit(code, {0x01, 0x01, 0x80, 0x00}); // 12: LOAD R1, [0x8000]
+    emit(code, {0x05, 0x01, 0x00});       // 16: ADD R1, R0
+    emit(code, {0x03, 0x80, 0x00, 0x01}); // 19: STORE 0x8000, R1
+    emit(code, {0x02, 0x03, 1});          // 23: LOAD R3, 1
+    emit(code, {0x07, 0x03, 0x00, 0});    // 26: JNZ R3, 0
+    emit(code, {0x01, 0x01, 0x80, 0x00}); // 30: done: LOAD R1, [0x8000]
+    emit(code, {0x03, 0xFF, 0x00, 0x01}); // 34: STORE 0xFF00, R1
+    emit(code, {0x00});                   // 38: HALT
+    return code;
+}
+
+// inputs of very different lengths, so the workers finish their own ranges at different times
+std::vector<std::string> unevenInputs(size_t count) {
+    std::vector<std::string> inputs;
+    for (size_t i = 0; i < count; ++i) {
+        size_t length = i % 7 == 0 ? 2000 : i % 13;
+        inputs.push_back(std::string(length, static_cast<char>('a' + i % 26)) + ".");
+    }
+    return inputs;
+}
+
+// one MinimalCPU per input, the way a single-threaded caller would do it
+BatchRunner::Result runAlone(const std::vector<uint8_t>& program, const std::string& text, uint64_t budget) {
+    BatchRunner::Result result;
+    MinimalCPU cpu;
+    StringOutput output(result.output);
+    SpanInput input(text);
+    cpu.echoInput = false;
+    cpu.setOutput(&output);
+    cpu.setInput(&input);
+    cpu.loadProgram(program);
+    result.reason = cpu.run(budget);
+    result.instructions = cpu.executed;
+    return result;
+}
+
+bool sameResults(const std::vector<BatchRunner::Result>& a, const std::vector<BatchRunner::Result>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (a[i].output != b[i].output || a[i].reason != b[i].reason || a[i].instructions != b[i].instructions) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Test functions
+bool test_results_match_single_cpu() {
+    std::vector<std::string> inputs = unevenInputs(300);
+    std::vector<BatchRunner::Result> expected;
+    for (const std::string& text : inputs) {
+        expected.push_back(runAlone(sumProgram(), text, 1ull << 32));
+    }
+    BatchRunner runner(sumProgram());
+    runner.threads = 4;
+    runner.echoInput = false;
+    return sameResults(runner.run(inputs), expected) && expected[0].output == std::string(1, static_cast<char>(2000 * 'a'));
+}
+
+bool test_stop_reasons_per_job() {
+    BatchRunner runner(echoOrLoopProgram());
+    runner.threads = 3;
+    runner.echoInput = false;
+    runner.maxInstructions = 10000;
+    std::vector<std::string> inputs = {"a", "L", "", "b"};
+    std::vector<BatchRunner::Result> results = runner.run(inputs);
+    return results[0].reason == MinimalCPU::StopReason::Halted && results[0].output == "aa" && results[0].instructions == 7
+        && results[1].reason == MinimalCPU::StopReason::BudgetExhausted && results[1].output == "L"
+        && results[1].instructions == 10000
+        && results[2].reason == MinimalCPU::StopReason::WaitingForInput && results[2].output.empty()
+        && results[3].reason == MinimalCPU::StopReason::Halted && results[3].output == "bb";
+}
+
+bool test_stats_add_up() {
+    std::vector<std::string> inputs = unevenInputs(100);
+    BatchRunner runner(sumProgram());
+    runner.threads = 8;
+    runner.echoInput = false;
+    std::vector<BatchRunner::Result> results = runner.run(inputs);
+    uint64_t total = 0;
+    for (const BatchRunner::Result& result : results) {
+        total += result.instructions;
+    }
+    const BatchRunner::Stats& stats = runner.stats();
+    return stats.jobs == 100 && stats.threads == 8 && stats.instructions == total && total > 0;
+}
+
+bool test_pool_is_reused() {
+    // a second run() on the same CPUs must start every job from the booted state again
+    std::vector<std::string> inputs = unevenInputs(50);
+    BatchRunner runner(sumProgram());
+    runner.threads = 2;
+    runner.echoInput = false;
+    std::vector<BatchRunner::Result> first = runner.run(inputs);
+    std::vector<BatchRunner::Result> second = runner.run(inputs);
+    runner.threads = 5;
+    std::vector<BatchRunner::Result> third = runner.run(inputs);
+    return sameResults(first, second) && sameResults(first, third);
+}
+
+bool test_jit_engine() {
+    std::vector<std::string> inputs = unevenInputs(60);
+    BatchRunner interpreted(sumProgram());
+    BatchRunner jitted(sumProgram());
+    interpreted.echoInput = jitted.echoInput = false;
+    interpreted.threads = jitted.threads = 3;
+    jitted.engine = MinimalCPU::Engine::Jit;
+    return sameResults(interpreted.run(inputs), jitted.run(inputs));
+}
+
+int main() {
+    TestFramework framework;
+
+    std::cout << "🧪 Batch Runner Test Suite" << std::endl;
+    std::cout << "==========================" << std::endl << std::endl;
+
+    std::cout << "🧵 Batch Tests:" << std::endl;
+    framework.runTest("Results Match Single CPU", test_results_match_single_cpu);
+    framework.runTest("Stop Reasons Per Job", test_stop_reasons_per_job);
+    framework.runTest("Stats Add Up", test_stats_add_up);
+    framework.runTest("Pool Is Reused", test_pool_is_reused);
+    framework.runTest("JIT Engine", test_jit_engine);
+
+    framework.printSummary();
+    return framework.getFailedCount();
+}
@@ -0,0 +1,1251 @@
+#include "../../include/cpu.h"
+#include "../../include/loader.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+
+// Test framework utilities
+class TestFramework {
+private:
+    int testsRun = 0;
+    int testsPassed = 0;
+    int testsFailed = 0;
+
+public:
+    void runTest(const std::string& testName, bool (*testFunc)()) {
+        std::cout << "Running test: " << testName << std::endl;
+        testsRun++;
+
+        try {
+            bool result = testFunc();
+            if (result) {
+                std::cout << "✓ PASSED: " << testName << std::endl;
+                testsPassed++;
+            } else {
+                std::cout << "✗ FAILED: " << testName << std::endl;
+                testsFailed++;
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ FAILED: " << testName << " (Exception: " << e.what() << ")" << std::endl;
+            testsFailed++;
+        }
+        std::cout << std::endl;
+    }
+
+    void printSummary() {
+        std::cout << "=== Test Summary ===" << std::endl;
+        std::cout << "Tests run: " << testsRun << std::endl;
+        std::cout << "Passed: " << testsPassed << std::endl;
+        std::cout << "Failed: " << testsFailed << std::endl;
+        if (testsFailed == 0) {
+            std::cout << "🎉 All tests passed!" << std::endl;
+        }
+    }
+
+    int getFailedCount() const { return testsFailed; }
+};
+
+// Test helper functions
+void emit(std::vector<uint8_t>& code, std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+}
+
+uint8_t hi(uint16_t addr) { return addr >> 8; }
+uint8_t lo(uint16_t addr) { return addr & 0xFF; }
+
+// run the program and return what it wrote to 0xFF00
+std::string runAndCapture(MinimalCPU& cpu, const std::vector<uint8_t>& program, uint16_t start = 0) {
+    std::stringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    cpu.loadProgram(program, start);
+    cpu.run();
+    std::cout.rdbuf(old_cout);
+    return output.str();
+}
+
+// run the program on both engines; true if output, registers and RAM all agree
+bool enginesAgree(const std::vector<uint8_t>& program, uint16_t start = 0, std::string* output = nullptr) {
+    MinimalCPU interpreted;
+    MinimalCPU jitted;
+    jitted.engine = MinimalCPU::Engine::Jit;
+    std::streambuf* old_cerr = std::cerr.rdbuf(nullptr);
+    std::string expected = runAndCapture(interpreted, program, start);
+    std::string actual = runAndCapture(jitted, program, start);
+    std::cerr.rdbuf(old_cerr);
+    if (output) {
+        *output = actual;
+    }
+    return expected == actual
+        && interpreted.PC == jitted.PC
+        && interpreted.halted == jitted.halted
+        && std::equal(interpreted.R, interpreted.R + 8, jitted.R)
+        && std::equal(interpreted.RAM, interpreted.RAM + 65536, jitted.RAM);
+}
+
+// run the program with and without superinstructions; true if output, registers and RAM agree
+bool fusionAgrees(const std::vector<uint8_t>& program, uint16_t start = 0, std::string* output = nullptr) {
+    MinimalCPU plain;
+    MinimalCPU fused;
+    plain.superinstructions = false;
+    std::string expected = runAndCapture(plain, program, start);
+    std::string actual = runAndCapture(fused, program, start);
+    if (output) {
+        *output = actual;
+    }
+    return expected == actual
+        && plain.PC == fused.PC
+        && std::equal(plain.R, plain.R + 8, fused.R)
+        && std::equal(plain.RAM, plain.RAM + 65536, fused.RAM);
+}
+
+// Codegen's IFLEQ lowering against a literal: LOAD R2,k; SUB R2,Ra; JZ R2,target
+void emitIfLeqConst(std::vector<uint8_t>& code, uint8_t ra, uint8_t k, uint16_t target) {
+    emit(code, {0x02, 0x02, k});
+    emit(code, {0x06, 0x02, ra});
+    emit(code, {0x08, 0x02, hi(target), lo(target)});
+}
+
+// Codegen's IFLEQ lowering between registers: SUB Rb,Ra; ADD Rb,Ra; JZ R2,target
+void emitIfLeq(std::vector<uint8_t>& code, uint8_t ra, uint8_t rb, uint16_t target) {
+    emit(code, {0x06, rb, ra});
+    emit(code, {0x05, rb, ra});
+    emit(code, {0x08, 0x02, hi(target), lo(target)});
+}
+
+// output device that keeps every chunk it is handed
+class RecordingOutput : public OutputDevice {
+public:
+    std::vector<std::string> chunks;
+    void write(const char* data, size_t size) override {
+        chunks.emplace_back(data, size);
+    }
+};
+
+// records every guest store into its page
+class RecordingDevice : public IoDevice {
+public:
+    std::vector<std::pair<uint16_t, uint8_t>> stores;
+    void store(uint16_t addr, uint8_t value) override {
+        stores.emplace_back(addr, value);
+    }
+};
+
+// scripted input that behaves like a terminal
+class TerminalInput : public SpanInput {
+public:
+    using SpanInput::SpanInput;
+    bool interactive() const override { return true; }
+};
+
+// counts R0 from 0 to 200, then stores it to 0x8000
+std::vector<uint8_t> counterProgram() {
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 0});          // LOAD R0, 0
+    emit(code, {0x02, 0x01, 1});          // LOAD R1, 1
+    emit(code, {0x02, 0x05, 200});        // LOAD R5, 200
+    emit(code, {0x05, 0x00, 0x01});       // loop: ADD R0, R1
+    emit(code, {0x02, 0x06, 0});          // LOAD R6, 0
+    emit(code, {0x05, 0x06, 0x05});       // ADD R6, R5
+    emit(code, {0x06, 0x06, 0x00});       // SUB R6, R0
+    emit(code, {0x07, 0x06, 0x00, 9});    // JNZ R6, loop
+    emit(code, {0x03, 0x80, 0x00, 0x00}); // STORE 0x8000, R0
+    emit(code, {0x00});                   // HALT
+    return code;
+}
+
+// prints 'A', patches the immediate of its first instruction to 'B' and runs it again.
+// indexed = true patches through STORE_INDEXED instead of STORE_CONST.
+std::vector<uint8_t> selfModifyingProgram(uint16_t base, bool indexed) {
+    std::vector<uint8_t> code;
+    uint16_t patchAddr = base + 2;
+    emit(code, {0x02, 0x00, 'A'});              // LOAD R0, 'A'  <- immediate gets patched
+    emit(code, {0x03, 0xFF, 0x00, 0x00});       // STORE 0xFF00, R0
+    emit(code, {0x01, 0x01, 0x80, 0x00});       // LOAD R1, [0x8000]
+    size_t donePos = code.size() + 2;
+    emit(code, {0x07, 0x01, 0x00, 0x00});       // JNZ R1, done
+    emit(code, {0x04, 0x80, 0x00, 1});          // STORE_CONST 0x8000, 1
+    if (indexed) {
+        emit(code, {0x02, 0x00, hi(patchAddr)}); // LOAD R0, hi
+        emit(code, {0x02, 0x01, lo(patchAddr)}); // LOAD R1, lo
+        emit(code, {0x02, 0x02, 0});            // LOAD R2, 0
+        emit(code, {0x02, 0x04, 'B'});          // LOAD R4, 'B'
+        emit(code, {0x0B});                     // STORE_INDEXED
+    } else {
+        emit(code, {0x04, hi(patchAddr), lo(patchAddr), 'B'}); // STORE_CONST patchAddr, 'B'
+    }
+    emit(code, {0x08, 0x02, hi(base), lo(base)}); // JZ R2, base (R2 is 0)
+    uint16_t done = base + code.size();
+    emit(code, {0x00});                         // done: HALT
+    code[donePos] = hi(done);
+    code[donePos + 1] = lo(done);
+    return code;
+}
+
+// Test functions
+bool test_store_const_output() {
+    std::vector<uint8_t> code;
+    emit(code, {0x04, 0xFF, 0x00, 'H'});
+    emit(code, {0x04, 0xFF, 0x00, 'i'});
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    return runAndCapture(cpu, code) == "Hi" && cpu.halted;
+}
+
+bool test_counter_loop() {
+    MinimalCPU cpu;
+    runAndCapture(cpu, counterProgram());
+    return cpu.RAM[0x8000] == 200 && cpu.R[2] == 0;
+}
+
+bool test_sub_sets_carry() {
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 3});     // LOAD R0, 3
+    emit(code, {0x02, 0x01, 5});     // LOAD R1, 5
+    emit(code, {0x06, 0x00, 0x01});  // SUB R0, R1
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    runAndCapture(cpu, code);
+    return cpu.R[0] == 254 && cpu.R[2] == 1;
+}
+
+bool test_unknown_opcode_halts() {
+    std::vector<uint8_t> code = {0x02, 0x00, 7, 0xEE, 0x02, 0x00, 9, 0x00};
+    MinimalCPU cpu;
+    std::streambuf* old_cerr = std::cerr.rdbuf(nullptr);
+    runAndCapture(cpu, code);
+    std::cerr.rdbuf(old_cerr);
+    return cpu.halted && cpu.R[0] == 7 && cpu.PC == 4;
+}
+
+bool test_self_modifying_store() {
+    MinimalCPU cpu;
+    return runAndCapture(cpu, selfModifyingProgram(0x1000, false), 0x1000) == "AB";
+}
+
+bool test_self_modifying_indexed_store() {
+    MinimalCPU cpu;
+    return runAndCapture(cpu, selfModifyingProgram(0x1000, true), 0x1000) == "AB";
+}
+
+bool test_self_modifying_across_page_boundary() {
+    // the patched immediate lives on the page after the instruction's opcode
+    MinimalCPU cpu;
+    return runAndCapture(cpu, selfModifyingProgram(0x10FE, false), 0x10FE) == "AB";
+}
+
+bool test_reload_program_drops_cache() {
+    MinimalCPU cpu;
+    std::vector<uint8_t> first = {0x04, 0xFF, 0x00, 'X', 0x00};
+    std::vector<uint8_t> second = {0x04, 0xFF, 0x00, 'Y', 0x00};
+    return runAndCapture(cpu, first) == "X" && runAndCapture(cpu, second) == "Y";
+}
+
+bool test_host_write_inside_instructions() {
+    // the write starts in the first STORE_CONST's operands and covers the
+    // second one whole, so both have to be decoded again
+    MinimalCPU cpu;
+    std::vector<uint8_t> code = {0x04, 0xFF, 0x00, 'a', 0x04, 0xFF, 0x00, 'b', 0x00};
+    if (runAndCapture(cpu, code) != "ab") {
+        return false;
+    }
+    const uint8_t patch[] = {'X', 0x04, 0xFF, 0x00, 'Y'};
+    std::copy(patch, patch + sizeof(patch), cpu.RAM + 3);
+    cpu.markDirty(3, sizeof(patch));
+    cpu.halted = false;
+    cpu.PC = 0;
+    std::stringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    cpu.run();
+    std::cout.rdbuf(old_cout);
+    return output.str() == "XY";
+}
+
+bool test_jit_counter_loop() {
+    return enginesAgree(counterProgram());
+}
+
+bool test_jit_output_and_carry() {
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 3});           // LOAD R0, 3
+    emit(code, {0x02, 0x01, 5});           // LOAD R1, 5
+    emit(code, {0x06, 0x00, 0x01});        // SUB R0, R1
+    emit(code, {0x04, 0xFF, 0x00, 'o'});   // STORE_CONST 0xFF00, 'o'
+    emit(code, {0x02, 0x05, 'k'});         // LOAD R5, 'k'
+    emit(code, {0x03, 0xFF, 0x00, 0x05});  // STORE 0xFF00, R5
+    emit(code, {0x00});
+    std::string output;
+    return enginesAgree(code, 0, &output) && output == "ok";
+}
+
+bool test_jit_indexed_ops() {
+    std::vector<uint8_t> code;
+    emit(code, {0x04, 0x90, 0x10, 42});    // STORE_CONST 0x9010, 42
+    emit(code, {0x02, 0x00, 0x90});        // LOAD R0, 0x90
+    emit(code, {0x02, 0x01, 0x0F});        // LOAD R1, 0x0F
+    emit(code, {0x02, 0x02, 1});           // LOAD R2, 1
+    emit(code, {0x0A});                    // LOAD_INDEXED -> R4 = 42
+    emit(code, {0x02, 0x02, 2});           // LOAD R2, 2
+    emit(code, {0x0B});                    // STORE_INDEXED 0x9011 = 42
+    emit(code, {0x00});
+    return enginesAgree(code);
+}
+
+bool test_jit_unknown_opcode() {
+    return enginesAgree({0x02, 0x00, 7, 0xEE, 0x02, 0x00, 9, 0x00});
+}
+
+bool test_jit_self_modifying() {
+    std::string output;
+    bool same = enginesAgree(selfModifyingProgram(0x1000, false), 0x1000, &output) && output == "AB";
+    same = same && enginesAgree(selfModifyingProgram(0x1000, true), 0x1000, &output) && output == "AB";
+    return same && enginesAgree(selfModifyingProgram(0x10FE, false), 0x10FE, &output) && output == "AB";
+}
+
+bool test_jit_reload_program() {
+    MinimalCPU cpu;
+    cpu.engine = MinimalCPU::Engine::Jit;
+    std::vector<uint8_t> first = {0x02, 0x00, 1, 0x00};
+    std::vector<uint8_t> second = {0x02, 0x00, 2, 0x00};
+    runAndCapture(cpu, first);
+    bool firstOk = cpu.R[0] == 1;
+    runAndCapture(cpu, second);
+    return firstOk && cpu.R[0] == 2;
+}
+
+// Like the bootloader: code at 0xC000 copies a routine to 0x1000 and jumps
+// to it. The routine picks the next routine to copy and jumps back, so the
+// same jump reaches two different routines at 0x1000.
+std::vector<uint8_t> copyLoaderProgram() {
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x03, 1});                      // LOAD R3, 1
+    emit(code, {0x02, 0x05, 0xC0});                   // LOAD R5, 0xC0 (copy from 0xC100)
+    uint16_t copy = static_cast<uint16_t>(0xC000 + code.size());
+    emit(code, {0x02, 0x02, 240});                    // LOAD R2, 240 (counts up to 0)
+    uint16_t loop = static_cast<uint16_t>(0xC000 + code.size());
+    emit(code, {0x02, 0x00, 0});                      // LOAD R0, 0
+    emit(code, {0x05, 0x00, 0x05});                   // ADD R0, R5
+    emit(code, {0x02, 0x01, 0x10});                   // LOAD R1, 0x10
+    emit(code, {0x0A});                               // LOAD_INDEXED R4 = [R5:10 + R2]
+    emit(code, {0x02, 0x00, 0x0F});                   // LOAD R0, 0x0F
+    emit(code, {0x02, 0x01, 0x10});                   // LOAD R1, 0x10
+    emit(code, {0x0B});                               // STORE_INDEXED [0x0F10 + R2] = R4
+    emit(code, {0x05, 0x02, 0x03});                   // ADD R2, R3
+    emit(code, {0x07, 0x02, hi(loop), lo(loop)});     // JNZ R2, loop
+    emit(code, {0x07, 0x03, 0x10, 0x00});             // JNZ R3, 0x1000
+    code.resize(0x100, 0);
+    emit(code, {0x02, 0x06, 'A'});                    // routine A: LOAD R6, 'A'
+    emit(code, {0x03, 0xFF, 0x00, 0x06});             // STORE 0xFF00, R6
+    emit(code, {0x02, 0x05, 0xC1});                   // LOAD R5, 0xC1 (copy routine B next)
+    emit(code, {0x07, 0x03, hi(copy), lo(copy)});     // JNZ R3, copy
+    code.resize(0x200, 0);
+    emit(code, {0x02, 0x06, 'B'});                    // routine B: LOAD R6, 'B'
+    emit(code, {0x03, 0xFF, 0x00, 0x06, 0x00});       // STORE 0xFF00, R6; HALT
+    code.resize(0x210, 0);
+    return code;
+}
+
+bool test_copied_code_is_retranslated() {
+    std::string output;
+    bool agree = enginesAgree(copyLoaderProgram(), 0xC000, &output) && output == "AB";
+    MinimalCPU cpu;
+    cpu.engine = MinimalCPU::Engine::Jit;
+    bool ran = runAndCapture(cpu, copyLoaderProgram(), 0xC000) == "AB";
+    return agree && ran && cpu.jitFlushes() == 0 && (cpu.jitBlocks() > 0 || !MinimalCPU::jitAvailable());
+}
+
+bool test_loading_elsewhere_keeps_blocks() {
+    MinimalCPU cpu;
+    cpu.engine = MinimalCPU::Engine::Jit;
+    std::string first = runAndCapture(cpu, counterProgram());
+    size_t blocks = cpu.jitBlocks();
+    bool other = runAndCapture(cpu, {0x04, 0xFF, 0x00, 'Z', 0x00}, 0x2000) == "Z";
+    bool kept = cpu.jitBlocks() >= blocks;
+    std::string again = runAndCapture(cpu, counterProgram());
+    return other && kept && again == first && cpu.RAM[0x8000] == 200 && cpu.jitFlushes() == 0;
+}
+
+bool test_fused_ifleq_const() {
+    // i += 1; s += i; if i <= 100 goto loop
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x03, 1});                  // LOAD R3, 1
+    uint16_t loop = code.size();
+    emit(code, {0x05, 0x00, 0x03});               // ADD R0, R3
+    emit(code, {0x05, 0x01, 0x00});               // ADD R1, R0
+    emitIfLeqConst(code, 0x00, 100, loop);
+    emit(code, {0x03, 0x80, 0x00, 0x00});         // STORE [0x8000], R0
+    emit(code, {0x03, 0x80, 0x01, 0x01});         // STORE [0x8001], R1
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    runAndCapture(cpu, code);
+    return fusionAgrees(code) && cpu.RAM[0x8000] == 101 && cpu.RAM[0x8001] == 31 && cpu.R[2] == 1;
+}
+
+bool test_fused_ifleq_loop() {
+    // i += 1; if i <= n goto loop, with n = 250 so the SUB borrows on most passes
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x03, 1});                  // LOAD R3, 1
+    emit(code, {0x02, 0x01, 250});                // LOAD R1, 250
+    uint16_t loop = code.size();
+    emit(code, {0x05, 0x00, 0x03});               // ADD R0, R3
+    emitIfLeq(code, 0x00, 0x01, loop);
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    runAndCapture(cpu, code);
+    return fusionAgrees(code) && cpu.R[0] == 251 && cpu.R[1] == 250 && cpu.R[2] == 1;
+}
+
+bool test_fused_overlapping_registers() {
+    // operand, carry and tested registers that coincide; each sequence skips a
+    // marker store when it jumps
+    std::vector<std::vector<uint8_t>> sequences = {
+        {0x02, 0x04, 5, 0x06, 0x04, 0x04},        // LOAD R4, 5; SUB R4, R4
+        {0x02, 0x02, 9, 0x06, 0x02, 0x05},        // LOAD R2, 9; SUB R2, R5
+        {0x06, 0x02, 0x05, 0x05, 0x02, 0x05},     // SUB R2, R5; ADD R2, R5
+        {0x06, 0x05, 0x02, 0x05, 0x05, 0x02},     // SUB R5, R2; ADD R5, R2
+        {0x06, 0x06, 0x06, 0x05, 0x06, 0x06},     // SUB R6, R6; ADD R6, R6
+    };
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x05, 7});                  // LOAD R5, 7
+    emit(code, {0x02, 0x06, 3});                  // LOAD R6, 3
+    uint8_t marker = 0;
+    for (const std::vector<uint8_t>& sequence : sequences) {
+        for (uint8_t tested : {uint8_t(0x02), sequence[1]}) {
+            code.insert(code.end(), sequence.begin(), sequence.end());
+            uint16_t next = code.size() + 4 + 4;
+            emit(code, {0x08, tested, hi(next), lo(next)});
+            emit(code, {0x04, 0x80, marker++, 1});
+        }
+    }
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    runAndCapture(cpu, code);
+    int taken = 0;
+    for (uint8_t i = 0; i < marker; ++i) {
+        taken += cpu.RAM[0x8000 + i] == 0;
+    }
+    return fusionAgrees(code) && taken > 0 && taken < marker;
+}
+
+bool test_jump_into_fused_sequence() {
+    // the second pass enters the sequence at its SUB, with R2 already set
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 5});                  // LOAD R0, 5
+    uint16_t seq = code.size();
+    emitIfLeqConst(code, 0x00, 3, 0);             // 5 <= 3 does not jump
+    size_t jump = code.size() - 2;
+    emit(code, {0x01, 0x05, 0x80, 0x03});         // LOAD R5, [done]
+    emit(code, {0x04, 0x80, 0x03, 1});            // done = 1
+    emit(code, {0x02, 0x02, 30});                 // LOAD R2, 30
+    emit(code, {0x08, 0x05, hi(seq + 3), lo(seq + 3)}); // JZ R5, SUB of the sequence
+    emit(code, {0x00});
+    uint16_t end = code.size();
+    emit(code, {0x04, 0x80, 0x02, 37});           // reached only through the JZ
+    emit(code, {0x00});
+    code[jump] = hi(end);
+    code[jump + 1] = lo(end);
+    MinimalCPU cpu;
+    runAndCapture(cpu, code);
+    return fusionAgrees(code) && cpu.RAM[0x8002] == 37;
+}
+
+bool test_self_modifying_fused_sequence() {
+    // patches the constant inside an already executed fused sequence
+    uint16_t base = 0x1000;
+    std::vector<uint8_t> program;
+    emit(program, {0x02, 0x03, 1});               // LOAD R3, 1
+    emit(program, {0x02, 0x00, 5});               // LOAD R0, 5
+    uint16_t seq = base + program.size();
+    emitIfLeqConst(program, 0x00, 3, 0);          // constant at seq + 2
+    size_t hit = program.size() - 2;
+    emit(program, {0x01, 0x05, 0x80, 0x10});      // LOAD R5, [done]
+    size_t jnz = program.size();
+    emit(program, {0x07, 0x05, 0x00, 0x00});      // JNZ R5, end
+    emit(program, {0x04, 0x80, 0x10, 1});         // done = 1
+    emit(program, {0x04, hi(seq + 2), lo(seq + 2), 9}); // 5 <= 9 jumps
+    emit(program, {0x07, 0x03, hi(seq), lo(seq)}); // JNZ R3, seq
+    uint16_t target = base + program.size();
+    emit(program, {0x04, 0x80, 0x02, 4});         // reached only through the JZ
+    uint16_t end = base + program.size();
+    emit(program, {0x00});
+    program[hit] = hi(target);
+    program[hit + 1] = lo(target);
+    program[jnz + 2] = hi(end);
+    program[jnz + 3] = lo(end);
+    MinimalCPU cpu;
+    runAndCapture(cpu, program, base);
+    return fusionAgrees(program, base) && cpu.RAM[0x8002] == 4;
+}
+
+bool test_output_is_buffered() {
+    std::vector<uint8_t> code;
+    for (char ch : std::string("Hello")) {
+        emit(code, {0x04, 0xFF, 0x00, static_cast<uint8_t>(ch)});
+    }
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    RecordingOutput device;
+    cpu.setOutput(&device);
+    cpu.loadProgram(code);
+    cpu.run();
+    return device.chunks.size() == 1 && device.chunks[0] == "Hello";
+}
+
+bool test_output_flushed_before_interactive_in() {
+    std::vector<uint8_t> code;
+    emit(code, {0x04, 0xFF, 0x00, '>'});   // prompt
+    emit(code, {0x09, 0x00});              // IN R0, echoed
+    emit(code, {0x03, 0xFF, 0x00, 0x00});  // STORE 0xFF00, R0
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    RecordingOutput device;
+    std::string text = " a";
+    TerminalInput input(text);
+    cpu.setOutput(&device);
+    cpu.setInput(&input);
+    cpu.loadProgram(code);
+    cpu.run();
+    return device.chunks.size() == 2 && device.chunks[0] == ">" && device.chunks[1] == "aa";
+}
+
+bool test_output_buffer_fills() {
+    // 256 * 256 + 1 bytes of output is one byte more than a buffer's worth
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x03, 1});           // LOAD R3, 1
+    emit(code, {0x02, 0x06, 0});           // LOAD R6, 0 (256 passes)
+    emit(code, {0x02, 0x05, 0});           // outer: LOAD R5, 0
+    emit(code, {0x04, 0xFF, 0x00, '.'});   // inner: STORE_CONST 0xFF00, '.'
+    emit(code, {0x06, 0x05, 0x03});        // SUB R5, R3
+    emit(code, {0x07, 0x05, 0x00, 9});     // JNZ R5, inner
+    emit(code, {0x06, 0x06, 0x03});        // SUB R6, R3
+    emit(code, {0x07, 0x06, 0x00, 6});     // JNZ R6, outer
+    emit(code, {0x04, 0xFF, 0x00, '!'});
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    RecordingOutput device;
+    cpu.setOutput(&device);
+    cpu.loadProgram(code);
+    cpu.run();
+    size_t total = 0;
+    for (const auto& chunk : device.chunks) {
+        total += chunk.size();
+    }
+    return device.chunks.size() == 2 && device.chunks[0].size() == MinimalCPU::OUTPUT_BUFFER_SIZE
+        && device.chunks[1] == "!" && total == 256 * 256 + 1;
+}
+
+// reads three bytes with IN into 0x8000..0x8002, printing '>' before each one
+std::vector<uint8_t> readThreeProgram() {
+    std::vector<uint8_t> code;
+    for (uint8_t i = 0; i < 3; ++i) {
+        emit(code, {0x04, 0xFF, 0x00, '>'});
+        emit(code, {0x09, 0x00});              // IN R0
+        emit(code, {0x03, 0x80, i, 0x00});     // STORE 0x800i, R0
+    }
+    emit(code, {0x00});
+    return code;
+}
+
+bool test_span_input() {
+    MinimalCPU cpu;
+    RecordingOutput device;
+    std::string text = " a\nb\tc";
+    SpanInput input(text);
+    cpu.setOutput(&device);
+    cpu.setInput(&input);
+    cpu.loadProgram(readThreeProgram());
+    cpu.run();
+    // batch input is not interactive, so the prompts are not flushed one by one
+    return std::string(reinterpret_cast<char*>(cpu.RAM + 0x8000), 3) == "abc"
+        && device.chunks.size() == 1 && device.chunks[0] == ">a>b>c";
+}
+
+bool test_input_policy() {
+    MinimalCPU cpu;
+    RecordingOutput device;
+    std::string text = " a\n";
+    SpanInput input(text);
+    cpu.setOutput(&device);
+    cpu.setInput(&input);
+    cpu.echoInput = false;
+    cpu.skipInputWhitespace = false;
+    cpu.loadProgram(readThreeProgram());
+    cpu.run();
+    return std::string(reinterpret_cast<char*>(cpu.RAM + 0x8000), 3) == " a\n"
+        && device.chunks.size() == 1 && device.chunks[0] == ">>>";
+}
+
+bool test_end_of_input_waits_on_in() {
+    MinimalCPU cpu;
+    RecordingOutput device;
+    std::string text = "x  ";
+    SpanInput input(text);
+    cpu.setOutput(&device);
+    cpu.setInput(&input);
+    cpu.loadProgram(readThreeProgram());
+    MinimalCPU::StopReason first = cpu.run();
+    // the second IN is at 14: STORE_CONST(4) IN(2) STORE(4) STORE_CONST(4)
+    bool waiting = first == MinimalCPU::StopReason::WaitingForInput && !cpu.halted && cpu.PC == 14
+        && cpu.RAM[0x8000] == 'x' && device.chunks[0] == ">x>";
+    std::string more = "yz";
+    SpanInput rest(more);
+    cpu.setInput(&rest);
+    MinimalCPU::StopReason second = cpu.run();
+    return waiting && second == MinimalCPU::StopReason::Halted && cpu.halted
+        && std::string(reinterpret_cast<char*>(cpu.RAM + 0x8000), 3) == "xyz";
+}
+
+bool test_file_input() {
+    std::ofstream("input.txt") << "q r s";
+    MinimalCPU cpu;
+    RecordingOutput device;
+    FileInput input("input.txt");
+    cpu.setOutput(&device);
+    cpu.setInput(&input);
+    cpu.loadProgram(readThreeProgram());
+    cpu.run();
+    return std::string(reinterpret_cast<char*>(cpu.RAM + 0x8000), 3) == "qrs" && input.remaining() == 0;
+}
+
+// records readThreeProgram reading " a\nb\tc" into path
+void recordReadThree(const std::string& path, std::string* output = nullptr) {
+    MinimalCPU cpu;
+    RecordingOutput device;
+    std::string text = " a\nb\tc";
+    SpanInput input(text);
+    InputRecorder recorder(path);
+    cpu.setOutput(&device);
+    cpu.setInput(&input);
+    cpu.setInputRecorder(&recorder);
+    cpu.loadProgram(readThreeProgram());
+    cpu.run();
+    if (output) {
+        *output = device.chunks.empty() ? "" : device.chunks[0];
+    }
+}
+
+bool test_record_then_replay() {
+    std::string recorded;
+    recordReadThree("input.log", &recorded);
+    InputReplay replay("input.log");
+    // the IN instructions are the 2nd, 5th and 8th; the whitespace is not logged
+    std::vector<InputEvent> expected = {{1, 'a'}, {4, 'b'}, {7, 'c'}};
+    if (replay.events() != expected) {
+        return false;
+    }
+    MinimalCPU cpu;
+    RecordingOutput device;
+    std::string text = "xyz";
+    SpanInput unused(text);
+    cpu.setOutput(&device);
+    cpu.setInput(&unused);
+    cpu.setInputReplay(&replay);
+    cpu.loadProgram(readThreeProgram());
+    cpu.run();
+    return std::string(reinterpret_cast<char*>(cpu.RAM + 0x8000), 3) == "abc" && device.chunks.size() == 1
+        && device.chunks[0] == recorded && replay.remaining() == 0 && replay.divergences() == 0
+        && unused.remaining() == 3;
+}
+
+bool test_replay_on_any_engine_and_budget() {
+    recordReadThree("input.log");
+    for (MinimalCPU::Engine engine : {MinimalCPU::Engine::Interpreter, MinimalCPU::Engine::Jit}) {
+        for (uint64_t slice : {MinimalCPU::UNLIMITED, uint64_t(2)}) {
+            InputReplay replay("input.log");
+            MinimalCPU cpu;
+            RecordingOutput device;
+            cpu.engine = engine;
+            cpu.setOutput(&device);
+            cpu.setInputReplay(&replay);
+            cpu.loadProgram(readThreeProgram());
+            while (cpu.run(slice) == MinimalCPU::StopReason::BudgetExhausted) {
+            }
+            if (std::string(reinterpret_cast<char*>(cpu.RAM + 0x8000), 3) != "abc" || replay.divergences() != 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool test_replay_reports_divergence() {
+    InputReplay replay({{1, 'a'}, {4, 'b'}, {7, 'c'}});
+    std::vector<uint8_t> code = readThreeProgram();
+    code.insert(code.begin() + 6, {0x02, 0x05, 0});  // LOAD R5, 0 after the first IN
+    MinimalCPU cpu;
+    RecordingOutput device;
+    cpu.setOutput(&device);
+    cpu.setInputReplay(&replay);
+    cpu.loadProgram(code);
+    cpu.run();
+    bool diverged = std::string(reinterpret_cast<char*>(cpu.RAM + 0x8000), 3) == "abc"
+        && replay.divergences() == 2 && replay.firstDivergence() == 1;
+    InputReplay empty(std::vector<InputEvent>{});
+    MinimalCPU waiting;
+    waiting.setOutput(&device);
+    waiting.setInputReplay(&empty);
+    waiting.loadProgram(readThreeProgram());
+    return diverged && waiting.run() == MinimalCPU::StopReason::WaitingForInput && waiting.PC == 4;
+}
+
+bool test_input_log_file_errors() {
+    recordReadThree("input.log");
+    std::ifstream whole("input.log", std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(whole)), std::istreambuf_iterator<char>());
+    std::ofstream("cut.log", std::ios::binary) << bytes.substr(0, bytes.size() - 1);
+    std::ofstream("foreign.log", std::ios::binary) << "q r s";
+    int thrown = 0;
+    for (const char* path : {"cut.log", "foreign.log", "missing.log"}) {
+        try {
+            InputReplay replay(path);
+        } catch (const std::runtime_error&) {
+            ++thrown;
+        }
+    }
+    return thrown == 3;
+}
+
+bool test_parse_hex_formats() {
+    std::string text = "02 00 31\n0x04 0XfF\t00 a\r\n\n";
+    uint8_t out[16] = {};
+    size_t size = parseHex(text.data(), text.size(), out, sizeof(out));
+    std::vector<uint8_t> expected = {0x02, 0x00, 0x31, 0x04, 0xFF, 0x00, 0x0A};
+    return size == expected.size() && std::equal(expected.begin(), expected.end(), out)
+        && parseHex("", 0, out, 0) == 0;
+}
+
+bool test_parse_hex_rejects_bad_images() {
+    int thrown = 0;
+    uint8_t out[4];
+    for (std::string text : {"02 0g", "123", "0x", "02,03", "0x 1", "01 02 03 04 05"}) {
+        try {
+            parseHex(text.data(), text.size(), out, sizeof(out));
+        } catch (const std::runtime_error&) {
+            ++thrown;
+        }
+    }
+    return thrown == 6;
+}
+
+bool test_load_hex_image() {
+    std::vector<uint8_t> program = {0x04, 0xFF, 0x00, 'h', 0x04, 0xFF, 0x00, 'i', 0x00};
+    std::ofstream("image.hex") << "04 FF 00 68\n04 FF 00 69\n00";
+    MinimalCPU cpu;
+    RecordingOutput device;
+    cpu.setOutput(&device);
+    cpu.PC = 0x1234;
+    size_t size = loadHexImage(cpu, "image.hex", 0x1000);
+    bool loaded = size == program.size() && cpu.PC == 0x1000
+        && std::equal(program.begin(), program.end(), cpu.RAM + 0x1000) && readHexImage("image.hex") == program;
+    cpu.run();
+    bool thrown = false;
+    try {
+        readHexImage("missing.hex");
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+    return loaded && device.chunks.size() == 1 && device.chunks[0] == "hi" && thrown;
+}
+
+bool test_load_hex_image_drops_cache() {
+    MinimalCPU cpu;
+    RecordingOutput device;
+    cpu.setOutput(&device);
+    std::ofstream("image.hex") << "04 FF 00 61 00";
+    loadHexImage(cpu, "image.hex");
+    cpu.run();
+    std::ofstream("image.hex") << "04 FF 00 62 00";
+    loadHexImage(cpu, "image.hex");
+    cpu.run();
+    return device.chunks.size() == 2 && device.chunks[0] == "a" && device.chunks[1] == "b";
+}
+
+bool test_image_sections_and_errors() {
+    ProgramImage image;
+    image.load = 0x1000;
+    image.entry = 0x1001;
+    image.code = {0x00, 0x01, 0x00, 0x90, 0x00, 0x03, 0xFF, 0x00, 0x00, 0x00};  // HALT; LOAD R0,[0x9000]; out R0; HALT
+    image.dataAddress = 0x9000;
+    image.data = {'d'};
+    image.bssSize = 4;
+    writeProgramImage("image.img", image);
+    MinimalCPU cpu;
+    RecordingOutput device;
+    cpu.setOutput(&device);
+    std::fill(cpu.RAM + 0x9001, cpu.RAM + 0x9006, 0xAA);
+    loadProgramFile(cpu, "image.img");
+    bool loaded = cpu.PC == 0x1001 && cpu.RAM[0x9004] == 0 && cpu.RAM[0x9005] == 0xAA;
+    cpu.run();
+    std::vector<uint8_t> bytes = ImageFormat::encode(image);
+    std::vector<std::vector<uint8_t>> bad(4, bytes);
+    bad[0][0] = 'X';                 // magic
+    bad[1][8] = 2;                   // version
+    bad[2].pop_back();               // size
+    bad[3][12] = bad[3][13] = 0xFF;  // code past the end of RAM
+    int thrown = 0;
+    for (const std::vector<uint8_t>& file : bad) {
+        try {
+            ImageFormat::view(file.data(), file.size());
+        } catch (const std::runtime_error&) {
+            ++thrown;
+        }
+    }
+    return loaded && device.chunks.size() == 1 && device.chunks[0] == "d" && readProgramImage("image.img").code == image.code
+        && thrown == 4;
+}
+
+// LOAD R1, 1; loop: ADD R0, R1; JNZ R1, loop -- counts R0 up forever
+std::vector<uint8_t> runawayProgram() {
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x01, 1});          // LOAD R1, 1
+    emit(code, {0x05, 0x00, 0x01});       // loop: ADD R0, R1
+    emit(code, {0x07, 0x01, 0x00, 3});    // JNZ R1, loop
+    return code;
+}
+
+// run in slices of `slice` instructions; true if the result matches one unbudgeted run
+bool slicedRunAgrees(const std::vector<uint8_t>& program, MinimalCPU::Engine engine, bool fused, uint64_t slice) {
+    MinimalCPU whole;
+    MinimalCPU sliced;
+    whole.engine = sliced.engine = engine;
+    whole.superinstructions = sliced.superinstructions = fused;
+    std::string expected = runAndCapture(whole, program);
+    std::stringstream output;
+    std::streambuf* old_cout = std::cout.rdbuf(output.rdbuf());
+    sliced.loadProgram(program);
+    MinimalCPU::StopReason reason;
+    int slices = 0;
+    while ((reason = sliced.run(slice)) == MinimalCPU::StopReason::BudgetExhausted) {
+        ++slices;
+    }
+    std::cout.rdbuf(old_cout);
+    return reason == MinimalCPU::StopReason::Halted && slices > 0
+        && output.str() == expected
+        && whole.PC == sliced.PC
+        && std::equal(whole.R, whole.R + 8, sliced.R)
+        && std::equal(whole.RAM, whole.RAM + 65536, sliced.RAM);
+}
+
+bool test_budget_stops_runaway_loop() {
+    for (MinimalCPU::Engine engine : {MinimalCPU::Engine::Interpreter, MinimalCPU::Engine::Jit}) {
+        MinimalCPU cpu;
+        cpu.engine = engine;
+        cpu.loadProgram(runawayProgram());
+        // LOAD, then ten ADD/JNZ pairs
+        if (cpu.run(21) != MinimalCPU::StopReason::BudgetExhausted || cpu.halted || cpu.R[0] != 10 || cpu.PC != 3) {
+            return false;
+        }
+        // one more stops between ADD and JNZ
+        if (cpu.run(1) != MinimalCPU::StopReason::BudgetExhausted || cpu.R[0] != 11 || cpu.PC != 6) {
+            return false;
+        }
+        if (cpu.run(0) != MinimalCPU::StopReason::BudgetExhausted || cpu.PC != 6) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_budget_slices_match_full_run() {
+    std::vector<uint8_t> ifleq;
+    emit(ifleq, {0x02, 0x03, 1});                 // LOAD R3, 1
+    emit(ifleq, {0x02, 0x01, 50});                // LOAD R1, 50
+    emit(ifleq, {0x05, 0x00, 0x03});              // ADD R0, R3
+    emitIfLeq(ifleq, 0x00, 0x01, 6);
+    emit(ifleq, {0x05, 0x04, 0x03});              // ADD R4, R3
+    emitIfLeqConst(ifleq, 0x04, 40, 19);
+    emit(ifleq, {0x03, 0x80, 0x00, 0x04});        // STORE [0x8000], R4
+    emit(ifleq, {0x00});
+    for (MinimalCPU::Engine engine : {MinimalCPU::Engine::Interpreter, MinimalCPU::Engine::Jit}) {
+        for (bool fused : {false, true}) {
+            for (uint64_t slice : {1, 3, 7}) {
+                if (!slicedRunAgrees(counterProgram(), engine, fused, slice)
+                    || !slicedRunAgrees(ifleq, engine, fused, slice)
+                    || !slicedRunAgrees(selfModifyingProgram(0, false), engine, fused, slice)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool test_budget_splits_superinstruction() {
+    std::vector<uint8_t> code;
+    emitIfLeqConst(code, 0x00, 7, 20);            // fused, 9 <= 7 does not jump
+    emitIfLeq(code, 0x00, 0x01, 20);              // fused, 9 <= 5 does not jump
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    cpu.loadProgram(code);
+    cpu.R[0] = 9;
+    cpu.R[1] = 5;
+    bool constSplit = cpu.run(1) == MinimalCPU::StopReason::BudgetExhausted && cpu.PC == 3 && cpu.R[2] == 7
+        && cpu.run(2) == MinimalCPU::StopReason::BudgetExhausted && cpu.PC == 10 && cpu.R[2] == 1;
+    bool subSplit = cpu.run(1) == MinimalCPU::StopReason::BudgetExhausted && cpu.PC == 13
+        && cpu.R[1] == 252 && cpu.R[2] == 1;
+    return constSplit && subSplit && cpu.run() == MinimalCPU::StopReason::Halted && cpu.R[1] == 5 && cpu.PC == 21;
+}
+
+bool test_fault_stop_reason() {
+    std::vector<uint8_t> code = {0x02, 0x00, 7, 0xEE, 0x00};
+    MinimalCPU cpu;
+    std::streambuf* old_cerr = std::cerr.rdbuf(nullptr);
+    cpu.loadProgram(code);
+    bool fault = cpu.run(100) == MinimalCPU::StopReason::Fault && cpu.halted && cpu.PC == 4;
+    std::cerr.rdbuf(old_cerr);
+    return fault && cpu.run() == MinimalCPU::StopReason::Fault;
+}
+
+bool test_restore_rewinds_state() {
+    for (MinimalCPU::Engine engine : {MinimalCPU::Engine::Interpreter, MinimalCPU::Engine::Jit}) {
+        MinimalCPU cpu;
+        cpu.engine = engine;
+        cpu.loadProgram(counterProgram());
+        cpu.snapshot();
+        cpu.run();
+        bool ran = cpu.halted && cpu.RAM[0x8000] == 200;
+        bool restored = cpu.restore() && !cpu.halted && cpu.PC == 0 && cpu.R[0] == 0 && cpu.RAM[0x8000] == 0;
+        cpu.run();
+        if (!ran || !restored || !cpu.halted || cpu.RAM[0x8000] != 200) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_restore_copies_dirty_pages_only() {
+    std::vector<uint8_t> code;
+    emit(code, {0x04, 0x80, 0x00, 1});    // STORE_CONST 0x8000, 1
+    emit(code, {0x04, 0x80, 0x01, 2});    // STORE_CONST 0x8001, 2
+    emit(code, {0x04, 0x91, 0x00, 3});    // STORE_CONST 0x9100, 3
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    bool noSnapshot = !cpu.restore() && cpu.dirtyPages() == 0;
+    cpu.loadProgram(code);
+    cpu.snapshot();
+    bool clean = cpu.dirtyPages() == 0;
+    cpu.run();
+    bool dirty = cpu.dirtyPages() == 2;
+    cpu.restore();
+    cpu.RAM[0xA000] = 9;  // host write, reported by hand
+    cpu.markDirty(0xA000);
+    bool hostWrite = cpu.dirtyPages() == 1;
+    cpu.restore();
+    return noSnapshot && clean && dirty && hostWrite && cpu.dirtyPages() == 0
+        && cpu.RAM[0x8000] == 0 && cpu.RAM[0x9100] == 0 && cpu.RAM[0xA000] == 0;
+}
+
+bool test_restore_drops_modified_code() {
+    for (MinimalCPU::Engine engine : {MinimalCPU::Engine::Interpreter, MinimalCPU::Engine::Jit}) {
+        MinimalCPU cpu;
+        RecordingOutput device;
+        cpu.engine = engine;
+        cpu.setOutput(&device);
+        cpu.loadProgram(selfModifyingProgram(0x10F8, false), 0x10F8);
+        cpu.snapshot();
+        cpu.run();
+        cpu.restore();
+        cpu.run();
+        if (device.chunks.size() != 2 || device.chunks[0] != "AB" || device.chunks[1] != "AB") {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_clone_shares_snapshot() {
+    for (MinimalCPU::Engine engine : {MinimalCPU::Engine::Interpreter, MinimalCPU::Engine::Jit}) {
+        MinimalCPU cpu;
+        cpu.engine = engine;
+        cpu.loadProgram(counterProgram());
+        cpu.RAM[0x9000] = 5;  // host write before the snapshot
+        cpu.markDirty(0x9000);
+        std::unique_ptr<MinimalCPU> clone = cpu.clone();
+        clone->run();
+        bool cloneRan = clone->engine == engine && clone->halted && clone->RAM[0x8000] == 200
+            && clone->RAM[0x9000] == 5 && clone->dirtyPages() == 1;
+        bool sourceUntouched = !cpu.halted && cpu.RAM[0x8000] == 0 && cpu.dirtyPages() == 0;
+        cpu.run();
+        bool cloneRestored = clone->restore() && !clone->halted && clone->PC == 0 && clone->RAM[0x8000] == 0;
+        if (!cloneRan || !sourceUntouched || !cloneRestored || cpu.RAM[0x8000] != 200) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_clone_after_second_snapshot() {
+    std::vector<uint8_t> code;
+    emit(code, {0x01, 0x00, 0x80, 0x00});  // LOAD R0, 0x8000
+    emit(code, {0x03, 0x80, 0x01, 0x00});  // STORE 0x8001, R0
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    cpu.loadProgram(code);
+    cpu.snapshot();
+    cpu.RAM[0x8000] = 42;  // kept as a private snapshot page, folded into the clone's image
+    cpu.markDirty(0x8000);
+    std::unique_ptr<MinimalCPU> first = cpu.clone();
+    std::unique_ptr<MinimalCPU> second = cpu.clone();
+    first->RAM[0x8000] = 1;  // a clone's host write stays in that clone
+    first->markDirty(0x8000);
+    first->run();
+    second->run();
+    bool ran = first->R[0] == 1 && second->RAM[0x8001] == 42 && cpu.RAM[0x8001] == 0;
+    return ran && first->restore() && first->RAM[0x8000] == 42 && first->RAM[0x8001] == 0;
+}
+
+bool test_decode_cache_grows_with_code() {
+    // the code straddles pages 0x10 and 0x11; nothing else gets records
+    std::vector<uint8_t> code;
+    emit(code, {0x04, 0xFF, 0x00, 'o'});  // STORE_CONST 0xFF00, 'o'
+    emit(code, {0x04, 0xFF, 0x00, 'k'});  // STORE_CONST 0xFF00, 'k'
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    std::string output = runAndCapture(cpu, code, 0x10FC);
+    std::unique_ptr<MinimalCPU> clone = cpu.clone();
+    bool lazy = output == "ok" && cpu.decodedPages() == 2 && clone->decodedPages() == 0;
+    std::string cloneText;
+    StringOutput cloneOutput(cloneText);
+    clone->setOutput(&cloneOutput);
+    clone->halted = false;
+    clone->PC = 0x10FC;
+    clone->run();
+    bool cloneDecoded = cloneText == "ok" && clone->decodedPages() == 2;
+    cpu.invalidateDecodeCache();
+    return lazy && cloneDecoded && cpu.decodedPages() == 0;
+}
+
+bool test_io_device_sees_every_store() {
+    std::vector<uint8_t> code;
+    emit(code, {0x04, 0xFE, 0x10, 7});    // STORE_CONST 0xFE10, 7
+    emit(code, {0x02, 0x05, 8});          // LOAD R5, 8
+    emit(code, {0x03, 0xFE, 0x11, 0x05}); // STORE 0xFE11, R5
+    emit(code, {0x04, 0xFD, 0xFF, 1});    // STORE_CONST 0xFDFF, 1 (next page down, not mapped)
+    emit(code, {0x02, 0x00, 0xFE});       // LOAD R0, 0xFE
+    emit(code, {0x02, 0x01, 0x20});       // LOAD R1, 0x20
+    emit(code, {0x02, 0x02, 0x01});       // LOAD R2, 1
+    emit(code, {0x02, 0x04, 9});          // LOAD R4, 9
+    emit(code, {0x0B});                   // STORE_INDEXED -> 0xFE21
+    emit(code, {0x00});
+    for (MinimalCPU::Engine engine : {MinimalCPU::Engine::Interpreter, MinimalCPU::Engine::Jit}) {
+        MinimalCPU cpu;
+        RecordingDevice device;
+        cpu.engine = engine;
+        cpu.mapIo(0xFE00, &device);
+        cpu.loadProgram(code);
+        cpu.run();
+        std::vector<std::pair<uint16_t, uint8_t>> expected = {{0xFE10, 7}, {0xFE11, 8}, {0xFE21, 9}};
+        if (device.stores != expected || cpu.RAM[0xFE11] != 8 || cpu.RAM[0xFDFF] != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool test_console_port_is_a_mapped_device() {
+    std::vector<uint8_t> code;
+    emit(code, {0x04, 0xFF, 0x00, 'A'});  // STORE_CONST 0xFF00, 'A'
+    emit(code, {0x04, 0xFF, 0x01, 'B'});  // STORE_CONST 0xFF01, 'B' (same page, not the port)
+    emit(code, {0x00});
+    MinimalCPU console;
+    RecordingOutput output;
+    console.setOutput(&output);
+    console.loadProgram(code);
+    console.run();
+    MinimalCPU unmapped;
+    RecordingOutput silent;
+    unmapped.setOutput(&silent);
+    unmapped.mapIo(MinimalCPU::CONSOLE_PORT, nullptr);
+    unmapped.loadProgram(code);
+    unmapped.run();
+    return output.chunks == std::vector<std::string>{"A"} && silent.chunks.empty() && unmapped.RAM[0xFF00] == 'A';
+}
+
+// counterProgram's loop is the five instructions at 9, run 200 times
+bool profileCountsCounter(const Profile& profile) {
+    return profile.instructions() == 1005
+        && profile.pcCounts[0] == 1 && profile.pcCounts[6] == 1
+        && profile.pcCounts[9] == 200 && profile.pcCounts[21] == 200
+        && profile.pcCounts[25] == 1 && profile.pcCounts[29] == 1
+        && profile.opCounts[0x05] == 400 && profile.opCounts[0x02] == 203
+        && profile.opCounts[0x07] == 200 && profile.opCounts[0x00] == 1;
+}
+
+bool test_profile_counts_every_instruction() {
+    for (MinimalCPU::Engine engine : {MinimalCPU::Engine::Interpreter, MinimalCPU::Engine::Jit}) {
+        for (uint64_t slice : {MinimalCPU::UNLIMITED, uint64_t(7)}) {
+            MinimalCPU cpu;
+            Profile profile;
+            cpu.engine = engine;  // a profiled run interprets anyway
+            cpu.setProfile(&profile);
+            cpu.loadProgram(counterProgram());
+            while (cpu.run(slice) == MinimalCPU::StopReason::BudgetExhausted) {
+            }
+            if (!profileCountsCounter(profile) || cpu.RAM[0x8000] != 200) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool test_profile_sees_through_superinstructions() {
+    std::vector<uint8_t> code;
+    emitIfLeqConst(code, 0x00, 7, 10);
+    emit(code, {0x00});
+    MinimalCPU cpu;
+    cpu.loadProgram(code);
+    cpu.run();  // decodes the fused compare and branch
+    Profile profile;
+    cpu.setProfile(&profile);
+    cpu.loadProgram(code);
+    cpu.run();
+    bool counted = profile.instructions() == 4 && profile.opCounts[OP_FUSED_CONST_CMP_JZ] == 0
+        && profile.opCounts[0x02] == 1 && profile.pcCounts[3] == 1 && profile.pcCounts[6] == 1;
+    cpu.setProfile(nullptr);
+    cpu.loadProgram(code);
+    cpu.run();
+    return counted && profile.instructions() == 4;
+}
+
+bool test_hot_block_report() {
+    MinimalCPU cpu;
+    Profile profile;
+    cpu.setProfile(&profile);
+    cpu.loadProgram(counterProgram());
+    cpu.run();
+    std::vector<Profile::Block> blocks = profile.hotBlocks(cpu.RAM);
+    if (blocks.size() != 3 || blocks[0].start != 9 || blocks[0].length != 5 || blocks[0].bytes != 16
+        || blocks[0].executions != 200 || blocks[1].start != 0 || blocks[1].length != 3) {
+        return false;
+    }
+    std::stringstream report;
+    profile.report(report, cpu.RAM, 1);
+    std::string text = report.str();
+    return text.find("Profile: 1005 instructions") != std::string::npos
+        && text.find("#1 0x0009: 200 x 5 instructions = 1000") != std::string::npos
+        && text.find("0015: 0x07 0x06 0x00 0x09 ; JNZ (JNZ Rd, addr) R6, 0x0009") != std::string::npos
+        && text.find("#2") == std::string::npos;
+}
+
+bool test_disassembler_follows_decoder() {
+    std::vector<uint8_t> code;
+    emit(code, {0x09, 0x03});        // IN R3
+    emit(code, {0x0A});              // LOAD_INDEXED
+    emit(code, {0x0B});              // STORE_INDEXED
+    emit(code, {0x02, 0x01, 200});   // LOAD R1, 200
+    std::stringstream listing;
+    size_t at = 0;
+    while (at < code.size()) {
+        at += disassemble(listing, code.data(), code.size(), at);
+        listing << "\n";
+    }
+    return listing.str() ==
+        "0x09 0x03 ; IN (IN Rd) R3\n"
+        "0x0a ; LOAD_INDEXED (LOAD_INDEXED R4 = [R0:R1 + R2])\n"
+        "0x0b ; STORE_INDEXED (STORE_INDEXED [R0:R1 + R2] = R4)\n"
+        "0x02 0x01 0xc8 ; LOAD_CONST (LOAD Rd, const) R1, 200\n";
+}
+
+int main() {
+    TestFramework framework;
+
+    std::cout << "🧪 CPU Test Suite" << std::endl;
+    std::cout << "=================" << std::endl << std::endl;
+
+    // Execution tests
+    std::cout << "⚙️  Execution Tests:" << std::endl;
+    framework.runTest("STORE_CONST Output", test_store_const_output);
+    framework.runTest("Counter Loop", test_counter_loop);
+    framework.runTest("SUB Sets Carry", test_sub_sets_carry);
+    framework.runTest("Unknown Opcode Halts", test_unknown_opcode_halts);
+
+    // Output device tests
+    std::cout << "📤 Output Device Tests:" << std::endl;
+    framework.runTest("Output Is Buffered", test_output_is_buffered);
+    framework.runTest("Output Flushed Before Interactive IN", test_output_flushed_before_interactive_in);
+    framework.runTest("Output Buffer Fills", test_output_buffer_fills);
+
+    // Input device tests
+    std::cout << "📥 Input Device Tests:" << std::endl;
+    framework.runTest("Span Input", test_span_input);
+    framework.runTest("Input Policy", test_input_policy);
+    framework.runTest("End Of Input Waits On IN", test_end_of_input_waits_on_in);
+    framework.runTest("File Input", test_file_input);
+
+    // Record/replay tests
+    std::cout << "🎬 Record/Replay Tests:" << std::endl;
+    framework.runTest("Record Then Replay", test_record_then_replay);
+    framework.runTest("Replay On Any Engine And Budget", test_replay_on_any_engine_and_budget);
+    framework.runTest("Replay Reports Divergence", test_replay_reports_divergence);
+    framework.runTest("Input Log File Errors", test_input_log_file_errors);
+
+    // Image loader tests
+    std::cout << "📦 Image Loader Tests:" << std::endl;
+    framework.runTest("Parse Hex Formats", test_parse_hex_formats);
+    framework.runTest("Parse Hex Rejects Bad Images", test_parse_hex_rejects_bad_images);
+    framework.runTest("Load Hex Image", test_load_hex_image);
+    framework.runTest("Load Hex Image Drops Cache", test_load_hex_image_drops_cache);
+    framework.runTest("Image Sections And Errors", test_image_sections_and_errors);
+
+    // Decode cache tests
+    std::cout << "🗂️  Decode Cache Tests:" << std::endl;
+    framework.runTest("Self-Modifying STORE_CONST", test_self_modifying_store);
+    framework.runTest("Self-Modifying STORE_INDEXED", test_self_modifying_indexed_store);
+    framework.runTest("Self-Modifying Across Page Boundary", test_self_modifying_across_page_boundary);
+    framework.runTest("Reloading Program Drops Cache", test_reload_program_drops_cache);
+    framework.runTest("Host Write Inside Instructions", test_host_write_inside_instructions);
+
+    // Superinstruction tests, compared against unfused decoding
+    std::cout << "🔗 Superinstruction Tests:" << std::endl;
+    framework.runTest("Fused IFLEQ Against Constant", test_fused_ifleq_const);
+    framework.runTest("Fused IFLEQ Loop", test_fused_ifleq_loop);
+    framework.runTest("Fused Overlapping Registers", test_fused_overlapping_registers);
+    framework.runTest("Jump Into Fused Sequence", test_jump_into_fused_sequence);
+    framework.runTest("Self-Modifying Fused Sequence", test_self_modifying_fused_sequence);
+
+    // JIT tests, compared against the interpreter
+    std::cout << "🚀 JIT Tests (" << (MinimalCPU::jitAvailable() ? "native" : "interpreter fallback") << "):" << std::endl;
+    framework.runTest("JIT Counter Loop", test_jit_counter_loop);
+    framework.runTest("JIT Output And Carry", test_jit_output_and_carry);
+    framework.runTest("JIT Indexed Ops", test_jit_indexed_ops);
+    framework.runTest("JIT Unknown Opcode", test_jit_unknown_opcode);
+    framework.runTest("JIT Self-Modifying Code", test_jit_self_modifying);
+    framework.runTest("JIT Reloading Program", test_jit_reload_program);
+    framework.runTest("Copied Code Is Retranslated", test_copied_code_is_retranslated);
+    framework.runTest("Loading Elsewhere Keeps Blocks", test_loading_elsewhere_keeps_blocks);
+
+    // Budgeted run() tests
+    std::cout << "⏱️  Budget Tests:" << std::endl;
+    framework.runTest("Budget Stops Runaway Loop", test_budget_stops_runaway_loop);
+    framework.runTest("Budget Slices Match Full Run", test_budget_slices_match_full_run);
+    framework.runTest("Budget Splits Superinstruction", test_budget_splits_superinstruction);
+    framework.runTest("Fault Stop Reason", test_fault_stop_reason);
+
+    // Memory-mapped I/O tests
+    std::cout << "🔌 Memory-Mapped I/O Tests:" << std::endl;
+    framework.runTest("I/O Device Sees Every Store", test_io_device_sees_every_store);
+    framework.runTest("Console Port Is A Mapped Device", test_console_port_is_a_mapped_device);
+
+    // Snapshot tests
+    std::cout << "📸 Snapshot Tests:" << std::endl;
+    framework.runTest("Restore Rewinds State", test_restore_rewinds_state);
+    framework.runTest("Restore Copies Dirty Pages Only", test_restore_copies_dirty_pages_only);
+    framework.runTest("Restore Drops Modified Code", test_restore_drops_modified_code);
+    framework.runTest("Clone Shares Snapshot", test_clone_shares_snapshot);
+    framework.runTest("Clone After Second Snapshot", test_clone_after_second_snapshot);
+    framework.runTest("Decode Cache Grows With Code", test_decode_cache_grows_with_code);
+
+    // Profiler tests
+    std::cout << "📊 Profiler Tests:" << std::endl;
+    framework.runTest("Profile Counts Every Instruction", test_profile_counts_every_instruction);
+    framework.runTest("Profile Sees Through Superinstructions", test_profile_sees_through_superinstructions);
+    framework.runTest("Hot Block Report", test_hot_block_report);
+    framework.runTest("Disassembler Follows Decoder", test_disassembler_follows_decoder);
+
+    framework.printSummary();
+    return framework.getFailedCount();
+}
@@ -0,0 +1,303 @@
+#include "../../include/cpu.h"
+#include "../../include/lockstep.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+// Test framework utilities
+class TestFramework {
+private:
+    int testsRun = 0;
+    int testsPassed = 0;
+    int testsFailed = 0;
+
+public:
+    void runTest(const std::string& testName, bool (*testFunc)()) {
+        std::cout << "Running test: " << testName << std::endl;
+        testsRun++;
+
+        try {
+            bool result = testFunc();
+            if (result) {
+                std::cout << "✓ PASSED: " << testName << std::endl;
+                testsPassed++;
+            } else {
+                std::cout << "✗ FAILED: " << testName << std::endl;
+                testsFailed++;
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ FAILED: " << testName << " (Exception: " << e.what() << ")" << std::endl;
+            testsFailed++;
+        }
+        std::cout << std::endl;
+    }
+
+    void printSummary() {
+        std::cout << "=== Test Summary ===" << std::endl;
+        std::cout << "Tests run: " << testsRun << std::endl;
+        std::cout << "Passed: " << testsPassed << std::endl;
+        std::cout << "Failed: " << testsFailed << std::endl;
+        if (testsFailed == 0) {
+            std::cout << "🎉 All tests passed!" << std::endl;
+        }
+    }
+
+    int getFailedCount() const { return testsFailed; }
+};
+
+// Test helper functions
+void emit(std::vector<uint8_t>& code, std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+}
+
+uint8_t hi(uint16_t addr) { return addr >> 8; }
+uint8_t lo(uint16_t addr) { return addr & 0xFF; }
+
+// what differs between lanes: RAM bytes written before the run, and IN input
+struct LaneSetup {
+    std::vector<std::pair<uint16_t, uint8_t>> pokes;
+    std::string input;
+};
+
+// runs every lane on the lockstep engine and on its own MinimalCPU;
+// true if output, registers, PC, RAM and how each lane stopped all agree
+bool lanesAgree(const std::vector<uint8_t>& program, const std::vector<LaneSetup>& setups,
+                uint16_t start = 0, LockstepCPU* result = nullptr) {
+    LockstepCPU lockstep(setups.size());
+    lockstep.loadProgram(program, start);
+    for (size_t lane = 0; lane < setups.size(); ++lane) {
+        for (const auto& poke : setups[lane].pokes) {
+            lockstep.poke(lane, poke.first, poke.second);
+        }
+        lockstep.setInput(lane, setups[lane].input);
+    }
+    if (!lockstep.run(1000000)) {
+        return false;
+    }
+    for (size_t lane = 0; lane < setups.size(); ++lane) {
+        MinimalCPU cpu;
+        std::string output;
+        StringOutput device(output);
+        SpanInput input(setups[lane].input);
+        cpu.setOutput(&device);
+        cpu.setInput(&input);
+        cpu.loadProgram(program, start);
+        for (const auto& poke : setups[lane].pokes) {
+            cpu.RAM[poke.first] = poke.second;
+        }
+        std::streambuf* old_cerr = std::cerr.rdbuf(nullptr);
+        MinimalCPU::StopReason reason = cpu.run();
+        std::cerr.rdbuf(old_cerr);
+        LockstepCPU::LaneState expected = reason == MinimalCPU::StopReason::Halted ? LockstepCPU::LaneState::Halted
+            : reason == MinimalCPU::StopReason::WaitingForInput ? LockstepCPU::LaneState::WaitingForInput
+            : LockstepCPU::LaneState::Fault;
+        if (lockstep.state(lane) != expected || lockstep.pc(lane) != cpu.PC || lockstep.output(lane) != output) {
+            return false;
+        }
+        for (uint8_t r = 0; r < 8; ++r) {
+            if (lockstep.reg(lane, r) != cpu.R[r]) {
+                return false;
+            }
+        }
+        for (uint32_t addr = 0; addr < 65536; ++addr) {
+            if (lockstep.peek(lane, addr) != cpu.RAM[addr]) {
+                return false;
+            }
+        }
+    }
+    if (result) {
+        *result = std::move(lockstep);
+    }
+    return true;
+}
+
+// sums n + (n-1) + ... + 1 for n = [0x8000], prints it and stores it to 0x8001
+std::vector<uint8_t> triangleProgram() {
+    std::vector<uint8_t> code;
+    emit(code, {0x01, 0x00, 0x80, 0x00});   // 0: LOAD R0, [0x8000]
+    emit(code, {0x02, 0x01, 0});            // 4: LOAD R1, 0
+    emit(code, {0x02, 0x03, 1});            // 7: LOAD R3, 1
+    emit(code, {0x08, 0x00, 0x00, 27});     // 10: loop: JZ R0, done
+    emit(code, {0x05, 0x01, 0x00});         // 14: ADD R1, R0
+    emit(code, {0x06, 0x00, 0x03});         // 17: SUB R0, R3
+    emit(code, {0x02, 0x05, 1});            // 20: LOAD R5, 1
+    emit(code, {0x07, 0x05, 0x00, 10});     // 23: JNZ R5, loop
+    emit(code, {0x03, 0xFF, 0x00, 0x01});   // 27: done: STORE 0xFF00, R1
+    emit(code, {0x03, 0x80, 0x01, 0x01});   // 31: STORE 0x8001, R1
+    emit(code, {0x00});                     // 35: HALT
+    return code;
+}
+
+// Test functions
+bool test_uniform_lanes() {
+    std::vector<LaneSetup> setups(40);
+    for (LaneSetup& setup : setups) {
+        setup.pokes = {{0x8000, 20}};
+    }
+    LockstepCPU lockstep(1);
+    // identical lanes never split: one issued instruction per executed lane-instruction
+    return lanesAgree(triangleProgram(), setups, 0, &lockstep) && lockstep.laneSteps == lockstep.steps * 40
+        && lockstep.output(0) == std::string(1, static_cast<char>(210));
+}
+
+bool test_divergent_loops() {
+    std::vector<LaneSetup> setups(67);
+    for (size_t lane = 0; lane < setups.size(); ++lane) {
+        setups[lane].pokes = {{0x8000, static_cast<uint8_t>(lane * 37 % 50)}};
+    }
+    LockstepCPU lockstep(1);
+    // the lanes still share most steps: far fewer issued than executed
+    return lanesAgree(triangleProgram(), setups, 0, &lockstep) && lockstep.steps * 10 < lockstep.laneSteps;
+}
+
+bool test_sub_carry_and_aliasing() {
+    std::vector<uint8_t> code;
+    emit(code, {0x01, 0x00, 0x80, 0x00});   // LOAD R0, [0x8000]
+    emit(code, {0x01, 0x01, 0x80, 0x01});   // LOAD R1, [0x8001]
+    emit(code, {0x06, 0x00, 0x01});         // SUB R0, R1
+    emit(code, {0x03, 0x90, 0x00, 0x02});   // STORE 0x9000, R2
+    emit(code, {0x06, 0x01, 0x01});         // SUB R1, R1
+    emit(code, {0x06, 0x02, 0x00});         // SUB R2, R0
+    emit(code, {0x00});
+    std::vector<LaneSetup> setups(33);
+    for (size_t lane = 0; lane < setups.size(); ++lane) {
+        setups[lane].pokes = {{0x8000, static_cast<uint8_t>(lane * 8)}, {0x8001, static_cast<uint8_t>(255 - lane * 9)}};
+    }
+    return lanesAgree(code, setups);
+}
+
+bool test_indexed_gather_scatter() {
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 0x90});         // LOAD R0, 0x90
+    emit(code, {0x01, 0x01, 0x80, 0x00});   // LOAD R1, [0x8000]  (per lane)
+    emit(code, {0x02, 0x02, 3});            // LOAD R2, 3
+    emit(code, {0x0A});                     // LOAD_INDEXED
+    emit(code, {0x05, 0x04, 0x04});         // ADD R4, R4
+    emit(code, {0x0B});                     // STORE_INDEXED
+    emit(code, {0x00});
+    std::vector<LaneSetup> setups(20);
+    for (size_t lane = 0; lane < setups.size(); ++lane) {
+        uint8_t offset = static_cast<uint8_t>(lane * 11);
+        setups[lane].pokes = {{0x8000, offset}, {static_cast<uint16_t>(0x9003 + offset), static_cast<uint8_t>(lane)}};
+    }
+    return lanesAgree(code, setups);
+}
+
+bool test_lane_with_different_code() {
+    // lane 5 has LOAD R0, 7 patched to an unknown opcode, lanes 6 and 7 another constant
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 'a'});          // LOAD R0, 'a'
+    emit(code, {0x03, 0xFF, 0x00, 0x00});   // STORE 0xFF00, R0
+    emit(code, {0x02, 0x00, 7});            // 7: LOAD R0, 7
+    emit(code, {0x03, 0x80, 0x00, 0x00});   // STORE 0x8000, R0
+    emit(code, {0x00});
+    std::vector<LaneSetup> setups(12);
+    setups[5].pokes = {{7, 0xEE}};
+    setups[6].pokes = {{9, 42}};
+    setups[7].pokes = {{9, 43}};
+    LockstepCPU lockstep(1);
+    return lanesAgree(code, setups, 0, &lockstep) && lockstep.state(5) == LockstepCPU::LaneState::Fault
+        && lockstep.peek(6, 0x8000) == 42 && lockstep.peek(0, 0x8000) == 7;
+}
+
+bool test_self_modifying_code() {
+    // prints 'A', patches the immediate to 'B' (only in lanes with [0x8000] != 0) and loops back once
+    std::vector<uint8_t> code;
+    uint16_t base = 0x10F8;
+    emit(code, {0x02, 0x00, 'A'});                    // LOAD R0, 'A'  <- patched
+    emit(code, {0x03, 0xFF, 0x00, 0x00});             // STORE 0xFF00, R0
+    emit(code, {0x01, 0x01, 0x80, 0x01});             // LOAD R1, [0x8001]
+    emit(code, {0x07, 0x01, hi(base + 33), lo(base + 33)}); // JNZ R1, done
+    emit(code, {0x04, 0x80, 0x01, 1});                // STORE_CONST 0x8001, 1
+    emit(code, {0x01, 0x01, 0x80, 0x00});             // LOAD R1, [0x8000]
+    emit(code, {0x08, 0x01, hi(base), lo(base)});     // JZ R1, base
+    emit(code, {0x04, hi(base + 2), lo(base + 2), 'B'}); // STORE_CONST base + 2, 'B'
+    emit(code, {0x08, 0x02, hi(base), lo(base)});     // JZ R2, base
+    emit(code, {0x00});                               // done: HALT
+    std::vector<LaneSetup> setups(9);
+    for (size_t lane = 0; lane < setups.size(); ++lane) {
+        setups[lane].pokes = {{0x8000, static_cast<uint8_t>(lane % 3)}};
+    }
+    LockstepCPU lockstep(1);
+    return lanesAgree(code, setups, base, &lockstep) && lockstep.output(0) == "AA" && lockstep.output(1) == "AB";
+}
+
+bool test_input_per_lane() {
+    std::vector<uint8_t> code;
+    for (uint8_t i = 0; i < 3; ++i) {
+        emit(code, {0x04, 0xFF, 0x00, '>'});  // STORE_CONST 0xFF00, '>'
+        emit(code, {0x09, 0x00});             // IN R0
+        emit(code, {0x03, 0x80, i, 0x00});    // STORE 0x800i, R0
+    }
+    emit(code, {0x00});
+    std::vector<LaneSetup> setups(6);
+    setups[0].input = "abc";
+    setups[1].input = "x y z";
+    setups[2].input = "";
+    setups[3].input = "pq";
+    setups[4].input = "12345";
+    setups[5].input = " \n";
+    LockstepCPU lockstep(1);
+    bool agree = lanesAgree(code, setups, 0, &lockstep);
+    lockstep.setInput(3, "r");
+    return agree && lockstep.state(3) == LockstepCPU::LaneState::Running && lockstep.run()
+        && lockstep.state(3) == LockstepCPU::LaneState::Halted && lockstep.output(3) == ">p>q>r";
+}
+
+bool test_register_index_faults() {
+    std::vector<uint8_t> code = {0x02, 0x09, 1, 0x00};  // LOAD R9, 1
+    LockstepCPU lockstep(4);
+    lockstep.loadProgram(code);
+    return lockstep.run() && lockstep.state(2) == LockstepCPU::LaneState::Fault && lockstep.pc(2) == 0;
+}
+
+bool test_spinning_lane_does_not_starve_others() {
+    // lane 3 spins forever at 8, below the countdown loop the other lanes run
+    std::vector<uint8_t> code;
+    emit(code, {0x01, 0x00, 0x80, 0x00});   // 0: LOAD R0, [0x8000]
+    emit(code, {0x07, 0x00, 0x00, 12});     // 4: JNZ R0, count
+    emit(code, {0x08, 0x00, 0x00, 8});      // 8: spin: JZ R0, spin
+    emit(code, {0x02, 0x03, 1});            // 12: count: LOAD R3, 1
+    emit(code, {0x06, 0x00, 0x03});         // 15: loop: SUB R0, R3
+    emit(code, {0x07, 0x00, 0x00, 15});     // 18: JNZ R0, loop
+    emit(code, {0x04, 0xFF, 0x00, 'k'});    // 22: STORE_CONST 0xFF00, 'k'
+    emit(code, {0x00});                     // 26: HALT
+    LockstepCPU lockstep(40);
+    lockstep.loadProgram(code);
+    for (size_t lane = 0; lane < lockstep.laneCount(); ++lane) {
+        lockstep.poke(lane, 0x8000, lane == 3 ? 0 : static_cast<uint8_t>(lane * 7 + 1));
+    }
+    if (lockstep.run(100000) || lockstep.state(3) != LockstepCPU::LaneState::Running || lockstep.pc(3) != 8) {
+        return false;
+    }
+    for (size_t lane = 0; lane < lockstep.laneCount(); ++lane) {
+        if (lane != 3 && (lockstep.state(lane) != LockstepCPU::LaneState::Halted || lockstep.output(lane) != "k")) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    TestFramework framework;
+
+    std::cout << "🧪 Lockstep Engine Test Suite" << std::endl;
+    std::cout << "=============================" << std::endl << std::endl;
+
+    // Every lane is compared against its own MinimalCPU
+    std::cout << "🛤️  Lockstep Tests:" << std::endl;
+    framework.runTest("Uniform Lanes", test_uniform_lanes);
+    framework.runTest("Divergent Loops", test_divergent_loops);
+    framework.runTest("SUB Carry And Aliasing", test_sub_carry_and_aliasing);
+    framework.runTest("Indexed Gather And Scatter", test_indexed_gather_scatter);
+    framework.runTest("Lane With Different Code", test_lane_with_different_code);
+    framework.runTest("Self-Modifying Code", test_self_modifying_code);
+    framework.runTest("Input Per Lane", test_input_per_lane);
+    framework.runTest("Register Index Faults", test_register_index_faults);
+    framework.runTest("Spinning Lane Does Not Starve Others", test_spinning_lane_does_not_starve_others);
+
+    framework.printSummary();
+    return framework.getFailedCount();
+}
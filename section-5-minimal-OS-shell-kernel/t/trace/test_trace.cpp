@@ -0,0 +1,286 @@
+#include "../../include/cpu.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+// Test framework utilities
+class TestFramework {
+private:
+    int testsRun = 0;
+    int testsPassed = 0;
+    int testsFailed = 0;
+
+public:
+    void runTest(const std::string& testName, bool (*testFunc)()) {
+        std::cout << "Running test: " << testName << std::endl;
+        testsRun++;
+
+        try {
+            bool result = testFunc();
+            if (result) {
+                std::cout << "✓ PASSED: " << testName << std::endl;
+                testsPassed++;
+            } else {
+                std::cout << "✗ FAILED: " << testName << std::endl;
+                testsFailed++;
+            }
+        } catch (const std::exception& e) {
+            std::cout << "✗ FAILED: " << testName << " (Exception: " << e.what() << ")" << std::endl;
+            testsFailed++;
+        }
+        std::cout << std::endl;
+    }
+
+    void printSummary() {
+        std::cout << "=== Test Summary ===" << std::endl;
+        std::cout << "Tests run: " << testsRun << std::endl;
+        std::cout << "Passed: " << testsPassed << std::endl;
+        std::cout << "Failed: " << testsFailed << std::endl;
+        if (testsFailed == 0) {
+            std::cout << "🎉 All tests passed!" << std::endl;
+        }
+    }
+
+    int getFailedCount() const { return testsFailed; }
+};
+
+// Test helper functions
+void emit(std::vector<uint8_t>& code, std::initializer_list<uint8_t> bytes) {
+    code.insert(code.end(), bytes);
+}
+
+// counts R0 from 0 to 200, then stores it to 0x8000
+std::vector<uint8_t> counterProgram() {
+    std::vector<uint8_t> code;
+    emit(code, {0x02, 0x00, 0});          // 0: LOAD R0, 0
+    emit(code, {0x02, 0x01, 1});          // 3: LOAD R1, 1
+    emit(code, {0x02, 0x05, 200});        // 6: LOAD R5, 200
+    emit(code, {0x05, 0x00, 0x01});       // 9: loop: ADD R0, R1
+    emit(code, {0x02, 0x06, 0});          // 12: LOAD R6, 0
+    emit(code, {0x05, 0x06, 0x05});       // 15: ADD R6, R5
+    emit(code, {0x06, 0x06, 0x00});       // 18: SUB R6, R0
+    emit(code, {0x07, 0x06, 0x00, 9});    // 21: JNZ R6, loop
+    emit(code, {0x03, 0x80, 0x00, 0x00}); // 25: STORE 0x8000, R0
+    emit(code, {0x00});                   // 29: HALT
+    return code;
+}
+
+// one of each memory access: IN, LOAD, STORE_CONST, and the indexed pair
+std::vector<uint8_t> accessProgram() {
+    std::vector<uint8_t> code;
+    emit(code, {0x09, 0x03});             // 0: IN R3
+    emit(code, {0x04, 0x90, 0x05, 7});    // 2: STORE_CONST 0x9005, 7
+    emit(code, {0x01, 0x06, 0x90, 0x05}); // 6: LOAD R6, 0x9005
+    emit(code, {0x02, 0x00, 0x90});       // 10: LOAD R0, 0x90
+    emit(code, {0x02, 0x01, 0x00});       // 13: LOAD R1, 0x00
+    emit(code, {0x02, 0x02, 5});          // 16: LOAD R2, 5
+    emit(code, {0x0A});                   // 19: LOAD_INDEXED -> R4 = [0x9005]
+    emit(code, {0x02, 0x02, 6});          // 20: LOAD R2, 6
+    emit(code, {0x0B});                   // 23: STORE_INDEXED [0x9006] = R4
+    emit(code, {0x00});                   // 24: HALT
+    return code;
+}
+
+std::vector<TraceRecord> readTrace(const std::string& path) {
+    std::vector<TraceRecord> records;
+    TraceReader reader(path);
+    TraceRecord record;
+    while (reader.next(record)) {
+        records.push_back(record);
+    }
+    return records;
+}
+
+// runs program with a trace of it written to path
+std::vector<TraceRecord> traceRun(MinimalCPU& cpu, const std::vector<uint8_t>& program, const std::string& path,
+                                  size_t capacity = 1 << 16, uint64_t* stalls = nullptr) {
+    std::string text;
+    StringOutput output(text);
+    cpu.setOutput(&output);
+    TraceWriter writer(path, capacity);
+    cpu.setTrace(&writer);
+    cpu.loadProgram(program);
+    cpu.run();
+    cpu.setTrace(nullptr);
+    writer.close();
+    if (stalls) {
+        *stalls = writer.stalls();
+    }
+    return writer.ok() && writer.records() == readTrace(path).size() ? readTrace(path) : std::vector<TraceRecord>();
+}
+
+TraceRecord record(uint16_t pc, uint8_t op, uint8_t effects, uint8_t value, uint16_t addr = 0, uint8_t data = 0) {
+    TraceRecord r;
+    r.pc = pc;
+    r.op = op;
+    r.effects = effects;
+    r.value = value;
+    r.addr = addr;
+    r.data = data;
+    return r;
+}
+
+// Test functions
+bool test_records_every_instruction() {
+    MinimalCPU cpu;
+    std::vector<TraceRecord> trace = traceRun(cpu, counterProgram(), "counter.trace");
+    if (trace.size() != 1005 || cpu.RAM[0x8000] != 200) {
+        return false;
+    }
+    return trace[3] == record(9, 0x05, TRACE_REG | 0, 1)
+        && trace[6] == record(18, 0x06, TRACE_REG | TRACE_CARRY | 6, 199, 0, 0)
+        && trace[7] == record(21, 0x07, 0, 0)
+        && trace[8].pc == 9
+        && trace[1003] == record(25, 0x03, TRACE_STORE, 0, 0x8000, 200)
+        && trace[1004] == record(29, 0x00, 0, 0);
+}
+
+bool test_memory_accesses() {
+    MinimalCPU cpu;
+    std::string text = "x";
+    SpanInput input(text);
+    cpu.setInput(&input);
+    std::vector<TraceRecord> trace = traceRun(cpu, accessProgram(), "access.trace");
+    return trace.size() == 10
+        && trace[0] == record(0, 0x09, TRACE_REG | 3, 'x')
+        && trace[1] == record(2, 0x04, TRACE_STORE, 0, 0x9005, 7)
+        && trace[2] == record(6, 0x01, TRACE_REG | TRACE_LOAD | 6, 7, 0x9005, 7)
+        && trace[6] == record(19, 0x0A, TRACE_REG | TRACE_LOAD | 4, 7, 0x9005, 7)
+        && trace[8] == record(23, 0x0B, TRACE_STORE, 0, 0x9006, 7)
+        && cpu.RAM[0x9006] == 7;
+}
+
+bool test_small_ring_wraps() {
+    MinimalCPU roomy;
+    MinimalCPU cramped;
+    uint64_t stalls = 0;
+    std::vector<TraceRecord> expected = traceRun(roomy, counterProgram(), "roomy.trace");
+    std::vector<TraceRecord> actual = traceRun(cramped, counterProgram(), "cramped.trace", 16, &stalls);
+    return expected.size() == 1005 && actual == expected && stalls > 0;
+}
+
+bool test_traced_jit_run_interprets() {
+    MinimalCPU plain;
+    plain.engine = MinimalCPU::Engine::Jit;
+    plain.loadProgram(counterProgram());
+    plain.run();
+    MinimalCPU traced;
+    traced.engine = MinimalCPU::Engine::Jit;
+    std::vector<TraceRecord> trace = traceRun(traced, counterProgram(), "jit.trace");
+    traced.loadProgram(counterProgram());
+    traced.run();  // untraced again, JIT compiled
+    return trace.size() == 1005 && traced.halted && std::equal(plain.R, plain.R + 8, traced.R)
+        && std::equal(plain.RAM, plain.RAM + 65536, traced.RAM);
+}
+
+bool test_codec_round_trip() {
+    std::vector<TraceRecord> records;
+    uint32_t seed = 12345;
+    for (int i = 0; i < 5000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        bool loop = (seed >> 16) % 4 != 0;  // mostly a repeating loop, sometimes noise
+        TraceRecord r = record(loop ? 0x100 + (i % 5) * 3 : seed >> 8, static_cast<uint8_t>(i % 5),
+                               static_cast<uint8_t>(seed >> 3), static_cast<uint8_t>(i), seed >> 12,
+                               static_cast<uint8_t>(seed));
+        records.push_back(r);
+    }
+    TraceEncoder encoder;
+    std::vector<uint8_t> encoded;
+    for (const TraceRecord& r : records) {
+        encoder.encode(r, encoded);
+    }
+    TraceDecoder decoder;
+    const uint8_t* in = encoded.data();
+    const uint8_t* end = in + encoded.size();
+    for (const TraceRecord& r : records) {
+        TraceRecord decoded;
+        size_t used = decoder.decode(in, end, decoded);
+        if (!used || !(decoded == r)) {
+            return false;
+        }
+        in += used;
+    }
+    return in == end;
+}
+
+bool test_loop_compresses() {
+    MinimalCPU cpu;
+    std::string text;
+    StringOutput output(text);
+    cpu.setOutput(&output);
+    uint64_t bytes = 0;
+    {
+        TraceWriter writer("loop.trace");
+        cpu.setTrace(&writer);
+        cpu.loadProgram(counterProgram());
+        cpu.run();
+        writer.close();
+        bytes = writer.bytesWritten();
+    }
+    std::ifstream file("loop.trace", std::ios::binary | std::ios::ate);
+    // 1005 records of 8 bytes; the loop body needs a mask and its changed register value
+    return static_cast<uint64_t>(file.tellg()) == bytes && bytes < 1005 * 3;
+}
+
+bool test_truncated_and_foreign_files() {
+    MinimalCPU cpu;
+    std::vector<TraceRecord> trace = traceRun(cpu, counterProgram(), "whole.trace");
+    std::ifstream whole("whole.trace", std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(whole)), std::istreambuf_iterator<char>());
+    {
+        std::ofstream cut("cut.trace", std::ios::binary);
+        cut.write(bytes.data(), static_cast<std::streamsize>(bytes.size() - 1));
+    }
+    std::vector<TraceRecord> partial = readTrace("cut.trace");
+    bool truncated = partial.size() == trace.size() - 1 && std::equal(partial.begin(), partial.end(), trace.begin());
+    {
+        std::ofstream foreign("foreign.trace", std::ios::binary);
+        foreign << "not a trace";
+    }
+    try {
+        TraceReader reader("foreign.trace");
+        return false;
+    } catch (const std::runtime_error&) {
+        return truncated;
+    }
+}
+
+bool test_render() {
+    std::stringstream out;
+    renderTrace(out, record(0x12, 0x06, TRACE_REG | TRACE_CARRY | 1, 0xFF, 0, 1));
+    out << "\n";
+    renderTrace(out, record(0x20, 0x0B, TRACE_STORE, 0, 0x9006, 7));
+    out << "\n";
+    renderTrace(out, record(0x30, 0x01, TRACE_REG | TRACE_LOAD | 6, 7, 0x9005, 7));
+    out << "\n";
+    return out.str() ==
+        "0012  SUB            R1=0xff R2=1\n"
+        "0020  STORE_INDEXED  [0x9006]<-0x07\n"
+        "0030  LOAD_VAR       R6=0x07 [0x9005]->0x07\n";
+}
+
+int main() {
+    TestFramework framework;
+
+    std::cout << "🧪 Trace Test Suite" << std::endl;
+    std::cout << "===================" << std::endl << std::endl;
+
+    std::cout << "🧾 Trace Tests:" << std::endl;
+    framework.runTest("Records Every Instruction", test_records_every_instruction);
+    framework.runTest("Memory Accesses", test_memory_accesses);
+    framework.runTest("Small Ring Wraps", test_small_ring_wraps);
+    framework.runTest("Traced JIT Run Interprets", test_traced_jit_run_interprets);
+
+    std::cout << "🗜️  Trace File Tests:" << std::endl;
+    framework.runTest("Codec Round Trip", test_codec_round_trip);
+    framework.runTest("Loop Compresses", test_loop_compresses);
+    framework.runTest("Truncated And Foreign Files", test_truncated_and_foreign_files);
+    framework.runTest("Render", test_render);
+
+    framework.printSummary();
+    return framework.getFailedCount();
+}